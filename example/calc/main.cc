@@ -1,5 +1,7 @@
 #include <mklisp/runtime.h>
 #include <mklisp/parser.h>
+#include <mklisp/compiler.h>
+#include <mklisp/optimizer.h>
 #include <fstream>
 
 int main() {
@@ -29,9 +31,8 @@ int main() {
 	{
 		mklisp::HostObjectRef<mklisp::NativeFnObject> printObject = mklisp::NativeFnObject::alloc(
 			runtime.get(),
-			[](mklisp::Context *context) {
-				auto &curFrame = context->frameList.back();
-				for (auto &i : curFrame.curEvalList->elements) {
+			[](mklisp::Context *context, mklisp::ValueSpan args) {
+				for (auto &i : args) {
 					switch (i.valueType) {
 						case mklisp::ValueType::Object: {
 							mklisp::Object *object = i.exData.asObject;
@@ -39,6 +40,19 @@ int main() {
 							switch (object->getObjectType()) {
 								case mklisp::ObjectType::String:
 									printf("%s", ((mklisp::StringObject *)object)->data.c_str());
+									break;
+								case mklisp::ObjectType::WeakRef:
+									printf("#<weak-ref>");
+									break;
+								case mklisp::ObjectType::Code:
+									printf("#<code>");
+									break;
+								case mklisp::ObjectType::Closure:
+									printf("#<closure>");
+									break;
+								case mklisp::ObjectType::Box:
+									// Boxes are only seen by compiled code.
+									break;
 							}
 						}
 					}
@@ -46,10 +60,9 @@ int main() {
 			});
 		mklisp::HostObjectRef<mklisp::NativeFnObject> catObject = mklisp::NativeFnObject::alloc(
 			runtime.get(),
-			[](mklisp::Context *context) {
-				auto &curFrame = context->frameList.back();
+			[](mklisp::Context *context, mklisp::ValueSpan args) {
 				std::pmr::string s;
-				for (auto &i : curFrame.curEvalList->elements) {
+				for (auto &i : args) {
 					switch (i.valueType) {
 						case mklisp::ValueType::Object: {
 							mklisp::Object *object = i.exData.asObject;
@@ -58,17 +71,25 @@ int main() {
 								case mklisp::ObjectType::String:
 									s += ((mklisp::StringObject *)object)->data;
 									break;
+								case mklisp::ObjectType::WeakRef:
+								case mklisp::ObjectType::Code:
+								case mklisp::ObjectType::Closure:
+								case mklisp::ObjectType::Box:
+									break;
 							}
 						}
 					}
 				}
 
-				curFrame.returnValue = mklisp::StringObject::alloc(context->runtime, std::move(s)).get();
+				context->frameStack.back().returnValue = mklisp::StringObject::alloc(context->runtime, std::move(s)).get();
 			});
 
+		// Concatenation only depends on its arguments.
+		catObject->isPure = true;
+
 		mklisp::Context context(runtime.get());
-		context.bindings["print"] = printObject.get();
-		context.bindings["+"] = catObject.get();
+		context.setBinding("print", printObject.get());
+		context.setBinding("+", catObject.get());
 
 		mklisp::Lexer lexer;
 		lexer.lex(std::pmr::get_default_resource(), src);
@@ -79,8 +100,33 @@ int main() {
 
 		parser.parse(&lexer, listObject, refHolder);
 
+		mklisp::Optimizer optimizer(&context);
+		if (mklisp::InternalExceptionPointer e = optimizer.optimize(listObject.get()); e) {
+			printf("Error optimizing main module\n");
+			e.reset();
+			return -1;
+		}
+
+		mklisp::Compiler compiler(&context);
+
 		for (auto &i : listObject->elements) {
-			runtime->eval(i, &context);
+			mklisp::Value result;
+			mklisp::HostObjectRef<mklisp::CodeObject> code;
+			mklisp::InternalExceptionPointer e;
+
+			// Fall back to the tree-walking evaluator for forms the compiler
+			// does not support.
+			if ((e = compiler.compile(i, code))) {
+				e.reset();
+				e = runtime->eval(i, &context, result);
+			} else
+				e = runtime->execute(code.get(), &context, result);
+
+			if (e) {
+				printf("Error evaluating main module\n");
+				e.reset();
+				return -1;
+			}
 		}
 	}
 
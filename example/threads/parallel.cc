@@ -0,0 +1,113 @@
+#include <mklisp/runtime.h>
+#include <mklisp/parser.h>
+#include <mklisp/builtins.h>
+#include <algorithm>
+#include <cstdlib>
+#include <thread>
+
+// Measures the parallel builtins over a long list with an increasing number
+// of workers, the scoring workload is what batch jobs map over their inputs.
+
+struct Workload {
+	const char *name;
+	const char *evalSrc;
+};
+
+static const Workload workloads[] = {
+	{ "pmap", "(pmap score xs)" },
+	{ "preduce", "(preduce + 0 (pmap score xs))" },
+	{ "pfilter", "(pfilter (lambda (x) (< (score x) 1000)) xs)" },
+	{ "psort", "(psort (lambda (a b) (> a b)) xs)" }
+};
+
+static const char *const defineSrc =
+	"(define (weight x n acc) (if (= n 0) acc (weight x (- n 1) (+ acc (* x n)))))"
+	"(define (score x) (weight x 16 0))";
+
+static bool evalSrc(mklisp::Context *context, const char *src, mklisp::Value &resultOut) {
+	mklisp::MutatorScope mutatorScope(context->runtime);
+
+	mklisp::Lexer lexer;
+	lexer.lex(std::pmr::get_default_resource(), src);
+	mklisp::Parser parser(context->runtime);
+
+	mklisp::HostRefHolder refHolder;
+	mklisp::HostObjectRef<mklisp::ListObject> forms;
+	if (mklisp::InternalExceptionPointer e = parser.parse(&lexer, forms, refHolder); e) {
+		e.reset();
+		return false;
+	}
+
+	for (auto &i : forms->elements) {
+		if (mklisp::InternalExceptionPointer e = context->runtime->eval(i, context, resultOut); e) {
+			e.reset();
+			return false;
+		}
+	}
+	return true;
+}
+
+// Returns the time of the workload in seconds, or a negative number if it has
+// failed.
+static double measure(const Workload &workload, size_t nWorkers, size_t size) {
+	mklisp::Runtime runtime(std::pmr::get_default_resource());
+	runtime.nParallelWorkers = nWorkers;
+
+	mklisp::Context context(&runtime);
+	mklisp::bindArithmeticBuiltins(&context);
+	mklisp::bindParallelBuiltins(&context);
+
+	{
+		mklisp::MutatorScope mutatorScope(&runtime);
+		mklisp::HostObjectRef<mklisp::ListObject> xs = mklisp::ListObject::alloc(&runtime);
+		for (size_t i = 0; i < size; ++i) {
+			// Scrambled so that sorting has work to do.
+			if (mklisp::InternalExceptionPointer e = xs->pushBack(mklisp::Value((int32_t)((i * 7919) % size))); e) {
+				e.reset();
+				return -1;
+			}
+		}
+		context.setBinding("xs", xs.get());
+	}
+
+	mklisp::Value result;
+	if (!evalSrc(&context, defineSrc, result))
+		return -1;
+
+	auto beginTime = std::chrono::steady_clock::now();
+	if ((!evalSrc(&context, workload.evalSrc, result)) || (result.valueType == mklisp::ValueType::Nil))
+		return -1;
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - beginTime).count();
+}
+
+int main(int argc, char **argv) {
+	size_t maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+	size_t size = 10000000;
+	if (argc > 1)
+		maxThreads = strtoul(argv[1], nullptr, 10);
+	if (argc > 2)
+		size = strtoul(argv[2], nullptr, 10);
+
+	for (auto &i : workloads) {
+		double baseTime = 0;
+
+		for (size_t nThreads = 1; nThreads <= maxThreads; nThreads *= 2) {
+			// The calling thread is one of the threads.
+			double time = measure(i, nThreads - 1, size);
+			if (time < 0) {
+				printf("%-10s failed\n", i.name);
+				return -1;
+			}
+			if (nThreads == 1)
+				baseTime = time;
+
+			printf("%-10s %3zu threads %10.3f s %6.2fx\n", i.name, nThreads, time, baseTime / time);
+
+			// Also measures the number of cores if it is not a power of two.
+			if ((nThreads < maxThreads) && (nThreads * 2 > maxThreads))
+				nThreads = maxThreads / 2;
+		}
+	}
+
+	return 0;
+}
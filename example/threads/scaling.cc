@@ -0,0 +1,129 @@
+#include <mklisp/runtime.h>
+#include <mklisp/parser.h>
+#include <mklisp/builtins.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+// Measures the throughput of evaluations on one shared runtime with an
+// increasing number of threads, each evaluating on its own context. The
+// arithmetic builtins are shared bindings, the functions are compiled by each
+// context. One workload only computes, the other one allocates closures and
+// collects.
+
+struct Workload {
+	const char *name;
+	const char *defineSrc;
+	const char *evalSrc;
+};
+
+static const Workload workloads[] = {
+	{ "fib",
+		"(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))",
+		"(fib 20)" },
+	{ "closures",
+		"(define (make-adder n) (lambda (x) (+ x n)))"
+		"(define (sum-adders n acc) (if (= n 0) acc (sum-adders (- n 1) ((make-adder n) acc))))",
+		"(sum-adders 5000 0)" }
+};
+
+static bool evalSrc(mklisp::Context *context, const char *src, mklisp::Value &resultOut) {
+	// The references to the forms are released while other threads may be
+	// collecting.
+	mklisp::MutatorScope mutatorScope(context->runtime);
+
+	mklisp::Lexer lexer;
+	lexer.lex(std::pmr::get_default_resource(), src);
+	mklisp::Parser parser(context->runtime);
+
+	mklisp::HostRefHolder refHolder;
+	mklisp::HostObjectRef<mklisp::ListObject> forms;
+	if (mklisp::InternalExceptionPointer e = parser.parse(&lexer, forms, refHolder); e) {
+		e.reset();
+		return false;
+	}
+
+	for (auto &i : forms->elements) {
+		if (mklisp::InternalExceptionPointer e = context->runtime->eval(i, context, resultOut); e) {
+			e.reset();
+			return false;
+		}
+	}
+	return true;
+}
+
+// Returns the number of evaluations completed by all threads per second.
+static double measure(const Workload &workload, size_t nThreads, std::chrono::milliseconds duration) {
+	mklisp::Runtime runtime(std::pmr::get_default_resource());
+
+	{
+		mklisp::Context context(&runtime);
+		mklisp::bindArithmeticBuiltins(&context);
+		for (auto i : { "+", "-", "*", "=", "<", "<=", ">", ">=" })
+			runtime.setSharedBinding(i, context.getBinding(i));
+	}
+
+	std::atomic_bool isStarted = false, isStopping = false;
+	std::atomic_size_t nEvals = 0;
+	std::vector<std::thread> threads;
+
+	for (size_t i = 0; i < nThreads; ++i) {
+		threads.push_back(std::thread([&]() {
+			mklisp::Context context(&runtime);
+			mklisp::Value result;
+			if (!evalSrc(&context, workload.defineSrc, result))
+				return;
+
+			while (!isStarted)
+				std::this_thread::yield();
+
+			size_t nLocalEvals = 0;
+			while (!isStopping) {
+				if (!evalSrc(&context, workload.evalSrc, result))
+					return;
+				++nLocalEvals;
+			}
+			nEvals += nLocalEvals;
+		}));
+	}
+
+	auto beginTime = std::chrono::steady_clock::now();
+	isStarted = true;
+	std::this_thread::sleep_for(duration);
+	isStopping = true;
+	for (auto &i : threads)
+		i.join();
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - beginTime).count();
+	return (double)nEvals / seconds;
+}
+
+int main(int argc, char **argv) {
+	size_t maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+	std::chrono::milliseconds duration(1000);
+	if (argc > 1)
+		maxThreads = strtoul(argv[1], nullptr, 10);
+	if (argc > 2)
+		duration = std::chrono::milliseconds(strtoul(argv[2], nullptr, 10));
+
+	for (auto &i : workloads) {
+		double baseThroughput = 0;
+
+		for (size_t nThreads = 1; nThreads <= maxThreads; nThreads *= 2) {
+			double throughput = measure(i, nThreads, duration);
+			if (nThreads == 1)
+				baseThroughput = throughput;
+
+			printf("%-10s %3zu threads %12.1f evals/s %6.2fx\n",
+				i.name, nThreads, throughput, baseThroughput ? throughput / baseThroughput : 0.0);
+
+			// Also measures the number of cores if it is not a power of two.
+			if ((nThreads < maxThreads) && (nThreads * 2 > maxThreads))
+				nThreads = maxThreads / 2;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,168 @@
+#include <mklisp/runtime.h>
+#include <mklisp/parser.h>
+#include <mklisp/builtins.h>
+#include <mklisp/heapstats.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+// Evaluates on many contexts of one runtime at once with collections forced
+// often, while the shared bindings are redefined and contexts come and go.
+
+static const char *const workerSrc =
+	"(define (make-adder n) (lambda (x) (+ x n)))"
+	"(define (churn n acc)"
+	"  (if (= n 0)"
+	"    acc"
+	"    (begin"
+	"      (cat \"churn\" \"ing\")"
+	"      (churn (- n 1) (+ acc ((make-adder n) 1) (square 2))))))";
+
+static std::atomic_size_t nErrors = 0;
+
+static void catFn(mklisp::Context *context, mklisp::ValueSpan args) {
+	std::pmr::string s;
+	for (auto &i : args) {
+		if ((i.valueType == mklisp::ValueType::Object) &&
+			(i.exData.asObject->getObjectType() == mklisp::ObjectType::String))
+			s += ((mklisp::StringObject *)i.exData.asObject)->data;
+	}
+	context->frameStack.back().returnValue = mklisp::StringObject::alloc(context->runtime, std::move(s)).get();
+}
+
+static bool evalSrc(mklisp::Context *context, const char *src, mklisp::Value &resultOut) {
+	// The references to the forms are released while other threads may be
+	// collecting.
+	mklisp::MutatorScope mutatorScope(context->runtime);
+
+	mklisp::Lexer lexer;
+	lexer.lex(std::pmr::get_default_resource(), src);
+	mklisp::Parser parser(context->runtime);
+
+	mklisp::HostRefHolder refHolder;
+	mklisp::HostObjectRef<mklisp::ListObject> forms;
+	if (mklisp::InternalExceptionPointer e = parser.parse(&lexer, forms, refHolder); e) {
+		e.reset();
+		return false;
+	}
+
+	for (auto &i : forms->elements) {
+		if (mklisp::InternalExceptionPointer e = context->runtime->eval(i, context, resultOut); e) {
+			e.reset();
+			return false;
+		}
+	}
+	return true;
+}
+
+static void runWorker(mklisp::Runtime *runtime, size_t nIterations) {
+	mklisp::Context context(runtime);
+	mklisp::Value result;
+
+	if (!evalSrc(&context, workerSrc, result)) {
+		++nErrors;
+		return;
+	}
+
+	// Sum of n + 1 + 4 for n from 1 to 200.
+	constexpr int32_t expectedChurn = 200 * 201 / 2 + 5 * 200;
+	int32_t lastGeneration = 0;
+
+	for (size_t i = 0; i < nIterations; ++i) {
+		if ((!evalSrc(&context, "(churn 200 0)", result)) ||
+			(result.valueType != mklisp::ValueType::Int) ||
+			(result.exData.asInt != expectedChurn)) {
+			++nErrors;
+			return;
+		}
+
+		// Redefinitions of the shared binding are seen in order.
+		if ((!evalSrc(&context, "(+ generation 0)", result)) ||
+			(result.valueType != mklisp::ValueType::Int) ||
+			(result.exData.asInt < lastGeneration)) {
+			++nErrors;
+			return;
+		}
+		lastGeneration = result.exData.asInt;
+
+		// Contexts created and destroyed while the others run.
+		if (!(i % 16)) {
+			mklisp::Context tempContext(runtime);
+			if ((!evalSrc(&tempContext, "((lambda (x) (square x)) 7)", result)) ||
+				(result.exData.asInt != 49)) {
+				++nErrors;
+				return;
+			}
+		}
+	}
+}
+
+static size_t runStress(mklisp::GCMode gcMode, size_t nThreads, size_t nIterations) {
+	mklisp::Runtime runtime(std::pmr::get_default_resource());
+	runtime.gcMode = gcMode;
+	runtime.gcThreshold = runtime.minGcThreshold = 256 * 1024;
+	runtime.minorGcThreshold = 64 * 1024;
+
+	{
+		mklisp::Context context(&runtime);
+		mklisp::bindArithmeticBuiltins(&context);
+		context.setBinding("cat", mklisp::NativeFnObject::alloc(&runtime, catFn).get());
+
+		mklisp::Value result;
+		if (!evalSrc(&context, "(define (square x) (* x x))", result))
+			return 1;
+
+		for (auto i : { "+", "-", "*", "=", "<", "cat", "square" })
+			runtime.setSharedBinding(i, context.getBinding(i));
+		runtime.setSharedBinding("generation", mklisp::Value((int32_t)0));
+	}
+
+	std::atomic_bool isDone = false;
+	std::thread redefiner([&runtime, &isDone]() {
+		for (int32_t i = 1; !isDone; ++i) {
+			runtime.setSharedBinding("generation", mklisp::Value(i));
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+		}
+	});
+
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < nThreads; ++i)
+		workers.push_back(std::thread(runWorker, &runtime, nIterations));
+
+	// Stops the world from a thread which is not a mutator.
+	mklisp::HeapStats stats;
+	for (size_t i = 0; i < 8; ++i) {
+		mklisp::collectHeapStats(&runtime, stats);
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+
+	for (auto &i : workers)
+		i.join();
+	isDone = true;
+	redefiner.join();
+
+	mklisp::collectHeapStats(&runtime, stats);
+	printf("%s: %zu threads, %zu major and %zu minor collections, %zu errors\n",
+		gcMode == mklisp::GCMode::Incremental ? "incremental" : "stop-the-world",
+		nThreads,
+		stats.gcPauseStats.nMajorCollections,
+		stats.gcPauseStats.nMinorCollections,
+		(size_t)nErrors);
+	return nErrors;
+}
+
+int main(int argc, char **argv) {
+	size_t nThreads = std::max(std::thread::hardware_concurrency(), 2u);
+	size_t nIterations = 200;
+	if (argc > 1)
+		nThreads = strtoul(argv[1], nullptr, 10);
+	if (argc > 2)
+		nIterations = strtoul(argv[2], nullptr, 10);
+
+	if (runStress(mklisp::GCMode::StopTheWorld, nThreads, nIterations) ||
+		runStress(mklisp::GCMode::Incremental, nThreads, nIterations))
+		return -1;
+	return 0;
+}
@@ -0,0 +1,497 @@
+#include "builtins.h"
+#include "parallel.h"
+#include <algorithm>
+
+using namespace mklisp;
+
+static bool _toLong(const Value &value, int64_t &valueOut) noexcept {
+	switch (value.valueType) {
+		case ValueType::Int:
+			valueOut = value.exData.asInt;
+			return true;
+		case ValueType::UInt:
+			valueOut = value.exData.asUInt;
+			return true;
+		case ValueType::Long:
+			valueOut = value.exData.asLong;
+			return true;
+		case ValueType::Short:
+			valueOut = value.exData.asShort;
+			return true;
+		case ValueType::UShort:
+			valueOut = value.exData.asUShort;
+			return true;
+		case ValueType::Byte:
+			valueOut = value.exData.asByte;
+			return true;
+		case ValueType::UByte:
+			valueOut = value.exData.asUByte;
+			return true;
+		default:
+			return false;
+	}
+}
+
+template <NativeIntrinsic intrinsic>
+static void _arithmeticFn(Context *context, ValueSpan args) {
+	Value &returnValue = context->frameStack.back().returnValue;
+
+	uint64_t result = intrinsic == NativeIntrinsic::Multiply ? 1 : 0;
+	bool isInt = true;
+	for (size_t i = 0; i < args.size; ++i) {
+		int64_t operand;
+		if (!_toLong(args[i], operand)) {
+			returnValue = Value(ValueType::Nil);
+			return;
+		}
+		isInt &= args[i].valueType == ValueType::Int;
+
+		switch (intrinsic) {
+			case NativeIntrinsic::Add:
+				result += (uint64_t)operand;
+				break;
+			case NativeIntrinsic::Subtract:
+				// Unary minus negates.
+				if ((i == 0) && (args.size > 1))
+					result = (uint64_t)operand;
+				else
+					result -= (uint64_t)operand;
+				break;
+			case NativeIntrinsic::Multiply:
+				result *= (uint64_t)operand;
+				break;
+		}
+	}
+
+	int64_t longResult = (int64_t)result;
+	if (isInt && (longResult >= INT32_MIN) && (longResult <= INT32_MAX))
+		returnValue = Value((int32_t)longResult);
+	else
+		returnValue = Value(longResult);
+}
+
+template <NativeIntrinsic intrinsic>
+static void _comparisonFn(Context *context, ValueSpan args) {
+	Value &returnValue = context->frameStack.back().returnValue;
+
+	bool isTrue = true;
+	int64_t lhs;
+	for (size_t i = 0; i < args.size; ++i) {
+		int64_t rhs;
+		if (!_toLong(args[i], rhs)) {
+			returnValue = Value(ValueType::Nil);
+			return;
+		}
+
+		if (i) {
+			switch (intrinsic) {
+				case NativeIntrinsic::Equal:
+					isTrue &= lhs == rhs;
+					break;
+				case NativeIntrinsic::Less:
+					isTrue &= lhs < rhs;
+					break;
+				case NativeIntrinsic::LessEqual:
+					isTrue &= lhs <= rhs;
+					break;
+				case NativeIntrinsic::Greater:
+					isTrue &= lhs > rhs;
+					break;
+				case NativeIntrinsic::GreaterEqual:
+					isTrue &= lhs >= rhs;
+					break;
+			}
+		}
+		lhs = rhs;
+	}
+
+	returnValue = isTrue ? Value((int32_t)1) : Value(ValueType::Nil);
+}
+
+static void _bindIntrinsic(Context *context, const char *name, NativeFnCallback callback, NativeIntrinsic intrinsic) {
+	HostObjectRef<NativeFnObject> fn = NativeFnObject::alloc(context->runtime, callback);
+	fn->intrinsic = intrinsic;
+	fn->isPure = true;
+	context->setBinding(name, fn.get());
+}
+
+MKLISP_API void mklisp::bindArithmeticBuiltins(Context *context) {
+	_bindIntrinsic(context, "+", _arithmeticFn<NativeIntrinsic::Add>, NativeIntrinsic::Add);
+	_bindIntrinsic(context, "-", _arithmeticFn<NativeIntrinsic::Subtract>, NativeIntrinsic::Subtract);
+	_bindIntrinsic(context, "*", _arithmeticFn<NativeIntrinsic::Multiply>, NativeIntrinsic::Multiply);
+	_bindIntrinsic(context, "=", _comparisonFn<NativeIntrinsic::Equal>, NativeIntrinsic::Equal);
+	_bindIntrinsic(context, "<", _comparisonFn<NativeIntrinsic::Less>, NativeIntrinsic::Less);
+	_bindIntrinsic(context, "<=", _comparisonFn<NativeIntrinsic::LessEqual>, NativeIntrinsic::LessEqual);
+	_bindIntrinsic(context, ">", _comparisonFn<NativeIntrinsic::Greater>, NativeIntrinsic::Greater);
+	_bindIntrinsic(context, ">=", _comparisonFn<NativeIntrinsic::GreaterEqual>, NativeIntrinsic::GreaterEqual);
+}
+
+static bool _isCallable(const Value &value) noexcept {
+	if (value.valueType != ValueType::Object)
+		return false;
+
+	switch (value.exData.asObject->getObjectType()) {
+		case ObjectType::NativeFn:
+		case ObjectType::Code:
+		case ObjectType::Closure:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static ListObject *_getList(const Value &value) noexcept {
+	if ((value.valueType == ValueType::Object) &&
+		(value.exData.asObject->getObjectType() == ObjectType::List))
+		return (ListObject *)value.exData.asObject;
+	return nullptr;
+}
+
+static HostObjectRef<ListObject> _newList(Runtime *runtime, const Value *values, size_t nValues) {
+	HostObjectRef<ListObject> list = ListObject::alloc(runtime);
+
+	list->elements.assign(values, values + nValues);
+	for (auto &i : list->elements)
+		runtime->writeBarrier(list.get(), i);
+
+	return list;
+}
+
+// Values computed by the threads of the pool, the objects are kept alive by
+// host references until they have been stored into the result.
+class _HeldValues {
+public:
+	std::pmr::vector<Value> values;
+
+	_HeldValues(Runtime *runtime, size_t size) : values(size, Value(ValueType::Nil), &runtime->globalHeapResource) {
+	}
+	_HeldValues(const _HeldValues &) = delete;
+	~_HeldValues() {
+		for (auto &i : values) {
+			switch (i.valueType) {
+				case ValueType::Object:
+				case ValueType::QuotedObject:
+					decHostRef(i.exData.asObject);
+					break;
+				default:
+					break;
+			}
+		}
+	}
+
+	void set(size_t index, const Value &value) {
+		switch (value.valueType) {
+			case ValueType::Object:
+			case ValueType::QuotedObject:
+				incHostRef(value.exData.asObject);
+				break;
+			default:
+				break;
+		}
+		values[index] = value;
+	}
+};
+
+struct _ParallelLoop {
+	Value fn;
+	ListObject *list;
+	size_t chunkSize;
+	_HeldValues *results;
+	std::pmr::vector<uint8_t> *isKept;
+};
+
+static InternalExceptionPointer _mapChunk(void *userData, Context *context, size_t begin, size_t end) {
+	auto loop = (_ParallelLoop *)userData;
+
+	for (size_t i = begin; i < end; ++i) {
+		Value result;
+		MKLISP_RETURN_IF_EXCEPT(context->runtime->call(loop->fn, &loop->list->elements[i], 1, context, result));
+		loop->results->set(i, result);
+	}
+	return {};
+}
+
+static InternalExceptionPointer _filterChunk(void *userData, Context *context, size_t begin, size_t end) {
+	auto loop = (_ParallelLoop *)userData;
+
+	for (size_t i = begin; i < end; ++i) {
+		Value result;
+		MKLISP_RETURN_IF_EXCEPT(context->runtime->call(loop->fn, &loop->list->elements[i], 1, context, result));
+		(*loop->isKept)[i] = result.valueType != ValueType::Nil;
+	}
+	return {};
+}
+
+// Folds the chunk from its first element.
+static InternalExceptionPointer _reduceChunk(void *userData, Context *context, size_t begin, size_t end) {
+	auto loop = (_ParallelLoop *)userData;
+	auto &elements = loop->list->elements;
+
+	Value result = elements[begin];
+	for (size_t i = begin + 1; i < end; ++i) {
+		Value args[2] = { result, elements[i] };
+		MKLISP_RETURN_IF_EXCEPT(context->runtime->call(loop->fn, args, 2, context, result));
+	}
+	loop->results->set(begin / loop->chunkSize, result);
+	return {};
+}
+
+static InternalExceptionPointer _isLess(Context *context, const Value &less, const Value &lhs, const Value &rhs, bool &isLessOut) {
+	Value args[2] = { lhs, rhs }, result;
+	MKLISP_RETURN_IF_EXCEPT(context->runtime->call(less, args, 2, context, result));
+	isLessOut = result.valueType != ValueType::Nil;
+	return {};
+}
+
+// Takes from the left run unless the element of the right one is less, which
+// keeps equal elements in their order.
+static InternalExceptionPointer _merge(Context *context, const Value &less, const Value *lhs, size_t nLhs, const Value *rhs, size_t nRhs, Value *out) {
+	size_t i = 0, j = 0;
+
+	while ((i < nLhs) && (j < nRhs)) {
+		bool isLess;
+		MKLISP_RETURN_IF_EXCEPT(_isLess(context, less, rhs[j], lhs[i], isLess));
+		*out++ = isLess ? rhs[j++] : lhs[i++];
+	}
+	out = std::copy(lhs + i, lhs + nLhs, out);
+	std::copy(rhs + j, rhs + nRhs, out);
+
+	return {};
+}
+
+// Returns the number of elements of the left run among the first `k`
+// elements of the merge of the runs, found by a binary search, so merges can
+// be split anywhere.
+static InternalExceptionPointer _splitMerge(Context *context, const Value &less, const Value *lhs, size_t nLhs, const Value *rhs, size_t nRhs, size_t k, size_t &nLhsOut) {
+	size_t low = k > nRhs ? k - nRhs : 0, high = std::min(k, nLhs);
+
+	// The least count for which the last element taken from the right run is
+	// less than the next one of the left run.
+	while (low < high) {
+		size_t i = low + (high - low) / 2;
+		bool isLess;
+		MKLISP_RETURN_IF_EXCEPT(_isLess(context, less, rhs[k - i - 1], lhs[i], isLess));
+		if (isLess)
+			high = i;
+		else
+			low = i + 1;
+	}
+
+	nLhsOut = low;
+	return {};
+}
+
+constexpr static size_t _SORT_RUN_SIZE = 16;
+
+// Sorts short runs by insertion first, then merges them.
+static InternalExceptionPointer _sortRange(Context *context, const Value &less, Value *data, Value *scratch, size_t size) {
+	for (size_t begin = 0; begin < size; begin += _SORT_RUN_SIZE) {
+		size_t end = std::min(begin + _SORT_RUN_SIZE, size);
+
+		for (size_t i = begin + 1; i < end; ++i) {
+			Value value = data[i];
+			size_t j = i;
+			for (; j > begin; --j) {
+				bool isLess;
+				MKLISP_RETURN_IF_EXCEPT(_isLess(context, less, value, data[j - 1], isLess));
+				if (!isLess)
+					break;
+				data[j] = data[j - 1];
+			}
+			data[j] = value;
+		}
+	}
+
+	Value *src = data, *dest = scratch;
+	for (size_t runSize = _SORT_RUN_SIZE; runSize < size; runSize *= 2) {
+		for (size_t begin = 0; begin < size; begin += 2 * runSize) {
+			size_t middle = std::min(begin + runSize, size), end = std::min(begin + 2 * runSize, size);
+			MKLISP_RETURN_IF_EXCEPT(_merge(context, less, src + begin, middle - begin, src + middle, end - middle, dest + begin));
+		}
+		std::swap(src, dest);
+	}
+	if (src != data)
+		std::copy(src, src + size, data);
+
+	return {};
+}
+
+struct _SortLoop {
+	Value less;
+	Value *src, *dest;
+	size_t size;
+	// Size of the sorted runs which are merged.
+	size_t runSize;
+};
+
+static InternalExceptionPointer _sortChunk(void *userData, Context *context, size_t begin, size_t end) {
+	auto loop = (_SortLoop *)userData;
+	return _sortRange(context, loop->less, loop->src + begin, loop->dest + begin, end - begin);
+}
+
+// Merges the part of the pair of runs which ends up in the chunk, the chunks
+// never span two pairs.
+static InternalExceptionPointer _mergeChunk(void *userData, Context *context, size_t begin, size_t end) {
+	auto loop = (_SortLoop *)userData;
+
+	size_t pairBegin = begin / (2 * loop->runSize) * (2 * loop->runSize);
+	size_t middle = std::min(pairBegin + loop->runSize, loop->size);
+	size_t pairEnd = std::min(pairBegin + 2 * loop->runSize, loop->size);
+	const Value *lhs = loop->src + pairBegin, *rhs = loop->src + middle;
+
+	size_t lhsBegin, lhsEnd;
+	MKLISP_RETURN_IF_EXCEPT(_splitMerge(context, loop->less, lhs, middle - pairBegin, rhs, pairEnd - middle, begin - pairBegin, lhsBegin));
+	MKLISP_RETURN_IF_EXCEPT(_splitMerge(context, loop->less, lhs, middle - pairBegin, rhs, pairEnd - middle, end - pairBegin, lhsEnd));
+	size_t rhsBegin = begin - pairBegin - lhsBegin, rhsEnd = end - pairBegin - lhsEnd;
+
+	return _merge(context, loop->less, lhs + lhsBegin, lhsEnd - lhsBegin, rhs + rhsBegin, rhsEnd - rhsBegin, loop->dest + begin);
+}
+
+// Checks the arguments of the parallel builtins, which are the function
+// followed by `nOtherArgs` values and the list, and returns the function and
+// the list, which are shared with the workers.
+static InternalExceptionPointer _getParallelArgs(Runtime *runtime, ValueSpan args, size_t nOtherArgs, Value (&inputsOut)[2]) {
+	if (args.size != nOtherArgs + 2)
+		return ArityMismatchError::alloc(&runtime->globalHeapResource, nOtherArgs + 2, args.size);
+	if (!_isCallable(args[0]))
+		return InvalidArgumentError::alloc(&runtime->globalHeapResource, 0);
+	if (!_getList(args[args.size - 1]))
+		return InvalidArgumentError::alloc(&runtime->globalHeapResource, args.size - 1);
+
+	inputsOut[0] = args[0];
+	inputsOut[1] = args[args.size - 1];
+	return {};
+}
+
+static void _pmapFn(Context *context, ValueSpan args) {
+	Runtime *runtime = context->runtime;
+	// The arguments are moved by calls on the context.
+	Value inputValues[2];
+	if (InternalExceptionPointer e = _getParallelArgs(runtime, args, 0, inputValues); e) {
+		runtime->failCall(context, std::move(e));
+		return;
+	}
+	ParallelInputs inputs = { inputValues, 2 };
+
+	_ParallelLoop loop = {};
+	loop.fn = inputValues[0];
+	loop.list = _getList(inputValues[1]);
+	size_t size = loop.list->elements.size();
+	loop.chunkSize = getParallelChunkSize(size);
+	_HeldValues results(runtime, size);
+	loop.results = &results;
+
+	if (InternalExceptionPointer e = runtime->getParallelPool()->run(context, inputs, size, loop.chunkSize, _mapChunk, &loop); e) {
+		runtime->failCall(context, std::move(e));
+		return;
+	}
+	context->frameStack.back().returnValue = _newList(runtime, results.values.data(), size).get();
+}
+
+static void _pfilterFn(Context *context, ValueSpan args) {
+	Runtime *runtime = context->runtime;
+	Value inputValues[2];
+	if (InternalExceptionPointer e = _getParallelArgs(runtime, args, 0, inputValues); e) {
+		runtime->failCall(context, std::move(e));
+		return;
+	}
+	ParallelInputs inputs = { inputValues, 2 };
+
+	_ParallelLoop loop = {};
+	loop.fn = inputValues[0];
+	loop.list = _getList(inputValues[1]);
+	size_t size = loop.list->elements.size();
+	loop.chunkSize = getParallelChunkSize(size);
+	std::pmr::vector<uint8_t> isKept(size, &runtime->globalHeapResource);
+	loop.isKept = &isKept;
+
+	if (InternalExceptionPointer e = runtime->getParallelPool()->run(context, inputs, size, loop.chunkSize, _filterChunk, &loop); e) {
+		runtime->failCall(context, std::move(e));
+		return;
+	}
+
+	std::pmr::vector<Value> keptElements(&runtime->globalHeapResource);
+	for (size_t i = 0; i < size; ++i) {
+		if (isKept[i])
+			keptElements.push_back(loop.list->elements[i]);
+	}
+	context->frameStack.back().returnValue = _newList(runtime, keptElements.data(), keptElements.size()).get();
+}
+
+// Folds the results of the chunks from `init`.
+static void _preduceFn(Context *context, ValueSpan args) {
+	Runtime *runtime = context->runtime;
+	Value inputValues[2];
+	if (InternalExceptionPointer e = _getParallelArgs(runtime, args, 1, inputValues); e) {
+		runtime->failCall(context, std::move(e));
+		return;
+	}
+	ParallelInputs inputs = { inputValues, 2 };
+
+	_ParallelLoop loop = {};
+	loop.fn = inputValues[0];
+	Value result = args[1];
+	loop.list = _getList(inputValues[1]);
+	size_t size = loop.list->elements.size();
+	loop.chunkSize = getParallelChunkSize(size);
+	_HeldValues chunkResults(runtime, size ? (size + loop.chunkSize - 1) / loop.chunkSize : 0);
+	loop.results = &chunkResults;
+
+	InternalExceptionPointer e = runtime->getParallelPool()->run(context, inputs, size, loop.chunkSize, _reduceChunk, &loop);
+	for (size_t i = 0; (!e) && (i < chunkResults.values.size()); ++i) {
+		Value callArgs[2] = { result, chunkResults.values[i] };
+		e = runtime->call(loop.fn, callArgs, 2, context, result);
+	}
+
+	if (e) {
+		runtime->failCall(context, std::move(e));
+		return;
+	}
+	context->frameStack.back().returnValue = result;
+}
+
+// Sorts the chunks, then merges pairs of sorted runs until one is left, each
+// merge split over the chunks of its result.
+static void _psortFn(Context *context, ValueSpan args) {
+	Runtime *runtime = context->runtime;
+	Value inputValues[2];
+	if (InternalExceptionPointer e = _getParallelArgs(runtime, args, 0, inputValues); e) {
+		runtime->failCall(context, std::move(e));
+		return;
+	}
+	ParallelInputs inputs = { inputValues, 2 };
+
+	_SortLoop loop;
+	loop.less = inputValues[0];
+	auto &elements = _getList(inputValues[1])->elements;
+	loop.size = elements.size();
+	size_t chunkSize = getParallelChunkSize(loop.size);
+
+	// Elements of the list are kept alive by the argument.
+	std::pmr::vector<Value> sortedElements(elements.begin(), elements.end(), &runtime->globalHeapResource);
+	std::pmr::vector<Value> scratch(loop.size, &runtime->globalHeapResource);
+	loop.src = sortedElements.data();
+	loop.dest = scratch.data();
+
+	ParallelPool *pool = runtime->getParallelPool();
+	InternalExceptionPointer e = pool->run(context, inputs, loop.size, chunkSize, _sortChunk, &loop);
+	for (loop.runSize = chunkSize; (!e) && (loop.runSize < loop.size); loop.runSize *= 2) {
+		e = pool->run(context, inputs, loop.size, chunkSize, _mergeChunk, &loop);
+		std::swap(loop.src, loop.dest);
+	}
+
+	if (e) {
+		runtime->failCall(context, std::move(e));
+		return;
+	}
+	context->frameStack.back().returnValue = _newList(runtime, loop.src, loop.size).get();
+}
+
+MKLISP_API void mklisp::bindParallelBuiltins(Context *context) {
+	Runtime *runtime = context->runtime;
+
+	context->setBinding("pmap", NativeFnObject::alloc(runtime, _pmapFn).get());
+	context->setBinding("pfilter", NativeFnObject::alloc(runtime, _pfilterFn).get());
+	context->setBinding("preduce", NativeFnObject::alloc(runtime, _preduceFn).get());
+	context->setBinding("psort", NativeFnObject::alloc(runtime, _psortFn).get());
+}
@@ -0,0 +1,34 @@
+#ifndef _MKLISP_BUILTINS_H_
+#define _MKLISP_BUILTINS_H_
+
+#include "runtime.h"
+
+namespace mklisp {
+	// Binds `+`, `-`, `*`, `=`, `<`, `<=`, `>` and `>=` in the context, which
+	// are pure and intrinsics of the JIT, see `NativeIntrinsic`.
+	//
+	// Arguments may be of any integer type but `ULong`. Results are `Int`s if
+	// all arguments are `Int`s and the result fits, `Long`s otherwise, and
+	// arithmetic wraps around on 64 bits. Comparisons compare each argument
+	// with the next one and return 1 or nil. All of them return nil if an
+	// argument is not an integer.
+	MKLISP_API void bindArithmeticBuiltins(Context *context);
+
+	// Binds `(pmap fn list)`, `(pfilter fn list)`, `(preduce fn init list)`
+	// and `(psort less list)`, which return new lists, or the reduced value,
+	// and split long lists over the threads of the pool of the runtime, see
+	// `ParallelPool`.
+	//
+	// Results are in the order of the list whatever thread computed them.
+	// `preduce` folds each chunk from its first element, then the results of
+	// the chunks from `init`, so `fn` must be associative. `psort` is stable,
+	// `less` returns nil unless its first argument goes first.
+	//
+	// While they run on the workers, the function, the list and the globals
+	// the function refers to are frozen, see `PARALLEL_MIN_SIZE`. Arguments of
+	// the wrong type fail the call with an `InvalidArgumentError`, and calls of
+	// the function which fail fail it with their error.
+	MKLISP_API void bindParallelBuiltins(Context *context);
+}
+
+#endif
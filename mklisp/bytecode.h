@@ -0,0 +1,76 @@
+#ifndef _MKLISP_BYTECODE_H_
+#define _MKLISP_BYTECODE_H_
+
+#include "basedefs.h"
+#include <cstdint>
+
+namespace mklisp {
+	// Instructions operate on the values pushed by the frame onto the value
+	// stack of the context. Local variables are the values at fixed offsets
+	// from the beginning of the frame, starting with the arguments. Captured
+	// variables are the values held by the closure of the frame. Variables
+	// which are both captured and assigned are boxed. Only nil is false.
+	enum class Opcode : uint8_t {
+		// Pushes the constant at index `operand`.
+		PushConst = 0,
+		// Pushes the global in slot `operand` of the context.
+		LoadGlobal,
+		// Binds the global in slot `operand` to the topmost value, which is
+		// kept.
+		StoreGlobal,
+		// Pushes the local variable at offset `operand`.
+		LoadLocal,
+		// Assigns the topmost value, which is kept, to the local variable at
+		// offset `operand`.
+		StoreLocal,
+		// Pushes the captured variable at index `operand`.
+		LoadCapture,
+		// Replaces the local variable at offset `operand` with a box holding
+		// its value.
+		BoxLocal,
+		// Replaces the topmost value, which is a box, with the value it holds.
+		Unbox,
+		// Pops the topmost value, which is a box, and assigns the value below
+		// it, which is kept, to the box.
+		StoreBox,
+		// Pops the topmost value.
+		Pop,
+		// Pops `operand` values below the topmost value.
+		Slide,
+		// Jumps to the instruction at index `operand`.
+		Jump,
+		// Pops the topmost value and jumps if it is false.
+		JumpIfFalse,
+		// Jumps if the topmost value is false, pops it otherwise.
+		JumpIfFalseOrPop,
+		// Jumps if the topmost value is true, pops it otherwise.
+		JumpIfTrueOrPop,
+		// Replaces the code object below the `operand` topmost values and them
+		// with a closure of the code capturing them.
+		MakeClosure,
+		// Calls the value below the `operand` topmost values with them as the
+		// arguments, all of them are replaced by the return value. Callees
+		// are looked up in the cache of the call site first.
+		Call,
+		// Like `Call` followed by `Return`. Code objects and closures are
+		// called with the frame, which is reused, so calls in tail positions
+		// do not grow the frame stack.
+		TailCall,
+		// Returns the topmost value.
+		Return
+	};
+
+	constexpr static size_t NUM_OPCODES = (size_t)Opcode::Return + 1;
+
+	constexpr static uint16_t NO_CALL_SITE_CACHE = UINT16_MAX;
+
+	struct Instruction {
+		Opcode opcode;
+		// Index of the cache of call instructions in `CodeObject::callSiteCaches`,
+		// kept in the padding before the operand.
+		uint16_t callSiteIndex = NO_CALL_SITE_CACHE;
+		uint32_t operand;
+	};
+}
+
+#endif
@@ -0,0 +1,713 @@
+#include "compiler.h"
+#include <algorithm>
+
+using namespace mklisp;
+
+const Compiler::SpecialFormCompiler Compiler::_specialFormCompilers[NUM_SPECIAL_FORMS] = {
+	&Compiler::_compileQuote,
+	&Compiler::_compileIf,
+	&Compiler::_compileCond,
+	&Compiler::_compileDefine,
+	&Compiler::_compileLet,
+	&Compiler::_compileLambda,
+	&Compiler::_compileBegin,
+	&Compiler::_compileSet,
+	&Compiler::_compileAnd,
+	&Compiler::_compileOr
+};
+
+Compiler::FunctionState::FunctionState(CodeObject *code, FunctionState *parent, std::pmr::memory_resource *memoryResource)
+	: code(code), parent(parent), localVariables(memoryResource), capturedVariables(memoryResource) {
+}
+
+MKLISP_API Compiler::Compiler(Context *context)
+	: _definedGlobals(&context->runtime->globalHeapResource), context(context) {
+}
+
+size_t Compiler::_emit(Opcode opcode, uint32_t operand) {
+	auto &instructions = _curFunction->code->instructions;
+
+	instructions.push_back({ opcode, NO_CALL_SITE_CACHE, operand });
+	return instructions.size() - 1;
+}
+
+void Compiler::_emitConst(const Value &value) {
+	_emit(Opcode::PushConst, _curFunction->code->addConstant(value));
+	_push();
+}
+
+// Pushes the variable, boxed variables are pushed as their boxes.
+void Compiler::_emitLoad(const VariableRef &ref) {
+	switch (ref.kind) {
+		case VariableKind::Local:
+			_emit(Opcode::LoadLocal, ref.index);
+			break;
+		case VariableKind::Captured:
+			_emit(Opcode::LoadCapture, ref.index);
+			break;
+		case VariableKind::Global:
+			_emit(Opcode::LoadGlobal, ref.index);
+			break;
+	}
+	_push();
+}
+
+void Compiler::_patchJump(size_t index) noexcept {
+	auto &instructions = _curFunction->code->instructions;
+
+	instructions[index].operand = (uint32_t)instructions.size();
+}
+
+// Called once the function has been compiled. Code is only ever jumped
+// forward, so following the jumps always ends.
+void Compiler::_markTailCalls() noexcept {
+	auto &instructions = _curFunction->code->instructions;
+
+	for (size_t i = 0; i < instructions.size(); ++i) {
+		if (instructions[i].opcode != Opcode::Call)
+			continue;
+
+		// Locals popped by `Slide` are dropped with the frame anyway.
+		size_t next = i + 1;
+		while (true) {
+			const Instruction &nextInstruction = instructions[next];
+
+			if (nextInstruction.opcode == Opcode::Slide)
+				++next;
+			else if (nextInstruction.opcode == Opcode::Jump)
+				next = nextInstruction.operand;
+			else
+				break;
+		}
+
+		if (instructions[next].opcode == Opcode::Return)
+			instructions[i].opcode = Opcode::TailCall;
+	}
+}
+
+void Compiler::_push(uint32_t nValues) noexcept {
+	uint32_t &curStackSize = _curFunction->curStackSize;
+
+	curStackSize += nValues;
+	if (curStackSize > _curFunction->code->maxStackSize)
+		_curFunction->code->maxStackSize = curStackSize;
+}
+
+void Compiler::_pop(uint32_t nValues) noexcept {
+	_curFunction->curStackSize -= nValues;
+}
+
+InternalExceptionPointer Compiler::_raiseError(const char *message, const std::string_view &detail) {
+	Runtime *runtime = context->runtime;
+	std::pmr::string msg(&runtime->globalHeapResource);
+
+	msg = message;
+	if (detail.size()) {
+		msg += ": ";
+		msg += detail;
+	}
+
+	return SyntaxError::alloc(&runtime->globalHeapResource, std::move(msg));
+}
+
+static SymbolObject *_getSymbol(const Value &value) noexcept {
+	if ((value.valueType != ValueType::Object) ||
+		(value.exData.asObject->getObjectType() != ObjectType::Symbol))
+		return nullptr;
+	return (SymbolObject *)value.exData.asObject;
+}
+
+static ListObject *_getList(const Value &value) noexcept {
+	if ((value.valueType != ValueType::Object) ||
+		(value.exData.asObject->getObjectType() != ObjectType::List))
+		return nullptr;
+	return (ListObject *)value.exData.asObject;
+}
+
+constexpr static uint8_t VARIABLE_CAPTURED = 0x01;
+constexpr static uint8_t VARIABLE_ASSIGNED = 0x02;
+
+static void _scanVariableUses(const Value &form, uint32_t symbolId, bool isInLambda, uint8_t &usesOut);
+
+static void _scanBodyVariableUses(ListObject *list, size_t indexBegin, uint32_t symbolId, bool isInLambda, uint8_t &usesOut) {
+	auto &elements = list->elements;
+
+	for (size_t i = indexBegin; i < elements.size(); ++i)
+		_scanVariableUses(elements[i], symbolId, isInLambda, usesOut);
+}
+
+static bool _isBoundBy(ListObject *params, size_t indexBegin, uint32_t symbolId) noexcept {
+	auto &elements = params->elements;
+
+	for (size_t i = indexBegin; i < elements.size(); ++i) {
+		if (SymbolObject *param = _getSymbol(elements[i]); param && (param->symbolId == symbolId))
+			return true;
+	}
+	return false;
+}
+
+// Finds whether the variable is referred to by lambdas or assigned in the
+// form. Forms which bind a variable of the same name hide it.
+static void _scanVariableUses(const Value &form, uint32_t symbolId, bool isInLambda, uint8_t &usesOut) {
+	if (SymbolObject *symbol = _getSymbol(form)) {
+		if (isInLambda && (symbol->symbolId == symbolId))
+			usesOut |= VARIABLE_CAPTURED;
+		return;
+	}
+
+	ListObject *list = _getList(form);
+	if ((!list) || (!list->elements.size()))
+		return;
+
+	auto &elements = list->elements;
+	SymbolObject *head = _getSymbol(elements[0]);
+	if ((!head) || (!head->isSpecialForm())) {
+		_scanBodyVariableUses(list, 0, symbolId, isInLambda, usesOut);
+		return;
+	}
+
+	switch ((SpecialForm)head->symbolId) {
+		case SpecialForm::Quote:
+			break;
+		case SpecialForm::Lambda: {
+			ListObject *params = elements.size() > 1 ? _getList(elements[1]) : nullptr;
+			if (params && (!_isBoundBy(params, 0, symbolId)))
+				_scanBodyVariableUses(list, 2, symbolId, true, usesOut);
+			break;
+		}
+		case SpecialForm::Define: {
+			// The name of the function is in its signature.
+			if (ListObject *signature = elements.size() > 1 ? _getList(elements[1]) : nullptr) {
+				if (!_isBoundBy(signature, 1, symbolId))
+					_scanBodyVariableUses(list, 2, symbolId, true, usesOut);
+			} else
+				_scanBodyVariableUses(list, 2, symbolId, isInLambda, usesOut);
+			break;
+		}
+		case SpecialForm::Let: {
+			ListObject *bindings = elements.size() > 1 ? _getList(elements[1]) : nullptr;
+			if (!bindings)
+				break;
+
+			bool isRebound = false;
+			for (auto &i : bindings->elements) {
+				ListObject *binding = _getList(i);
+				if ((!binding) || (binding->elements.size() != 2))
+					continue;
+
+				if (SymbolObject *name = _getSymbol(binding->elements[0]); name && (name->symbolId == symbolId))
+					isRebound = true;
+				_scanVariableUses(binding->elements[1], symbolId, isInLambda, usesOut);
+			}
+
+			if (!isRebound)
+				_scanBodyVariableUses(list, 2, symbolId, isInLambda, usesOut);
+			break;
+		}
+		case SpecialForm::Set: {
+			if (elements.size() != 3)
+				break;
+
+			if (SymbolObject *name = _getSymbol(elements[1]); name && (name->symbolId == symbolId))
+				usesOut |= isInLambda ? (VARIABLE_ASSIGNED | VARIABLE_CAPTURED) : VARIABLE_ASSIGNED;
+			_scanVariableUses(elements[2], symbolId, isInLambda, usesOut);
+			break;
+		}
+		default:
+			_scanBodyVariableUses(list, 1, symbolId, isInLambda, usesOut);
+			break;
+	}
+}
+
+// Variables bound for the body of the list from `bodyBegin` are boxed only if
+// they are both captured and assigned.
+static bool _needsBox(ListObject *list, size_t bodyBegin, uint32_t symbolId) {
+	uint8_t uses = 0;
+
+	_scanBodyVariableUses(list, bodyBegin, symbolId, false, uses);
+	return uses == (VARIABLE_CAPTURED | VARIABLE_ASSIGNED);
+}
+
+// Variables of enclosing functions are captured by each function between
+// them and the current one.
+bool Compiler::_resolveLocalVariable(FunctionState *function, uint32_t symbolId, VariableRef &refOut) {
+	auto &localVariables = function->localVariables;
+	for (size_t i = localVariables.size(); i; --i) {
+		const LocalVariable &variable = localVariables[i - 1];
+
+		if (variable.symbolId == symbolId) {
+			refOut = { VariableKind::Local, variable.offset, variable.isBoxed };
+			return true;
+		}
+	}
+
+	auto &capturedVariables = function->capturedVariables;
+	for (size_t i = 0; i < capturedVariables.size(); ++i) {
+		if (capturedVariables[i].symbolId == symbolId) {
+			refOut = { VariableKind::Captured, (uint32_t)i, capturedVariables[i].isBoxed };
+			return true;
+		}
+	}
+
+	VariableRef sourceRef;
+	if ((!function->parent) || (!_resolveLocalVariable(function->parent, symbolId, sourceRef)))
+		return false;
+
+	capturedVariables.push_back({ symbolId, sourceRef.kind == VariableKind::Local, sourceRef.index, sourceRef.isBoxed });
+	refOut = { VariableKind::Captured, (uint32_t)(capturedVariables.size() - 1), sourceRef.isBoxed };
+	return true;
+}
+
+InternalExceptionPointer Compiler::_resolveVariable(SymbolObject *symbol, VariableRef &refOut) {
+	if (symbol->isSpecialForm())
+		return _raiseError("Special form used as a variable", symbol->name);
+
+	if (_resolveLocalVariable(_curFunction, symbol->symbolId, refOut))
+		return {};
+
+	uint32_t slot = context->resolveGlobal(symbol->name);
+
+	// Lambdas may refer to globals which are defined later, they are checked
+	// when the code runs.
+	if ((!_curFunction->parent) &&
+		(context->globals[slot].valueType == ValueType::Undefined) &&
+		(!_definedGlobals.count(slot)))
+		return _raiseError("Undefined symbol", symbol->name);
+
+	refOut = { VariableKind::Global, slot, false };
+	return {};
+}
+
+InternalExceptionPointer Compiler::_compileVariableRef(SymbolObject *symbol) {
+	VariableRef ref;
+
+	MKLISP_RETURN_IF_EXCEPT(_resolveVariable(symbol, ref));
+
+	_emitLoad(ref);
+	if (ref.isBoxed)
+		_emit(Opcode::Unbox);
+
+	return {};
+}
+
+InternalExceptionPointer Compiler::_compileExpr(const Value &value) {
+	switch (value.valueType) {
+		case ValueType::Object: {
+			Object *object = value.exData.asObject;
+
+			switch (object->getObjectType()) {
+				case ObjectType::List:
+					return _compileCall((ListObject *)object);
+				case ObjectType::Symbol:
+					return _compileVariableRef((SymbolObject *)object);
+				default:
+					_emitConst(value);
+					break;
+			}
+			break;
+		}
+		case ValueType::QuotedObject:
+			_emitConst(Value(value.exData.asObject));
+			break;
+		default:
+			_emitConst(value);
+			break;
+	}
+
+	return {};
+}
+
+InternalExceptionPointer Compiler::_compileBody(ListObject *list, size_t indexBegin) {
+	auto &elements = list->elements;
+
+	if (indexBegin >= elements.size()) {
+		_emitConst(Value(ValueType::Nil));
+		return {};
+	}
+
+	for (size_t i = indexBegin; i < elements.size(); ++i) {
+		MKLISP_RETURN_IF_EXCEPT(_compileExpr(elements[i]));
+
+		if (i + 1 < elements.size()) {
+			_emit(Opcode::Pop);
+			_pop();
+		}
+	}
+
+	return {};
+}
+
+InternalExceptionPointer Compiler::_compileCall(ListObject *list) {
+	auto &elements = list->elements;
+
+	if (!elements.size())
+		return _raiseError("Empty form");
+
+	SymbolObject *head = _getSymbol(elements[0]);
+	if (head && head->isSpecialForm()) {
+		SpecialFormCompiler specialFormCompiler = _specialFormCompilers[head->symbolId];
+		return (this->*specialFormCompiler)(list);
+	}
+
+	MKLISP_RETURN_IF_EXCEPT(_compileExpr(elements[0]));
+
+	for (size_t i = 1; i < elements.size(); ++i)
+		MKLISP_RETURN_IF_EXCEPT(_compileExpr(elements[i]));
+
+	uint32_t nArgs = (uint32_t)(elements.size() - 1);
+	size_t callIndex = _emit(Opcode::Call, nArgs);
+	_curFunction->code->instructions[callIndex].callSiteIndex = _curFunction->code->addCallSiteCache();
+	_pop(nArgs);
+
+	return {};
+}
+
+// Pushes the code of the function, or a closure of it if it captures any
+// variables.
+InternalExceptionPointer Compiler::_compileFunction(const Value &params, ListObject *list, size_t bodyBegin) {
+	ListObject *paramList = _getList(params);
+	if (!paramList)
+		return _raiseError("Expecting a parameter list");
+
+	HostObjectRef<CodeObject> code = CodeObject::alloc(context->runtime);
+	FunctionState state(code.get(), _curFunction, &context->runtime->globalHeapResource);
+
+	for (auto &i : paramList->elements) {
+		SymbolObject *param = _getSymbol(i);
+		if (!param)
+			return _raiseError("Expecting a parameter name");
+		if (param->isSpecialForm())
+			return _raiseError("Special form used as a parameter name", param->name);
+		if (std::any_of(state.localVariables.begin(), state.localVariables.end(), [param](auto &j) { return j.symbolId == param->symbolId; }))
+			return _raiseError("Duplicate parameter name", param->name);
+
+		state.localVariables.push_back({ param->symbolId,
+			(uint32_t)state.localVariables.size(),
+			_needsBox(list, bodyBegin, param->symbolId) });
+	}
+	code->nParams = (uint32_t)paramList->elements.size();
+	code->maxStackSize = code->nParams;
+	state.curStackSize = code->nParams;
+
+	FunctionState *parent = _curFunction;
+	_curFunction = &state;
+
+	for (auto &i : state.localVariables) {
+		if (i.isBoxed)
+			_emit(Opcode::BoxLocal, i.offset);
+	}
+
+	InternalExceptionPointer e = _compileBody(list, bodyBegin);
+	if (!e) {
+		_emit(Opcode::Return);
+		_markTailCalls();
+	}
+	_curFunction = parent;
+
+	if (e)
+		return e;
+
+	_emitConst(Value(code.get()));
+
+	if (uint32_t nCaptures = (uint32_t)state.capturedVariables.size()) {
+		for (auto &i : state.capturedVariables) {
+			_emit(i.isLocal ? Opcode::LoadLocal : Opcode::LoadCapture, i.sourceIndex);
+			_push();
+		}
+		_emit(Opcode::MakeClosure, nCaptures);
+		_pop(nCaptures);
+	}
+
+	return {};
+}
+
+InternalExceptionPointer Compiler::_compileQuote(ListObject *list) {
+	auto &elements = list->elements;
+
+	if (elements.size() != 2)
+		return _raiseError("Malformed quote");
+
+	const Value &value = elements[1];
+	switch (value.valueType) {
+		case ValueType::Object:
+		case ValueType::QuotedObject:
+			_emitConst(Value(value.exData.asObject));
+			break;
+		default:
+			_emitConst(value);
+			break;
+	}
+
+	return {};
+}
+
+InternalExceptionPointer Compiler::_compileIf(ListObject *list) {
+	auto &elements = list->elements;
+
+	if ((elements.size() != 3) && (elements.size() != 4))
+		return _raiseError("Malformed if");
+
+	MKLISP_RETURN_IF_EXCEPT(_compileExpr(elements[1]));
+	size_t elseJump = _emit(Opcode::JumpIfFalse);
+	_pop();
+
+	MKLISP_RETURN_IF_EXCEPT(_compileExpr(elements[2]));
+	size_t endJump = _emit(Opcode::Jump);
+	_pop();
+
+	_patchJump(elseJump);
+	if (elements.size() == 4) {
+		MKLISP_RETURN_IF_EXCEPT(_compileExpr(elements[3]));
+	} else
+		_emitConst(Value(ValueType::Nil));
+	_patchJump(endJump);
+
+	return {};
+}
+
+InternalExceptionPointer Compiler::_compileCond(ListObject *list) {
+	auto &elements = list->elements;
+	std::pmr::vector<size_t> endJumps(&context->runtime->globalHeapResource);
+	bool hasElse = false;
+
+	for (size_t i = 1; i < elements.size(); ++i) {
+		ListObject *clause = _getList(elements[i]);
+		if ((!clause) || (!clause->elements.size()))
+			return _raiseError("Malformed cond clause");
+
+		if (SymbolObject *head = _getSymbol(clause->elements[0]); head && (head->name == "else")) {
+			if (i + 1 < elements.size())
+				return _raiseError("The else clause must be the last one");
+
+			MKLISP_RETURN_IF_EXCEPT(_compileBody(clause, 1));
+			hasElse = true;
+			break;
+		}
+
+		MKLISP_RETURN_IF_EXCEPT(_compileExpr(clause->elements[0]));
+
+		// A clause with only a test evaluates to the value of the test.
+		if (clause->elements.size() == 1) {
+			endJumps.push_back(_emit(Opcode::JumpIfTrueOrPop));
+			_pop();
+			continue;
+		}
+
+		size_t nextJump = _emit(Opcode::JumpIfFalse);
+		_pop();
+
+		MKLISP_RETURN_IF_EXCEPT(_compileBody(clause, 1));
+		endJumps.push_back(_emit(Opcode::Jump));
+		_pop();
+
+		_patchJump(nextJump);
+	}
+
+	if (!hasElse)
+		_emitConst(Value(ValueType::Nil));
+
+	for (auto i : endJumps)
+		_patchJump(i);
+
+	return {};
+}
+
+InternalExceptionPointer Compiler::_compileDefine(ListObject *list) {
+	auto &elements = list->elements;
+
+	if (elements.size() < 3)
+		return _raiseError("Malformed define");
+
+	// (define (name params...) body...)
+	if (ListObject *signature = _getList(elements[1])) {
+		if (!signature->elements.size())
+			return _raiseError("Malformed define");
+
+		SymbolObject *name = _getSymbol(signature->elements[0]);
+		if (!name)
+			return _raiseError("Expecting a name to define");
+		if (name->isSpecialForm())
+			return _raiseError("Special form used as a variable", name->name);
+
+		uint32_t slot = context->resolveGlobal(name->name);
+		_definedGlobals.insert(slot);
+
+		// The parameter list is the signature without the name.
+		HostObjectRef<ListObject> params = ListObject::alloc(context->runtime);
+		for (size_t i = 1; i < signature->elements.size(); ++i)
+			params->elements.push_back(signature->elements[i]);
+
+		MKLISP_RETURN_IF_EXCEPT(_compileFunction(Value(params.get()), list, 2));
+		_emit(Opcode::StoreGlobal, slot);
+		return {};
+	}
+
+	if (elements.size() != 3)
+		return _raiseError("Malformed define");
+
+	SymbolObject *name = _getSymbol(elements[1]);
+	if (!name)
+		return _raiseError("Expecting a name to define");
+	if (name->isSpecialForm())
+		return _raiseError("Special form used as a variable", name->name);
+
+	uint32_t slot = context->resolveGlobal(name->name);
+	_definedGlobals.insert(slot);
+
+	MKLISP_RETURN_IF_EXCEPT(_compileExpr(elements[2]));
+	_emit(Opcode::StoreGlobal, slot);
+
+	return {};
+}
+
+InternalExceptionPointer Compiler::_compileLet(ListObject *list) {
+	auto &elements = list->elements;
+
+	if (elements.size() < 2)
+		return _raiseError("Malformed let");
+
+	ListObject *bindings = _getList(elements[1]);
+	if (!bindings)
+		return _raiseError("Expecting a binding list");
+
+	// Initial values are evaluated before any of the variables is bound, and
+	// become the variables where they are pushed.
+	std::pmr::vector<LocalVariable> newVariables(&context->runtime->globalHeapResource);
+	for (auto &i : bindings->elements) {
+		ListObject *binding = _getList(i);
+		if ((!binding) || (binding->elements.size() != 2))
+			return _raiseError("Malformed let binding");
+
+		SymbolObject *name = _getSymbol(binding->elements[0]);
+		if (!name)
+			return _raiseError("Expecting a variable name");
+		if (name->isSpecialForm())
+			return _raiseError("Special form used as a variable", name->name);
+		if (std::any_of(newVariables.begin(), newVariables.end(), [name](auto &j) { return j.symbolId == name->symbolId; }))
+			return _raiseError("Duplicate variable name", name->name);
+
+		uint32_t offset = _curFunction->curStackSize;
+		MKLISP_RETURN_IF_EXCEPT(_compileExpr(binding->elements[1]));
+		newVariables.push_back({ name->symbolId, offset, _needsBox(list, 2, name->symbolId) });
+	}
+
+	for (auto &i : newVariables) {
+		if (i.isBoxed)
+			_emit(Opcode::BoxLocal, i.offset);
+	}
+
+	auto &localVariables = _curFunction->localVariables;
+	size_t nOuterVariables = localVariables.size();
+	localVariables.insert(localVariables.end(), newVariables.begin(), newVariables.end());
+
+	InternalExceptionPointer e = _compileBody(list, 2);
+	localVariables.resize(nOuterVariables);
+	if (e)
+		return e;
+
+	if (uint32_t nVariables = (uint32_t)newVariables.size()) {
+		_emit(Opcode::Slide, nVariables);
+		_pop(nVariables);
+	}
+
+	return {};
+}
+
+InternalExceptionPointer Compiler::_compileLambda(ListObject *list) {
+	auto &elements = list->elements;
+
+	if (elements.size() < 3)
+		return _raiseError("Malformed lambda");
+
+	return _compileFunction(elements[1], list, 2);
+}
+
+InternalExceptionPointer Compiler::_compileBegin(ListObject *list) {
+	return _compileBody(list, 1);
+}
+
+InternalExceptionPointer Compiler::_compileSet(ListObject *list) {
+	auto &elements = list->elements;
+
+	if (elements.size() != 3)
+		return _raiseError("Malformed set!");
+
+	SymbolObject *name = _getSymbol(elements[1]);
+	if (!name)
+		return _raiseError("Expecting a variable name");
+
+	VariableRef ref;
+	MKLISP_RETURN_IF_EXCEPT(_resolveVariable(name, ref));
+
+	MKLISP_RETURN_IF_EXCEPT(_compileExpr(elements[2]));
+	if (ref.isBoxed) {
+		_emitLoad(ref);
+		_emit(Opcode::StoreBox);
+		_pop();
+		return {};
+	}
+
+	switch (ref.kind) {
+		case VariableKind::Local:
+			_emit(Opcode::StoreLocal, ref.index);
+			break;
+		case VariableKind::Captured:
+			assert(("Captured variables which are assigned must be boxed", false));
+			break;
+		case VariableKind::Global:
+			_emit(Opcode::StoreGlobal, ref.index);
+			break;
+	}
+
+	return {};
+}
+
+InternalExceptionPointer Compiler::_compileShortCircuit(ListObject *list, Opcode jumpOpcode) {
+	auto &elements = list->elements;
+	std::pmr::vector<size_t> endJumps(&context->runtime->globalHeapResource);
+
+	if (elements.size() < 2)
+		return _raiseError("Expecting at least one operand");
+
+	for (size_t i = 1; i < elements.size(); ++i) {
+		MKLISP_RETURN_IF_EXCEPT(_compileExpr(elements[i]));
+
+		if (i + 1 < elements.size()) {
+			endJumps.push_back(_emit(jumpOpcode));
+			_pop();
+		}
+	}
+
+	for (auto i : endJumps)
+		_patchJump(i);
+
+	return {};
+}
+
+InternalExceptionPointer Compiler::_compileAnd(ListObject *list) {
+	return _compileShortCircuit(list, Opcode::JumpIfFalseOrPop);
+}
+
+InternalExceptionPointer Compiler::_compileOr(ListObject *list) {
+	return _compileShortCircuit(list, Opcode::JumpIfTrueOrPop);
+}
+
+MKLISP_API InternalExceptionPointer Compiler::compile(const Value &value, HostObjectRef<CodeObject> &codeOut) {
+	MutatorScope mutatorScope(context->runtime);
+	HostObjectRef<CodeObject> code = CodeObject::alloc(context->runtime);
+	FunctionState state(code.get(), nullptr, &context->runtime->globalHeapResource);
+
+	_curFunction = &state;
+	InternalExceptionPointer e = _compileExpr(value);
+	if (!e) {
+		_emit(Opcode::Return);
+		_markTailCalls();
+	}
+	_curFunction = nullptr;
+
+	if (e)
+		return e;
+
+	codeOut = std::move(code);
+	return {};
+}
@@ -0,0 +1,120 @@
+#ifndef _MKLISP_COMPILER_H_
+#define _MKLISP_COMPILER_H_
+
+#include "runtime.h"
+#include <set>
+#include <string_view>
+
+namespace mklisp {
+	// Compiles parsed forms into bytecode which `Runtime::execute` runs.
+	//
+	// Symbols evaluate to the variables they name. Parameters of lambdas and
+	// variables bound by `let` are local to the frame, everything else is a
+	// global of the context, which is resolved to its slot when compiling so
+	// the code follows later rebinding of it. `define` always binds globals.
+	//
+	// Lambdas which refer to local variables of enclosing functions become
+	// flat closures holding copies of exactly those variables. A variable
+	// which is captured and also assigned anywhere in its scope is boxed when
+	// it is bound, so the frame and the closures share it.
+	//
+	// Calls whose values are returned by the function, such as the last
+	// calls of the bodies and of the branches of `if` and `cond`, are tail
+	// calls and do not grow the frame stack.
+	//
+	// Globals referred to outside of lambdas must be bound when compiling, or
+	// be defined by code compiled before by the same compiler. Forms which
+	// cannot be compiled are reported with a `SyntaxError`.
+	class Compiler {
+	private:
+		struct LocalVariable {
+			uint32_t symbolId;
+			uint32_t offset;
+			bool isBoxed;
+		};
+
+		// Variable of the enclosing function copied into the closure.
+		struct CapturedVariable {
+			uint32_t symbolId;
+			// Index of the captured variable of the enclosing function
+			// instead if not set.
+			bool isLocal;
+			// Offset of the local variable of the enclosing function.
+			uint32_t sourceIndex;
+			bool isBoxed;
+		};
+
+		enum class VariableKind : uint8_t {
+			Local = 0,
+			Captured,
+			Global
+		};
+
+		struct VariableRef {
+			VariableKind kind;
+			// Offset of local variables, index of captured variables, or slot
+			// of globals.
+			uint32_t index;
+			bool isBoxed;
+		};
+
+		// Lambdas are compiled with a state of their own.
+		struct FunctionState {
+			CodeObject *code;
+			FunctionState *parent;
+			// Innermost variables are the last ones.
+			std::pmr::vector<LocalVariable> localVariables;
+			// Captures of the closure, in the order of the first references.
+			std::pmr::vector<CapturedVariable> capturedVariables;
+			uint32_t curStackSize = 0;
+
+			FunctionState(CodeObject *code, FunctionState *parent, std::pmr::memory_resource *memoryResource);
+		};
+
+		using SpecialFormCompiler = InternalExceptionPointer (Compiler::*)(ListObject *list);
+
+		static const SpecialFormCompiler _specialFormCompilers[NUM_SPECIAL_FORMS];
+
+		FunctionState *_curFunction = nullptr;
+		std::pmr::set<uint32_t> _definedGlobals;
+
+		InternalExceptionPointer _compileExpr(const Value &value);
+		InternalExceptionPointer _compileBody(ListObject *list, size_t indexBegin);
+		InternalExceptionPointer _compileCall(ListObject *list);
+		InternalExceptionPointer _compileVariableRef(SymbolObject *symbol);
+		InternalExceptionPointer _compileFunction(const Value &params, ListObject *list, size_t bodyBegin);
+
+		InternalExceptionPointer _compileQuote(ListObject *list);
+		InternalExceptionPointer _compileIf(ListObject *list);
+		InternalExceptionPointer _compileCond(ListObject *list);
+		InternalExceptionPointer _compileDefine(ListObject *list);
+		InternalExceptionPointer _compileLet(ListObject *list);
+		InternalExceptionPointer _compileLambda(ListObject *list);
+		InternalExceptionPointer _compileBegin(ListObject *list);
+		InternalExceptionPointer _compileSet(ListObject *list);
+		InternalExceptionPointer _compileAnd(ListObject *list);
+		InternalExceptionPointer _compileOr(ListObject *list);
+		InternalExceptionPointer _compileShortCircuit(ListObject *list, Opcode jumpOpcode);
+
+		bool _resolveLocalVariable(FunctionState *function, uint32_t symbolId, VariableRef &refOut);
+		InternalExceptionPointer _resolveVariable(SymbolObject *symbol, VariableRef &refOut);
+		InternalExceptionPointer _raiseError(const char *message, const std::string_view &detail = {});
+
+		size_t _emit(Opcode opcode, uint32_t operand = 0);
+		void _emitConst(const Value &value);
+		void _emitLoad(const VariableRef &ref);
+		void _patchJump(size_t index) noexcept;
+		void _markTailCalls() noexcept;
+		void _push(uint32_t nValues = 1) noexcept;
+		void _pop(uint32_t nValues = 1) noexcept;
+
+	public:
+		Context *context;
+
+		MKLISP_API Compiler(Context *context);
+
+		MKLISP_API InternalExceptionPointer compile(const Value &value, HostObjectRef<CodeObject> &codeOut);
+	};
+}
+
+#endif
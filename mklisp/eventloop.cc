@@ -0,0 +1,303 @@
+#include "eventloop.h"
+#include <cerrno>
+#include <system_error>
+#include <thread>
+
+#if MKLISP_EVENT_LOOP
+	#include <sys/epoll.h>
+	#include <sys/eventfd.h>
+	#include <sys/timerfd.h>
+	#include <unistd.h>
+
+using namespace mklisp;
+
+static thread_local EventLoop *_currentLoop = nullptr;
+
+static int _addFd(int epollFd, int fd, uint32_t events) noexcept {
+	epoll_event event = {};
+	event.events = events;
+	event.data.fd = fd;
+	return epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+}
+
+MKLISP_API EventLoop::EventLoop(std::pmr::memory_resource *memoryResource)
+	: _tasks(memoryResource),
+	  _readyContexts(memoryResource),
+	  _fdWatches(memoryResource),
+	  _timers(memoryResource),
+	  _postedCalls(memoryResource),
+	  memoryResource(memoryResource) {
+	if (((_epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0) ||
+		((_timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) ||
+		((_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) ||
+		(_addFd(_epollFd, _timerFd, EPOLLIN) < 0) ||
+		(_addFd(_epollFd, _wakeFd, EPOLLIN) < 0)) {
+		int error = errno;
+		for (int i : { _epollFd, _timerFd, _wakeFd }) {
+			if (i >= 0)
+				close(i);
+		}
+		throw std::system_error(error, std::generic_category(), "Error creating the event loop");
+	}
+}
+
+MKLISP_API EventLoop::~EventLoop() {
+	for (auto &i : _tasks) {
+		if (i.second.isStarted)
+			i.first->runtime->abortEval(i.first);
+	}
+
+	close(_wakeFd);
+	close(_timerFd);
+	close(_epollFd);
+}
+
+MKLISP_API EventLoop *EventLoop::getCurrent() noexcept {
+	return _currentLoop;
+}
+
+void EventLoop::_markReady(Context *context) {
+	Task &task = _tasks.at(context);
+
+	if (!task.isReady) {
+		task.isReady = true;
+		_readyContexts.push_back(context);
+	}
+}
+
+void EventLoop::_runSlice(Context *context) {
+	Task &task = _tasks.at(context);
+	Runtime *runtime = context->runtime;
+	task.isReady = false;
+
+	EvalStatus status;
+	Value result;
+	InternalExceptionPointer e = task.isStarted
+									 ? runtime->resumeEval(context, fuel, timeSlice, status, result)
+									 : runtime->startEval(task.value, context, fuel, timeSlice, status, result);
+	task.isStarted = true;
+
+	if (!e) {
+		switch (status) {
+			case EvalStatus::Yielded:
+				_markReady(context);
+				return;
+			case EvalStatus::Awaiting:
+				// Ready once the call has been completed.
+				return;
+			default:
+				break;
+		}
+	}
+
+	TaskCompletionCallback callback = task.callback;
+	void *userData = task.userData;
+	_tasks.erase(context);
+
+	if (callback)
+		callback(userData, context, e, result);
+	e.reset();
+}
+
+void EventLoop::_armTimer() {
+	itimerspec spec = {};
+
+	if (_timers.size()) {
+		auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(_timers.begin()->first.time_since_epoch()).count();
+		// Zero disarms the timer.
+		if (nanoseconds <= 0)
+			nanoseconds = 1;
+		spec.it_value.tv_sec = (time_t)(nanoseconds / 1000000000);
+		spec.it_value.tv_nsec = (long)(nanoseconds % 1000000000);
+	}
+
+	timerfd_settime(_timerFd, TFD_TIMER_ABSTIME, &spec, nullptr);
+}
+
+void EventLoop::_expireTimers() {
+	uint64_t nExpirations;
+	while (read(_timerFd, &nExpirations, sizeof(nExpirations)) > 0)
+		;
+
+	auto now = std::chrono::steady_clock::now();
+	while (_timers.size() && (_timers.begin()->first <= now)) {
+		Context *context = _timers.begin()->second;
+		_timers.erase(_timers.begin());
+		completeCall(context, Value(ValueType::Nil));
+	}
+
+	_armTimer();
+}
+
+void EventLoop::_runPostedCalls() {
+	uint64_t nPosts;
+	while (read(_wakeFd, &nPosts, sizeof(nPosts)) > 0)
+		;
+
+	std::pmr::vector<PostedCall> postedCalls(memoryResource);
+	{
+		std::lock_guard<std::mutex> lock(_postedCallsMutex);
+		postedCalls.swap(_postedCalls);
+	}
+
+	for (auto &i : postedCalls)
+		i.callback(this, i.userData);
+}
+
+void EventLoop::_dispatchEvent(int fd, uint32_t events) {
+	if (fd == _wakeFd) {
+		_runPostedCalls();
+		return;
+	}
+	if (fd == _timerFd) {
+		_expireTimers();
+		return;
+	}
+
+	// The descriptor may have been unwatched by an earlier event.
+	auto it = _fdWatches.find(fd);
+	if (it == _fdWatches.end())
+		return;
+
+	FdWatch watch = it->second;
+	if (watch.awaitingContext) {
+		epoll_ctl(_epollFd, EPOLL_CTL_DEL, fd, nullptr);
+		_fdWatches.erase(it);
+		completeCall(watch.awaitingContext, Value((int32_t)events));
+	} else
+		watch.callback(this, fd, events, watch.userData);
+}
+
+MKLISP_API void EventLoop::spawn(Context *context, Value value, TaskCompletionCallback callback, void *userData) {
+	Task task;
+	task.value = value;
+	task.callback = callback;
+	task.userData = userData;
+
+	bool isInserted = _tasks.emplace(context, task).second;
+	assert(("The context is already running a task", isInserted));
+	_markReady(context);
+}
+
+MKLISP_API void EventLoop::run() {
+	EventLoop *prevLoop = _currentLoop;
+	_currentLoop = this;
+
+	epoll_event events[EVENT_LOOP_MAX_EVENTS];
+	while (true) {
+		// Tasks which yield now are run again after polling.
+		for (size_t i = _readyContexts.size(); i; --i) {
+			Context *context = _readyContexts.front();
+			_readyContexts.pop_front();
+			_runSlice(context);
+		}
+
+		if (_isStopping || ((!_tasks.size()) && (!_fdWatches.size())))
+			break;
+
+		int nEvents = epoll_wait(_epollFd, events, (int)EVENT_LOOP_MAX_EVENTS, _readyContexts.size() ? 0 : -1);
+		if (nEvents < 0) {
+			if (errno == EINTR)
+				continue;
+			_currentLoop = prevLoop;
+			throw std::system_error(errno, std::generic_category(), "Error waiting for events");
+		}
+
+		for (int i = 0; i < nEvents; ++i)
+			_dispatchEvent(events[i].data.fd, events[i].events);
+	}
+
+	_isStopping = false;
+	_currentLoop = prevLoop;
+}
+
+MKLISP_API void EventLoop::stop() {
+	post([](EventLoop *loop, void *) { loop->_isStopping = true; }, nullptr);
+}
+
+MKLISP_API void EventLoop::post(PostedCallback callback, void *userData) {
+	{
+		std::lock_guard<std::mutex> lock(_postedCallsMutex);
+		_postedCalls.push_back({ callback, userData });
+	}
+
+	uint64_t one = 1;
+	write(_wakeFd, &one, sizeof(one));
+}
+
+MKLISP_API bool EventLoop::watchFd(int fd, uint32_t events, FdEventCallback callback, void *userData) {
+	if (_fdWatches.count(fd) || (_addFd(_epollFd, fd, events) < 0))
+		return false;
+
+	FdWatch &watch = _fdWatches[fd];
+	watch.callback = callback;
+	watch.userData = userData;
+	return true;
+}
+
+MKLISP_API void EventLoop::unwatchFd(int fd) noexcept {
+	if (auto it = _fdWatches.find(fd); it != _fdWatches.end()) {
+		epoll_ctl(_epollFd, EPOLL_CTL_DEL, fd, nullptr);
+		_fdWatches.erase(it);
+	}
+}
+
+MKLISP_API bool EventLoop::awaitFd(Context *context, int fd, uint32_t events) {
+	if ((!_tasks.count(context)) || _fdWatches.count(fd) || (!context->isYieldable))
+		return false;
+	if (_addFd(_epollFd, fd, events | EPOLLONESHOT) < 0)
+		return false;
+
+	_fdWatches[fd].awaitingContext = context;
+	return suspendCall(context);
+}
+
+MKLISP_API bool EventLoop::awaitTimeout(Context *context, std::chrono::nanoseconds timeout) {
+	if (!suspendCall(context))
+		return false;
+
+	auto it = _timers.emplace(std::chrono::steady_clock::now() + timeout, context);
+	if (it == _timers.begin())
+		_armTimer();
+	return true;
+}
+
+MKLISP_API bool EventLoop::suspendCall(Context *context) noexcept {
+	return _tasks.count(context) && context->runtime->suspendCall(context);
+}
+
+MKLISP_API void EventLoop::completeCall(Context *context, const Value &result) {
+	context->runtime->completeCall(context, result);
+	_markReady(context);
+}
+
+static void _sleepFn(Context *context, ValueSpan args) {
+	int64_t nMilliseconds = 0;
+	if (args.size) {
+		switch (args.data[0].valueType) {
+			case ValueType::Int:
+				nMilliseconds = args.data[0].exData.asInt;
+				break;
+			case ValueType::Long:
+				nMilliseconds = args.data[0].exData.asLong;
+				break;
+			default:
+				break;
+		}
+	}
+	std::chrono::milliseconds timeout(nMilliseconds);
+
+	if (EventLoop *loop = EventLoop::getCurrent(); loop && loop->awaitTimeout(context, timeout))
+		return;
+
+	BlockingScope blockingScope(context->runtime);
+	std::this_thread::sleep_for(timeout);
+}
+
+MKLISP_API void mklisp::bindEventLoopBuiltins(Context *context) {
+	HostObjectRef<NativeFnObject> fn = NativeFnObject::alloc(context->runtime, _sleepFn);
+	fn->isAsync = true;
+	context->setBinding("sleep", fn.get());
+}
+
+#endif
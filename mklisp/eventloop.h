@@ -0,0 +1,133 @@
+#ifndef _MKLISP_EVENTLOOP_H_
+#define _MKLISP_EVENTLOOP_H_
+
+#include "runtime.h"
+#include <deque>
+#include <map>
+
+// The event loop is built on epoll, timerfd and eventfd. Define
+// `MKLISP_NO_EVENT_LOOP` to leave it out.
+#if defined(__linux__) && !defined(MKLISP_NO_EVENT_LOOP)
+	#define MKLISP_EVENT_LOOP 1
+#else
+	#define MKLISP_EVENT_LOOP 0
+#endif
+
+#if MKLISP_EVENT_LOOP
+
+namespace mklisp {
+	constexpr static size_t DEFAULT_EVENT_LOOP_FUEL = 100000;
+	constexpr static std::chrono::nanoseconds DEFAULT_EVENT_LOOP_TIME_SLICE = std::chrono::milliseconds(2);
+	constexpr static size_t EVENT_LOOP_MAX_EVENTS = 64;
+
+	class EventLoop;
+
+	// Called on the thread of the loop with the events of epoll.
+	typedef void (*FdEventCallback)(EventLoop *loop, int fd, uint32_t events, void *userData);
+	typedef void (*PostedCallback)(EventLoop *loop, void *userData);
+
+	// Runs evaluations on many contexts on the thread which calls `run`, in
+	// slices like `Scheduler`, and completes the calls which async natives
+	// have suspended, see `Runtime::suspendCall`, once what they wait for is
+	// ready. Evaluations waiting for calls take no time of the loop.
+	//
+	// Natives find the loop running them with `getCurrent`, and suspend their
+	// calls with `awaitFd` or `awaitTimeout`, or with `suspendCall` and
+	// complete them with `completeCall` later, which other threads do through
+	// `post`.
+	//
+	// The host must not use the runtimes of the tasks while the loop is
+	// running, and must keep the values being evaluated alive until the tasks
+	// have completed.
+	class EventLoop {
+	private:
+		struct Task {
+			Value value;
+			TaskCompletionCallback callback;
+			void *userData;
+			bool isStarted = false;
+			bool isReady = false;
+		};
+
+		// Watches are either persistent, with a callback, or complete the
+		// call of a context once.
+		struct FdWatch {
+			FdEventCallback callback = nullptr;
+			void *userData = nullptr;
+			Context *awaitingContext = nullptr;
+		};
+
+		struct PostedCall {
+			PostedCallback callback;
+			void *userData;
+		};
+
+		int _epollFd = -1, _timerFd = -1, _wakeFd = -1;
+		std::pmr::unordered_map<Context *, Task> _tasks;
+		std::pmr::deque<Context *> _readyContexts;
+		std::pmr::unordered_map<int, FdWatch> _fdWatches;
+		std::pmr::multimap<std::chrono::steady_clock::time_point, Context *> _timers;
+		bool _isStopping = false;
+
+		// Guards the calls posted by other threads.
+		std::mutex _postedCallsMutex;
+		std::pmr::vector<PostedCall> _postedCalls;
+
+		void _markReady(Context *context);
+		void _runSlice(Context *context);
+		void _armTimer();
+		void _expireTimers();
+		void _runPostedCalls();
+		void _dispatchEvent(int fd, uint32_t events);
+
+	public:
+		std::pmr::memory_resource *memoryResource;
+		size_t fuel = DEFAULT_EVENT_LOOP_FUEL;
+		std::chrono::nanoseconds timeSlice = DEFAULT_EVENT_LOOP_TIME_SLICE;
+
+		// Throws `std::system_error` if the descriptors cannot be created.
+		MKLISP_API EventLoop(std::pmr::memory_resource *memoryResource);
+		EventLoop(const EventLoop &) = delete;
+		// Evaluations of the tasks which have not completed are aborted
+		// without calling their callbacks.
+		MKLISP_API ~EventLoop();
+
+		// Returns the loop which is running on the thread, if any.
+		MKLISP_API static EventLoop *getCurrent() noexcept;
+
+		// Queues the evaluation of the value on the context, which must not be
+		// used for anything else until the task has completed.
+		MKLISP_API void spawn(Context *context, Value value, TaskCompletionCallback callback, void *userData);
+		// Runs until all tasks have completed and no descriptor is watched, or
+		// until stopped.
+		MKLISP_API void run();
+		// May be called by any thread.
+		MKLISP_API void stop();
+		// Calls the callback on the thread of the loop, may be called by any
+		// thread.
+		MKLISP_API void post(PostedCallback callback, void *userData);
+
+		// Watches the descriptor until it is unwatched. Returns false if it
+		// cannot be watched.
+		MKLISP_API bool watchFd(int fd, uint32_t events, FdEventCallback callback, void *userData);
+		MKLISP_API void unwatchFd(int fd) noexcept;
+
+		// Suspend the call of the native which calls them, and complete it
+		// with the events of the descriptor as an int once it is ready, or
+		// with nil after the timeout. Return false if the call cannot be
+		// suspended.
+		MKLISP_API bool awaitFd(Context *context, int fd, uint32_t events);
+		MKLISP_API bool awaitTimeout(Context *context, std::chrono::nanoseconds timeout);
+
+		MKLISP_API bool suspendCall(Context *context) noexcept;
+		MKLISP_API void completeCall(Context *context, const Value &result);
+	};
+
+	// Binds `(sleep ms)`, which waits without blocking the loop, or blocks the
+	// thread if it is not run by a loop.
+	MKLISP_API void bindEventLoopBuiltins(Context *context);
+}
+
+#endif
+
+#endif
@@ -69,3 +69,203 @@ MKLISP_API SyntaxError *SyntaxError::alloc(
 
 	return ptr.release();
 }
+
+MKLISP_API RuntimeError::RuntimeError(
+	std::pmr::memory_resource *memoryResource,
+	RuntimeErrorCode errorCode) : InternalException(memoryResource, InternalExceptionKind::RuntimeError), errorCode(errorCode) {
+}
+
+MKLISP_API RuntimeError::~RuntimeError() {
+}
+
+MKLISP_API FrozenObjectMutationError::FrozenObjectMutationError(
+	std::pmr::memory_resource *memoryResource,
+	Object *object) : RuntimeError(memoryResource, RuntimeErrorCode::FrozenObjectMutation), object(object) {
+}
+
+MKLISP_API FrozenObjectMutationError::~FrozenObjectMutationError() {
+}
+
+MKLISP_API void FrozenObjectMutationError::dealloc() noexcept {
+	using Alloc = std::pmr::polymorphic_allocator<FrozenObjectMutationError>;
+	Alloc allocator(memoryResource);
+
+	std::destroy_at(this);
+	allocator.deallocate(this, 1);
+}
+
+MKLISP_API FrozenObjectMutationError *FrozenObjectMutationError::alloc(
+	std::pmr::memory_resource *memoryResource,
+	Object *object) {
+	using Alloc = std::pmr::polymorphic_allocator<FrozenObjectMutationError>;
+	Alloc allocator(memoryResource);
+
+	std::unique_ptr<FrozenObjectMutationError, StatefulDeleter<Alloc>> ptr(
+		allocator.allocate(1),
+		StatefulDeleter<Alloc>(allocator));
+	allocator.construct(ptr.get(), memoryResource, object);
+
+	return ptr.release();
+}
+
+MKLISP_API StackOverflowError::StackOverflowError(
+	std::pmr::memory_resource *memoryResource,
+	size_t depth) : RuntimeError(memoryResource, RuntimeErrorCode::StackOverflow), depth(depth) {
+}
+
+MKLISP_API StackOverflowError::~StackOverflowError() {
+}
+
+MKLISP_API void StackOverflowError::dealloc() noexcept {
+	using Alloc = std::pmr::polymorphic_allocator<StackOverflowError>;
+	Alloc allocator(memoryResource);
+
+	std::destroy_at(this);
+	allocator.deallocate(this, 1);
+}
+
+MKLISP_API StackOverflowError *StackOverflowError::alloc(
+	std::pmr::memory_resource *memoryResource,
+	size_t depth) {
+	using Alloc = std::pmr::polymorphic_allocator<StackOverflowError>;
+	Alloc allocator(memoryResource);
+
+	std::unique_ptr<StackOverflowError, StatefulDeleter<Alloc>> ptr(
+		allocator.allocate(1),
+		StatefulDeleter<Alloc>(allocator));
+	allocator.construct(ptr.get(), memoryResource, depth);
+
+	return ptr.release();
+}
+
+MKLISP_API UncallableTargetError::UncallableTargetError(
+	std::pmr::memory_resource *memoryResource,
+	const Value &target) : RuntimeError(memoryResource, RuntimeErrorCode::UncallableTarget), target(target) {
+}
+
+MKLISP_API UncallableTargetError::~UncallableTargetError() {
+}
+
+MKLISP_API void UncallableTargetError::dealloc() noexcept {
+	using Alloc = std::pmr::polymorphic_allocator<UncallableTargetError>;
+	Alloc allocator(memoryResource);
+
+	std::destroy_at(this);
+	allocator.deallocate(this, 1);
+}
+
+MKLISP_API UncallableTargetError *UncallableTargetError::alloc(
+	std::pmr::memory_resource *memoryResource,
+	const Value &target) {
+	using Alloc = std::pmr::polymorphic_allocator<UncallableTargetError>;
+	Alloc allocator(memoryResource);
+
+	std::unique_ptr<UncallableTargetError, StatefulDeleter<Alloc>> ptr(
+		allocator.allocate(1),
+		StatefulDeleter<Alloc>(allocator));
+	allocator.construct(ptr.get(), memoryResource, target);
+
+	return ptr.release();
+}
+
+MKLISP_API UnboundVariableError::UnboundVariableError(
+	std::pmr::memory_resource *memoryResource,
+	const std::string_view &name) : RuntimeError(memoryResource, RuntimeErrorCode::UnboundVariable), name(name, memoryResource) {
+}
+
+MKLISP_API UnboundVariableError::~UnboundVariableError() {
+}
+
+MKLISP_API void UnboundVariableError::dealloc() noexcept {
+	using Alloc = std::pmr::polymorphic_allocator<UnboundVariableError>;
+	Alloc allocator(memoryResource);
+
+	std::destroy_at(this);
+	allocator.deallocate(this, 1);
+}
+
+MKLISP_API UnboundVariableError *UnboundVariableError::alloc(
+	std::pmr::memory_resource *memoryResource,
+	const std::string_view &name) {
+	using Alloc = std::pmr::polymorphic_allocator<UnboundVariableError>;
+	Alloc allocator(memoryResource);
+
+	std::unique_ptr<UnboundVariableError, StatefulDeleter<Alloc>> ptr(
+		allocator.allocate(1),
+		StatefulDeleter<Alloc>(allocator));
+	allocator.construct(ptr.get(), memoryResource, name);
+
+	return ptr.release();
+}
+
+MKLISP_API ArityMismatchError::ArityMismatchError(
+	std::pmr::memory_resource *memoryResource,
+	size_t nParams,
+	size_t nArgs) : RuntimeError(memoryResource, RuntimeErrorCode::ArityMismatch), nParams(nParams), nArgs(nArgs) {
+}
+
+MKLISP_API ArityMismatchError::~ArityMismatchError() {
+}
+
+MKLISP_API void ArityMismatchError::dealloc() noexcept {
+	using Alloc = std::pmr::polymorphic_allocator<ArityMismatchError>;
+	Alloc allocator(memoryResource);
+
+	std::destroy_at(this);
+	allocator.deallocate(this, 1);
+}
+
+MKLISP_API ArityMismatchError *ArityMismatchError::alloc(
+	std::pmr::memory_resource *memoryResource,
+	size_t nParams,
+	size_t nArgs) {
+	using Alloc = std::pmr::polymorphic_allocator<ArityMismatchError>;
+	Alloc allocator(memoryResource);
+
+	std::unique_ptr<ArityMismatchError, StatefulDeleter<Alloc>> ptr(
+		allocator.allocate(1),
+		StatefulDeleter<Alloc>(allocator));
+	allocator.construct(ptr.get(), memoryResource, nParams, nArgs);
+
+	return ptr.release();
+}
+
+MKLISP_API InvalidArgumentError::InvalidArgumentError(
+	std::pmr::memory_resource *memoryResource,
+	size_t argIndex) : RuntimeError(memoryResource, RuntimeErrorCode::InvalidArgument), argIndex(argIndex) {
+}
+
+MKLISP_API InvalidArgumentError::~InvalidArgumentError() {
+}
+
+MKLISP_API void InvalidArgumentError::dealloc() noexcept {
+	using Alloc = std::pmr::polymorphic_allocator<InvalidArgumentError>;
+	Alloc allocator(memoryResource);
+
+	std::destroy_at(this);
+	allocator.deallocate(this, 1);
+}
+
+MKLISP_API InvalidArgumentError *InvalidArgumentError::alloc(
+	std::pmr::memory_resource *memoryResource,
+	size_t argIndex) {
+	using Alloc = std::pmr::polymorphic_allocator<InvalidArgumentError>;
+	Alloc allocator(memoryResource);
+
+	std::unique_ptr<InvalidArgumentError, StatefulDeleter<Alloc>> ptr(
+		allocator.allocate(1),
+		StatefulDeleter<Alloc>(allocator));
+	allocator.construct(ptr.get(), memoryResource, argIndex);
+
+	return ptr.release();
+}
+
+MKLISP_API OutOfMemoryError::OutOfMemoryError(std::pmr::memory_resource *memoryResource)
+	: RuntimeError(memoryResource, RuntimeErrorCode::OutOfMemory) {
+}
+
+MKLISP_API OutOfMemoryError::~OutOfMemoryError() {
+}
+
+MKLISP_API void OutOfMemoryError::dealloc() noexcept {
+}
@@ -3,6 +3,7 @@
 
 #include "except_base.h"
 #include "astnode.h"
+#include "value.h"
 
 namespace mklisp {
 	enum class CompilationErrorCode {
@@ -50,6 +51,133 @@ namespace mklisp {
 			std::pmr::memory_resource *memoryResource,
 			std::pmr::string &&message);
 	};
+
+	enum class RuntimeErrorCode {
+		FrozenObjectMutation = 0,
+		OutOfMemory,
+		StackOverflow,
+		UncallableTarget,
+		UnboundVariable,
+		ArityMismatch,
+		InvalidArgument
+	};
+
+	class RuntimeError : public InternalException {
+	public:
+		RuntimeErrorCode errorCode;
+
+		MKLISP_API RuntimeError(
+			std::pmr::memory_resource *memoryResource,
+			RuntimeErrorCode errorCode);
+		MKLISP_API virtual ~RuntimeError();
+	};
+
+	class Object;
+
+	class FrozenObjectMutationError : public RuntimeError {
+	public:
+		Object *object;
+
+		MKLISP_API FrozenObjectMutationError(
+			std::pmr::memory_resource *memoryResource,
+			Object *object);
+		MKLISP_API virtual ~FrozenObjectMutationError();
+		MKLISP_API virtual void dealloc() noexcept override;
+
+		MKLISP_API static FrozenObjectMutationError *alloc(
+			std::pmr::memory_resource *memoryResource,
+			Object *object);
+	};
+
+	class StackOverflowError : public RuntimeError {
+	public:
+		size_t depth;
+
+		MKLISP_API StackOverflowError(
+			std::pmr::memory_resource *memoryResource,
+			size_t depth);
+		MKLISP_API virtual ~StackOverflowError();
+		MKLISP_API virtual void dealloc() noexcept override;
+
+		MKLISP_API static StackOverflowError *alloc(
+			std::pmr::memory_resource *memoryResource,
+			size_t depth);
+	};
+
+	// Raised when calling a value which is not a function, such as an unbound
+	// global.
+	class UncallableTargetError : public RuntimeError {
+	public:
+		Value target;
+
+		MKLISP_API UncallableTargetError(
+			std::pmr::memory_resource *memoryResource,
+			const Value &target);
+		MKLISP_API virtual ~UncallableTargetError();
+		MKLISP_API virtual void dealloc() noexcept override;
+
+		MKLISP_API static UncallableTargetError *alloc(
+			std::pmr::memory_resource *memoryResource,
+			const Value &target);
+	};
+
+	class UnboundVariableError : public RuntimeError {
+	public:
+		std::pmr::string name;
+
+		MKLISP_API UnboundVariableError(
+			std::pmr::memory_resource *memoryResource,
+			const std::string_view &name);
+		MKLISP_API virtual ~UnboundVariableError();
+		MKLISP_API virtual void dealloc() noexcept override;
+
+		MKLISP_API static UnboundVariableError *alloc(
+			std::pmr::memory_resource *memoryResource,
+			const std::string_view &name);
+	};
+
+	class ArityMismatchError : public RuntimeError {
+	public:
+		size_t nParams;
+		size_t nArgs;
+
+		MKLISP_API ArityMismatchError(
+			std::pmr::memory_resource *memoryResource,
+			size_t nParams,
+			size_t nArgs);
+		MKLISP_API virtual ~ArityMismatchError();
+		MKLISP_API virtual void dealloc() noexcept override;
+
+		MKLISP_API static ArityMismatchError *alloc(
+			std::pmr::memory_resource *memoryResource,
+			size_t nParams,
+			size_t nArgs);
+	};
+
+	// Raised by natives called with an argument of the wrong type.
+	class InvalidArgumentError : public RuntimeError {
+	public:
+		size_t argIndex;
+
+		MKLISP_API InvalidArgumentError(
+			std::pmr::memory_resource *memoryResource,
+			size_t argIndex);
+		MKLISP_API virtual ~InvalidArgumentError();
+		MKLISP_API virtual void dealloc() noexcept override;
+
+		MKLISP_API static InvalidArgumentError *alloc(
+			std::pmr::memory_resource *memoryResource,
+			size_t argIndex);
+	};
+
+	// Preallocated by each runtime since it is raised when nothing else can be
+	// allocated, `dealloc` does nothing.
+	class OutOfMemoryError : public RuntimeError {
+	public:
+		MKLISP_API OutOfMemoryError(std::pmr::memory_resource *memoryResource);
+		MKLISP_API virtual ~OutOfMemoryError();
+		MKLISP_API virtual void dealloc() noexcept override;
+	};
 }
 
 #endif
@@ -9,7 +9,8 @@
 
 namespace mklisp {
 	enum class InternalExceptionKind {
-		CompilationError = 0
+		CompilationError = 0,
+		RuntimeError
 	};
 
 	class InternalException {
@@ -0,0 +1,601 @@
+#include "runtime.h"
+#include <algorithm>
+
+using namespace mklisp;
+
+MKLISP_API RuntimeThreadCache::~RuntimeThreadCache() {
+}
+
+MKLISP_API ThreadCache *Runtime::newThreadCache() {
+	return new RuntimeThreadCache();
+}
+
+MKLISP_API void Runtime::flushThreadCache(ThreadCache *cache) noexcept {
+	HeapLimitExemptScope exemptScope;
+	std::lock_guard<std::mutex> heapLock(heapMutex);
+	_registerCreatedObjects((RuntimeThreadCache *)cache);
+}
+
+void Runtime::_registerCreatedObjects(RuntimeThreadCache *cache) {
+	for (size_t i = 0; i < cache->nCreatedObjects; ++i) {
+		Object *object = cache->createdObjects[i];
+
+		// Objects created during a major collection are allocated black.
+		if (gcPhase != GCPhase::Idle)
+			object->objectFlags |= OBJECT_MARKED;
+
+		createdObjects.push_back(object);
+		++nTotalCreatedObjects;
+		if (youngObjectsBegin == createdObjects.end())
+			youngObjectsBegin = std::prev(createdObjects.end());
+	}
+
+	cache->nCreatedObjects = 0;
+}
+
+MKLISP_API void Runtime::addCreatedObject(Object *object) {
+	RuntimeThreadCache *cache = (RuntimeThreadCache *)getThreadCache();
+
+	cache->createdObjects[cache->nCreatedObjects++] = object;
+
+	if (cache->nCreatedObjects == RUNTIME_THREAD_CACHE_SIZE) {
+		HeapLimitExemptScope exemptScope;
+		auto heapLock = lockHeap();
+		_registerCreatedObjects(cache);
+	}
+}
+
+MKLISP_API void Runtime::flushAllThreadCaches() noexcept {
+	ThreadCacheOwner::flushAllThreadCaches();
+	nurseryResource.flushAllThreadCaches();
+	globalHeapResource.flushAllThreadCaches();
+}
+
+MKLISP_API void Runtime::attachMutator() {
+	RuntimeThreadCache *cache = (RuntimeThreadCache *)getThreadCache();
+
+	if (cache->nMutatorScopes++)
+		return;
+
+	std::unique_lock<std::mutex> lock(_safepointMutex);
+	// The thread which has stopped the world may use it as a mutator too.
+	_safepointCond.wait(lock, [this]() {
+		return (!_isWorldStopRequested) || (_worldStoppingThread == std::this_thread::get_id());
+	});
+	++_nMutators;
+}
+
+MKLISP_API void Runtime::detachMutator() noexcept {
+	RuntimeThreadCache *cache = (RuntimeThreadCache *)getThreadCache();
+
+	if (--cache->nMutatorScopes)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(_safepointMutex);
+		--_nMutators;
+	}
+	// The thread stopping the world may be waiting for it.
+	_safepointCond.notify_all();
+}
+
+MKLISP_API BlockingScope::BlockingScope(Runtime *runtime) noexcept : _runtime(runtime) {
+	RuntimeThreadCache *cache = (RuntimeThreadCache *)runtime->getThreadCache();
+
+	_nMutatorScopes = cache->nMutatorScopes;
+	if (_nMutatorScopes) {
+		cache->nMutatorScopes = 1;
+		runtime->detachMutator();
+	}
+}
+
+MKLISP_API BlockingScope::~BlockingScope() {
+	if (_nMutatorScopes) {
+		_runtime->attachMutator();
+		((RuntimeThreadCache *)_runtime->getThreadCache())->nMutatorScopes = _nMutatorScopes;
+	}
+}
+
+// Parks the mutator until the world is resumed.
+void Runtime::_parkMutator(std::unique_lock<std::mutex> &lock) {
+	++_nParkedMutators;
+	_safepointCond.notify_all();
+	_safepointCond.wait(lock, [this]() { return !_isWorldStopRequested; });
+	--_nParkedMutators;
+}
+
+void Runtime::_waitForParkedMutators(std::unique_lock<std::mutex> &lock, bool isMutator) {
+	_isWorldStopRequested = true;
+	_worldStoppingThread = std::this_thread::get_id();
+	_nWorldStops = 1;
+
+	// The thread counts as parked.
+	if (isMutator)
+		++_nParkedMutators;
+	_safepointCond.wait(lock, [this]() { return _nParkedMutators == _nMutators; });
+	if (isMutator)
+		--_nParkedMutators;
+}
+
+MKLISP_API void Runtime::stopTheWorld() {
+	bool isMutator = ((RuntimeThreadCache *)getThreadCache())->nMutatorScopes;
+	std::unique_lock<std::mutex> lock(_safepointMutex);
+
+	while (_isWorldStopRequested) {
+		if (_worldStoppingThread == std::this_thread::get_id()) {
+			++_nWorldStops;
+			return;
+		}
+
+		if (isMutator)
+			_parkMutator(lock);
+		else
+			_safepointCond.wait(lock, [this]() { return !_isWorldStopRequested; });
+	}
+
+	_waitForParkedMutators(lock, isMutator);
+}
+
+MKLISP_API void Runtime::resumeTheWorld() noexcept {
+	{
+		std::lock_guard<std::mutex> lock(_safepointMutex);
+		assert(("The world is not stopped by the thread",
+			_isWorldStopRequested && (_worldStoppingThread == std::this_thread::get_id())));
+
+		if (--_nWorldStops)
+			return;
+		_isWorldStopRequested = false;
+		_worldStoppingThread = std::thread::id();
+	}
+	_safepointCond.notify_all();
+}
+
+// Collections are started by whichever mutator reaches a safepoint first once
+// they are due, the others are parked meanwhile and check again afterwards.
+void Runtime::_onSafepoint() {
+	bool isMutator = ((RuntimeThreadCache *)getThreadCache())->nMutatorScopes;
+
+	{
+		std::unique_lock<std::mutex> lock(_safepointMutex);
+
+		while (true) {
+			if (_isWorldStopRequested) {
+				// Evaluations of the thread stopping the world, such as the ones
+				// of callbacks, never collect.
+				if ((_worldStoppingThread == std::this_thread::get_id()) || (!isMutator))
+					return;
+				_parkMutator(lock);
+				continue;
+			}
+
+			if (!_isCollectionDue())
+				return;
+			break;
+		}
+
+		_waitForParkedMutators(lock, isMutator);
+	}
+
+	try {
+		if ((globalHeapResource.szAllocated > heapSoftLimit) != _isOverHeapSoftLimit)
+			_onHeapSoftLimitCrossed();
+
+		if (gcPhase != GCPhase::Idle)
+			performGcSlice();
+		else if (globalHeapResource.szAllocated > gcThreshold) {
+			if (gcMode == GCMode::Incremental)
+				performGcSlice();
+			else
+				collectGarbage();
+		} else if (nurseryResource.szYoungAllocated > minorGcThreshold)
+			collectYoungGarbage();
+	} catch (...) {
+		resumeTheWorld();
+		throw;
+	}
+	resumeTheWorld();
+
+	runPendingFinalizers();
+}
+
+// Objects of base images are never collected and are shared by other
+// runtimes, so references to them are not registered.
+MKLISP_API void mklisp::registerWeakReference(WeakReference *weakReference, Object *target) {
+	if (!target)
+		return;
+	if (target->associatedRuntime->isImageBase) {
+		weakReference->target = target;
+		return;
+	}
+	target->associatedRuntime->addWeakReference(weakReference, target);
+}
+
+MKLISP_API void mklisp::unregisterWeakReference(WeakReference *weakReference) noexcept {
+	if (weakReference->runtime)
+		weakReference->runtime->removeWeakReference(weakReference);
+	weakReference->target = nullptr;
+}
+
+MKLISP_API void Runtime::addWeakReference(WeakReference *weakReference, Object *target) {
+	auto heapLock = lockHeap();
+
+	weakReference->target = target;
+	weakReference->runtime = this;
+	weakReference->prev = nullptr;
+	weakReference->next = weakReferences;
+	if (weakReferences)
+		weakReferences->prev = weakReference;
+	weakReferences = weakReference;
+}
+
+MKLISP_API void Runtime::removeWeakReference(WeakReference *weakReference) noexcept {
+	auto heapLock = lockHeap();
+
+	if (weakReference->prev)
+		weakReference->prev->next = weakReference->next;
+	else
+		weakReferences = weakReference->next;
+	if (weakReference->next)
+		weakReference->next->prev = weakReference->prev;
+
+	weakReference->target = nullptr;
+	weakReference->runtime = nullptr;
+	weakReference->prev = nullptr;
+	weakReference->next = nullptr;
+}
+
+MKLISP_API void Runtime::registerFinalizer(Object *object, FinalizerCallback callback, void *userData) {
+	auto heapLock = lockHeap();
+
+	finalizers.push_back({ object, callback, userData });
+}
+
+MKLISP_API void Runtime::runPendingFinalizers() {
+	std::pmr::vector<Finalizer> curFinalizers(&globalHeapResource);
+
+	{
+		auto heapLock = lockHeap();
+		curFinalizers.swap(pendingFinalizers);
+	}
+
+	// Finalizers may allocate, or register new finalizers.
+	for (auto &i : curFinalizers)
+		i.callback(this, i.userData);
+}
+
+void Runtime::_rememberObject(Object *object) {
+	HeapLimitExemptScope exemptScope;
+	auto heapLock = lockHeap();
+
+	if (object->objectFlags & OBJECT_REMEMBERED)
+		return;
+	object->objectFlags |= OBJECT_REMEMBERED;
+	rememberedObjects.push_back(object);
+}
+
+void Runtime::_shadeObject(Object *object) {
+	HeapLimitExemptScope exemptScope;
+	auto heapLock = lockHeap();
+	_markValue(Value(object));
+}
+
+void Runtime::_markValue(const Value &value) {
+	switch (value.valueType) {
+		case ValueType::Object:
+		case ValueType::QuotedObject: {
+			Object *object = value.exData.asObject;
+
+			// Objects of the base image are never swept, and are read by the
+			// other children meanwhile.
+			if ((object->associatedRuntime != this) || (object->objectFlags & OBJECT_MARKED))
+				break;
+			// Old objects are treated as live by minor collections, their
+			// references to young objects are found through the remembered set.
+			if (_isMinorCollection && (object->objectFlags & OBJECT_OLD))
+				break;
+			object->objectFlags |= OBJECT_MARKED;
+			_gcPendingObjects.push_back(object);
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+void Runtime::_markContextRoots() {
+	// Shared bindings are only changed with the world stopped.
+	for (auto &i : sharedGlobals)
+		_markValue(i);
+
+	for (auto i : contexts) {
+		for (auto &j : i->globals)
+			_markValue(j);
+
+		for (auto &j : i->valueStack)
+			_markValue(j);
+
+		for (auto &j : i->frameStack) {
+			if (j.curEvalList)
+				_markValue(Value(j.curEvalList));
+			if (j.code)
+				_markValue(Value(j.code));
+			if (j.closure)
+				_markValue(Value(j.closure));
+			_markValue(j.returnValue);
+			if (j.callTarget)
+				_markValue(Value(j.callTarget));
+		}
+	}
+}
+
+void Runtime::_markRememberedObjects() {
+	for (auto i : rememberedObjects)
+		_traceObject(i);
+}
+
+size_t Runtime::_traceObject(Object *object) {
+	switch (object->getObjectType()) {
+		case ObjectType::List: {
+			auto &elements = ((ListObject *)object)->elements;
+			for (auto &i : elements)
+				_markValue(i);
+			return elements.size();
+		}
+		case ObjectType::Code: {
+			auto code = (CodeObject *)object;
+			for (auto &i : code->constants)
+				_markValue(i);
+
+			// Invalid entries are never hit, so their objects may be swept.
+			for (auto &i : code->callSiteCaches) {
+				if (i.bindingVersion != bindingVersion)
+					continue;
+				for (uint8_t j = 0; j < i.nEntries; ++j)
+					_markValue(Value(i.entries[j].object));
+			}
+			return code->constants.size() + code->callSiteCaches.size();
+		}
+		case ObjectType::Closure: {
+			auto closure = (ClosureObject *)object;
+			_markValue(Value(closure->code));
+			for (auto &i : closure->captures)
+				_markValue(i);
+			return closure->captures.size() + 1;
+		}
+		case ObjectType::Box:
+			_markValue(((BoxObject *)object)->value);
+			return 1;
+		default:
+			break;
+	}
+
+	return 0;
+}
+
+void Runtime::_markPendingObjects() {
+	while (_gcPendingObjects.size()) {
+		Object *object = _gcPendingObjects.back();
+		_gcPendingObjects.pop_back();
+
+		_traceObject(object);
+	}
+}
+
+void Runtime::_recordGcPause(std::chrono::steady_clock::time_point beginTime) {
+	auto pauseTime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - beginTime);
+
+	++gcPauseStats.nPauses;
+	gcPauseStats.totalPauseTime += pauseTime;
+	gcPauseStats.maxPauseTime = std::max(gcPauseStats.maxPauseTime, pauseTime);
+	gcPauseStats.lastPauseTime = pauseTime;
+
+	size_t bucket = 0;
+	for (auto us = std::chrono::duration_cast<std::chrono::microseconds>(pauseTime).count();
+		 us && (bucket < GC_PAUSE_HISTOGRAM_SIZE - 1);
+		 us >>= 1)
+		++bucket;
+	++gcPauseStats.pauseHistogram[bucket];
+}
+
+static bool _isCollected(Runtime *runtime, Object *object, bool isMinorCollection) noexcept {
+	if ((object->associatedRuntime != runtime) || (object->objectFlags & OBJECT_MARKED))
+		return false;
+	return !(isMinorCollection && (object->objectFlags & OBJECT_OLD));
+}
+
+// Called once marking has finished and before anything is swept.
+void Runtime::_processWeakReferences() {
+	for (WeakReference *i = weakReferences, *next; i; i = next) {
+		next = i->next;
+
+		if (_isCollected(this, i->target, _isMinorCollection))
+			removeWeakReference(i);
+	}
+
+	for (size_t i = 0; i < finalizers.size();) {
+		if (_isCollected(this, finalizers[i].object, _isMinorCollection)) {
+			pendingFinalizers.push_back(finalizers[i]);
+			finalizers[i] = finalizers.back();
+			finalizers.pop_back();
+		} else
+			++i;
+	}
+}
+
+void Runtime::_beginMajorCollection() {
+	// The remembered set is not needed during a major collection, all
+	// survivors are promoted by the sweep.
+	for (auto i : rememberedObjects)
+		i->objectFlags &= ~OBJECT_REMEMBERED;
+	rememberedObjects.clear();
+
+	_isMinorCollection = false;
+	gcPhase = GCPhase::Marking;
+	_gcCursor = createdObjects.begin();
+	++gcPauseStats.nMajorCollections;
+
+	_markContextRoots();
+}
+
+bool Runtime::_runMajorCollection(size_t workBudget, std::chrono::steady_clock::time_point deadline) {
+	size_t nWork = 0, nextTimeCheck = 0;
+	bool hasDeadline = deadline != std::chrono::steady_clock::time_point::max();
+
+	auto isOverBudget = [&]() -> bool {
+		if (nWork >= workBudget)
+			return true;
+		if (hasDeadline && (nWork >= nextTimeCheck)) {
+			nextTimeCheck = nWork + 256;
+			return std::chrono::steady_clock::now() >= deadline;
+		}
+		return false;
+	};
+
+	while (true) {
+		switch (gcPhase) {
+			case GCPhase::Marking:
+				while (_gcCursor != createdObjects.end()) {
+					if (isOverBudget())
+						return false;
+
+					Object *object = *(_gcCursor++);
+					if (object->hostRefCount)
+						_markValue(Value(object));
+					++nWork;
+				}
+
+				while (_gcPendingObjects.size()) {
+					if (isOverBudget())
+						return false;
+
+					Object *object = _gcPendingObjects.back();
+					_gcPendingObjects.pop_back();
+
+					nWork += 1 + _traceObject(object);
+				}
+
+				// Frames and globals are modified without barriers, rescan them
+				// and finish marking in this slice.
+				_markContextRoots();
+				_markPendingObjects();
+				_processWeakReferences();
+
+				gcPhase = GCPhase::Sweeping;
+				_gcCursor = createdObjects.begin();
+				break;
+			case GCPhase::Sweeping:
+				while (_gcCursor != createdObjects.end()) {
+					if (isOverBudget())
+						return false;
+
+					Object *object = *_gcCursor;
+
+					if (object->objectFlags & OBJECT_MARKED) {
+						object->objectFlags.store((ObjectFlags)((object->objectFlags & ~OBJECT_MARKED) | OBJECT_OLD), std::memory_order_relaxed);
+						++_gcCursor;
+					} else {
+						if (_gcCursor == youngObjectsBegin)
+							++youngObjectsBegin;
+						object->dealloc();
+						_gcCursor = createdObjects.erase(_gcCursor);
+					}
+					++nWork;
+				}
+
+				_finishMajorCollection();
+				return true;
+			default:
+				return true;
+		}
+	}
+}
+
+void Runtime::_finishMajorCollection() {
+	gcPhase = GCPhase::Idle;
+
+	youngObjectsBegin = createdObjects.end();
+	nurseryResource.resetYoungAllocated();
+	_gcPendingObjects.shrink_to_fit();
+
+	gcThreshold = std::max(globalHeapResource.szAllocated * 2, minGcThreshold);
+}
+
+MKLISP_API void Runtime::collectGarbage() {
+	HeapLimitExemptScope exemptScope;
+	StopTheWorldScope stopTheWorldScope(this);
+	auto beginTime = std::chrono::steady_clock::now();
+
+	ThreadCacheOwner::flushAllThreadCaches();
+
+	if (gcPhase == GCPhase::Idle)
+		_beginMajorCollection();
+	_runMajorCollection(SIZE_MAX, std::chrono::steady_clock::time_point::max());
+
+	_recordGcPause(beginTime);
+}
+
+MKLISP_API void Runtime::performGcSlice() {
+	HeapLimitExemptScope exemptScope;
+	StopTheWorldScope stopTheWorldScope(this);
+	auto beginTime = std::chrono::steady_clock::now();
+
+	ThreadCacheOwner::flushAllThreadCaches();
+
+	if (gcPhase == GCPhase::Idle)
+		_beginMajorCollection();
+	_runMajorCollection(
+		gcSliceWorkBudget,
+		gcSliceTimeBudget.count()
+			? beginTime + gcSliceTimeBudget
+			: std::chrono::steady_clock::time_point::max());
+
+	_recordGcPause(beginTime);
+}
+
+MKLISP_API void Runtime::collectYoungGarbage() {
+	HeapLimitExemptScope exemptScope;
+	StopTheWorldScope stopTheWorldScope(this);
+
+	if (gcPhase != GCPhase::Idle)
+		return;
+
+	auto beginTime = std::chrono::steady_clock::now();
+
+	ThreadCacheOwner::flushAllThreadCaches();
+
+	_isMinorCollection = true;
+	++gcPauseStats.nMinorCollections;
+
+	for (auto it = youngObjectsBegin; it != createdObjects.end(); ++it) {
+		if ((*it)->hostRefCount)
+			_markValue(Value(*it));
+	}
+	_markContextRoots();
+	_markRememberedObjects();
+	_markPendingObjects();
+	_processWeakReferences();
+
+	for (auto it = youngObjectsBegin; it != createdObjects.end();) {
+		Object *object = *it;
+
+		if (object->objectFlags & OBJECT_MARKED) {
+			object->objectFlags.store((ObjectFlags)((object->objectFlags & ~OBJECT_MARKED) | OBJECT_OLD), std::memory_order_relaxed);
+			++it;
+		} else {
+			object->dealloc();
+			it = createdObjects.erase(it);
+		}
+	}
+
+	// All survivors have been promoted, so no old object refers to a young one.
+	for (auto i : rememberedObjects)
+		i->objectFlags &= ~OBJECT_REMEMBERED;
+	rememberedObjects.clear();
+
+	youngObjectsBegin = createdObjects.end();
+	nurseryResource.resetYoungAllocated();
+
+	_isMinorCollection = false;
+
+	_recordGcPause(beginTime);
+}
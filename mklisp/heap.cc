@@ -0,0 +1,596 @@
+#include "heap.h"
+#include <cassert>
+#include <algorithm>
+#include <new>
+
+using namespace mklisp;
+
+static std::mutex _threadCacheRegistryMutex;
+static std::atomic<uint64_t> _nextThreadCacheOwnerId(1);
+
+constexpr static size_t _THREAD_CACHE_SLOTS = 16;
+
+struct ThreadCacheSlot {
+	uint64_t ownerId = 0;
+	ThreadCache *cache = nullptr;
+};
+
+// Owner IDs are never reused, so slots of destroyed owners never match again.
+static thread_local ThreadCacheSlot _threadCacheSlots[_THREAD_CACHE_SLOTS];
+
+// Set while the thread flushes caches with the registry locked, flushing may
+// use other owners, which must not create caches then.
+static thread_local bool _isFlushingThreadCaches = false;
+
+struct ThreadCacheFlushScope {
+	std::lock_guard<std::mutex> registryLock;
+
+	ThreadCacheFlushScope() : registryLock(_threadCacheRegistryMutex) {
+		_isFlushingThreadCaches = true;
+	}
+	~ThreadCacheFlushScope() {
+		_isFlushingThreadCaches = false;
+	}
+};
+
+// Caches of a thread are linked after a sentinel so that they can be unlinked
+// by owners on other threads.
+struct ThreadCacheList {
+	ThreadCache sentinel;
+
+	~ThreadCacheList() {
+		ThreadCacheFlushScope flushScope;
+
+		for (ThreadCache *i = sentinel.nextInThread, *next; i; i = next) {
+			next = i->nextInThread;
+			sentinel.nextInThread = next;
+
+			ThreadCacheSlot &slot = _threadCacheSlots[i->owner->threadCacheOwnerId % _THREAD_CACHE_SLOTS];
+			if (slot.cache == i)
+				slot = ThreadCacheSlot();
+
+			i->owner->detachThreadCache(i);
+			delete i;
+		}
+
+		sentinel.nextInThread = nullptr;
+	}
+};
+
+static thread_local ThreadCacheList _threadCacheList;
+
+static thread_local size_t _heapLimitExemptDepth = 0;
+
+MKLISP_API HeapLimitExemptScope::HeapLimitExemptScope() noexcept {
+	++_heapLimitExemptDepth;
+}
+
+MKLISP_API HeapLimitExemptScope::~HeapLimitExemptScope() {
+	--_heapLimitExemptDepth;
+}
+
+MKLISP_API bool HeapLimitExemptScope::isInScope() noexcept {
+	return _heapLimitExemptDepth;
+}
+
+MKLISP_API ThreadCache::~ThreadCache() {
+}
+
+MKLISP_API ThreadCacheOwner::ThreadCacheOwner() : threadCacheOwnerId(_nextThreadCacheOwnerId++) {
+}
+
+MKLISP_API ThreadCacheOwner::~ThreadCacheOwner() {
+	assert(("Derived classes must release thread caches", !_threadCaches));
+}
+
+MKLISP_API ThreadCache *ThreadCacheOwner::getThreadCache() {
+	ThreadCacheSlot &slot = _threadCacheSlots[threadCacheOwnerId % _THREAD_CACHE_SLOTS];
+
+	if (slot.ownerId == threadCacheOwnerId)
+		return slot.cache;
+
+	if (_isFlushingThreadCaches)
+		return nullptr;
+
+	ThreadCache *cache = _lookupThreadCache();
+
+	slot.ownerId = threadCacheOwnerId;
+	slot.cache = cache;
+
+	return cache;
+}
+
+ThreadCache *ThreadCacheOwner::_lookupThreadCache() {
+	std::lock_guard<std::mutex> registryLock(_threadCacheRegistryMutex);
+
+	for (ThreadCache *i = _threadCacheList.sentinel.nextInThread; i; i = i->nextInThread) {
+		if (i->owner == this)
+			return i;
+	}
+
+	ThreadCache *cache = newThreadCache();
+	cache->owner = this;
+
+	cache->nextInOwner = _threadCaches;
+	if (_threadCaches)
+		_threadCaches->prevInOwner = cache;
+	_threadCaches = cache;
+
+	ThreadCache &sentinel = _threadCacheList.sentinel;
+	cache->prevInThread = &sentinel;
+	cache->nextInThread = sentinel.nextInThread;
+	if (sentinel.nextInThread)
+		sentinel.nextInThread->prevInThread = cache;
+	sentinel.nextInThread = cache;
+
+	return cache;
+}
+
+MKLISP_API void ThreadCacheOwner::_releaseThreadCaches() noexcept {
+	ThreadCacheFlushScope flushScope;
+
+	for (ThreadCache *i = _threadCaches, *next; i; i = next) {
+		next = i->nextInOwner;
+
+		flushThreadCache(i);
+
+		// The cache may belong to another thread, thread lists are only
+		// modified with the registry locked.
+		i->prevInThread->nextInThread = i->nextInThread;
+		if (i->nextInThread)
+			i->nextInThread->prevInThread = i->prevInThread;
+
+		delete i;
+	}
+
+	_threadCaches = nullptr;
+}
+
+MKLISP_API void ThreadCacheOwner::detachThreadCache(ThreadCache *cache) noexcept {
+	flushThreadCache(cache);
+
+	if (cache->prevInOwner)
+		cache->prevInOwner->nextInOwner = cache->nextInOwner;
+	else
+		_threadCaches = cache->nextInOwner;
+	if (cache->nextInOwner)
+		cache->nextInOwner->prevInOwner = cache->prevInOwner;
+}
+
+MKLISP_API void ThreadCacheOwner::flushAllThreadCaches() noexcept {
+	ThreadCacheFlushScope flushScope;
+
+	for (ThreadCache *i = _threadCaches; i; i = i->nextInOwner)
+		flushThreadCache(i);
+}
+
+static constexpr size_t _POOL_SLAB_HEADER_SIZE =
+	(sizeof(PoolSlab) + (POOL_SIZE_CLASS_GRANULARITY - 1)) & ~(POOL_SIZE_CLASS_GRANULARITY - 1);
+
+static void _unlinkSlab(PoolSlab *&list, PoolSlab *slab) noexcept {
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		list = slab->next;
+	if (slab->next)
+		slab->next->prev = slab->prev;
+}
+
+static void _linkSlab(PoolSlab *&list, PoolSlab *slab) noexcept {
+	slab->prev = nullptr;
+	slab->next = list;
+	if (list)
+		list->prev = slab;
+	list = slab;
+}
+
+MKLISP_API PoolThreadCache::~PoolThreadCache() {
+}
+
+MKLISP_API CountablePoolResource::CountablePoolResource(
+	std::pmr::memory_resource *upstream,
+	size_t slabSize)
+	: upstream(upstream),
+	  slabSize(slabSize) {
+	assert(("Slab size must be a power of 2", !(slabSize & (slabSize - 1))));
+
+	for (size_t i = 0; i < POOL_NUM_SIZE_CLASSES; ++i) {
+		sizeClasses[i].szAllocation = (i + 1) * POOL_SIZE_CLASS_GRANULARITY;
+		sizeClasses[i].nAllocationsPerSlab = (slabSize - _POOL_SLAB_HEADER_SIZE) / sizeClasses[i].szAllocation;
+	}
+}
+
+MKLISP_API CountablePoolResource::~CountablePoolResource() {
+	_releaseThreadCaches();
+
+	for (auto &i : sizeClasses) {
+		for (PoolSlab *j = i.partialSlabs, *next; j; j = next) {
+			next = j->next;
+			upstream->deallocate(j, slabSize, slabSize);
+		}
+		for (PoolSlab *j = i.fullSlabs, *next; j; j = next) {
+			next = j->next;
+			upstream->deallocate(j, slabSize, slabSize);
+		}
+		if (i.emptySlab)
+			upstream->deallocate(i.emptySlab, slabSize, slabSize);
+	}
+}
+
+PoolSlab *CountablePoolResource::_allocSlab(PoolSizeClass &sizeClass) {
+	PoolSlab *slab;
+
+	if (sizeClass.emptySlab) {
+		slab = sizeClass.emptySlab;
+		sizeClass.emptySlab = nullptr;
+	} else {
+		slab = (PoolSlab *)upstream->allocate(slabSize, slabSize);
+		szReserved += slabSize;
+		++sizeClass.stats.nSlabs;
+
+		slab->freeList = nullptr;
+		slab->unusedBegin = ((char *)slab) + _POOL_SLAB_HEADER_SIZE;
+		slab->nLiveAllocations = 0;
+	}
+
+	_linkSlab(sizeClass.partialSlabs, slab);
+
+	return slab;
+}
+
+void CountablePoolResource::_releaseSlab(PoolSizeClass &sizeClass, PoolSlab *slab) noexcept {
+	_unlinkSlab(sizeClass.partialSlabs, slab);
+
+	if (!sizeClass.emptySlab) {
+		sizeClass.emptySlab = slab;
+		return;
+	}
+
+	upstream->deallocate(slab, slabSize, slabSize);
+	szReserved -= slabSize;
+	--sizeClass.stats.nSlabs;
+}
+
+void *CountablePoolResource::_allocSlot(PoolSizeClass &sizeClass) {
+	PoolSlab *slab = sizeClass.partialSlabs;
+
+	if (!slab)
+		slab = _allocSlab(sizeClass);
+
+	void *p;
+	if ((p = slab->freeList))
+		slab->freeList = *(void **)p;
+	else {
+		p = slab->unusedBegin;
+		slab->unusedBegin += sizeClass.szAllocation;
+	}
+
+	if (++slab->nLiveAllocations == sizeClass.nAllocationsPerSlab) {
+		_unlinkSlab(sizeClass.partialSlabs, slab);
+		_linkSlab(sizeClass.fullSlabs, slab);
+	}
+
+	++sizeClass.stats.nLiveAllocations;
+	++sizeClass.stats.nTotalAllocations;
+
+	return p;
+}
+
+void CountablePoolResource::_freeSlot(PoolSizeClass &sizeClass, void *p) noexcept {
+	PoolSlab *slab = getSlabOf(p);
+
+	*(void **)p = slab->freeList;
+	slab->freeList = p;
+
+	if (slab->nLiveAllocations-- == sizeClass.nAllocationsPerSlab) {
+		_unlinkSlab(sizeClass.fullSlabs, slab);
+		_linkSlab(sizeClass.partialSlabs, slab);
+	}
+
+	if (!slab->nLiveAllocations)
+		_releaseSlab(sizeClass, slab);
+
+	--sizeClass.stats.nLiveAllocations;
+}
+
+void CountablePoolResource::_checkLimit(size_t size, ptrdiff_t szPending) {
+	if ((szLimit != SIZE_MAX) && !HeapLimitExemptScope::isInScope()) {
+		size_t szNewAllocated = szAllocated + std::max(szPending, (ptrdiff_t)0) + size;
+		if (szNewAllocated > szLimit)
+			throw std::bad_alloc();
+	}
+}
+
+void CountablePoolResource::_refillThreadCache(PoolThreadCache *cache, size_t index) {
+	PoolSizeClass &sizeClass = sizeClasses[index];
+
+	_checkLimit(sizeClass.szAllocation * POOL_THREAD_CACHE_BATCH_SIZE, cache->szAllocatedDelta);
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	for (size_t i = 0; i < POOL_THREAD_CACHE_BATCH_SIZE; ++i) {
+		void *p = _allocSlot(sizeClass);
+
+		*(void **)p = cache->freeLists[index];
+		cache->freeLists[index] = p;
+	}
+	cache->nFreeSlots[index] += POOL_THREAD_CACHE_BATCH_SIZE;
+}
+
+void CountablePoolResource::_flushThreadCacheSlots(PoolThreadCache *cache, size_t index, size_t nSlots) noexcept {
+	PoolSizeClass &sizeClass = sizeClasses[index];
+
+	for (size_t i = 0; i < nSlots; ++i) {
+		void *p = cache->freeLists[index];
+		cache->freeLists[index] = *(void **)p;
+
+		_freeSlot(sizeClass, p);
+	}
+	cache->nFreeSlots[index] -= nSlots;
+}
+
+void CountablePoolResource::_mergeAccounting(PoolThreadCache *cache) noexcept {
+	szAllocated += cache->szAllocatedDelta;
+	cache->szAllocatedDelta = 0;
+}
+
+MKLISP_API ThreadCache *CountablePoolResource::newThreadCache() {
+	return new PoolThreadCache();
+}
+
+MKLISP_API void CountablePoolResource::flushThreadCache(ThreadCache *cache) noexcept {
+	PoolThreadCache *poolCache = (PoolThreadCache *)cache;
+	std::lock_guard<std::mutex> lock(mutex);
+
+	for (size_t i = 0; i < POOL_NUM_SIZE_CLASSES; ++i)
+		_flushThreadCacheSlots(poolCache, i, poolCache->nFreeSlots[i]);
+	_mergeAccounting(poolCache);
+}
+
+MKLISP_API void *CountablePoolResource::do_allocate(size_t bytes, size_t alignment) {
+	if ((bytes > POOL_MAX_SMALL_ALLOCATION_SIZE) || (alignment > POOL_SIZE_CLASS_GRANULARITY)) {
+		_checkLimit(bytes);
+
+		std::lock_guard<std::mutex> lock(mutex);
+
+		void *p = upstream->allocate(bytes, alignment);
+
+		szAllocated += bytes;
+		szReserved += bytes;
+		++largeAllocationStats.nLiveAllocations;
+		++largeAllocationStats.nTotalAllocations;
+		largeAllocationStats.szLive += bytes;
+
+		return p;
+	}
+
+	PoolThreadCache *cache = (PoolThreadCache *)getThreadCache();
+	size_t index = getSizeClassIndex(bytes);
+
+	if (!cache) {
+		_checkLimit(bytes);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		void *p = _allocSlot(sizeClasses[index]);
+		szAllocated += bytes;
+		return p;
+	}
+
+	if (!cache->freeLists[index])
+		_refillThreadCache(cache, index);
+
+	void *p = cache->freeLists[index];
+	cache->freeLists[index] = *(void **)p;
+	--cache->nFreeSlots[index];
+
+	if ((cache->szAllocatedDelta += bytes) > (ptrdiff_t)HEAP_ACCOUNTING_MERGE_THRESHOLD)
+		_mergeAccounting(cache);
+
+	return p;
+}
+
+MKLISP_API void CountablePoolResource::do_deallocate(void *p, size_t bytes, size_t alignment) {
+	if ((bytes > POOL_MAX_SMALL_ALLOCATION_SIZE) || (alignment > POOL_SIZE_CLASS_GRANULARITY)) {
+		std::lock_guard<std::mutex> lock(mutex);
+
+		upstream->deallocate(p, bytes, alignment);
+
+		szAllocated -= bytes;
+		szReserved -= bytes;
+		--largeAllocationStats.nLiveAllocations;
+		largeAllocationStats.szLive -= bytes;
+		return;
+	}
+
+	PoolThreadCache *cache = (PoolThreadCache *)getThreadCache();
+	size_t index = getSizeClassIndex(bytes);
+
+	if (!cache) {
+		std::lock_guard<std::mutex> lock(mutex);
+		szAllocated -= bytes;
+		_freeSlot(sizeClasses[index], p);
+		return;
+	}
+
+	*(void **)p = cache->freeLists[index];
+	cache->freeLists[index] = p;
+
+	if (++cache->nFreeSlots[index] > POOL_THREAD_CACHE_BATCH_SIZE * 2) {
+		std::lock_guard<std::mutex> lock(mutex);
+		_flushThreadCacheSlots(cache, index, POOL_THREAD_CACHE_BATCH_SIZE);
+	}
+
+	if ((cache->szAllocatedDelta -= bytes) < -(ptrdiff_t)HEAP_ACCOUNTING_MERGE_THRESHOLD)
+		_mergeAccounting(cache);
+}
+
+MKLISP_API bool CountablePoolResource::do_is_equal(const std::pmr::memory_resource &other) const noexcept {
+	return this == &other;
+}
+
+MKLISP_API NurseryThreadCache::~NurseryThreadCache() {
+}
+
+MKLISP_API NurseryResource::NurseryResource(
+	std::pmr::memory_resource *upstream,
+	size_t blockSize)
+	: upstream(upstream),
+	  blockSize(blockSize),
+	  maxSmallAllocationSize(blockSize / 4) {
+	assert(("Block size must be a power of 2", !(blockSize & (blockSize - 1))));
+}
+
+MKLISP_API NurseryResource::~NurseryResource() {
+	_releaseThreadCaches();
+	flushThreadCache(&_sharedCache);
+
+	for (NurseryBlock *i = freeBlocks, *next; i; i = next) {
+		next = i->next;
+		upstream->deallocate(i, blockSize, blockSize);
+	}
+}
+
+NurseryBlock *NurseryResource::_acquireBlock() {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	NurseryBlock *block;
+
+	if (freeBlocks) {
+		block = freeBlocks;
+		freeBlocks = freeBlocks->next;
+		--nFreeBlocks;
+	} else
+		block = (NurseryBlock *)upstream->allocate(blockSize, blockSize);
+
+	block->prev = nullptr;
+	block->next = usedBlocks;
+	if (usedBlocks)
+		usedBlocks->prev = block;
+	usedBlocks = block;
+	++nUsedBlocks;
+
+	block->szUsed = sizeof(NurseryBlock);
+	block->nLiveAllocations = 1;
+	block->szLiveAllocations = 0;
+
+	return block;
+}
+
+void NurseryResource::_releaseBlock(NurseryBlock *block) noexcept {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (block->prev)
+		block->prev->next = block->next;
+	else
+		usedBlocks = block->next;
+	if (block->next)
+		block->next->prev = block->prev;
+	--nUsedBlocks;
+
+	if (nFreeBlocks < maxFreeBlocks) {
+		block->next = freeBlocks;
+		freeBlocks = block;
+		++nFreeBlocks;
+	} else
+		upstream->deallocate(block, blockSize, blockSize);
+}
+
+void NurseryResource::_retireBlock(NurseryThreadCache *cache) noexcept {
+	NurseryBlock *block = cache->curBlock;
+	cache->curBlock = nullptr;
+
+	// The block is released by whoever drops its last reference.
+	if (!--block->nLiveAllocations)
+		_releaseBlock(block);
+
+	szYoungAllocated += cache->szYoungAllocatedDelta;
+	szTotalAllocated += cache->szYoungAllocatedDelta;
+	cache->szYoungAllocatedDelta = 0;
+}
+
+MKLISP_API ThreadCache *NurseryResource::newThreadCache() {
+	return new NurseryThreadCache();
+}
+
+MKLISP_API void NurseryResource::flushThreadCache(ThreadCache *cache) noexcept {
+	NurseryThreadCache *nurseryCache = (NurseryThreadCache *)cache;
+
+	if (nurseryCache->curBlock)
+		_retireBlock(nurseryCache);
+}
+
+void *NurseryResource::_allocate(NurseryThreadCache *cache, size_t bytes, size_t alignment) {
+	NurseryBlock *block = cache->curBlock;
+	size_t offset;
+
+	if (block) {
+		// Only the reference of the allocation buffer is left, rewind it.
+		if (block->nLiveAllocations == 1)
+			block->szUsed = sizeof(NurseryBlock);
+
+		offset = (block->szUsed + (alignment - 1)) & ~(alignment - 1);
+		if (offset + bytes <= blockSize)
+			goto allocated;
+
+		_retireBlock(cache);
+	}
+
+	block = cache->curBlock = _acquireBlock();
+	offset = (block->szUsed + (alignment - 1)) & ~(alignment - 1);
+
+allocated:
+	block->szUsed = offset + bytes;
+	++block->nLiveAllocations;
+	block->szLiveAllocations.fetch_add(bytes, std::memory_order_relaxed);
+	cache->szYoungAllocatedDelta += bytes;
+
+	return ((char *)block) + offset;
+}
+
+MKLISP_API void *NurseryResource::do_allocate(size_t bytes, size_t alignment) {
+	if (bytes > maxSmallAllocationSize) {
+		std::lock_guard<std::mutex> lock(mutex);
+		return upstream->allocate(bytes, alignment);
+	}
+
+	NurseryThreadCache *cache = (NurseryThreadCache *)getThreadCache();
+
+	if (!cache) {
+		std::lock_guard<std::mutex> lock(sharedCacheMutex);
+		return _allocate(&_sharedCache, bytes, alignment);
+	}
+
+	return _allocate(cache, bytes, alignment);
+}
+
+MKLISP_API void NurseryResource::do_deallocate(void *p, size_t bytes, size_t alignment) {
+	if (bytes > maxSmallAllocationSize) {
+		std::lock_guard<std::mutex> lock(mutex);
+		upstream->deallocate(p, bytes, alignment);
+		return;
+	}
+
+	NurseryBlock *block = getBlockOf(p);
+
+	block->szLiveAllocations.fetch_sub(bytes, std::memory_order_relaxed);
+	if (!--block->nLiveAllocations)
+		_releaseBlock(block);
+}
+
+MKLISP_API void NurseryResource::getBlockStats(NurseryBlockStats &statsOut) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	statsOut = NurseryBlockStats();
+	statsOut.nBlocks = nUsedBlocks;
+	for (NurseryBlock *i = usedBlocks; i; i = i->next) {
+		size_t szLive = i->szLiveAllocations.load(std::memory_order_relaxed);
+
+		statsOut.szLiveAllocations += szLive;
+		if (szLive < blockSize / NURSERY_SPARSE_BLOCK_DIVISOR)
+			++statsOut.nSparseBlocks;
+	}
+}
+
+MKLISP_API bool NurseryResource::do_is_equal(const std::pmr::memory_resource &other) const noexcept {
+	return this == &other;
+}
@@ -0,0 +1,284 @@
+#ifndef _MKLISP_HEAP_H_
+#define _MKLISP_HEAP_H_
+
+#include "basedefs.h"
+#include <memory_resource>
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+
+namespace mklisp {
+	class ThreadCacheOwner;
+
+	// Per-thread state of a `ThreadCacheOwner`, only accessed by its thread
+	// except when the thread or the owner is going away.
+	struct ThreadCache {
+		ThreadCacheOwner *owner = nullptr;
+		ThreadCache *prevInOwner = nullptr, *nextInOwner = nullptr;
+		ThreadCache *prevInThread = nullptr, *nextInThread = nullptr;
+
+		MKLISP_API virtual ~ThreadCache();
+	};
+
+	// Base of objects which keep a cache for each thread using them.
+	//
+	// Caches are created on first use by a thread, and are flushed back to
+	// their owner when the thread exits or the owner is destroyed. Derived
+	// classes must call `_releaseThreadCaches` at the beginning of their
+	// destructors.
+	class ThreadCacheOwner {
+	private:
+		ThreadCache *_lookupThreadCache();
+
+	protected:
+		ThreadCache *_threadCaches = nullptr;
+
+		MKLISP_API void _releaseThreadCaches() noexcept;
+
+	public:
+		const uint64_t threadCacheOwnerId;
+
+		MKLISP_API ThreadCacheOwner();
+		ThreadCacheOwner(const ThreadCacheOwner &) = delete;
+		MKLISP_API virtual ~ThreadCacheOwner();
+
+		// Returns null if the thread has no cache yet and is flushing caches,
+		// owners which may be used by a flush must handle it.
+		MKLISP_API ThreadCache *getThreadCache();
+		// Calls `flushThreadCache` for the caches of all threads, the caller
+		// must make sure that none of the threads is using its cache.
+		MKLISP_API void flushAllThreadCaches() noexcept;
+		// Flushes the cache and unlinks it from the owner, used on thread exit.
+		MKLISP_API void detachThreadCache(ThreadCache *cache) noexcept;
+
+		virtual ThreadCache *newThreadCache() = 0;
+		// Returns everything held by the cache back to the owner.
+		virtual void flushThreadCache(ThreadCache *cache) noexcept = 0;
+	};
+
+	// Allocations made by the thread while a scope exists ignore the limits of
+	// all pools, used by bookkeeping which must not fail halfway.
+	class HeapLimitExemptScope {
+	public:
+		MKLISP_API HeapLimitExemptScope() noexcept;
+		HeapLimitExemptScope(const HeapLimitExemptScope &) = delete;
+		MKLISP_API ~HeapLimitExemptScope();
+
+		MKLISP_API static bool isInScope() noexcept;
+	};
+
+	constexpr static size_t POOL_SIZE_CLASS_GRANULARITY = 16;
+	constexpr static size_t POOL_MAX_SMALL_ALLOCATION_SIZE = 512;
+	constexpr static size_t POOL_NUM_SIZE_CLASSES = POOL_MAX_SMALL_ALLOCATION_SIZE / POOL_SIZE_CLASS_GRANULARITY;
+	constexpr static size_t DEFAULT_POOL_SLAB_SIZE = 32 * 1024;
+	// Number of slots moved between a thread cache and the slabs at once.
+	constexpr static size_t POOL_THREAD_CACHE_BATCH_SIZE = 16;
+	// Accounting deltas of thread caches are merged once they grow over it.
+	constexpr static size_t HEAP_ACCOUNTING_MERGE_THRESHOLD = 64 * 1024;
+
+	struct PoolSlab {
+		PoolSlab *prev, *next;
+		void *freeList;
+		char *unusedBegin;
+		size_t nLiveAllocations;
+	};
+
+	// Slots count as live from the moment they are handed out to a thread
+	// cache until they are flushed back.
+	struct PoolSizeClassStats {
+		size_t nSlabs = 0;
+		size_t nLiveAllocations = 0;
+		size_t nTotalAllocations = 0;
+	};
+
+	struct PoolSizeClass {
+		size_t szAllocation;
+		size_t nAllocationsPerSlab;
+
+		// Slabs with free slots, full slabs and at most one cached empty slab.
+		PoolSlab *partialSlabs = nullptr;
+		PoolSlab *fullSlabs = nullptr;
+		PoolSlab *emptySlab = nullptr;
+
+		PoolSizeClassStats stats;
+	};
+
+	struct PoolLargeAllocationStats {
+		size_t nLiveAllocations = 0;
+		size_t nTotalAllocations = 0;
+		size_t szLive = 0;
+	};
+
+	struct PoolThreadCache : public ThreadCache {
+		void *freeLists[POOL_NUM_SIZE_CLASSES] = {};
+		size_t nFreeSlots[POOL_NUM_SIZE_CLASSES] = {};
+		ptrdiff_t szAllocatedDelta = 0;
+
+		MKLISP_API virtual ~PoolThreadCache();
+	};
+
+	// Memory resource with per-size-class slabs.
+	//
+	// Allocations up to `POOL_MAX_SMALL_ALLOCATION_SIZE` bytes are rounded up
+	// to their size class and served from the free list of a slab, larger or
+	// over-aligned allocations are forwarded to the upstream resource. Slabs
+	// are aligned to their size so a deallocation finds its slab by masking
+	// the address, and are returned to the upstream resource once empty.
+	//
+	// Each thread pops and pushes slots from its own cache, the slabs and the
+	// large allocations are guarded by `mutex`. `szAllocated` is merged from
+	// the thread caches lazily.
+	//
+	// Allocations which would grow `szAllocated` over `szLimit` throw
+	// `std::bad_alloc`. Small allocations are only checked when a thread cache
+	// is refilled, so the limit may be exceeded by what the thread caches
+	// hold.
+	class CountablePoolResource : public std::pmr::memory_resource, public ThreadCacheOwner {
+	private:
+		PoolSlab *_allocSlab(PoolSizeClass &sizeClass);
+		void _releaseSlab(PoolSizeClass &sizeClass, PoolSlab *slab) noexcept;
+		void *_allocSlot(PoolSizeClass &sizeClass);
+		void _freeSlot(PoolSizeClass &sizeClass, void *p) noexcept;
+		void _refillThreadCache(PoolThreadCache *cache, size_t index);
+		void _flushThreadCacheSlots(PoolThreadCache *cache, size_t index, size_t nSlots) noexcept;
+		void _mergeAccounting(PoolThreadCache *cache) noexcept;
+		void _checkLimit(size_t size, ptrdiff_t szPending = 0);
+
+	public:
+		std::pmr::memory_resource *upstream;
+		const size_t slabSize;
+		std::mutex mutex;
+
+		// Bytes requested by live allocations.
+		std::atomic_size_t szAllocated = 0;
+		// Bytes obtained from the upstream resource.
+		size_t szReserved = 0;
+		size_t szLimit = SIZE_MAX;
+
+		PoolSizeClass sizeClasses[POOL_NUM_SIZE_CLASSES];
+		PoolLargeAllocationStats largeAllocationStats;
+
+		MKLISP_API CountablePoolResource(
+			std::pmr::memory_resource *upstream,
+			size_t slabSize = DEFAULT_POOL_SLAB_SIZE);
+		MKLISP_API CountablePoolResource(const CountablePoolResource &) = delete;
+		MKLISP_API virtual ~CountablePoolResource();
+
+		MKLISP_FORCEINLINE static size_t getSizeClassIndex(size_t size) noexcept {
+			return size ? (size - 1) / POOL_SIZE_CLASS_GRANULARITY : 0;
+		}
+
+		MKLISP_FORCEINLINE PoolSlab *getSlabOf(void *p) const noexcept {
+			return (PoolSlab *)((uintptr_t)p & ~(uintptr_t)(slabSize - 1));
+		}
+
+		MKLISP_API virtual ThreadCache *newThreadCache() override;
+		MKLISP_API virtual void flushThreadCache(ThreadCache *cache) noexcept override;
+
+		MKLISP_API virtual void *do_allocate(size_t bytes, size_t alignment) override;
+		MKLISP_API virtual void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+		MKLISP_API virtual bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
+	};
+
+	constexpr static size_t DEFAULT_NURSERY_BLOCK_SIZE = 64 * 1024;
+	constexpr static size_t DEFAULT_NURSERY_MAX_FREE_BLOCKS = 4;
+	// Blocks whose live allocations fill less than a quarter of them count as
+	// sparse, see `NurseryBlockStats`.
+	constexpr static size_t NURSERY_SPARSE_BLOCK_DIVISOR = 4;
+
+	struct NurseryBlock {
+		// Links the free blocks, or the blocks in use.
+		NurseryBlock *prev, *next;
+		size_t szUsed;
+		// Counts the allocations in the block, plus one while the block is
+		// the allocation buffer of a thread.
+		std::atomic_size_t nLiveAllocations;
+		std::atomic_size_t szLiveAllocations;
+	};
+
+	// Blocks are only reused once all allocations in them are gone, so a few
+	// long-lived objects keep whole blocks, which sparse blocks count.
+	struct NurseryBlockStats {
+		size_t nBlocks = 0;
+		size_t szLiveAllocations = 0;
+		size_t nSparseBlocks = 0;
+	};
+
+	struct NurseryThreadCache : public ThreadCache {
+		NurseryBlock *curBlock = nullptr;
+		size_t szYoungAllocatedDelta = 0;
+
+		MKLISP_API virtual ~NurseryThreadCache();
+	};
+
+	// Bump-pointer allocator for newly created objects.
+	//
+	// Each thread allocates from its own block, carved from blocks shared by
+	// all threads. Objects are never moved, a block is rewound or released as
+	// soon as all allocations in it have been deallocated. Blocks are aligned
+	// to their size so the owning block of an allocation can be found by
+	// masking its address. Allocations larger than `maxSmallAllocationSize` are
+	// forwarded to the upstream resource.
+	class NurseryResource : public std::pmr::memory_resource, public ThreadCacheOwner {
+	private:
+		NurseryBlock *_acquireBlock();
+		void _releaseBlock(NurseryBlock *block) noexcept;
+		void _retireBlock(NurseryThreadCache *cache) noexcept;
+		void *_allocate(NurseryThreadCache *cache, size_t bytes, size_t alignment);
+
+		// Used by threads which cannot get a cache of their own while they
+		// are flushing caches.
+		NurseryThreadCache _sharedCache;
+
+	public:
+		std::pmr::memory_resource *upstream;
+		const size_t blockSize;
+		const size_t maxSmallAllocationSize;
+		size_t maxFreeBlocks = DEFAULT_NURSERY_MAX_FREE_BLOCKS;
+		// Guards the free blocks and the upstream resource.
+		std::mutex mutex;
+		// Guards the shared cache.
+		std::mutex sharedCacheMutex;
+
+		NurseryBlock *freeBlocks = nullptr;
+		size_t nFreeBlocks = 0;
+		// Blocks holding allocations or used as allocation buffers.
+		NurseryBlock *usedBlocks = nullptr;
+		size_t nUsedBlocks = 0;
+
+		// Bytes allocated since the last call of `resetYoungAllocated`, merged
+		// from the thread caches each time they acquire a new block.
+		std::atomic_size_t szYoungAllocated = 0;
+		// Bytes allocated since the resource was created, merged in the same
+		// way.
+		std::atomic_size_t szTotalAllocated = 0;
+
+		MKLISP_API NurseryResource(
+			std::pmr::memory_resource *upstream,
+			size_t blockSize = DEFAULT_NURSERY_BLOCK_SIZE);
+		MKLISP_API NurseryResource(const NurseryResource &) = delete;
+		MKLISP_API virtual ~NurseryResource();
+
+		MKLISP_FORCEINLINE void resetYoungAllocated() noexcept {
+			szYoungAllocated = 0;
+		}
+
+		MKLISP_FORCEINLINE NurseryBlock *getBlockOf(void *p) const noexcept {
+			return (NurseryBlock *)((uintptr_t)p & ~(uintptr_t)(blockSize - 1));
+		}
+
+		// Allocation buffers count as allocations, flush the thread caches
+		// first for exact results.
+		MKLISP_API void getBlockStats(NurseryBlockStats &statsOut);
+
+		MKLISP_API virtual ThreadCache *newThreadCache() override;
+		MKLISP_API virtual void flushThreadCache(ThreadCache *cache) noexcept override;
+
+		MKLISP_API virtual void *do_allocate(size_t bytes, size_t alignment) override;
+		MKLISP_API virtual void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+		MKLISP_API virtual bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
+	};
+}
+
+#endif
@@ -0,0 +1,471 @@
+#include "heapstats.h"
+#include <cstdio>
+#include <cinttypes>
+#include <cstring>
+#include <cstdarg>
+#include <algorithm>
+
+using namespace mklisp;
+
+MKLISP_API const char *mklisp::getObjectTypeName(ObjectType objectType) noexcept {
+	switch (objectType) {
+		case ObjectType::String:
+			return "string";
+		case ObjectType::Symbol:
+			return "symbol";
+		case ObjectType::List:
+			return "list";
+		case ObjectType::NativeFn:
+			return "native_fn";
+		case ObjectType::WeakRef:
+			return "weak_ref";
+		case ObjectType::Code:
+			return "code";
+		case ObjectType::Closure:
+			return "closure";
+		case ObjectType::Box:
+			return "box";
+	}
+	return "unknown";
+}
+
+MKLISP_API size_t mklisp::getObjectSize(const Object *object) noexcept {
+	switch (object->getObjectType()) {
+		case ObjectType::String: {
+			auto &data = ((const StringObject *)object)->data;
+			// Short strings are stored inline.
+			return sizeof(StringObject) + (data.capacity() > 15 ? data.capacity() + 1 : 0);
+		}
+		case ObjectType::Symbol: {
+			auto &name = ((const SymbolObject *)object)->name;
+			return sizeof(SymbolObject) + (name.capacity() > 15 ? name.capacity() + 1 : 0);
+		}
+		case ObjectType::List:
+			return sizeof(ListObject) + ((const ListObject *)object)->elements.size() * sizeof(Value);
+		case ObjectType::NativeFn:
+			return sizeof(NativeFnObject);
+		case ObjectType::WeakRef:
+			return sizeof(WeakRefObject);
+		case ObjectType::Code: {
+			auto code = (const CodeObject *)object;
+			return sizeof(CodeObject) +
+				   code->instructions.capacity() * sizeof(Instruction) +
+				   code->constants.capacity() * sizeof(Value) +
+				   code->callSiteCaches.capacity() * sizeof(CallSiteCache);
+		}
+		case ObjectType::Closure:
+			return sizeof(ClosureObject) + ((const ClosureObject *)object)->captures.capacity() * sizeof(Value);
+		case ObjectType::Box:
+			return sizeof(BoxObject);
+	}
+	return 0;
+}
+
+static Object *_getReferencedObject(const Value &value) noexcept {
+	switch (value.valueType) {
+		case ValueType::Object:
+		case ValueType::QuotedObject:
+			return value.exData.asObject;
+		default:
+			return nullptr;
+	}
+}
+
+// Calls `fn` with each object which the object refers to.
+template <typename Fn>
+static void _forEachReferencedObject(Object *object, Fn &&fn) {
+	switch (object->getObjectType()) {
+		case ObjectType::List:
+			for (auto &i : ((ListObject *)object)->elements) {
+				if (Object *target = _getReferencedObject(i))
+					fn(target);
+			}
+			break;
+		case ObjectType::Code:
+			for (auto &i : ((CodeObject *)object)->constants) {
+				if (Object *target = _getReferencedObject(i))
+					fn(target);
+			}
+			break;
+		case ObjectType::Closure:
+			fn(((ClosureObject *)object)->code);
+			for (auto &i : ((ClosureObject *)object)->captures) {
+				if (Object *target = _getReferencedObject(i))
+					fn(target);
+			}
+			break;
+		case ObjectType::Box:
+			if (Object *target = _getReferencedObject(((BoxObject *)object)->value))
+				fn(target);
+			break;
+		default:
+			break;
+	}
+}
+
+static size_t _getSizeHistogramBucket(size_t size) noexcept {
+	size_t bucket = 0;
+	for (size_t limit = HEAP_SIZE_HISTOGRAM_MIN_SIZE;
+		 (size > limit) && (bucket < HEAP_SIZE_HISTOGRAM_SIZE - 1);
+		 limit <<= 1)
+		++bucket;
+	return bucket;
+}
+
+static void _addTopRetainer(HeapObjectTypeStats &stats, const HeapRetainerStats &retainer) noexcept {
+	size_t i = stats.nTopRetainers;
+
+	if (i == HEAP_STATS_MAX_TOP_RETAINERS) {
+		if (stats.topRetainers[i - 1].szRetained >= retainer.szRetained)
+			return;
+		--i;
+	} else
+		++stats.nTopRetainers;
+
+	for (; i && (stats.topRetainers[i - 1].szRetained < retainer.szRetained); --i)
+		stats.topRetainers[i] = stats.topRetainers[i - 1];
+	stats.topRetainers[i] = retainer;
+}
+
+MKLISP_API void mklisp::collectHeapStats(Runtime *runtime, HeapStats &statsOut) {
+	StopTheWorldScope stopTheWorldScope(runtime);
+	runtime->flushAllThreadCaches();
+
+	statsOut = HeapStats();
+	statsOut.sampleTime = std::chrono::steady_clock::now();
+
+	bool isYoung = false;
+	for (auto it = runtime->createdObjects.begin(); it != runtime->createdObjects.end(); ++it) {
+		Object *object = *it;
+
+		if (it == runtime->youngObjectsBegin)
+			isYoung = true;
+
+		HeapObjectTypeStats &typeStats = statsOut.typeStats[(size_t)object->getObjectType()];
+		size_t size = getObjectSize(object);
+
+		++typeStats.nObjects;
+		typeStats.szObjects += size;
+		if (isYoung)
+			++typeStats.nYoungObjects;
+		if (object->isFrozen())
+			++typeStats.nFrozenObjects;
+		++typeStats.sizeHistogram[_getSizeHistogramBucket(size)];
+
+		++statsOut.nObjects;
+		statsOut.szObjects += size;
+
+		HeapRetainerStats retained[NUM_OBJECT_TYPES];
+
+		_forEachReferencedObject(object, [&retained](Object *target) {
+			HeapRetainerStats &j = retained[(size_t)target->getObjectType()];
+			++j.nRetained;
+			j.szRetained += getObjectSize(target);
+		});
+
+		for (size_t i = 0; i < NUM_OBJECT_TYPES; ++i) {
+			if (retained[i].nRetained) {
+				retained[i].retainer = object;
+				_addTopRetainer(statsOut.typeStats[i], retained[i]);
+			}
+		}
+	}
+
+	statsOut.szAllocated = runtime->globalHeapResource.szAllocated;
+	statsOut.szReserved = runtime->globalHeapResource.szReserved;
+	statsOut.szYoungAllocated = runtime->nurseryResource.szYoungAllocated;
+	runtime->nurseryResource.getBlockStats(statsOut.nurseryBlockStats);
+	statsOut.nRememberedObjects = runtime->rememberedObjects.size();
+	statsOut.nContexts = runtime->contexts.size();
+
+	statsOut.nTotalCreatedObjects = runtime->nTotalCreatedObjects;
+	statsOut.szTotalNurseryAllocated = runtime->nurseryResource.szTotalAllocated;
+	statsOut.nCallSiteCacheHits = runtime->nCallSiteCacheHits;
+	statsOut.nCallSiteCacheMisses = runtime->nCallSiteCacheMisses;
+	for (auto i : runtime->contexts) {
+		statsOut.nCallSiteCacheHits += i->nCallSiteCacheHits;
+		statsOut.nCallSiteCacheMisses += i->nCallSiteCacheMisses;
+	}
+	statsOut.nMacroExpansions = runtime->nMacroExpansions;
+	statsOut.nMacroExpansionCacheHits = runtime->nMacroExpansionCacheHits;
+	{
+		auto heapLock = runtime->lockHeap();
+		statsOut.macroExpansionTime = runtime->macroExpansionTime;
+	}
+
+	statsOut.gcPauseStats = runtime->gcPauseStats;
+}
+
+MKLISP_API double mklisp::getAllocationRate(const HeapStats &prevStats, const HeapStats &stats) noexcept {
+	double seconds = std::chrono::duration<double>(stats.sampleTime - prevStats.sampleTime).count();
+
+	if (seconds <= 0)
+		return 0;
+	return (double)(stats.szTotalNurseryAllocated - prevStats.szTotalNurseryAllocated) / seconds;
+}
+
+namespace {
+	// Buffers the output and passes it to the callback in large chunks.
+	class HeapStatsWriter {
+	private:
+		HeapStatsWriteCallback _callback;
+		void *_userData;
+		char _buffer[4096];
+		size_t _szBuffer = 0;
+
+	public:
+		HeapStatsWriter(HeapStatsWriteCallback callback, void *userData) : _callback(callback), _userData(userData) {
+		}
+		~HeapStatsWriter() {
+			flush();
+		}
+
+		void flush() {
+			if (_szBuffer) {
+				_callback(_userData, _buffer, _szBuffer);
+				_szBuffer = 0;
+			}
+		}
+
+		void write(const char *data, size_t size) {
+			if (_szBuffer + size > sizeof(_buffer)) {
+				flush();
+				if (size > sizeof(_buffer)) {
+					_callback(_userData, data, size);
+					return;
+				}
+			}
+			memcpy(_buffer + _szBuffer, data, size);
+			_szBuffer += size;
+		}
+
+		void write(const char *s) {
+			write(s, strlen(s));
+		}
+
+		void writeFormatted(const char *format, ...) {
+			char s[256];
+
+			va_list args;
+			va_start(args, format);
+			int size = vsnprintf(s, sizeof(s), format, args);
+			va_end(args);
+
+			if (size > 0)
+				write(s, std::min((size_t)size, sizeof(s) - 1));
+		}
+
+		void writeJsonString(const std::string_view &s) {
+			write("\"");
+			for (char c : s) {
+				switch (c) {
+					case '"':
+						write("\\\"");
+						break;
+					case '\\':
+						write("\\\\");
+						break;
+					default:
+						if ((unsigned char)c < 0x20)
+							writeFormatted("\\u%04x", (unsigned int)(unsigned char)c);
+						else
+							write(&c, 1);
+				}
+			}
+			write("\"");
+		}
+	};
+
+	struct FileWriteState {
+		FILE *fp;
+		bool succeeded = true;
+	};
+}
+
+static void _writeFile(void *userData, const char *data, size_t size) {
+	FileWriteState *state = (FileWriteState *)userData;
+
+	if (fwrite(data, 1, size, state->fp) != size)
+		state->succeeded = false;
+}
+
+static void _writeMetricHeader(HeapStatsWriter &writer, const char *name, const char *type, const char *help) {
+	writer.writeFormatted("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+MKLISP_API void mklisp::writePrometheusMetrics(const HeapStats &stats, HeapStatsWriteCallback callback, void *userData) {
+	HeapStatsWriter writer(callback, userData);
+
+	_writeMetricHeader(writer, "mklisp_heap_objects", "gauge", "Live objects by type.");
+	for (size_t i = 0; i < NUM_OBJECT_TYPES; ++i)
+		writer.writeFormatted("mklisp_heap_objects{type=\"%s\"} %zu\n", getObjectTypeName((ObjectType)i), stats.typeStats[i].nObjects);
+
+	_writeMetricHeader(writer, "mklisp_heap_young_objects", "gauge", "Live objects in the young generation by type.");
+	for (size_t i = 0; i < NUM_OBJECT_TYPES; ++i)
+		writer.writeFormatted("mklisp_heap_young_objects{type=\"%s\"} %zu\n", getObjectTypeName((ObjectType)i), stats.typeStats[i].nYoungObjects);
+
+	_writeMetricHeader(writer, "mklisp_heap_frozen_objects", "gauge", "Frozen objects by type.");
+	for (size_t i = 0; i < NUM_OBJECT_TYPES; ++i)
+		writer.writeFormatted("mklisp_heap_frozen_objects{type=\"%s\"} %zu\n", getObjectTypeName((ObjectType)i), stats.typeStats[i].nFrozenObjects);
+
+	_writeMetricHeader(writer, "mklisp_heap_object_size_bytes", "histogram", "Shallow sizes of live objects by type.");
+	for (size_t i = 0; i < NUM_OBJECT_TYPES; ++i) {
+		const char *typeName = getObjectTypeName((ObjectType)i);
+		const HeapObjectTypeStats &typeStats = stats.typeStats[i];
+		size_t nObjects = 0;
+
+		for (size_t j = 0; j < HEAP_SIZE_HISTOGRAM_SIZE - 1; ++j) {
+			nObjects += typeStats.sizeHistogram[j];
+			writer.writeFormatted(
+				"mklisp_heap_object_size_bytes_bucket{type=\"%s\",le=\"%zu\"} %zu\n",
+				typeName, HEAP_SIZE_HISTOGRAM_MIN_SIZE << j, nObjects);
+		}
+		writer.writeFormatted("mklisp_heap_object_size_bytes_bucket{type=\"%s\",le=\"+Inf\"} %zu\n", typeName, typeStats.nObjects);
+		writer.writeFormatted("mklisp_heap_object_size_bytes_sum{type=\"%s\"} %zu\n", typeName, typeStats.szObjects);
+		writer.writeFormatted("mklisp_heap_object_size_bytes_count{type=\"%s\"} %zu\n", typeName, typeStats.nObjects);
+	}
+
+	_writeMetricHeader(writer, "mklisp_heap_allocated_bytes", "gauge", "Bytes requested by live allocations of the global heap.");
+	writer.writeFormatted("mklisp_heap_allocated_bytes %zu\n", stats.szAllocated);
+	_writeMetricHeader(writer, "mklisp_heap_reserved_bytes", "gauge", "Bytes obtained from the system by the global heap.");
+	writer.writeFormatted("mklisp_heap_reserved_bytes %zu\n", stats.szReserved);
+	_writeMetricHeader(writer, "mklisp_heap_young_allocated_bytes", "gauge", "Bytes allocated in the nursery since the last collection.");
+	writer.writeFormatted("mklisp_heap_young_allocated_bytes %zu\n", stats.szYoungAllocated);
+	_writeMetricHeader(writer, "mklisp_heap_nursery_blocks", "gauge", "Nursery blocks holding live allocations.");
+	writer.writeFormatted("mklisp_heap_nursery_blocks %zu\n", stats.nurseryBlockStats.nBlocks);
+	_writeMetricHeader(writer, "mklisp_heap_nursery_live_bytes", "gauge", "Bytes of live allocations in nursery blocks.");
+	writer.writeFormatted("mklisp_heap_nursery_live_bytes %zu\n", stats.nurseryBlockStats.szLiveAllocations);
+	_writeMetricHeader(writer, "mklisp_heap_nursery_sparse_blocks", "gauge", "Nursery blocks less than a quarter full of live allocations.");
+	writer.writeFormatted("mklisp_heap_nursery_sparse_blocks %zu\n", stats.nurseryBlockStats.nSparseBlocks);
+	_writeMetricHeader(writer, "mklisp_heap_remembered_objects", "gauge", "Old objects in the remembered set.");
+	writer.writeFormatted("mklisp_heap_remembered_objects %zu\n", stats.nRememberedObjects);
+	_writeMetricHeader(writer, "mklisp_contexts", "gauge", "Live contexts.");
+	writer.writeFormatted("mklisp_contexts %zu\n", stats.nContexts);
+
+	_writeMetricHeader(writer, "mklisp_heap_created_objects_total", "counter", "Objects created.");
+	writer.writeFormatted("mklisp_heap_created_objects_total %zu\n", stats.nTotalCreatedObjects);
+	_writeMetricHeader(writer, "mklisp_heap_nursery_allocated_bytes_total", "counter", "Bytes allocated in the nursery.");
+	writer.writeFormatted("mklisp_heap_nursery_allocated_bytes_total %zu\n", stats.szTotalNurseryAllocated);
+	_writeMetricHeader(writer, "mklisp_call_site_cache_hits_total", "counter", "Calls whose callees were found in the cache of the call site.");
+	writer.writeFormatted("mklisp_call_site_cache_hits_total %zu\n", stats.nCallSiteCacheHits);
+	_writeMetricHeader(writer, "mklisp_call_site_cache_misses_total", "counter", "Calls whose callees were resolved and then cached by the call site.");
+	writer.writeFormatted("mklisp_call_site_cache_misses_total %zu\n", stats.nCallSiteCacheMisses);
+	_writeMetricHeader(writer, "mklisp_macro_expansions_total", "counter", "Macro calls expanded.");
+	writer.writeFormatted("mklisp_macro_expansions_total %zu\n", stats.nMacroExpansions);
+	_writeMetricHeader(writer, "mklisp_macro_expansion_cache_hits_total", "counter", "Macro calls whose expansions were found in the expansion cache.");
+	writer.writeFormatted("mklisp_macro_expansion_cache_hits_total %zu\n", stats.nMacroExpansionCacheHits);
+	_writeMetricHeader(writer, "mklisp_macro_expansion_seconds_total", "counter", "Time spent expanding macros.");
+	writer.writeFormatted("mklisp_macro_expansion_seconds_total %.9f\n", std::chrono::duration<double>(stats.macroExpansionTime).count());
+
+	const GCPauseStats &pauseStats = stats.gcPauseStats;
+	_writeMetricHeader(writer, "mklisp_gc_collections_total", "counter", "Garbage collections by generation.");
+	writer.writeFormatted("mklisp_gc_collections_total{generation=\"major\"} %zu\n", pauseStats.nMajorCollections);
+	writer.writeFormatted("mklisp_gc_collections_total{generation=\"minor\"} %zu\n", pauseStats.nMinorCollections);
+	_writeMetricHeader(writer, "mklisp_gc_pauses_total", "counter", "Garbage collection pauses, including incremental slices.");
+	writer.writeFormatted("mklisp_gc_pauses_total %zu\n", pauseStats.nPauses);
+	_writeMetricHeader(writer, "mklisp_gc_pause_seconds_total", "counter", "Time spent in garbage collection pauses.");
+	writer.writeFormatted("mklisp_gc_pause_seconds_total %.9f\n", std::chrono::duration<double>(pauseStats.totalPauseTime).count());
+	_writeMetricHeader(writer, "mklisp_gc_pause_seconds_max", "gauge", "Longest garbage collection pause.");
+	writer.writeFormatted("mklisp_gc_pause_seconds_max %.9f\n", std::chrono::duration<double>(pauseStats.maxPauseTime).count());
+}
+
+MKLISP_API bool mklisp::writePrometheusMetricsToFile(const HeapStats &stats, const char *path) {
+	FileWriteState state;
+
+	if (!(state.fp = fopen(path, "w")))
+		return false;
+
+	writePrometheusMetrics(stats, _writeFile, &state);
+
+	if (fclose(state.fp))
+		state.succeeded = false;
+	return state.succeeded;
+}
+
+static void _writeSnapshotRoot(HeapStatsWriter &writer, bool &isFirst, const char *kind, Context *context, Object *object) {
+	writer.writeFormatted(
+		"%s\n{\"kind\":\"%s\",\"context\":%" PRIuPTR ",\"id\":%" PRIuPTR,
+		isFirst ? "" : ",", kind, (uintptr_t)context, (uintptr_t)object);
+	isFirst = false;
+}
+
+MKLISP_API void mklisp::writeHeapSnapshot(Runtime *runtime, HeapStatsWriteCallback callback, void *userData) {
+	StopTheWorldScope stopTheWorldScope(runtime);
+	runtime->flushAllThreadCaches();
+
+	HeapStatsWriter writer(callback, userData);
+	bool isFirst = true;
+
+	writer.write("{\"objects\":[");
+	for (auto i : runtime->createdObjects) {
+		writer.writeFormatted(
+			"%s\n{\"id\":%" PRIuPTR ",\"type\":\"%s\",\"size\":%zu,\"flags\":%u,\"hostRefs\":%zu,\"refs\":[",
+			isFirst ? "" : ",",
+			(uintptr_t)i,
+			getObjectTypeName(i->getObjectType()),
+			getObjectSize(i),
+			(unsigned int)i->objectFlags,
+			(size_t)i->hostRefCount);
+		isFirst = false;
+
+		bool isFirstRef = true;
+		_forEachReferencedObject(i, [&writer, &isFirstRef](Object *target) {
+			writer.writeFormatted("%s%" PRIuPTR, isFirstRef ? "" : ",", (uintptr_t)target);
+			isFirstRef = false;
+		});
+		writer.write("]}");
+	}
+
+	writer.write("\n],\"roots\":[");
+	isFirst = true;
+	for (auto i : runtime->contexts) {
+		for (auto &j : i->globalSlots) {
+			Object *object = _getReferencedObject(i->globals[j.second]);
+			if (!object)
+				continue;
+
+			_writeSnapshotRoot(writer, isFirst, "binding", i, object);
+			writer.write(",\"name\":");
+			writer.writeJsonString(j.first);
+			writer.write("}");
+		}
+
+		for (auto &j : i->valueStack) {
+			if (Object *object = _getReferencedObject(j)) {
+				_writeSnapshotRoot(writer, isFirst, "stack", i, object);
+				writer.write("}");
+			}
+		}
+
+		for (auto &j : i->frameStack) {
+			Object *frameObjects[] = {
+				j.curEvalList,
+				j.code,
+				j.closure,
+				_getReferencedObject(j.returnValue),
+				j.callTarget
+			};
+
+			for (auto k : frameObjects) {
+				if (k) {
+					_writeSnapshotRoot(writer, isFirst, "frame", i, k);
+					writer.write("}");
+				}
+			}
+		}
+	}
+	writer.write("\n]}\n");
+}
+
+MKLISP_API bool mklisp::writeHeapSnapshotToFile(Runtime *runtime, const char *path) {
+	FileWriteState state;
+
+	if (!(state.fp = fopen(path, "w")))
+		return false;
+
+	writeHeapSnapshot(runtime, _writeFile, &state);
+
+	if (fclose(state.fp))
+		state.succeeded = false;
+	return state.succeeded;
+}
@@ -0,0 +1,84 @@
+#ifndef _MKLISP_HEAPSTATS_H_
+#define _MKLISP_HEAPSTATS_H_
+
+#include "object.h"
+#include <chrono>
+
+namespace mklisp {
+	constexpr static size_t NUM_OBJECT_TYPES = (size_t)ObjectType::Box + 1;
+
+	// Bucket `i` of size histograms counts objects of at most `16 << i` bytes,
+	// the last bucket counts all the larger ones.
+	constexpr static size_t HEAP_SIZE_HISTOGRAM_SIZE = 16;
+	constexpr static size_t HEAP_SIZE_HISTOGRAM_MIN_SIZE = 16;
+	constexpr static size_t HEAP_STATS_MAX_TOP_RETAINERS = 8;
+
+	// Sizes are shallow, i.e. an object and the buffers owned by it.
+	struct HeapRetainerStats {
+		Object *retainer = nullptr;
+		size_t nRetained = 0;
+		size_t szRetained = 0;
+	};
+
+	struct HeapObjectTypeStats {
+		size_t nObjects = 0;
+		size_t szObjects = 0;
+		size_t nYoungObjects = 0;
+		size_t nFrozenObjects = 0;
+		size_t sizeHistogram[HEAP_SIZE_HISTOGRAM_SIZE] = {};
+
+		// Objects which directly refer to the most bytes of objects of the
+		// type, in descending order.
+		HeapRetainerStats topRetainers[HEAP_STATS_MAX_TOP_RETAINERS];
+		size_t nTopRetainers = 0;
+	};
+
+	struct HeapStats {
+		std::chrono::steady_clock::time_point sampleTime;
+
+		HeapObjectTypeStats typeStats[NUM_OBJECT_TYPES];
+		size_t nObjects = 0;
+		size_t szObjects = 0;
+
+		size_t szAllocated = 0;
+		size_t szReserved = 0;
+		size_t szYoungAllocated = 0;
+		NurseryBlockStats nurseryBlockStats;
+		size_t nRememberedObjects = 0;
+		size_t nContexts = 0;
+
+		// Cumulative counters, see `getAllocationRate`.
+		size_t nTotalCreatedObjects = 0;
+		size_t szTotalNurseryAllocated = 0;
+		size_t nCallSiteCacheHits = 0;
+		size_t nCallSiteCacheMisses = 0;
+		size_t nMacroExpansions = 0;
+		size_t nMacroExpansionCacheHits = 0;
+		std::chrono::nanoseconds macroExpansionTime = {};
+
+		GCPauseStats gcPauseStats;
+	};
+
+	typedef void (*HeapStatsWriteCallback)(void *userData, const char *data, size_t size);
+
+	MKLISP_API const char *getObjectTypeName(ObjectType objectType) noexcept;
+	MKLISP_API size_t getObjectSize(const Object *object) noexcept;
+
+	// Walks the whole heap with the world stopped, see `Runtime::stopTheWorld`.
+	MKLISP_API void collectHeapStats(Runtime *runtime, HeapStats &statsOut);
+
+	// Bytes allocated in the nursery per second between two samples.
+	MKLISP_API double getAllocationRate(const HeapStats &prevStats, const HeapStats &stats) noexcept;
+
+	// Writes the counters in the Prometheus text exposition format.
+	MKLISP_API void writePrometheusMetrics(const HeapStats &stats, HeapStatsWriteCallback callback, void *userData);
+	MKLISP_API bool writePrometheusMetricsToFile(const HeapStats &stats, const char *path);
+
+	// Writes the object graph as JSON, with the objects, their sizes and
+	// references, and the roots. The world is stopped meanwhile, the callback
+	// must not wait for other mutators.
+	MKLISP_API void writeHeapSnapshot(Runtime *runtime, HeapStatsWriteCallback callback, void *userData);
+	MKLISP_API bool writeHeapSnapshotToFile(Runtime *runtime, const char *path);
+}
+
+#endif
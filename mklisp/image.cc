@@ -0,0 +1,42 @@
+#include "image.h"
+
+using namespace mklisp;
+
+MKLISP_API RuntimeImage::RuntimeImage(std::pmr::memory_resource *upstream)
+	: baseRuntime(upstream),
+	  bindings(&baseRuntime.globalHeapResource) {
+}
+
+MKLISP_API RuntimeImage::~RuntimeImage() {
+	assert(("The image is still used by child runtimes", !nChildRuntimes));
+}
+
+MKLISP_API void RuntimeImage::seal(Context *context) {
+	assert(("The image has already been sealed", !isSealed));
+	assert(context->runtime == &baseRuntime);
+
+	// Bindings of the image are not roots of the base runtime.
+	HostRefHolder refHolder(&baseRuntime.globalHeapResource);
+
+	for (auto &i : context->globalSlots) {
+		const Value &value = context->globals[i.second];
+		if (value.valueType == ValueType::Undefined)
+			continue;
+		if (value.valueType == ValueType::Object || value.valueType == ValueType::QuotedObject) {
+			baseRuntime.freeze(value.exData.asObject);
+			refHolder.addObject(value.exData.asObject);
+		}
+		bindings.emplace(i.first, value);
+	}
+	isSealed = true;
+
+	// Children never touch the base runtime, so drop everything else once.
+	context->globals.clear();
+	context->globalSlots.clear();
+	context->frameStack.clear();
+	context->compiledLists.clear();
+	baseRuntime.collectGarbage();
+	baseRuntime.runPendingFinalizers();
+
+	baseRuntime.isImageBase = true;
+}
@@ -0,0 +1,36 @@
+#ifndef _MKLISP_IMAGE_H_
+#define _MKLISP_IMAGE_H_
+
+#include "runtime.h"
+
+namespace mklisp {
+	// A fully initialized runtime which child runtimes are created from.
+	//
+	// Everything reachable from the bindings of the image is frozen, so
+	// children share the objects of the base runtime instead of copying them,
+	// and may run on any thread. Bindings made by the contexts of a child
+	// shadow the bindings of the image. Creating a child only costs an empty
+	// `Runtime` and a copy of the global slots of the image, which its code
+	// refers to.
+	//
+	// The image must outlive its children and no longer be used to evaluate
+	// once it has been sealed.
+	class RuntimeImage final {
+	public:
+		Runtime baseRuntime;
+		BindingMap bindings;
+		bool isSealed = false;
+		std::atomic_size_t nChildRuntimes = 0;
+
+		MKLISP_API RuntimeImage(std::pmr::memory_resource *upstream);
+		RuntimeImage(const RuntimeImage &) = delete;
+		MKLISP_API ~RuntimeImage();
+
+		// Freezes the bindings of a context of the base runtime and takes them
+		// as the bindings of the image. Objects which are not reachable from
+		// them are collected.
+		MKLISP_API void seal(Context *context);
+	};
+}
+
+#endif
@@ -0,0 +1,731 @@
+#include "jit.h"
+#include <cassert>
+#include <cstring>
+#include <memory>
+
+#if MKLISP_JIT
+	#include <sys/mman.h>
+	#include <unistd.h>
+#endif
+
+using namespace mklisp;
+
+JitCode::JitCode(std::pmr::memory_resource *memoryResource)
+	: memoryResource(memoryResource),
+	  memory(nullptr),
+	  szMemory(0),
+	  instructionOffsets(memoryResource),
+	  guardedCallees(memoryResource) {
+}
+
+#if MKLISP_JIT
+
+namespace {
+	enum class Reg : uint8_t {
+		Rax = 0,
+		Rcx,
+		Rdx,
+		Rbx,
+		Rsp,
+		Rbp,
+		Rsi,
+		Rdi,
+		R8,
+		R9,
+		R10,
+		R11,
+		R12,
+		R13,
+		R14,
+		R15
+	};
+
+	enum class Cond : uint8_t {
+		Overflow = 0x0,
+		Equal = 0x4,
+		NotEqual = 0x5,
+		Less = 0xc,
+		GreaterEqual = 0xd,
+		LessEqual = 0xe,
+		Greater = 0xf
+	};
+
+	// Registers of the native code, which are preserved across calls: the top
+	// of the value stack, the local variables of the frame and the state.
+	constexpr Reg REG_SP = Reg::Rbx;
+	constexpr Reg REG_LOCALS = Reg::R12;
+	constexpr Reg REG_STATE = Reg::R13;
+
+	constexpr int32_t VALUE_SIZE = (int32_t)sizeof(Value);
+	constexpr int32_t VALUE_TYPE_OFFSET = (int32_t)offsetof(Value, valueType);
+
+	// Emits the few x86-64 instructions the JIT needs. Memory operands are
+	// always addressed by a base register and a 32-bit displacement.
+	class Assembler {
+	public:
+		std::pmr::vector<uint8_t> bytes;
+
+		Assembler(std::pmr::memory_resource *memoryResource) : bytes(memoryResource) {}
+
+		MKLISP_FORCEINLINE size_t getOffset() const noexcept {
+			return bytes.size();
+		}
+
+		void byte(uint8_t value) {
+			bytes.push_back(value);
+		}
+		void dword(uint32_t value) {
+			for (size_t i = 0; i < 4; ++i)
+				byte((uint8_t)(value >> (i * 8)));
+		}
+		void qword(uint64_t value) {
+			for (size_t i = 0; i < 8; ++i)
+				byte((uint8_t)(value >> (i * 8)));
+		}
+
+		void rex(bool w, uint8_t reg, Reg base) {
+			uint8_t prefix = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((uint8_t)base >> 3);
+			if (prefix != 0x40)
+				byte(prefix);
+		}
+		void modrmMem(uint8_t reg, Reg base, int32_t disp) {
+			byte(0x80 | ((reg & 7) << 3) | ((uint8_t)base & 7));
+			if (((uint8_t)base & 7) == 4)
+				byte(0x24);
+			dword((uint32_t)disp);
+		}
+		void modrmReg(uint8_t reg, Reg rm) {
+			byte(0xc0 | ((reg & 7) << 3) | ((uint8_t)rm & 7));
+		}
+
+		void load(Reg dst, Reg base, int32_t disp) {
+			rex(true, (uint8_t)dst, base);
+			byte(0x8b);
+			modrmMem((uint8_t)dst, base, disp);
+		}
+		void store(Reg base, int32_t disp, Reg src) {
+			rex(true, (uint8_t)src, base);
+			byte(0x89);
+			modrmMem((uint8_t)src, base, disp);
+		}
+		void load32(Reg dst, Reg base, int32_t disp) {
+			rex(false, (uint8_t)dst, base);
+			byte(0x8b);
+			modrmMem((uint8_t)dst, base, disp);
+		}
+		void store32(Reg base, int32_t disp, Reg src) {
+			rex(false, (uint8_t)src, base);
+			byte(0x89);
+			modrmMem((uint8_t)src, base, disp);
+		}
+		void storeImm8(Reg base, int32_t disp, uint8_t imm) {
+			rex(false, 0, base);
+			byte(0xc6);
+			modrmMem(0, base, disp);
+			byte(imm);
+		}
+		void storeImm32(Reg base, int32_t disp, uint32_t imm) {
+			rex(false, 0, base);
+			byte(0xc7);
+			modrmMem(0, base, disp);
+			dword(imm);
+		}
+		void cmpImm8(Reg base, int32_t disp, uint8_t imm) {
+			rex(false, 0, base);
+			byte(0x80);
+			modrmMem(7, base, disp);
+			byte(imm);
+		}
+		void cmp(Reg reg, Reg base, int32_t disp) {
+			rex(true, (uint8_t)reg, base);
+			byte(0x3b);
+			modrmMem((uint8_t)reg, base, disp);
+		}
+		// Atomic, counters of the runtime are shared by threads.
+		void lockIncMem(Reg base, int32_t disp) {
+			byte(0xf0);
+			rex(true, 0, base);
+			byte(0xff);
+			modrmMem(0, base, disp);
+		}
+		// `opcode` is the form of the operation with a register destination
+		// and a memory source.
+		void alu32(uint8_t opcode, Reg reg, Reg base, int32_t disp) {
+			rex(false, (uint8_t)reg, base);
+			byte(opcode);
+			modrmMem((uint8_t)reg, base, disp);
+		}
+		void imul32(Reg reg, Reg base, int32_t disp) {
+			rex(false, (uint8_t)reg, base);
+			byte(0x0f);
+			byte(0xaf);
+			modrmMem((uint8_t)reg, base, disp);
+		}
+		void movImm64(Reg dst, uint64_t imm) {
+			rex(true, 0, dst);
+			byte(0xb8 | ((uint8_t)dst & 7));
+			qword(imm);
+		}
+		void movImm32(Reg dst, uint32_t imm) {
+			rex(false, 0, dst);
+			byte(0xb8 | ((uint8_t)dst & 7));
+			dword(imm);
+		}
+		void mov(Reg dst, Reg src) {
+			rex(true, (uint8_t)src, dst);
+			byte(0x89);
+			modrmReg((uint8_t)src, dst);
+		}
+		void lea(Reg dst, Reg base, int32_t disp) {
+			rex(true, (uint8_t)dst, base);
+			byte(0x8d);
+			modrmMem((uint8_t)dst, base, disp);
+		}
+		void addImm(Reg dst, int32_t imm) {
+			rex(true, 0, dst);
+			byte(0x81);
+			modrmReg(0, dst);
+			dword((uint32_t)imm);
+		}
+		void test(Reg reg) {
+			rex(true, (uint8_t)reg, reg);
+			byte(0x85);
+			modrmReg((uint8_t)reg, reg);
+		}
+		void testAl() {
+			byte(0x84);
+			byte(0xc0);
+		}
+		void push(Reg reg) {
+			rex(false, 0, reg);
+			byte(0x50 | ((uint8_t)reg & 7));
+		}
+		void pop(Reg reg) {
+			rex(false, 0, reg);
+			byte(0x58 | ((uint8_t)reg & 7));
+		}
+		void callAbs(const void *fn) {
+			movImm64(Reg::Rax, (uint64_t)(uintptr_t)fn);
+			byte(0xff);
+			modrmReg(2, Reg::Rax);
+		}
+		void jmpReg(Reg reg) {
+			rex(false, 0, reg);
+			byte(0xff);
+			modrmReg(4, reg);
+		}
+		void ret() {
+			byte(0xc3);
+		}
+
+		// Jumps return the offset of their displacement, see `patch`.
+		size_t jmp() {
+			byte(0xe9);
+			dword(0);
+			return getOffset() - 4;
+		}
+		size_t jcc(Cond cond) {
+			byte(0x0f);
+			byte(0x80 | (uint8_t)cond);
+			dword(0);
+			return getOffset() - 4;
+		}
+		void patch(size_t dispOffset, size_t target) {
+			int32_t disp = (int32_t)((ptrdiff_t)target - (ptrdiff_t)(dispOffset + 4));
+			memcpy(bytes.data() + dispOffset, &disp, sizeof(disp));
+		}
+
+		// Values are moved as two quadwords through rax and rdx.
+		void loadValue(Reg base, int32_t disp) {
+			load(Reg::Rax, base, disp);
+			load(Reg::Rdx, base, disp + 8);
+		}
+		void storeValue(Reg base, int32_t disp) {
+			store(base, disp, Reg::Rax);
+			store(base, disp + 8, Reg::Rdx);
+		}
+	};
+
+	struct JumpPatch {
+		size_t dispOffset;
+		uint32_t targetPc;
+	};
+}
+
+static MKLISP_FORCEINLINE void _reloadJitState(JitState *state) noexcept {
+	Context *context = state->context;
+	state->locals = context->valueStack.data() + state->stackBase;
+	state->globals = context->globals.data();
+}
+
+// Helpers called by the native code. They never throw through it since it has
+// no unwind information, instead exceptions of native functions are kept in
+// the state, and the instructions which fail otherwise are left to the
+// interpreter to be run again.
+
+static Value *_jitCallNative(JitState *state, NativeFnCallback callback, Value *args, uint32_t nArgs, uint32_t nextPc) noexcept {
+	Context *context = state->context;
+	auto &valueStack = context->valueStack;
+	size_t argBase = args - valueStack.data();
+
+	try {
+		state->runtime->checkGarbageCollection();
+
+		Frame &frame = context->frameStack[state->frameIndex];
+		frame.pc = nextPc;
+		frame.returnValue = Value(ValueType::Nil);
+
+		callback(context, ValueSpan(args, nArgs));
+		// Left to the interpreter to be raised.
+		if (context->nativeException)
+			return nullptr;
+
+		valueStack.resize(state->stackBase + state->code->maxStackSize);
+	} catch (...) {
+		state->exception = std::current_exception();
+		return nullptr;
+	}
+	_reloadJitState(state);
+
+	args = valueStack.data() + argBase;
+	args[-1] = context->frameStack[state->frameIndex].returnValue;
+	return args;
+}
+
+static Value *_jitSafepoint(JitState *state, Value *sp) noexcept {
+	size_t spOffset = sp - state->locals;
+
+	try {
+		state->runtime->checkGarbageCollection();
+	} catch (...) {
+		state->exception = std::current_exception();
+		return nullptr;
+	}
+	_reloadJitState(state);
+	state->isYielding = state->runtime->consumeFuel(state->context);
+
+	return state->locals + spOffset;
+}
+
+// Returns true if the callee of a tail call is the code of the frame or a
+// closure of it, the loop then continues with the captures of the callee.
+static bool _jitEnterSelfTailCall(JitState *state, const Value *callee) noexcept {
+	if (callee->valueType != ValueType::Object)
+		return false;
+
+	ClosureObject *closure = nullptr;
+	switch (Object *object = callee->exData.asObject; object->getObjectType()) {
+		case ObjectType::Code:
+			if (object != state->code)
+				return false;
+			break;
+		case ObjectType::Closure:
+			closure = (ClosureObject *)object;
+			if (closure->code != state->code)
+				return false;
+			break;
+		default:
+			return false;
+	}
+
+	state->context->frameStack[state->frameIndex].closure = closure;
+	state->captures = closure ? closure->captures.data() : nullptr;
+	return true;
+}
+
+static bool _jitBoxLocal(JitState *state, uint32_t index) noexcept {
+	try {
+		Value &local = state->locals[index];
+		local = Value(BoxObject::alloc(state->runtime, local).get());
+	} catch (std::bad_alloc &) {
+		return false;
+	}
+	return true;
+}
+
+static void _jitUnbox(Value *value) noexcept {
+	*value = ((BoxObject *)value->exData.asObject)->value;
+}
+
+static bool _jitStoreBox(Value *sp) noexcept {
+	BoxObject *box = (BoxObject *)sp[-1].exData.asObject;
+	if (box->isFrozen())
+		return false;
+	box->set(sp[-2]);
+	return true;
+}
+
+static bool _jitMakeClosure(JitState *state, Value *sp, uint32_t nCaptures) noexcept {
+	sp -= nCaptures;
+
+	try {
+		CodeObject *closureCode = (CodeObject *)sp[-1].exData.asObject;
+		sp[-1] = Value(ClosureObject::alloc(state->runtime, closureCode, sp, nCaptures).get());
+	} catch (std::bad_alloc &) {
+		return false;
+	}
+	return true;
+}
+
+// Returns the callee of the call site if it has only been resolved to one
+// since the bindings last changed.
+static const CallTarget *_getMonomorphicCallTarget(Runtime *runtime, CodeObject *code, uint16_t callSiteIndex) {
+	if (callSiteIndex == NO_CALL_SITE_CACHE)
+		return nullptr;
+
+	const CallSiteCache &cache = code->callSiteCaches[callSiteIndex];
+	if ((cache.bindingVersion != runtime->bindingVersion) || (cache.nEntries != 1))
+		return nullptr;
+	return &cache.entries[0];
+}
+
+static JitCode *_compileJitCode(Runtime *runtime, CodeObject *code) {
+	std::pmr::memory_resource *memoryResource = &runtime->globalHeapResource;
+	const size_t nInstructions = code->instructions.size();
+
+	Assembler a(memoryResource);
+	std::pmr::vector<uint32_t> instructionOffsets(nInstructions, memoryResource);
+	std::pmr::vector<JumpPatch> jumpPatches(memoryResource), exitPatches(memoryResource);
+	std::pmr::list<HostWeakRef<Object>> guardedCallees(memoryResource);
+
+	// Entry, called with the state, the top of the value stack and the
+	// address of the instruction to run. Five pushes keep the stack aligned
+	// for the calls of helpers.
+	a.push(Reg::Rbx);
+	a.push(Reg::Rbp);
+	a.push(Reg::R12);
+	a.push(Reg::R13);
+	a.push(Reg::R14);
+	a.mov(REG_STATE, Reg::Rdi);
+	a.mov(REG_SP, Reg::Rsi);
+	a.load(REG_LOCALS, REG_STATE, offsetof(JitState, locals));
+	a.jmpReg(Reg::Rdx);
+
+	// Exits with the index of the next instruction in eax.
+	const size_t exitStubOffset = a.getOffset();
+	a.store(REG_STATE, offsetof(JitState, sp), REG_SP);
+	a.pop(Reg::R14);
+	a.pop(Reg::R13);
+	a.pop(Reg::R12);
+	a.pop(Reg::Rbp);
+	a.pop(Reg::Rbx);
+	a.ret();
+
+	const size_t exceptionExitOffset = a.getOffset();
+	a.movImm32(Reg::Rax, JIT_EXIT_EXCEPTION);
+	a.patch(a.jmp(), exitStubOffset);
+
+	auto exitTo = [&](size_t dispOffset, uint32_t pc) {
+		exitPatches.push_back({ dispOffset, pc });
+	};
+	auto guardCallee = [&](uint32_t pc, uint32_t nArgs, Object *object) {
+		int32_t calleeDisp = -VALUE_SIZE * (int32_t)(nArgs + 1);
+		a.cmpImm8(REG_SP, calleeDisp + VALUE_TYPE_OFFSET, (uint8_t)ValueType::Object);
+		exitTo(a.jcc(Cond::NotEqual), pc);
+		// The callee is held weakly, the guard fails once it is collected.
+		guardedCallees.emplace_back(object);
+		a.movImm64(Reg::Rax, (uint64_t)(uintptr_t)guardedCallees.back().getTargetAddress());
+		a.load(Reg::Rax, Reg::Rax, 0);
+		a.cmp(Reg::Rax, REG_SP, calleeDisp);
+		exitTo(a.jcc(Cond::NotEqual), pc);
+	};
+
+	for (uint32_t pc = 0; pc < nInstructions; ++pc) {
+		const Instruction &instruction = code->instructions[pc];
+		const uint32_t operand = instruction.operand;
+		const int32_t localDisp = VALUE_SIZE * (int32_t)operand;
+		instructionOffsets[pc] = (uint32_t)a.getOffset();
+
+		switch (instruction.opcode) {
+			case Opcode::PushConst: {
+				const Value &value = code->constants[operand];
+				uint64_t bits;
+				memcpy(&bits, &value.exData, sizeof(bits));
+
+				a.movImm64(Reg::Rax, bits);
+				a.store(REG_SP, 0, Reg::Rax);
+				a.storeImm8(REG_SP, VALUE_TYPE_OFFSET, (uint8_t)value.valueType);
+				a.addImm(REG_SP, VALUE_SIZE);
+				break;
+			}
+			case Opcode::LoadGlobal:
+				a.load(Reg::Rcx, REG_STATE, offsetof(JitState, globals));
+				a.cmpImm8(Reg::Rcx, localDisp + VALUE_TYPE_OFFSET, (uint8_t)ValueType::Undefined);
+				exitTo(a.jcc(Cond::Equal), pc);
+				a.loadValue(Reg::Rcx, localDisp);
+				a.storeValue(REG_SP, 0);
+				a.addImm(REG_SP, VALUE_SIZE);
+				break;
+			case Opcode::StoreGlobal: {
+				// Same as `Context::storeGlobal`.
+				a.load(Reg::Rcx, REG_STATE, offsetof(JitState, globals));
+				a.cmpImm8(Reg::Rcx, localDisp + VALUE_TYPE_OFFSET, (uint8_t)ValueType::Object);
+				size_t bumpDisp = a.jcc(Cond::Equal);
+				a.cmpImm8(Reg::Rcx, localDisp + VALUE_TYPE_OFFSET, (uint8_t)ValueType::QuotedObject);
+				size_t storeDisp = a.jcc(Cond::NotEqual);
+				a.patch(bumpDisp, a.getOffset());
+				a.load(Reg::Rax, REG_STATE, offsetof(JitState, bindingVersion));
+				a.lockIncMem(Reg::Rax, 0);
+				a.patch(storeDisp, a.getOffset());
+				a.loadValue(REG_SP, -VALUE_SIZE);
+				a.storeValue(Reg::Rcx, localDisp);
+				break;
+			}
+			case Opcode::LoadLocal:
+				a.loadValue(REG_LOCALS, localDisp);
+				a.storeValue(REG_SP, 0);
+				a.addImm(REG_SP, VALUE_SIZE);
+				break;
+			case Opcode::StoreLocal:
+				a.loadValue(REG_SP, -VALUE_SIZE);
+				a.storeValue(REG_LOCALS, localDisp);
+				break;
+			case Opcode::LoadCapture:
+				a.load(Reg::Rcx, REG_STATE, offsetof(JitState, captures));
+				a.loadValue(Reg::Rcx, localDisp);
+				a.storeValue(REG_SP, 0);
+				a.addImm(REG_SP, VALUE_SIZE);
+				break;
+			case Opcode::BoxLocal:
+				a.mov(Reg::Rdi, REG_STATE);
+				a.movImm32(Reg::Rsi, operand);
+				a.callAbs((const void *)&_jitBoxLocal);
+				a.testAl();
+				exitTo(a.jcc(Cond::Equal), pc);
+				break;
+			case Opcode::Unbox:
+				a.lea(Reg::Rdi, REG_SP, -VALUE_SIZE);
+				a.callAbs((const void *)&_jitUnbox);
+				break;
+			case Opcode::StoreBox:
+				a.mov(Reg::Rdi, REG_SP);
+				a.callAbs((const void *)&_jitStoreBox);
+				a.testAl();
+				exitTo(a.jcc(Cond::Equal), pc);
+				a.addImm(REG_SP, -VALUE_SIZE);
+				break;
+			case Opcode::Pop:
+				a.addImm(REG_SP, -VALUE_SIZE);
+				break;
+			case Opcode::Slide:
+				a.loadValue(REG_SP, -VALUE_SIZE);
+				a.storeValue(REG_SP, -VALUE_SIZE * (int32_t)(operand + 1));
+				a.addImm(REG_SP, -VALUE_SIZE * (int32_t)operand);
+				break;
+			case Opcode::Jump:
+				jumpPatches.push_back({ a.jmp(), operand });
+				break;
+			case Opcode::JumpIfFalse:
+				a.addImm(REG_SP, -VALUE_SIZE);
+				a.cmpImm8(REG_SP, VALUE_TYPE_OFFSET, (uint8_t)ValueType::Nil);
+				jumpPatches.push_back({ a.jcc(Cond::Equal), operand });
+				break;
+			case Opcode::JumpIfFalseOrPop:
+				a.cmpImm8(REG_SP, -VALUE_SIZE + VALUE_TYPE_OFFSET, (uint8_t)ValueType::Nil);
+				jumpPatches.push_back({ a.jcc(Cond::Equal), operand });
+				a.addImm(REG_SP, -VALUE_SIZE);
+				break;
+			case Opcode::JumpIfTrueOrPop:
+				a.cmpImm8(REG_SP, -VALUE_SIZE + VALUE_TYPE_OFFSET, (uint8_t)ValueType::Nil);
+				jumpPatches.push_back({ a.jcc(Cond::NotEqual), operand });
+				a.addImm(REG_SP, -VALUE_SIZE);
+				break;
+			case Opcode::MakeClosure:
+				a.mov(Reg::Rdi, REG_STATE);
+				a.mov(Reg::Rsi, REG_SP);
+				a.movImm32(Reg::Rdx, operand);
+				a.callAbs((const void *)&_jitMakeClosure);
+				a.testAl();
+				exitTo(a.jcc(Cond::Equal), pc);
+				a.addImm(REG_SP, -VALUE_SIZE * (int32_t)operand);
+				break;
+			case Opcode::Call: {
+				const CallTarget *target = _getMonomorphicCallTarget(runtime, code, instruction.callSiteIndex);
+				if ((!target) || (!target->callback) || ((NativeFnObject *)target->object)->isAsync) {
+					exitTo(a.jmp(), pc);
+					break;
+				}
+				guardCallee(pc, operand, target->object);
+
+				NativeIntrinsic intrinsic = ((NativeFnObject *)target->object)->intrinsic;
+				if ((intrinsic != NativeIntrinsic::None) && (operand == 2)) {
+					// Both arguments must be `Int`s and arithmetic must not
+					// overflow, the native function handles everything else.
+					const int32_t lhsDisp = -2 * VALUE_SIZE, rhsDisp = -VALUE_SIZE, resultDisp = -3 * VALUE_SIZE;
+					a.cmpImm8(REG_SP, lhsDisp + VALUE_TYPE_OFFSET, (uint8_t)ValueType::Int);
+					exitTo(a.jcc(Cond::NotEqual), pc);
+					a.cmpImm8(REG_SP, rhsDisp + VALUE_TYPE_OFFSET, (uint8_t)ValueType::Int);
+					exitTo(a.jcc(Cond::NotEqual), pc);
+					a.load32(Reg::Rax, REG_SP, lhsDisp);
+
+					Cond falseCond = Cond::NotEqual;
+					switch (intrinsic) {
+						case NativeIntrinsic::Add:
+						case NativeIntrinsic::Subtract:
+						case NativeIntrinsic::Multiply:
+							if (intrinsic == NativeIntrinsic::Multiply)
+								a.imul32(Reg::Rax, REG_SP, rhsDisp);
+							else
+								a.alu32(intrinsic == NativeIntrinsic::Add ? 0x03 : 0x2b, Reg::Rax, REG_SP, rhsDisp);
+							exitTo(a.jcc(Cond::Overflow), pc);
+							a.store32(REG_SP, resultDisp, Reg::Rax);
+							a.storeImm8(REG_SP, resultDisp + VALUE_TYPE_OFFSET, (uint8_t)ValueType::Int);
+							a.addImm(REG_SP, -2 * VALUE_SIZE);
+							continue;
+						case NativeIntrinsic::Equal:
+							falseCond = Cond::NotEqual;
+							break;
+						case NativeIntrinsic::Less:
+							falseCond = Cond::GreaterEqual;
+							break;
+						case NativeIntrinsic::LessEqual:
+							falseCond = Cond::Greater;
+							break;
+						case NativeIntrinsic::Greater:
+							falseCond = Cond::LessEqual;
+							break;
+						case NativeIntrinsic::GreaterEqual:
+							falseCond = Cond::Less;
+							break;
+						default:
+							assert(("Unhandled intrinsic", false));
+					}
+
+					// Comparisons return 1 or nil.
+					a.alu32(0x3b, Reg::Rax, REG_SP, rhsDisp);
+					size_t falseDisp = a.jcc(falseCond);
+					a.storeImm32(REG_SP, resultDisp, 1);
+					a.storeImm8(REG_SP, resultDisp + VALUE_TYPE_OFFSET, (uint8_t)ValueType::Int);
+					size_t endDisp = a.jmp();
+					a.patch(falseDisp, a.getOffset());
+					a.storeImm8(REG_SP, resultDisp + VALUE_TYPE_OFFSET, (uint8_t)ValueType::Nil);
+					a.patch(endDisp, a.getOffset());
+					a.addImm(REG_SP, -2 * VALUE_SIZE);
+					break;
+				}
+
+				a.mov(Reg::Rdi, REG_STATE);
+				a.movImm64(Reg::Rsi, (uint64_t)(uintptr_t)target->callback);
+				a.lea(Reg::Rdx, REG_SP, -VALUE_SIZE * (int32_t)operand);
+				a.movImm32(Reg::Rcx, operand);
+				a.movImm32(Reg::R8, pc + 1);
+				a.callAbs((const void *)&_jitCallNative);
+				a.test(Reg::Rax);
+				a.patch(a.jcc(Cond::Equal), exceptionExitOffset);
+				a.mov(REG_SP, Reg::Rax);
+				a.load(REG_LOCALS, REG_STATE, offsetof(JitState, locals));
+				break;
+			}
+			case Opcode::TailCall: {
+				const CallTarget *target = _getMonomorphicCallTarget(runtime, code, instruction.callSiteIndex);
+				if ((!target) || (target->code != code) || (operand != code->nParams)) {
+					exitTo(a.jmp(), pc);
+					break;
+				}
+
+				// Tail calls of the code itself or of closures of it replace the
+				// arguments and loop, with a safepoint like the calls of the
+				// interpreter. Yields are left to the interpreter, which performs
+				// the tail call once it is resumed.
+				a.mov(Reg::Rdi, REG_STATE);
+				a.lea(Reg::Rsi, REG_SP, -VALUE_SIZE * (int32_t)(operand + 1));
+				a.callAbs((const void *)&_jitEnterSelfTailCall);
+				a.testAl();
+				exitTo(a.jcc(Cond::Equal), pc);
+				a.mov(Reg::Rdi, REG_STATE);
+				a.mov(Reg::Rsi, REG_SP);
+				a.callAbs((const void *)&_jitSafepoint);
+				a.test(Reg::Rax);
+				a.patch(a.jcc(Cond::Equal), exceptionExitOffset);
+				a.mov(REG_SP, Reg::Rax);
+				a.load(REG_LOCALS, REG_STATE, offsetof(JitState, locals));
+				a.cmpImm8(REG_STATE, offsetof(JitState, isYielding), 0);
+				exitTo(a.jcc(Cond::NotEqual), pc);
+				for (uint32_t i = 0; i < operand; ++i) {
+					a.loadValue(REG_SP, -VALUE_SIZE * (int32_t)(operand - i));
+					a.storeValue(REG_LOCALS, VALUE_SIZE * (int32_t)i);
+				}
+				a.lea(REG_SP, REG_LOCALS, VALUE_SIZE * (int32_t)operand);
+				jumpPatches.push_back({ a.jmp(), 0 });
+				break;
+			}
+			case Opcode::Return:
+				exitTo(a.jmp(), pc);
+				break;
+			default:
+				return nullptr;
+		}
+	}
+
+	for (const JumpPatch &i : jumpPatches)
+		a.patch(i.dispOffset, instructionOffsets[i.targetPc]);
+
+	// Exits to the same instruction share their code.
+	std::pmr::vector<uint32_t> exitOffsets(nInstructions, UINT32_MAX, memoryResource);
+	for (const JumpPatch &i : exitPatches) {
+		uint32_t &exitOffset = exitOffsets[i.targetPc];
+		if (exitOffset == UINT32_MAX) {
+			exitOffset = (uint32_t)a.getOffset();
+			a.movImm32(Reg::Rax, i.targetPc);
+			a.patch(a.jmp(), exitStubOffset);
+		}
+		a.patch(i.dispOffset, exitOffset);
+	}
+
+	using Alloc = std::pmr::polymorphic_allocator<JitCode>;
+	Alloc allocator(memoryResource);
+
+	std::unique_ptr<JitCode, StatefulDeleter<Alloc>> jitCode(
+		allocator.allocate(1),
+		StatefulDeleter<Alloc>(allocator));
+	allocator.construct(jitCode.get(), memoryResource);
+	jitCode->instructionOffsets = std::move(instructionOffsets);
+	jitCode->guardedCallees.splice(jitCode->guardedCallees.end(), guardedCallees);
+
+	size_t szPage = (size_t)sysconf(_SC_PAGESIZE);
+	size_t szMemory = (a.bytes.size() + szPage - 1) / szPage * szPage;
+	void *memory = mmap(nullptr, szMemory, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) {
+		std::destroy_at(jitCode.get());
+		return nullptr;
+	}
+	memcpy(memory, a.bytes.data(), a.bytes.size());
+	if (mprotect(memory, szMemory, PROT_READ | PROT_EXEC)) {
+		munmap(memory, szMemory);
+		std::destroy_at(jitCode.get());
+		return nullptr;
+	}
+	jitCode->memory = (uint8_t *)memory;
+	jitCode->szMemory = szMemory;
+
+	return jitCode.release();
+}
+
+MKLISP_API JitCode *mklisp::compileJitCode(Runtime *runtime, CodeObject *code) noexcept {
+	try {
+		return _compileJitCode(runtime, code);
+	} catch (std::bad_alloc &) {
+		return nullptr;
+	}
+}
+
+MKLISP_API void mklisp::freeJitCode(JitCode *jitCode) noexcept {
+	using Alloc = std::pmr::polymorphic_allocator<JitCode>;
+	Alloc allocator(jitCode->memoryResource);
+
+	if (jitCode->memory)
+		munmap(jitCode->memory, jitCode->szMemory);
+	std::destroy_at(jitCode);
+	allocator.deallocate(jitCode, 1);
+}
+
+#else
+
+MKLISP_API JitCode *mklisp::compileJitCode(Runtime *runtime, CodeObject *code) noexcept {
+	return nullptr;
+}
+
+MKLISP_API void mklisp::freeJitCode(JitCode *jitCode) noexcept {
+}
+
+#endif
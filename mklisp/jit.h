@@ -0,0 +1,87 @@
+#ifndef _MKLISP_JIT_H_
+#define _MKLISP_JIT_H_
+
+#include "runtime.h"
+#include <exception>
+#include <list>
+
+// The baseline JIT is built for x86-64 Linux with compilers which follow the
+// System V ABI. Define `MKLISP_NO_JIT` to run everything in the interpreter.
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__) && !defined(MKLISP_NO_JIT)
+	#define MKLISP_JIT 1
+#else
+	#define MKLISP_JIT 0
+#endif
+
+namespace mklisp {
+	// Returned by native code instead of an instruction index if a native
+	// function has thrown, the exception is kept in `JitState::exception`.
+	constexpr static uint32_t JIT_EXIT_EXCEPTION = UINT32_MAX;
+
+	// State of the frame the native code runs, the pointers are reloaded from
+	// it after each call out of the native code, since the stacks may move.
+	struct JitState {
+		Runtime *runtime;
+		Context *context;
+		CodeObject *code;
+		size_t frameIndex;
+		size_t stackBase;
+		Value *locals;
+		const Value *captures;
+		Value *globals;
+		std::atomic_size_t *bindingVersion;
+		// Top of the value stack once the native code has exited.
+		Value *sp;
+		// Set by safepoints if the evaluation has to yield, the native code
+		// exits to the interpreter, which suspends it.
+		bool isYielding = false;
+		std::exception_ptr exception;
+	};
+
+	typedef uint32_t (*JitEntry)(JitState *state, Value *sp, const void *target);
+
+	// Native code of a code object. It runs the instructions of the code with
+	// the same frame and value stack as the interpreter, from any instruction,
+	// until it reaches an instruction it leaves to the interpreter, and returns
+	// the index of it.
+	//
+	// Calls of natives which the call site has only ever resolved to, other
+	// than async ones, are compiled to direct calls guarded by the identity of the callee, or to
+	// inline integer arithmetic for intrinsics, see `NativeIntrinsic`. Calls of
+	// code objects and returns are left to the interpreter, except for tail
+	// calls of the code itself or of closures of it, which are compiled to
+	// loops. The interpreter is the reference, native code exits to it
+	// whenever a guard fails.
+	struct JitCode {
+		std::pmr::memory_resource *memoryResource;
+		// Executable pages, which are never writable at the same time.
+		uint8_t *memory;
+		size_t szMemory;
+		// Offsets of the native code of each instruction in `memory`.
+		std::pmr::vector<uint32_t> instructionOffsets;
+		// Callees the guards compare with, held weakly. Once one has been
+		// collected its guards always fail.
+		std::pmr::list<HostWeakRef<Object>> guardedCallees;
+
+		JitCode(std::pmr::memory_resource *memoryResource);
+	};
+
+	// Returns nullptr if the code cannot be compiled. Compiling reads the call
+	// site caches of the code, the callees it guards against are not kept
+	// alive by it.
+	MKLISP_API JitCode *compileJitCode(Runtime *runtime, CodeObject *code) noexcept;
+	MKLISP_API void freeJitCode(JitCode *jitCode) noexcept;
+
+	// Runs the native code from the instruction at `pc` and returns the index
+	// of the instruction the interpreter continues from. Exceptions thrown by
+	// native functions are rethrown, the ones of natives which have failed
+	// their call are left in `Context::nativeException`.
+	MKLISP_FORCEINLINE uint32_t runJitCode(JitCode *jitCode, JitState &state, Value *sp, uint32_t pc) {
+		uint32_t nextPc = ((JitEntry)jitCode->memory)(&state, sp, jitCode->memory + jitCode->instructionOffsets[pc]);
+		if ((nextPc == JIT_EXIT_EXCEPTION) && state.exception)
+			std::rethrow_exception(state.exception);
+		return nextPc;
+	}
+}
+
+#endif
@@ -0,0 +1,535 @@
+#include "macro.h"
+#include <algorithm>
+#include <string>
+
+using namespace mklisp;
+
+static SymbolObject *_getSymbol(const Value &value) noexcept {
+	if ((value.valueType != ValueType::Object) ||
+		(value.exData.asObject->getObjectType() != ObjectType::Symbol))
+		return nullptr;
+	return (SymbolObject *)value.exData.asObject;
+}
+
+static ListObject *_getList(const Value &value) noexcept {
+	if ((value.valueType != ValueType::Object) ||
+		(value.exData.asObject->getObjectType() != ObjectType::List))
+		return nullptr;
+	return (ListObject *)value.exData.asObject;
+}
+
+static bool _isLiteral(const ListObject *literals, uint32_t symbolId) noexcept {
+	if (!literals)
+		return false;
+	for (auto &i : literals->elements) {
+		if (SymbolObject *literal = _getSymbol(i); literal && (literal->symbolId == symbolId))
+			return true;
+	}
+	return false;
+}
+
+// Constants in patterns match equal constants.
+static bool _isEqualConstant(const Value &lhs, const Value &rhs) noexcept {
+	if (lhs.valueType != rhs.valueType)
+		return false;
+
+	switch (lhs.valueType) {
+		case ValueType::Undefined:
+		case ValueType::Nil:
+			return true;
+		case ValueType::Int:
+		case ValueType::UInt:
+			return lhs.exData.asUInt == rhs.exData.asUInt;
+		case ValueType::Long:
+		case ValueType::ULong:
+			return lhs.exData.asULong == rhs.exData.asULong;
+		case ValueType::Short:
+		case ValueType::UShort:
+			return lhs.exData.asUShort == rhs.exData.asUShort;
+		case ValueType::Byte:
+		case ValueType::UByte:
+			return lhs.exData.asUByte == rhs.exData.asUByte;
+		case ValueType::Char:
+			return lhs.exData.asChar == rhs.exData.asChar;
+		case ValueType::Object:
+		case ValueType::QuotedObject: {
+			Object *lhsObject = lhs.exData.asObject, *rhsObject = rhs.exData.asObject;
+			if (lhsObject == rhsObject)
+				return true;
+			if ((lhsObject->getObjectType() != ObjectType::String) || (rhsObject->getObjectType() != ObjectType::String))
+				return false;
+			return ((StringObject *)lhsObject)->data == ((StringObject *)rhsObject)->data;
+		}
+	}
+	return false;
+}
+
+MKLISP_API MacroExpander::MacroExpander(Runtime *runtime)
+	: _macros(&runtime->globalHeapResource),
+	  _expansionCache(&runtime->globalHeapResource),
+	  _localSymbolIds(&runtime->globalHeapResource),
+	  runtime(runtime) {
+	_defineSyntaxId = runtime->internSymbol(std::pmr::string("define-syntax", &runtime->globalHeapResource));
+	_syntaxRulesId = runtime->internSymbol(std::pmr::string("syntax-rules", &runtime->globalHeapResource));
+	_ellipsisId = runtime->internSymbol(std::pmr::string("...", &runtime->globalHeapResource));
+	_wildcardId = runtime->internSymbol(std::pmr::string("_", &runtime->globalHeapResource));
+}
+
+InternalExceptionPointer MacroExpander::_raiseError(const char *message, const std::string_view &detail) {
+	std::pmr::string msg(&runtime->globalHeapResource);
+
+	msg = message;
+	if (detail.size()) {
+		msg += ": ";
+		msg += detail;
+	}
+
+	return SyntaxError::alloc(&runtime->globalHeapResource, std::move(msg));
+}
+
+MKLISP_API void MacroExpander::clearExpansionCache() noexcept {
+	_expansionCache.clear();
+}
+
+InternalExceptionPointer MacroExpander::_defineMacro(ListObject *list) {
+	auto &elements = list->elements;
+
+	SymbolObject *name = elements.size() == 3 ? _getSymbol(elements[1]) : nullptr;
+	if (!name)
+		return _raiseError("Malformed define-syntax");
+	if (name->isSpecialForm())
+		return _raiseError("Special form used as a macro name", name->name);
+
+	ListObject *syntaxRules = _getList(elements[2]);
+	SymbolObject *head = syntaxRules && (syntaxRules->elements.size() >= 2) ? _getSymbol(syntaxRules->elements[0]) : nullptr;
+	if ((!head) || (head->symbolId != _syntaxRulesId) || (!_getList(syntaxRules->elements[1])))
+		return _raiseError("Expecting syntax-rules", name->name);
+
+	for (size_t i = 2; i < syntaxRules->elements.size(); ++i) {
+		ListObject *rule = _getList(syntaxRules->elements[i]);
+		if ((!rule) || (rule->elements.size() != 2) || (!_getList(rule->elements[0])))
+			return _raiseError("Malformed syntax rule", name->name);
+	}
+
+	_macros[name->symbolId] = syntaxRules;
+	// Calls expanded before may expand differently now.
+	clearExpansionCache();
+	return {};
+}
+
+bool MacroExpander::_isEllipsis(const ListObject *list, size_t index) const noexcept {
+	if (index >= list->elements.size())
+		return false;
+	SymbolObject *symbol = _getSymbol(list->elements[index]);
+	return symbol && (symbol->symbolId == _ellipsisId);
+}
+
+void MacroExpander::_collectPatternVariables(const Value &pattern, const ListObject *literals, std::pmr::vector<uint32_t> &variablesOut) const {
+	if (SymbolObject *symbol = _getSymbol(pattern)) {
+		if ((symbol->symbolId != _wildcardId) && (symbol->symbolId != _ellipsisId) && (!_isLiteral(literals, symbol->symbolId)))
+			variablesOut.push_back(symbol->symbolId);
+	} else if (ListObject *list = _getList(pattern)) {
+		for (auto &i : list->elements)
+			_collectPatternVariables(i, literals, variablesOut);
+	}
+}
+
+bool MacroExpander::_match(const Value &pattern, const Value &form, const ListObject *literals, MacroBindingMap &bindings) const {
+	if (SymbolObject *symbol = _getSymbol(pattern)) {
+		if (symbol->symbolId == _wildcardId)
+			return true;
+		if (_isLiteral(literals, symbol->symbolId)) {
+			SymbolObject *formSymbol = _getSymbol(form);
+			return formSymbol && (formSymbol->symbolId == symbol->symbolId);
+		}
+
+		bindings[symbol->symbolId].value = form;
+		return true;
+	}
+
+	if (ListObject *patternList = _getList(pattern)) {
+		ListObject *formList = _getList(form);
+		return formList && _matchList(patternList, 0, formList, 0, literals, bindings);
+	}
+
+	return _isEqualConstant(pattern, form);
+}
+
+bool MacroExpander::_matchList(const ListObject *pattern, size_t patternBegin, const ListObject *form, size_t formBegin, const ListObject *literals, MacroBindingMap &bindings) const {
+	auto &patternElements = pattern->elements;
+	auto &formElements = form->elements;
+	size_t nPatterns = patternElements.size() - patternBegin, nForms = formElements.size() - formBegin;
+
+	size_t ellipsisIndex = SIZE_MAX;
+	for (size_t i = patternBegin + 1; i < patternElements.size(); ++i) {
+		if (_isEllipsis(pattern, i)) {
+			ellipsisIndex = i;
+			break;
+		}
+	}
+
+	if (ellipsisIndex == SIZE_MAX) {
+		if (nPatterns != nForms)
+			return false;
+		for (size_t i = 0; i < nPatterns; ++i) {
+			if (!_match(patternElements[patternBegin + i], formElements[formBegin + i], literals, bindings))
+				return false;
+		}
+		return true;
+	}
+
+	// The subpattern before the ellipsis takes the elements which the
+	// patterns around it leave.
+	size_t nBefore = ellipsisIndex - 1 - patternBegin, nAfter = patternElements.size() - ellipsisIndex - 1;
+	if (nForms < nBefore + nAfter)
+		return false;
+	size_t nRepetitions = nForms - nBefore - nAfter;
+
+	for (size_t i = 0; i < nBefore; ++i) {
+		if (!_match(patternElements[patternBegin + i], formElements[formBegin + i], literals, bindings))
+			return false;
+	}
+
+	const Value &repeatedPattern = patternElements[ellipsisIndex - 1];
+	std::pmr::vector<uint32_t> variables(&runtime->globalHeapResource);
+	_collectPatternVariables(repeatedPattern, literals, variables);
+	for (uint32_t i : variables)
+		bindings[i].isRepeated = true;
+
+	for (size_t i = 0; i < nRepetitions; ++i) {
+		MacroBindingMap repetitionBindings(&runtime->globalHeapResource);
+		if (!_match(repeatedPattern, formElements[formBegin + nBefore + i], literals, repetitionBindings))
+			return false;
+		for (uint32_t j : variables)
+			bindings[j].repetitions.push_back(std::move(repetitionBindings[j]));
+	}
+
+	for (size_t i = 0; i < nAfter; ++i) {
+		if (!_match(patternElements[ellipsisIndex + 1 + i], formElements[formBegin + nBefore + nRepetitions + i], literals, bindings))
+			return false;
+	}
+	return true;
+}
+
+void MacroExpander::_addRename(const Value &value, const MacroBindingMap &bindings, RenameMap &renames) {
+	SymbolObject *symbol = _getSymbol(value);
+	if ((!symbol) || symbol->isSpecialForm() || (symbol->symbolId == _ellipsisId) ||
+		bindings.count(symbol->symbolId) || renames.count(symbol->symbolId))
+		return;
+
+	// Names with spaces cannot be written in the source.
+	std::pmr::string name(symbol->name, &runtime->globalHeapResource);
+	name += ' ';
+	name += std::to_string(++_nRenamedSymbols);
+	renames[symbol->symbolId] = SymbolObject::alloc(runtime, std::move(name));
+}
+
+// Finds the variables which the template binds itself.
+void MacroExpander::_collectRenames(const Value &tmpl, const MacroBindingMap &bindings, RenameMap &renames) {
+	ListObject *list = _getList(tmpl);
+	if (!list)
+		return;
+	auto &elements = list->elements;
+
+	if (SymbolObject *head = elements.size() >= 2 ? _getSymbol(elements[0]) : nullptr; head && head->isSpecialForm()) {
+		switch ((SpecialForm)head->symbolId) {
+			case SpecialForm::Quote:
+				return;
+			case SpecialForm::Let:
+				if (ListObject *letBindings = _getList(elements[1])) {
+					for (auto &i : letBindings->elements) {
+						if (ListObject *binding = _getList(i); binding && binding->elements.size())
+							_addRename(binding->elements[0], bindings, renames);
+					}
+				}
+				break;
+			case SpecialForm::Lambda:
+				if (ListObject *params = _getList(elements[1])) {
+					for (auto &i : params->elements)
+						_addRename(i, bindings, renames);
+				}
+				break;
+			case SpecialForm::Define:
+				if (ListObject *signature = _getList(elements[1])) {
+					for (size_t i = 1; i < signature->elements.size(); ++i)
+						_addRename(signature->elements[i], bindings, renames);
+				}
+				break;
+			default:
+				break;
+		}
+	}
+
+	for (auto &i : elements)
+		_collectRenames(i, bindings, renames);
+}
+
+InternalExceptionPointer MacroExpander::_substitute(const Value &tmpl, const MacroBindingMap &bindings, const RenameMap &renames, Value &valueOut) {
+	if (SymbolObject *symbol = _getSymbol(tmpl)) {
+		if (auto it = bindings.find(symbol->symbolId); it != bindings.end()) {
+			if (it->second.isRepeated)
+				return _raiseError("Pattern variable used without an ellipsis", symbol->name);
+			valueOut = it->second.value;
+		} else if (auto it = renames.find(symbol->symbolId); it != renames.end())
+			valueOut = Value((Object *)it->second._value);
+		else
+			valueOut = tmpl;
+		return {};
+	}
+
+	if (tmpl.valueType == ValueType::QuotedObject) {
+		Value quoted;
+		MKLISP_RETURN_IF_EXCEPT(_substitute(Value(tmpl.exData.asObject), bindings, renames, quoted));
+		valueOut = quoted.valueType == ValueType::Object ? Value(quoted.exData.asObject, true) : quoted;
+		return {};
+	}
+
+	ListObject *list = _getList(tmpl);
+	if (!list) {
+		valueOut = tmpl;
+		return {};
+	}
+	auto &elements = list->elements;
+
+	HostObjectRef<ListObject> result = ListObject::alloc(runtime);
+	for (size_t i = 0; i < elements.size(); ++i) {
+		Value element;
+
+		if (!_isEllipsis(list, i + 1)) {
+			MKLISP_RETURN_IF_EXCEPT(_substitute(elements[i], bindings, renames, element));
+			result->elements.push_back(element);
+			continue;
+		}
+
+		// The element is substituted once for each element which the
+		// repeated variables in it have matched.
+		std::pmr::vector<uint32_t> variables(&runtime->globalHeapResource);
+		_collectPatternVariables(elements[i], nullptr, variables);
+
+		size_t nRepetitions = SIZE_MAX;
+		for (auto it = variables.begin(); it != variables.end();) {
+			auto binding = bindings.find(*it);
+			if ((binding == bindings.end()) || (!binding->second.isRepeated)) {
+				it = variables.erase(it);
+				continue;
+			}
+			if ((nRepetitions != SIZE_MAX) && (nRepetitions != binding->second.repetitions.size()))
+				return _raiseError("Pattern variables repeated different times");
+			nRepetitions = binding->second.repetitions.size();
+			++it;
+		}
+		if (nRepetitions == SIZE_MAX)
+			return _raiseError("No pattern variable to repeat before an ellipsis");
+
+		for (size_t j = 0; j < nRepetitions; ++j) {
+			MacroBindingMap repetitionBindings(bindings);
+			for (uint32_t k : variables)
+				repetitionBindings[k] = bindings.at(k).repetitions[j];
+
+			MKLISP_RETURN_IF_EXCEPT(_substitute(elements[i], repetitionBindings, renames, element));
+			result->elements.push_back(element);
+		}
+		++i;
+	}
+
+	valueOut = Value(result.get());
+	return {};
+}
+
+InternalExceptionPointer MacroExpander::_expandCall(SymbolObject *name, ListObject *syntaxRules, ListObject *call, Value &expansionOut) {
+	auto &rules = syntaxRules->elements;
+	ListObject *literals = _getList(rules[1]);
+
+	for (size_t i = 2; i < rules.size(); ++i) {
+		ListObject *rule = _getList(rules[i]);
+		ListObject *pattern = _getList(rule->elements[0]);
+		const Value &tmpl = rule->elements[1];
+
+		MacroBindingMap bindings(&runtime->globalHeapResource);
+		if ((!pattern->elements.size()) || (!_matchList(pattern, 1, call, 1, literals, bindings)))
+			continue;
+
+		RenameMap renames(&runtime->globalHeapResource);
+		_collectRenames(tmpl, bindings, renames);
+		return _substitute(tmpl, bindings, renames, expansionOut);
+	}
+
+	return _raiseError("No syntax rule matches the macro call", name->name);
+}
+
+InternalExceptionPointer MacroExpander::_expandElements(ListObject *list, size_t indexBegin) {
+	for (size_t i = indexBegin; i < list->elements.size(); ++i) {
+		Value element = list->elements[i];
+		bool isReplaced;
+
+		MKLISP_RETURN_IF_EXCEPT(_expandExpr(element, isReplaced));
+		if (isReplaced)
+			MKLISP_RETURN_IF_EXCEPT(list->setElement(i, element));
+	}
+	return {};
+}
+
+InternalExceptionPointer MacroExpander::_expandScope(ListObject *list, size_t bodyBegin, const Value &params, size_t paramsBegin) {
+	size_t nOuterSymbols = _localSymbolIds.size();
+
+	if (ListObject *paramList = _getList(params)) {
+		for (size_t i = paramsBegin; i < paramList->elements.size(); ++i) {
+			if (SymbolObject *param = _getSymbol(paramList->elements[i]))
+				_localSymbolIds.push_back(param->symbolId);
+		}
+	}
+
+	InternalExceptionPointer e = _expandElements(list, bodyBegin);
+	_localSymbolIds.resize(nOuterSymbols);
+	return e;
+}
+
+InternalExceptionPointer MacroExpander::_expandLet(ListObject *list) {
+	auto &elements = list->elements;
+	size_t nOuterSymbols = _localSymbolIds.size();
+
+	// Initial values are evaluated before any of the variables is bound.
+	if (ListObject *bindings = elements.size() >= 2 ? _getList(elements[1]) : nullptr) {
+		for (auto &i : bindings->elements) {
+			if (ListObject *binding = _getList(i); binding && (binding->elements.size() == 2) && !binding->isFrozen())
+				MKLISP_RETURN_IF_EXCEPT(_expandElements(binding, 1));
+		}
+		for (auto &i : bindings->elements) {
+			if (ListObject *binding = _getList(i); binding && binding->elements.size()) {
+				if (SymbolObject *name = _getSymbol(binding->elements[0]))
+					_localSymbolIds.push_back(name->symbolId);
+			}
+		}
+	}
+
+	InternalExceptionPointer e = _expandElements(list, 2);
+	_localSymbolIds.resize(nOuterSymbols);
+	return e;
+}
+
+InternalExceptionPointer MacroExpander::_expandExpr(Value &form, bool &isReplacedOut) {
+	isReplacedOut = false;
+
+	ListObject *list = _getList(form);
+	if ((!list) || list->isFrozen() || list->elements.empty())
+		return {};
+	auto &elements = list->elements;
+
+	SymbolObject *head = _getSymbol(elements[0]);
+	if (head && head->isSpecialForm()) {
+		switch ((SpecialForm)head->symbolId) {
+			case SpecialForm::Quote:
+				return {};
+			case SpecialForm::Cond:
+				// Clauses are not calls.
+				for (size_t i = 1; i < elements.size(); ++i) {
+					if (ListObject *clause = _getList(elements[i]); clause && !clause->isFrozen())
+						MKLISP_RETURN_IF_EXCEPT(_expandElements(clause, 0));
+				}
+				return {};
+			case SpecialForm::Define:
+				if (elements.size() >= 2 && _getList(elements[1]))
+					return _expandScope(list, 2, elements[1], 1);
+				return _expandElements(list, 2);
+			case SpecialForm::Let:
+				return _expandLet(list);
+			case SpecialForm::Lambda:
+				if (elements.size() >= 2)
+					return _expandScope(list, 2, elements[1], 0);
+				return {};
+			case SpecialForm::Set:
+				return _expandElements(list, 2);
+			default:
+				return _expandElements(list, 1);
+		}
+	}
+
+	auto macro = head ? _macros.find(head->symbolId) : _macros.end();
+	if ((macro == _macros.end()) ||
+		(std::find(_localSymbolIds.begin(), _localSymbolIds.end(), head->symbolId) != _localSymbolIds.end()))
+		return _expandElements(list, 0);
+
+	if (auto it = _expansionCache.find(list); it != _expansionCache.end()) {
+		// Calls which have been collected may have left entries to new ones
+		// at the same address.
+		if (it->second.call.get() == list) {
+			++runtime->nMacroExpansionCacheHits;
+			form = it->second.expansion;
+			isReplacedOut = true;
+			return {};
+		}
+		_expansionCache.erase(it);
+	}
+
+	if (_expansionDepth >= maxExpansionDepth)
+		return _raiseError("Macro expansion is too deep", head->name);
+
+	// The syntax rules are kept alive by the macro table while expanding.
+	Value expansion;
+	MKLISP_RETURN_IF_EXCEPT(_expandCall(head, macro->second.get(), list, expansion));
+	++runtime->nMacroExpansions;
+
+	++_expansionDepth;
+	bool isReplaced;
+	InternalExceptionPointer e = _expandExpr(expansion, isReplaced);
+	--_expansionDepth;
+	if (e)
+		return e;
+
+	if (_expansionCache.size() >= _expansionCachePruneSize) {
+		for (auto it = _expansionCache.begin(); it != _expansionCache.end();) {
+			if (it->second.call)
+				++it;
+			else
+				it = _expansionCache.erase(it);
+		}
+		_expansionCachePruneSize = std::max(_expansionCache.size() * 2, (size_t)64);
+	}
+
+	ExpansionCacheEntry &entry = _expansionCache[list];
+	entry.call = list;
+	entry.expansion = expansion;
+	if ((expansion.valueType == ValueType::Object) || (expansion.valueType == ValueType::QuotedObject))
+		entry.expansionObject = expansion.exData.asObject;
+
+	form = expansion;
+	isReplacedOut = true;
+	return {};
+}
+
+MKLISP_API InternalExceptionPointer MacroExpander::expand(ListObject *forms) {
+	if (forms->isFrozen())
+		return {};
+
+	MutatorScope mutatorScope(runtime);
+	auto beginTime = std::chrono::steady_clock::now();
+	InternalExceptionPointer e;
+
+	for (size_t i = 0; i < forms->elements.size(); ++i) {
+		ListObject *list = _getList(forms->elements[i]);
+		SymbolObject *head = list && list->elements.size() ? _getSymbol(list->elements[0]) : nullptr;
+
+		if (head && (head->symbolId == _defineSyntaxId) &&
+			(std::find(_localSymbolIds.begin(), _localSymbolIds.end(), head->symbolId) == _localSymbolIds.end())) {
+			if ((e = _defineMacro(list)))
+				break;
+			if ((e = forms->setElement(i, Value(ValueType::Nil))))
+				break;
+			continue;
+		}
+
+		Value form = forms->elements[i];
+		bool isReplaced;
+		if ((e = _expandExpr(form, isReplaced)))
+			break;
+		if (isReplaced && (e = forms->setElement(i, form)))
+			break;
+	}
+
+	auto expansionTime = std::chrono::steady_clock::now() - beginTime;
+	{
+		auto heapLock = runtime->lockHeap();
+		runtime->macroExpansionTime += expansionTime;
+	}
+	return e;
+}
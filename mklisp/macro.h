@@ -0,0 +1,92 @@
+#ifndef _MKLISP_MACRO_H_
+#define _MKLISP_MACRO_H_
+
+#include "runtime.h"
+#include <string_view>
+#include <unordered_map>
+
+namespace mklisp {
+	constexpr static size_t DEFAULT_MAX_MACRO_EXPANSION_DEPTH = 256;
+
+	// Expands macros in parsed forms, before they are optimized, compiled or
+	// evaluated. Macros are defined by top-level forms like
+	//
+	//     (define-syntax name (syntax-rules (literals...) (pattern template)...))
+	//
+	// which are replaced by nil and apply to the forms after them and to later
+	// expansions. A call of a macro is replaced by the template of the first
+	// rule whose pattern matches it, with the pattern variables substituted,
+	// and the replacement is expanded again. The keyword at the head of
+	// patterns is ignored, `_` matches anything, literals match themselves
+	// and a subpattern followed by `...` matches any number of elements.
+	//
+	// Variables which templates bind by `let`, `lambda` or `define` of
+	// functions are renamed on each expansion, so they never capture the
+	// variables of the call. Other identifiers of templates refer to what
+	// they are bound to at the call.
+	//
+	// Expansions are cached by the lists of the calls, so a call which is
+	// reached again, such as an argument which an outer macro substitutes
+	// more than once, is not matched again. The cache keeps the expansions
+	// alive as long as the calls, entries of collected calls are dropped as
+	// the cache grows, redefining a macro clears it.
+	class MacroExpander {
+	private:
+		struct MacroBinding {
+			Value value;
+			// Set for variables of subpatterns followed by an ellipsis, which
+			// are bound to each of the elements matched.
+			bool isRepeated = false;
+			std::pmr::vector<MacroBinding> repetitions;
+		};
+
+		using MacroBindingMap = std::pmr::unordered_map<uint32_t, MacroBinding>;
+		using RenameMap = std::pmr::unordered_map<uint32_t, HostObjectRef<SymbolObject>>;
+
+		struct ExpansionCacheEntry {
+			HostWeakRef<ListObject> call;
+			Value expansion;
+			HostObjectRef<Object> expansionObject;
+		};
+
+		// Symbol ids of the macros to their `syntax-rules` forms.
+		std::pmr::unordered_map<uint32_t, HostObjectRef<ListObject>> _macros;
+		std::pmr::unordered_map<ListObject *, ExpansionCacheEntry> _expansionCache;
+		size_t _expansionCachePruneSize = 64;
+		// Innermost variables are the last ones.
+		std::pmr::vector<uint32_t> _localSymbolIds;
+		size_t _nRenamedSymbols = 0;
+		size_t _expansionDepth = 0;
+
+		uint32_t _defineSyntaxId, _syntaxRulesId, _ellipsisId, _wildcardId;
+
+		InternalExceptionPointer _defineMacro(ListObject *list);
+		InternalExceptionPointer _expandExpr(Value &form, bool &isReplacedOut);
+		InternalExceptionPointer _expandElements(ListObject *list, size_t indexBegin);
+		InternalExceptionPointer _expandScope(ListObject *list, size_t bodyBegin, const Value &params, size_t paramsBegin);
+		InternalExceptionPointer _expandLet(ListObject *list);
+		InternalExceptionPointer _expandCall(SymbolObject *name, ListObject *syntaxRules, ListObject *call, Value &expansionOut);
+
+		bool _isEllipsis(const ListObject *list, size_t index) const noexcept;
+		void _collectPatternVariables(const Value &pattern, const ListObject *literals, std::pmr::vector<uint32_t> &variablesOut) const;
+		bool _match(const Value &pattern, const Value &form, const ListObject *literals, MacroBindingMap &bindings) const;
+		bool _matchList(const ListObject *pattern, size_t patternBegin, const ListObject *form, size_t formBegin, const ListObject *literals, MacroBindingMap &bindings) const;
+		void _collectRenames(const Value &tmpl, const MacroBindingMap &bindings, RenameMap &renames);
+		void _addRename(const Value &value, const MacroBindingMap &bindings, RenameMap &renames);
+		InternalExceptionPointer _substitute(const Value &tmpl, const MacroBindingMap &bindings, const RenameMap &renames, Value &valueOut);
+		InternalExceptionPointer _raiseError(const char *message, const std::string_view &detail = {});
+
+	public:
+		Runtime *runtime;
+		size_t maxExpansionDepth = DEFAULT_MAX_MACRO_EXPANSION_DEPTH;
+
+		MKLISP_API MacroExpander(Runtime *runtime);
+
+		// Expands the forms of the list in place, such as the ones returned by
+		// `Parser::parse`. Frozen lists are left as they are.
+		MKLISP_API InternalExceptionPointer expand(ListObject *forms);
+		MKLISP_API void clearExpansionCache() noexcept;
+	};
+}
+
+#endif
@@ -1,9 +1,11 @@
 #include "runtime.h"
+#include "jit.h"
 #include <cassert>
+#include <memory>
 
 using namespace mklisp;
 
-MKLISP_API Object::Object(Runtime *associatedRuntime) : associatedRuntime(associatedRuntime) {
+MKLISP_API Object::Object(Runtime *associatedRuntime) : associatedRuntime(associatedRuntime), hostRefCount(0) {
 }
 
 MKLISP_API Object::~Object() {
@@ -15,24 +17,24 @@ MKLISP_API HostRefHolder::HostRefHolder(std::pmr::memory_resource *memoryResourc
 
 MKLISP_API HostRefHolder::~HostRefHolder() {
 	for (auto i : holdedObjects)
-		--i->hostRefCount;
+		decHostRef(i);
 }
 
 MKLISP_API void HostRefHolder::addObject(Object *object) {
 	if (!holdedObjects.count(object)) {
 		holdedObjects.insert(object);
-		++object->hostRefCount;
+		incHostRef(object);
 	}
 }
 
 MKLISP_API void HostRefHolder::removeObject(Object *object) noexcept {
 	assert(holdedObjects.count(object));
 	holdedObjects.erase(object);
-	--object->hostRefCount;
+	decHostRef(object);
 }
 
 MKLISP_API StringObject::StringObject(Runtime *runtime, std::pmr::string &&data)
-	: Object(runtime), data(data) {
+	: Object(runtime), data(std::move(data), &runtime->globalHeapResource) {
 }
 
 MKLISP_API StringObject::~StringObject() {
@@ -44,26 +46,72 @@ MKLISP_API ObjectType StringObject::getObjectType() const noexcept {
 
 MKLISP_API void StringObject::dealloc() noexcept {
 	using Alloc = std::pmr::polymorphic_allocator<StringObject>;
-	Alloc allocator(&associatedRuntime->globalHeapResource);
+	Alloc allocator(&associatedRuntime->nurseryResource);
 
 	std::destroy_at(this);
 	allocator.deallocate(this, 1);
 }
 
+MKLISP_API InternalExceptionPointer StringObject::assign(std::pmr::string &&data) {
+	if (isFrozen())
+		return FrozenObjectMutationError::alloc(&associatedRuntime->globalHeapResource, this);
+
+	this->data = std::move(data);
+
+	return {};
+}
+
+MKLISP_API InternalExceptionPointer StringObject::append(const std::string_view &data) {
+	if (isFrozen())
+		return FrozenObjectMutationError::alloc(&associatedRuntime->globalHeapResource, this);
+
+	this->data += data;
+
+	return {};
+}
+
 MKLISP_API HostObjectRef<StringObject> StringObject::alloc(Runtime *runtime, std::pmr::string &&data) {
 	using Alloc = std::pmr::polymorphic_allocator<StringObject>;
-	Alloc allocator(&runtime->globalHeapResource);
+	Alloc allocator(&runtime->nurseryResource);
 
 	std::unique_ptr<StringObject, StatefulDeleter<Alloc>> ptr(
 		allocator.allocate(1),
 		StatefulDeleter<Alloc>(allocator));
 	allocator.construct(ptr.get(), runtime, std::move(data));
+	runtime->addCreatedObject(ptr.get());
 
 	return ptr.release();
 }
 
+MKLISP_API const char *mklisp::getSpecialFormName(SpecialForm specialForm) noexcept {
+	switch (specialForm) {
+		case SpecialForm::Quote:
+			return "quote";
+		case SpecialForm::If:
+			return "if";
+		case SpecialForm::Cond:
+			return "cond";
+		case SpecialForm::Define:
+			return "define";
+		case SpecialForm::Let:
+			return "let";
+		case SpecialForm::Lambda:
+			return "lambda";
+		case SpecialForm::Begin:
+			return "begin";
+		case SpecialForm::Set:
+			return "set!";
+		case SpecialForm::And:
+			return "and";
+		case SpecialForm::Or:
+			return "or";
+	}
+	return nullptr;
+}
+
 MKLISP_API SymbolObject::SymbolObject(Runtime *runtime, std::pmr::string &&name)
-	: Object(runtime), name(name) {
+	: Object(runtime), name(std::move(name), &runtime->globalHeapResource) {
+	symbolId = runtime->internSymbol(this->name);
 }
 
 MKLISP_API SymbolObject::~SymbolObject() {
@@ -75,7 +123,7 @@ MKLISP_API ObjectType SymbolObject::getObjectType() const noexcept {
 
 MKLISP_API void SymbolObject::dealloc() noexcept {
 	using Alloc = std::pmr::polymorphic_allocator<SymbolObject>;
-	Alloc allocator(&associatedRuntime->globalHeapResource);
+	Alloc allocator(&associatedRuntime->nurseryResource);
 
 	std::destroy_at(this);
 	allocator.deallocate(this, 1);
@@ -83,18 +131,19 @@ MKLISP_API void SymbolObject::dealloc() noexcept {
 
 MKLISP_API HostObjectRef<SymbolObject> SymbolObject::alloc(Runtime *runtime, std::pmr::string &&name) {
 	using Alloc = std::pmr::polymorphic_allocator<SymbolObject>;
-	Alloc allocator(&runtime->globalHeapResource);
+	Alloc allocator(&runtime->nurseryResource);
 
 	std::unique_ptr<SymbolObject, StatefulDeleter<Alloc>> ptr(
 		allocator.allocate(1),
 		StatefulDeleter<Alloc>(allocator));
 	allocator.construct(ptr.get(), runtime, std::move(name));
+	runtime->addCreatedObject(ptr.get());
 
 	return ptr.release();
 }
 
 MKLISP_API ListObject::ListObject(Runtime *runtime)
-	: Object(runtime) {
+	: Object(runtime), elements(&runtime->globalHeapResource) {
 }
 
 MKLISP_API ListObject::~ListObject() {
@@ -106,20 +155,69 @@ MKLISP_API ObjectType ListObject::getObjectType() const noexcept {
 
 MKLISP_API void ListObject::dealloc() noexcept {
 	using Alloc = std::pmr::polymorphic_allocator<ListObject>;
-	Alloc allocator(&associatedRuntime->globalHeapResource);
+	Alloc allocator(&associatedRuntime->nurseryResource);
 
 	std::destroy_at(this);
 	allocator.deallocate(this, 1);
 }
 
+MKLISP_API InternalExceptionPointer ListObject::setElement(size_t index, const Value &value) {
+	if (isFrozen())
+		return FrozenObjectMutationError::alloc(&associatedRuntime->globalHeapResource, this);
+
+	elements.at(index) = value;
+	associatedRuntime->writeBarrier(this, value);
+
+	return {};
+}
+
+MKLISP_API InternalExceptionPointer ListObject::pushBack(const Value &value) {
+	if (isFrozen())
+		return FrozenObjectMutationError::alloc(&associatedRuntime->globalHeapResource, this);
+
+	elements.push_back(value);
+	associatedRuntime->writeBarrier(this, value);
+
+	return {};
+}
+
+MKLISP_API InternalExceptionPointer ListObject::popBack() {
+	if (isFrozen())
+		return FrozenObjectMutationError::alloc(&associatedRuntime->globalHeapResource, this);
+
+	elements.pop_back();
+
+	return {};
+}
+
+MKLISP_API InternalExceptionPointer ListObject::clear() {
+	if (isFrozen())
+		return FrozenObjectMutationError::alloc(&associatedRuntime->globalHeapResource, this);
+
+	elements.clear();
+
+	return {};
+}
+
+MKLISP_API HostObjectRef<ListObject> ListObject::duplicate() {
+	HostObjectRef<ListObject> newList = ListObject::alloc(associatedRuntime);
+
+	newList->elements = elements;
+	for (auto &i : newList->elements)
+		associatedRuntime->writeBarrier(newList.get(), i);
+
+	return newList;
+}
+
 MKLISP_API HostObjectRef<ListObject> ListObject::alloc(Runtime *runtime) {
 	using Alloc = std::pmr::polymorphic_allocator<ListObject>;
-	Alloc allocator(&runtime->globalHeapResource);
+	Alloc allocator(&runtime->nurseryResource);
 
 	std::unique_ptr<ListObject, StatefulDeleter<Alloc>> ptr(
 		allocator.allocate(1),
 		StatefulDeleter<Alloc>(allocator));
 	allocator.construct(ptr.get(), runtime);
+	runtime->addCreatedObject(ptr.get());
 
 	return ptr.release();
 }
@@ -137,7 +235,7 @@ MKLISP_API ObjectType NativeFnObject::getObjectType() const noexcept {
 
 MKLISP_API void NativeFnObject::dealloc() noexcept {
 	using Alloc = std::pmr::polymorphic_allocator<NativeFnObject>;
-	Alloc allocator(&associatedRuntime->globalHeapResource);
+	Alloc allocator(&associatedRuntime->nurseryResource);
 
 	std::destroy_at(this);
 	allocator.deallocate(this, 1);
@@ -145,12 +243,182 @@ MKLISP_API void NativeFnObject::dealloc() noexcept {
 
 MKLISP_API HostObjectRef<NativeFnObject> NativeFnObject::alloc(Runtime *runtime, NativeFnCallback callback) {
 	using Alloc = std::pmr::polymorphic_allocator<NativeFnObject>;
-	Alloc allocator(&runtime->globalHeapResource);
+	Alloc allocator(&runtime->nurseryResource);
 
 	std::unique_ptr<NativeFnObject, StatefulDeleter<Alloc>> ptr(
 		allocator.allocate(1),
 		StatefulDeleter<Alloc>(allocator));
 	allocator.construct(ptr.get(), runtime, callback);
+	runtime->addCreatedObject(ptr.get());
+
+	return ptr.release();
+}
+
+MKLISP_API WeakRefObject::WeakRefObject(Runtime *runtime)
+	: Object(runtime) {
+}
+
+MKLISP_API WeakRefObject::~WeakRefObject() {
+	unregisterWeakReference(&weakReference);
+}
+
+MKLISP_API ObjectType WeakRefObject::getObjectType() const noexcept {
+	return ObjectType::WeakRef;
+}
+
+MKLISP_API void WeakRefObject::dealloc() noexcept {
+	using Alloc = std::pmr::polymorphic_allocator<WeakRefObject>;
+	Alloc allocator(&associatedRuntime->nurseryResource);
+
+	std::destroy_at(this);
+	allocator.deallocate(this, 1);
+}
+
+MKLISP_API HostObjectRef<WeakRefObject> WeakRefObject::alloc(Runtime *runtime, Object *target) {
+	using Alloc = std::pmr::polymorphic_allocator<WeakRefObject>;
+	Alloc allocator(&runtime->nurseryResource);
+
+	std::unique_ptr<WeakRefObject, StatefulDeleter<Alloc>> ptr(
+		allocator.allocate(1),
+		StatefulDeleter<Alloc>(allocator));
+	allocator.construct(ptr.get(), runtime);
+	registerWeakReference(&ptr->weakReference, target);
+	runtime->addCreatedObject(ptr.get());
+
+	return ptr.release();
+}
+
+MKLISP_API CodeObject::CodeObject(Runtime *runtime)
+	: Object(runtime),
+	  instructions(&runtime->globalHeapResource),
+	  constants(&runtime->globalHeapResource),
+	  callSiteCaches(&runtime->globalHeapResource) {
+}
+
+MKLISP_API CodeObject::~CodeObject() {
+	if (jitCode)
+		freeJitCode(jitCode);
+}
+
+MKLISP_API ObjectType CodeObject::getObjectType() const noexcept {
+	return ObjectType::Code;
+}
+
+MKLISP_API void CodeObject::dealloc() noexcept {
+	using Alloc = std::pmr::polymorphic_allocator<CodeObject>;
+	Alloc allocator(&associatedRuntime->nurseryResource);
+
+	std::destroy_at(this);
+	allocator.deallocate(this, 1);
+}
+
+MKLISP_API uint32_t CodeObject::addConstant(const Value &value) {
+	constants.push_back(value);
+	associatedRuntime->writeBarrier(this, value);
+
+	return (uint32_t)(constants.size() - 1);
+}
+
+MKLISP_API uint16_t CodeObject::addCallSiteCache() {
+	if (callSiteCaches.size() >= NO_CALL_SITE_CACHE)
+		return NO_CALL_SITE_CACHE;
+
+	callSiteCaches.emplace_back();
+	return (uint16_t)(callSiteCaches.size() - 1);
+}
+
+MKLISP_API HostObjectRef<CodeObject> CodeObject::alloc(Runtime *runtime) {
+	using Alloc = std::pmr::polymorphic_allocator<CodeObject>;
+	Alloc allocator(&runtime->nurseryResource);
+
+	std::unique_ptr<CodeObject, StatefulDeleter<Alloc>> ptr(
+		allocator.allocate(1),
+		StatefulDeleter<Alloc>(allocator));
+	allocator.construct(ptr.get(), runtime);
+	runtime->addCreatedObject(ptr.get());
+
+	return ptr.release();
+}
+
+MKLISP_API ClosureObject::ClosureObject(Runtime *runtime, CodeObject *code)
+	: Object(runtime),
+	  code(code),
+	  captures(&runtime->globalHeapResource) {
+}
+
+MKLISP_API ClosureObject::~ClosureObject() {
+}
+
+MKLISP_API ObjectType ClosureObject::getObjectType() const noexcept {
+	return ObjectType::Closure;
+}
+
+MKLISP_API void ClosureObject::dealloc() noexcept {
+	using Alloc = std::pmr::polymorphic_allocator<ClosureObject>;
+	Alloc allocator(&associatedRuntime->nurseryResource);
+
+	std::destroy_at(this);
+	allocator.deallocate(this, 1);
+}
+
+MKLISP_API HostObjectRef<ClosureObject> ClosureObject::alloc(Runtime *runtime, CodeObject *code, const Value *captures, size_t nCaptures) {
+	using Alloc = std::pmr::polymorphic_allocator<ClosureObject>;
+	Alloc allocator(&runtime->nurseryResource);
+
+	std::unique_ptr<ClosureObject, StatefulDeleter<Alloc>> ptr(
+		allocator.allocate(1),
+		StatefulDeleter<Alloc>(allocator));
+	allocator.construct(ptr.get(), runtime, code);
+	ptr->captures.assign(captures, captures + nCaptures);
+	runtime->addCreatedObject(ptr.get());
+
+	runtime->writeBarrier(ptr.get(), Value(code));
+	for (auto &i : ptr->captures)
+		runtime->writeBarrier(ptr.get(), i);
+
+	return ptr.release();
+}
+
+MKLISP_API BoxObject::BoxObject(Runtime *runtime, const Value &value)
+	: Object(runtime), value(value) {
+}
+
+MKLISP_API BoxObject::~BoxObject() {
+}
+
+MKLISP_API ObjectType BoxObject::getObjectType() const noexcept {
+	return ObjectType::Box;
+}
+
+MKLISP_API void BoxObject::dealloc() noexcept {
+	using Alloc = std::pmr::polymorphic_allocator<BoxObject>;
+	Alloc allocator(&associatedRuntime->nurseryResource);
+
+	std::destroy_at(this);
+	allocator.deallocate(this, 1);
+}
+
+MKLISP_API InternalExceptionPointer BoxObject::set(const Value &value) {
+	if (isFrozen())
+		return FrozenObjectMutationError::alloc(&associatedRuntime->globalHeapResource, this);
+
+	this->value = value;
+	associatedRuntime->writeBarrier(this, value);
+
+	return {};
+}
+
+MKLISP_API HostObjectRef<BoxObject> BoxObject::alloc(Runtime *runtime, const Value &value) {
+	using Alloc = std::pmr::polymorphic_allocator<BoxObject>;
+	Alloc allocator(&runtime->nurseryResource);
+
+	std::unique_ptr<BoxObject, StatefulDeleter<Alloc>> ptr(
+		allocator.allocate(1),
+		StatefulDeleter<Alloc>(allocator));
+	allocator.construct(ptr.get(), runtime, value);
+	runtime->addCreatedObject(ptr.get());
+
+	runtime->writeBarrier(ptr.get(), value);
 
 	return ptr.release();
 }
@@ -2,36 +2,85 @@
 #define _MKLISP_OBJECTS_H_
 
 #include "value.h"
+#include "bytecode.h"
 #include "util.h"
+#include "except.h"
 #include <string>
 #include <memory_resource>
 #include <list>
 #include <atomic>
 #include <set>
 #include <deque>
+#include <vector>
 
 namespace mklisp {
 	enum class ObjectType : uint8_t {
 		String = 0,
 		Symbol,
 		List,
-		NativeFn
+		NativeFn,
+		WeakRef,
+		Code,
+		Closure,
+		Box
 	};
 
 	class Runtime;
 
+	using ObjectFlags = uint8_t;
+
+	// The object and everything reachable from it are immutable, see `Runtime::freeze`.
+	constexpr static ObjectFlags OBJECT_FROZEN = 0x01;
+	// Used by the garbage collector during marking.
+	constexpr static ObjectFlags OBJECT_MARKED = 0x02;
+	// The object has survived a collection and is no longer in the young generation.
+	constexpr static ObjectFlags OBJECT_OLD = 0x04;
+	// The object is in the remembered set of the runtime.
+	constexpr static ObjectFlags OBJECT_REMEMBERED = 0x08;
+	// The object is immutable while a parallel loop shares it with the
+	// workers, see `freezeForWorkers`.
+	constexpr static ObjectFlags OBJECT_LENT = 0x10;
+
 	class Object {
 	public:
 		Runtime *associatedRuntime;
 		std::atomic_size_t hostRefCount;
+		// Only changed by the runtime of the object with the heap locked or
+		// the world stopped, but frozen objects are read by any thread.
+		std::atomic<ObjectFlags> objectFlags = { 0 };
 
 		MKLISP_API Object(Runtime *associatedRuntime);
 		MKLISP_API virtual ~Object();
 
 		virtual ObjectType getObjectType() const noexcept = 0;
 		virtual void dealloc() noexcept = 0;
+
+		MKLISP_FORCEINLINE bool isFrozen() const noexcept {
+			return objectFlags & (OBJECT_FROZEN | OBJECT_LENT);
+		}
+	};
+
+	// Objects of base images are shared by the threads of all child runtimes
+	// and never collected, so we never touch their reference counts. Defined
+	// in runtime.h since taking a reference during incremental marking has to
+	// shade the object.
+	MKLISP_FORCEINLINE void incHostRef(Object *object) noexcept;
+	MKLISP_FORCEINLINE void decHostRef(Object *object) noexcept;
+
+	// Refers to an object without keeping it alive. Registered references are
+	// cleared and unregistered when their target is collected.
+	struct WeakReference {
+		Object *target = nullptr;
+		// Runtime the reference is registered in, if any.
+		Runtime *runtime = nullptr;
+		WeakReference *prev = nullptr, *next = nullptr;
 	};
 
+	// Does nothing if the target is null.
+	MKLISP_API void registerWeakReference(WeakReference *weakReference, Object *target);
+	// Does nothing if the reference has been cleared.
+	MKLISP_API void unregisterWeakReference(WeakReference *weakReference) noexcept;
+
 	template <typename T = Object>
 	class HostObjectRef final {
 	public:
@@ -39,14 +88,14 @@ namespace mklisp {
 
 		MKLISP_FORCEINLINE void reset() {
 			if (_value) {
-				--_value->hostRefCount;
+				decHostRef(_value);
 				_value = nullptr;
 			}
 		}
 
 		MKLISP_FORCEINLINE T *release() {
 			T *v = _value;
-			--_value->hostRefCount;
+			decHostRef(_value);
 			_value = nullptr;
 			return v;
 		}
@@ -55,7 +104,7 @@ namespace mklisp {
 
 		MKLISP_FORCEINLINE HostObjectRef(const HostObjectRef<T> &x) : _value(x._value) {
 			if (x._value) {
-				++_value->hostRefCount;
+				incHostRef(_value);
 			}
 		}
 		MKLISP_FORCEINLINE HostObjectRef(HostObjectRef<T> &&x) noexcept : _value(x._value) {
@@ -65,7 +114,7 @@ namespace mklisp {
 		}
 		MKLISP_FORCEINLINE HostObjectRef(T *value = nullptr) noexcept : _value(value) {
 			if (_value) {
-				++_value->hostRefCount;
+				incHostRef(_value);
 			}
 		}
 		MKLISP_FORCEINLINE ~HostObjectRef() {
@@ -81,7 +130,7 @@ namespace mklisp {
 			reset();
 
 			if ((_value = x._value)) {
-				++_value->hostRefCount;
+				incHostRef(_value);
 			}
 
 			return *this;
@@ -100,7 +149,7 @@ namespace mklisp {
 			reset();
 
 			if ((_value = other)) {
-				++_value->hostRefCount;
+				incHostRef(_value);
 			}
 
 			return *this;
@@ -121,6 +170,57 @@ namespace mklisp {
 		}
 	};
 
+	// Weak counterpart of `HostObjectRef`, `get` returns null once the object
+	// has been collected.
+	template <typename T = Object>
+	class HostWeakRef final {
+	private:
+		WeakReference _weakReference;
+
+	public:
+		MKLISP_FORCEINLINE void reset() noexcept {
+			unregisterWeakReference(&_weakReference);
+		}
+
+		MKLISP_FORCEINLINE HostWeakRef(T *value = nullptr) {
+			registerWeakReference(&_weakReference, value);
+		}
+		MKLISP_FORCEINLINE HostWeakRef(const HostWeakRef<T> &x) {
+			registerWeakReference(&_weakReference, x._weakReference.target);
+		}
+		MKLISP_FORCEINLINE ~HostWeakRef() {
+			reset();
+		}
+
+		MKLISP_FORCEINLINE T *get() const noexcept { return (T *)_weakReference.target; }
+		// The address stays the same while the reference lives, the target is
+		// cleared once the object has been collected.
+		MKLISP_FORCEINLINE Object *const *getTargetAddress() const noexcept { return &_weakReference.target; }
+
+		// Returns a strong reference, which is null if the object has been
+		// collected.
+		MKLISP_FORCEINLINE HostObjectRef<T> lock() const { return HostObjectRef<T>(get()); }
+
+		MKLISP_FORCEINLINE HostWeakRef<T> &operator=(const HostWeakRef<T> &x) {
+			if (this != &x) {
+				reset();
+				registerWeakReference(&_weakReference, x._weakReference.target);
+			}
+
+			return *this;
+		}
+		MKLISP_FORCEINLINE HostWeakRef<T> &operator=(T *other) {
+			reset();
+			registerWeakReference(&_weakReference, other);
+
+			return *this;
+		}
+
+		MKLISP_FORCEINLINE operator bool() const noexcept {
+			return _weakReference.target;
+		}
+	};
+
 	class HostRefHolder final {
 	public:
 		std::pmr::set<Object *> holdedObjects;
@@ -144,12 +244,36 @@ namespace mklisp {
 		MKLISP_API virtual ObjectType getObjectType() const noexcept override;
 		MKLISP_API virtual void dealloc() noexcept override;
 
+		MKLISP_API InternalExceptionPointer assign(std::pmr::string &&data);
+		MKLISP_API InternalExceptionPointer append(const std::string_view &data);
+
 		MKLISP_API static HostObjectRef<StringObject> alloc(Runtime *runtime, std::pmr::string &&data);
 	};
 
+	// Special forms are interned before any other symbol, so their symbol ids
+	// are the same in all runtimes.
+	enum class SpecialForm : uint32_t {
+		Quote = 0,
+		If,
+		Cond,
+		Define,
+		Let,
+		Lambda,
+		Begin,
+		Set,
+		And,
+		Or
+	};
+
+	constexpr static size_t NUM_SPECIAL_FORMS = (size_t)SpecialForm::Or + 1;
+
+	MKLISP_API const char *getSpecialFormName(SpecialForm specialForm) noexcept;
+
 	class SymbolObject : public Object {
 	public:
 		std::pmr::string name;
+		// See `Runtime::internSymbol`.
+		uint32_t symbolId;
 
 		MKLISP_API SymbolObject(Runtime *runtime, std::pmr::string &&name);
 		MKLISP_API virtual ~SymbolObject();
@@ -157,6 +281,10 @@ namespace mklisp {
 		MKLISP_API virtual ObjectType getObjectType() const noexcept override;
 		MKLISP_API virtual void dealloc() noexcept override;
 
+		MKLISP_FORCEINLINE bool isSpecialForm() const noexcept {
+			return symbolId < NUM_SPECIAL_FORMS;
+		}
+
 		MKLISP_API static HostObjectRef<SymbolObject> alloc(Runtime *runtime, std::pmr::string &&name);
 	};
 
@@ -170,15 +298,46 @@ namespace mklisp {
 		MKLISP_API virtual ObjectType getObjectType() const noexcept override;
 		MKLISP_API virtual void dealloc() noexcept override;
 
+		MKLISP_API InternalExceptionPointer setElement(size_t index, const Value &value);
+		MKLISP_API InternalExceptionPointer pushBack(const Value &value);
+		MKLISP_API InternalExceptionPointer popBack();
+		MKLISP_API InternalExceptionPointer clear();
+
+		MKLISP_API HostObjectRef<ListObject> duplicate();
+
 		MKLISP_API static HostObjectRef<ListObject> alloc(Runtime *runtime);
 	};
 
 	struct Context;
 
-	typedef void (*NativeFnCallback)(Context *context);
+	// Arguments are on the value stack of the context, they may be moved if the
+	// callback evaluates anything on the same context. Natives fail their calls
+	// through `Runtime::failCall`.
+	typedef void (*NativeFnCallback)(Context *context, ValueSpan args);
+	// Natives whose results the JIT computes inline for `Int` arguments, see
+	// `bindArithmeticBuiltins`.
+	enum class NativeIntrinsic : uint8_t {
+		None = 0,
+		Add,
+		Subtract,
+		Multiply,
+		Equal,
+		Less,
+		LessEqual,
+		Greater,
+		GreaterEqual
+	};
+
 	class NativeFnObject : public Object {
 	public:
 		NativeFnCallback callback;
+		NativeIntrinsic intrinsic = NativeIntrinsic::None;
+		// Pure natives return the same results for the same arguments and
+		// have no side effects, so `Optimizer` may call them ahead of time.
+		bool isPure = false;
+		// Async natives may suspend their calls, see `Runtime::suspendCall`,
+		// they are always called by the interpreter.
+		bool isAsync = false;
 
 		MKLISP_API NativeFnObject(Runtime *runtime, NativeFnCallback callback);
 		MKLISP_API virtual ~NativeFnObject();
@@ -188,6 +347,121 @@ namespace mklisp {
 
 		MKLISP_API static HostObjectRef<NativeFnObject> alloc(Runtime *runtime, NativeFnCallback callback);
 	};
+
+	// Weak references are cleared even if the reference object is frozen.
+	class WeakRefObject : public Object {
+	public:
+		WeakReference weakReference;
+
+		MKLISP_API WeakRefObject(Runtime *runtime);
+		MKLISP_API virtual ~WeakRefObject();
+
+		MKLISP_API virtual ObjectType getObjectType() const noexcept override;
+		MKLISP_API virtual void dealloc() noexcept override;
+
+		MKLISP_FORCEINLINE Object *getTarget() const noexcept {
+			return weakReference.target;
+		}
+
+		MKLISP_API static HostObjectRef<WeakRefObject> alloc(Runtime *runtime, Object *target);
+	};
+
+	class CodeObject;
+	class ClosureObject;
+	struct JitCode;
+
+	// Callee resolved by a call instruction.
+	struct CallTarget {
+		Object *object = nullptr;
+		// Set for native functions.
+		NativeFnCallback callback = nullptr;
+		// Set for code objects and closures.
+		CodeObject *code = nullptr;
+		ClosureObject *closure = nullptr;
+	};
+
+	constexpr static size_t MAX_CALL_SITE_CACHE_ENTRIES = 4;
+
+	// Callees last resolved by a call instruction, compared by identity. The
+	// entries are valid while the binding version of the runtime is the one
+	// they were resolved with, and keep their objects alive meanwhile.
+	struct CallSiteCache {
+		size_t bindingVersion = 0;
+		CallTarget entries[MAX_CALL_SITE_CACHE_ENTRIES];
+		uint8_t nEntries = 0;
+		// Entry to be replaced next once all of them are used.
+		uint8_t nextEntryIndex = 0;
+	};
+
+	// Bytecode compiled from a form or a lambda, see `Compiler`. Code objects
+	// are callable.
+	class CodeObject : public Object {
+	public:
+		std::pmr::vector<Instruction> instructions;
+		std::pmr::vector<Value> constants;
+		// Frozen code objects may be shared by threads and never use their
+		// caches.
+		std::pmr::vector<CallSiteCache> callSiteCaches;
+		// Arguments are the first local variables of the frame.
+		uint32_t nParams = 0;
+		// Maximum number of values the code keeps on the value stack,
+		// including the arguments and the local variables.
+		uint32_t maxStackSize = 0;
+		// Number of times frames have been entered with the code, the code is
+		// compiled to native code once it reaches `Runtime::jitThreshold`, see
+		// jit.h. Frozen code is never compiled.
+		uint32_t nCalls = 0;
+		JitCode *jitCode = nullptr;
+
+		MKLISP_API CodeObject(Runtime *runtime);
+		MKLISP_API virtual ~CodeObject();
+
+		MKLISP_API virtual ObjectType getObjectType() const noexcept override;
+		MKLISP_API virtual void dealloc() noexcept override;
+
+		MKLISP_API uint32_t addConstant(const Value &value);
+		// Returns `NO_CALL_SITE_CACHE` if the code has too many call sites.
+		MKLISP_API uint16_t addCallSiteCache();
+
+		MKLISP_API static HostObjectRef<CodeObject> alloc(Runtime *runtime);
+	};
+
+	// Code of a lambda with copies of the variables it captures from the
+	// enclosing functions. Captures never change after the closure has been
+	// created, variables which are assigned are captured as boxes.
+	class ClosureObject : public Object {
+	public:
+		CodeObject *code;
+		std::pmr::vector<Value> captures;
+
+		MKLISP_API ClosureObject(Runtime *runtime, CodeObject *code);
+		MKLISP_API virtual ~ClosureObject();
+
+		MKLISP_API virtual ObjectType getObjectType() const noexcept override;
+		MKLISP_API virtual void dealloc() noexcept override;
+
+		MKLISP_API static HostObjectRef<ClosureObject> alloc(Runtime *runtime, CodeObject *code, const Value *captures, size_t nCaptures);
+	};
+
+	// Holds a captured variable which is assigned, shared by the frame which
+	// binds the variable and the closures capturing it.
+	class BoxObject : public Object {
+	public:
+		Value value;
+
+		MKLISP_API BoxObject(Runtime *runtime, const Value &value);
+		MKLISP_API virtual ~BoxObject();
+
+		MKLISP_API virtual ObjectType getObjectType() const noexcept override;
+		MKLISP_API virtual void dealloc() noexcept override;
+
+		MKLISP_API InternalExceptionPointer set(const Value &value);
+
+		MKLISP_API static HostObjectRef<BoxObject> alloc(Runtime *runtime, const Value &value);
+	};
 }
 
+// Provides definitions of inline functions which need the complete `Runtime`.
+#include "runtime.h"
+
 #endif
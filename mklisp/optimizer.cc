@@ -0,0 +1,299 @@
+#include "optimizer.h"
+#include <algorithm>
+
+using namespace mklisp;
+
+static SymbolObject *_getSymbol(const Value &value) noexcept {
+	if ((value.valueType != ValueType::Object) ||
+		(value.exData.asObject->getObjectType() != ObjectType::Symbol))
+		return nullptr;
+	return (SymbolObject *)value.exData.asObject;
+}
+
+static ListObject *_getList(const Value &value) noexcept {
+	if ((value.valueType != ValueType::Object) ||
+		(value.exData.asObject->getObjectType() != ObjectType::List))
+		return nullptr;
+	return (ListObject *)value.exData.asObject;
+}
+
+// Returns false if the form is not a constant, or the value it evaluates to.
+static bool _getConstant(const Value &form, Value &valueOut) noexcept {
+	switch (form.valueType) {
+		case ValueType::Undefined:
+			return false;
+		case ValueType::QuotedObject:
+			valueOut = Value(form.exData.asObject);
+			return true;
+		case ValueType::Object:
+			if (form.exData.asObject->getObjectType() != ObjectType::String)
+				return false;
+			valueOut = form;
+			return true;
+		default:
+			valueOut = form;
+			return true;
+	}
+}
+
+MKLISP_API Optimizer::Optimizer(Context *context)
+	: _localSymbolIds(&context->runtime->globalHeapResource),
+	  _assignedSymbolIds(&context->runtime->globalHeapResource),
+	  context(context) {
+}
+
+void Optimizer::_scanAssignments(const Value &form) {
+	ListObject *list = _getList(form);
+	if (!list)
+		return;
+	auto &elements = list->elements;
+
+	if (SymbolObject *head = elements.size() ? _getSymbol(elements[0]) : nullptr; head && head->isSpecialForm()) {
+		switch ((SpecialForm)head->symbolId) {
+			case SpecialForm::Quote:
+				return;
+			case SpecialForm::Define:
+			case SpecialForm::Set:
+				if (elements.size() < 2)
+					break;
+				if (ListObject *signature = _getList(elements[1]); signature && signature->elements.size()) {
+					if (SymbolObject *name = _getSymbol(signature->elements[0]))
+						_assignedSymbolIds.insert(name->symbolId);
+				} else if (SymbolObject *name = _getSymbol(elements[1]))
+					_assignedSymbolIds.insert(name->symbolId);
+				break;
+			default:
+				break;
+		}
+	}
+
+	for (auto &i : elements)
+		_scanAssignments(i);
+}
+
+void Optimizer::_report(OptimizationKind kind, const Value &form, const Value &replacement) {
+	switch (kind) {
+		case OptimizationKind::FoldedCall:
+			++nFoldedCalls;
+			break;
+		case OptimizationKind::EliminatedBranch:
+			++nEliminatedBranches;
+			break;
+	}
+
+	if (optimizationCallback)
+		optimizationCallback(optimizationCallbackUserData, kind, form, replacement);
+}
+
+InternalExceptionPointer Optimizer::_optimizeElements(ListObject *list, size_t indexBegin) {
+	for (size_t i = indexBegin; i < list->elements.size(); ++i) {
+		Value replacement;
+		bool isReplaced;
+
+		MKLISP_RETURN_IF_EXCEPT(_optimizeExpr(list->elements[i], replacement, isReplaced));
+		if (isReplaced)
+			MKLISP_RETURN_IF_EXCEPT(list->setElement(i, replacement));
+	}
+	return {};
+}
+
+// Optimizes the body with the parameters bound, parameters are the elements
+// of the list from `paramsBegin`.
+InternalExceptionPointer Optimizer::_optimizeScope(ListObject *list, size_t bodyBegin, const Value &params, size_t paramsBegin) {
+	size_t nOuterSymbols = _localSymbolIds.size();
+
+	if (ListObject *paramList = _getList(params)) {
+		for (size_t i = paramsBegin; i < paramList->elements.size(); ++i) {
+			if (SymbolObject *param = _getSymbol(paramList->elements[i]))
+				_localSymbolIds.push_back(param->symbolId);
+		}
+	}
+
+	InternalExceptionPointer e = _optimizeElements(list, bodyBegin);
+	_localSymbolIds.resize(nOuterSymbols);
+	return e;
+}
+
+InternalExceptionPointer Optimizer::_optimizeLet(ListObject *list) {
+	auto &elements = list->elements;
+	size_t nOuterSymbols = _localSymbolIds.size();
+
+	// Initial values are evaluated before any of the variables is bound.
+	if (ListObject *bindings = elements.size() >= 2 ? _getList(elements[1]) : nullptr) {
+		for (auto &i : bindings->elements) {
+			ListObject *binding = _getList(i);
+			if ((!binding) || (binding->elements.size() != 2) || binding->isFrozen())
+				continue;
+
+			Value replacement;
+			bool isReplaced;
+
+			MKLISP_RETURN_IF_EXCEPT(_optimizeExpr(binding->elements[1], replacement, isReplaced));
+			if (isReplaced)
+				MKLISP_RETURN_IF_EXCEPT(binding->setElement(1, replacement));
+		}
+		for (auto &i : bindings->elements) {
+			if (ListObject *binding = _getList(i); binding && binding->elements.size()) {
+				if (SymbolObject *name = _getSymbol(binding->elements[0]))
+					_localSymbolIds.push_back(name->symbolId);
+			}
+		}
+	}
+
+	InternalExceptionPointer e = _optimizeElements(list, 2);
+	_localSymbolIds.resize(nOuterSymbols);
+	return e;
+}
+
+NativeFnObject *Optimizer::_getPureNative(SymbolObject *symbol) const {
+	if (std::find(_localSymbolIds.begin(), _localSymbolIds.end(), symbol->symbolId) != _localSymbolIds.end())
+		return nullptr;
+	if (_assignedSymbolIds.count(symbol->symbolId))
+		return nullptr;
+
+	Value binding = context->getBinding(symbol->name);
+	if ((binding.valueType != ValueType::Object) ||
+		(binding.exData.asObject->getObjectType() != ObjectType::NativeFn))
+		return nullptr;
+
+	NativeFnObject *fn = (NativeFnObject *)binding.exData.asObject;
+	return fn->isPure ? fn : nullptr;
+}
+
+bool Optimizer::_foldCall(ListObject *list, Value &replacementOut) {
+	auto &elements = list->elements;
+
+	SymbolObject *head = _getSymbol(elements[0]);
+	if (!head)
+		return false;
+	NativeFnObject *fn = _getPureNative(head);
+	if (!fn)
+		return false;
+
+	for (size_t i = 1; i < elements.size(); ++i) {
+		Value arg;
+		if (!_getConstant(elements[i], arg))
+			return false;
+	}
+
+	auto &frameStack = context->frameStack;
+	auto &valueStack = context->valueStack;
+	size_t argBase = valueStack.size();
+
+	for (size_t i = 1; i < elements.size(); ++i) {
+		Value arg;
+		_getConstant(elements[i], arg);
+		valueStack.push_back(arg);
+	}
+
+	// Called like the evaluator calls natives, on a frame of its own.
+	frameStack.push_back(Frame(nullptr, argBase));
+	try {
+		fn->callback(context, ValueSpan(valueStack.data() + argBase, valueStack.size() - argBase));
+	} catch (...) {
+		frameStack.pop_back();
+		valueStack.resize(argBase);
+		throw;
+	}
+	Value result = frameStack.back().returnValue;
+	frameStack.pop_back();
+	valueStack.resize(argBase);
+
+	// Failed calls are left to fail when evaluated.
+	if (context->nativeException) {
+		context->nativeException.reset();
+		return false;
+	}
+
+	switch (result.valueType) {
+		case ValueType::Undefined:
+			return false;
+		case ValueType::Object:
+			// Results which are not literals are quoted so they are not
+			// evaluated again.
+			if (result.exData.asObject->getObjectType() != ObjectType::String)
+				result = Value(result.exData.asObject, true);
+			break;
+		default:
+			break;
+	}
+
+	replacementOut = result;
+	return true;
+}
+
+// Sets `isReplacedOut`, and the replacement of the form if it has been
+// replaced.
+InternalExceptionPointer Optimizer::_optimizeExpr(const Value &form, Value &replacementOut, bool &isReplacedOut) {
+	isReplacedOut = false;
+
+	ListObject *list = _getList(form);
+	if ((!list) || list->isFrozen() || list->elements.empty())
+		return {};
+	auto &elements = list->elements;
+
+	SymbolObject *head = _getSymbol(elements[0]);
+	if (head && head->isSpecialForm()) {
+		switch ((SpecialForm)head->symbolId) {
+			case SpecialForm::Quote:
+				break;
+			case SpecialForm::If: {
+				MKLISP_RETURN_IF_EXCEPT(_optimizeElements(list, 1));
+
+				Value condition;
+				if ((elements.size() < 3) || (elements.size() > 4) || (!_getConstant(elements[1], condition)))
+					break;
+
+				if (condition.valueType != ValueType::Nil)
+					replacementOut = elements[2];
+				else
+					replacementOut = elements.size() == 4 ? elements[3] : Value(ValueType::Nil);
+				_report(OptimizationKind::EliminatedBranch, form, replacementOut);
+				isReplacedOut = true;
+				return {};
+			}
+			case SpecialForm::Cond:
+				// Clauses are not calls.
+				for (size_t i = 1; i < elements.size(); ++i) {
+					if (ListObject *clause = _getList(elements[i]); clause && !clause->isFrozen())
+						MKLISP_RETURN_IF_EXCEPT(_optimizeElements(clause, 0));
+				}
+				break;
+			case SpecialForm::Define:
+				if (elements.size() < 2)
+					break;
+				if (_getList(elements[1]))
+					return _optimizeScope(list, 2, elements[1], 1);
+				return _optimizeElements(list, 2);
+			case SpecialForm::Let:
+				return _optimizeLet(list);
+			case SpecialForm::Lambda:
+				if (elements.size() >= 2)
+					return _optimizeScope(list, 2, elements[1], 0);
+				break;
+			case SpecialForm::Set:
+				return _optimizeElements(list, 2);
+			default:
+				return _optimizeElements(list, 1);
+		}
+		return {};
+	}
+
+	MKLISP_RETURN_IF_EXCEPT(_optimizeElements(list, 0));
+
+	if (_foldCall(list, replacementOut)) {
+		_report(OptimizationKind::FoldedCall, form, replacementOut);
+		isReplacedOut = true;
+	}
+	return {};
+}
+
+MKLISP_API InternalExceptionPointer Optimizer::optimize(ListObject *forms) {
+	MutatorScope mutatorScope(context->runtime);
+	for (auto &i : forms->elements)
+		_scanAssignments(i);
+
+	if (forms->isFrozen())
+		return {};
+	return _optimizeElements(forms, 0);
+}
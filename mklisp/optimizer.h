@@ -0,0 +1,63 @@
+#ifndef _MKLISP_OPTIMIZER_H_
+#define _MKLISP_OPTIMIZER_H_
+
+#include "runtime.h"
+#include <set>
+
+namespace mklisp {
+	enum class OptimizationKind : uint8_t {
+		// Call of a pure native function replaced by its result.
+		FoldedCall = 0,
+		// `if` replaced by the branch its constant condition selects.
+		EliminatedBranch
+	};
+
+	// Called with each form which has been replaced and its replacement, the
+	// form is no longer referred to by the parsed forms afterwards.
+	typedef void (*OptimizationCallback)(void *userData, OptimizationKind kind, const Value &form, const Value &replacement);
+
+	// Rewrites parsed forms in place before they are evaluated or compiled.
+	//
+	// Calls of native functions which are pure, see `NativeFnObject::isPure`,
+	// with constant arguments are replaced by their results, innermost calls
+	// first. Constants are literals other than symbols and lists, quoted
+	// values and results folded before. Results are shared by all evaluations
+	// of the forms like literals are.
+	//
+	// Callees are looked up in the bindings of the context when optimizing.
+	// Names bound by lambdas or `let` in scope, and globals which the forms
+	// define or assign anywhere, are never folded, other bindings must not
+	// change before the forms are evaluated.
+	class Optimizer {
+	private:
+		// Innermost variables are the last ones.
+		std::pmr::vector<uint32_t> _localSymbolIds;
+		std::pmr::set<uint32_t> _assignedSymbolIds;
+
+		void _scanAssignments(const Value &form);
+		InternalExceptionPointer _optimizeExpr(const Value &form, Value &replacementOut, bool &isReplacedOut);
+		InternalExceptionPointer _optimizeElements(ListObject *list, size_t indexBegin);
+		InternalExceptionPointer _optimizeScope(ListObject *list, size_t bodyBegin, const Value &params, size_t paramsBegin);
+		InternalExceptionPointer _optimizeLet(ListObject *list);
+		bool _foldCall(ListObject *list, Value &replacementOut);
+		NativeFnObject *_getPureNative(SymbolObject *symbol) const;
+		void _report(OptimizationKind kind, const Value &form, const Value &replacement);
+
+	public:
+		Context *context;
+
+		size_t nFoldedCalls = 0;
+		size_t nEliminatedBranches = 0;
+		OptimizationCallback optimizationCallback = nullptr;
+		void *optimizationCallbackUserData = nullptr;
+
+		MKLISP_API Optimizer(Context *context);
+
+		// Optimizes the forms of the list, such as the ones returned by
+		// `Parser::parse`. Frozen lists are left as they are, forms replaced
+		// before an error are kept.
+		MKLISP_API InternalExceptionPointer optimize(ListObject *forms);
+	};
+}
+
+#endif
@@ -0,0 +1,276 @@
+#include "parallel.h"
+#include <unordered_set>
+
+using namespace mklisp;
+
+MKLISP_API void mklisp::freezeForWorkers(Context *context, const Value &value, ParallelGlobals &globalsOut, std::pmr::vector<Object *> &lentObjectsOut) {
+	Runtime *runtime = context->runtime;
+	std::pmr::vector<Object *> pendingObjects(&runtime->globalHeapResource);
+	// Only objects which may refer to others are visited.
+	std::pmr::unordered_set<Object *> visitedObjects(&runtime->globalHeapResource);
+	std::pmr::unordered_set<uint32_t> visitedSlots(&runtime->globalHeapResource);
+
+	// Objects which are frozen already are still visited for the globals
+	// their code refers to.
+	auto visit = [&pendingObjects, &visitedObjects, &lentObjectsOut](const Value &value) {
+		switch (value.valueType) {
+			case ValueType::Object:
+			case ValueType::QuotedObject:
+				break;
+			default:
+				return;
+		}
+
+		Object *object = value.exData.asObject;
+		if (!object->isFrozen()) {
+			object->objectFlags |= OBJECT_LENT;
+			lentObjectsOut.push_back(object);
+		}
+
+		switch (object->getObjectType()) {
+			case ObjectType::List:
+			case ObjectType::Code:
+			case ObjectType::Closure:
+			case ObjectType::Box:
+				if (visitedObjects.insert(object).second)
+					pendingObjects.push_back(object);
+				break;
+			default:
+				break;
+		}
+	};
+
+	visit(value);
+	while (pendingObjects.size()) {
+		Object *curObject = pendingObjects.back();
+		pendingObjects.pop_back();
+
+		switch (curObject->getObjectType()) {
+			case ObjectType::List:
+				for (auto &i : ((ListObject *)curObject)->elements)
+					visit(i);
+				break;
+			case ObjectType::Code: {
+				auto code = (CodeObject *)curObject;
+				for (auto &i : code->instructions) {
+					if ((i.opcode != Opcode::LoadGlobal) ||
+						(i.operand >= context->globals.size()) ||
+						(!visitedSlots.insert(i.operand).second))
+						continue;
+
+					const Value &global = context->globals[i.operand];
+					globalsOut.push_back({ i.operand, global });
+					visit(global);
+				}
+				for (auto &i : code->constants)
+					visit(i);
+				break;
+			}
+			case ObjectType::Closure: {
+				auto closure = (ClosureObject *)curObject;
+				visit(Value(closure->code));
+				for (auto &i : closure->captures)
+					visit(i);
+				break;
+			}
+			case ObjectType::Box:
+				visit(((BoxObject *)curObject)->value);
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+MKLISP_API void mklisp::thawLentObjects(std::pmr::vector<Object *> &lentObjects) noexcept {
+	for (auto i : lentObjects)
+		i->objectFlags &= ~OBJECT_LENT;
+	lentObjects.clear();
+}
+
+static MKLISP_FORCEINLINE uint64_t _packChunkRange(size_t begin, size_t end) noexcept {
+	return (uint64_t)begin | ((uint64_t)end << 32);
+}
+
+ParallelPool::Loop::Loop(std::pmr::memory_resource *memoryResource, size_t nThreads)
+	: chunkRanges(nThreads, memoryResource) {
+}
+
+MKLISP_API ParallelPool::ParallelPool(Runtime *runtime, size_t nWorkers)
+	: _runtime(runtime),
+	  _workers(&runtime->globalHeapResource) {
+	for (size_t i = 0; i < nWorkers; ++i)
+		_workers.push_back(std::thread([this, i]() { _runWorker(i); }));
+}
+
+MKLISP_API ParallelPool::~ParallelPool() {
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_isStopping = true;
+	}
+	_loopStartedCond.notify_all();
+
+	for (auto &i : _workers)
+		i.join();
+}
+
+void ParallelPool::_runWorker(size_t index) {
+	Context context(_runtime);
+	size_t nSeenLoops = 0;
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	while (true) {
+		_loopStartedCond.wait(lock, [this, nSeenLoops]() { return _isStopping || (_nStartedLoops != nSeenLoops); });
+		if (_isStopping)
+			return;
+		nSeenLoops = _nStartedLoops;
+
+		// The loop may have been finished by the other threads already.
+		Loop *loop = _loop;
+		if (!loop)
+			continue;
+		++loop->nJoinedWorkers;
+		lock.unlock();
+
+		{
+			MutatorScope mutatorScope(_runtime);
+
+			if (context.globals.size() < _runtime->nGlobalSlots)
+				context.syncGlobals();
+			for (auto &i : *loop->globals)
+				context.storeGlobal(i.first, i.second);
+
+			_runChunks(loop, &context, index);
+
+			// The values of the loop are not kept alive by the workers.
+			for (auto &i : *loop->globals)
+				context.storeGlobal(i.first, _runtime->sharedGlobals[i.first]);
+		}
+
+		lock.lock();
+		if (!--loop->nJoinedWorkers)
+			_loopDoneCond.notify_all();
+	}
+}
+
+void ParallelPool::_runChunks(Loop *loop, Context *context, size_t index) {
+	size_t chunk;
+
+	while (_takeChunk(loop, index, chunk)) {
+		if (chunk < loop->firstFailedChunk) {
+			size_t begin = chunk * loop->chunkSize;
+			InternalExceptionPointer e = loop->callback(loop->userData, context, begin, std::min(begin + loop->chunkSize, loop->size));
+
+			if (e) {
+				std::lock_guard<std::mutex> lock(loop->exceptionMutex);
+				if (chunk < loop->firstFailedChunk) {
+					loop->firstFailedChunk = chunk;
+					loop->exception = std::move(e);
+				} else
+					e.reset();
+			}
+		}
+
+		if (!--loop->nUnfinishedChunks) {
+			std::lock_guard<std::mutex> lock(_mutex);
+			_loopDoneCond.notify_all();
+		}
+	}
+}
+
+// Takes the first chunk left to the thread, or steals the back half of the
+// chunks left to another one.
+bool ParallelPool::_takeChunk(Loop *loop, size_t index, size_t &chunkOut) {
+	auto &chunkRanges = loop->chunkRanges;
+	std::atomic_uint64_t &ownRange = chunkRanges[index].packedRange;
+
+	for (uint64_t range = ownRange.load(); (uint32_t)range < (uint32_t)(range >> 32);) {
+		if (ownRange.compare_exchange_weak(range, range + 1)) {
+			chunkOut = (uint32_t)range;
+			return true;
+		}
+	}
+
+	for (size_t i = 1; i < chunkRanges.size(); ++i) {
+		std::atomic_uint64_t &victimRange = chunkRanges[(index + i) % chunkRanges.size()].packedRange;
+
+		for (uint64_t range = victimRange.load(); (uint32_t)range < (uint32_t)(range >> 32);) {
+			uint32_t begin = (uint32_t)range, end = (uint32_t)(range >> 32);
+			uint32_t middle = begin + (end - begin) / 2;
+
+			if (victimRange.compare_exchange_weak(range, _packChunkRange(begin, middle))) {
+				// Other threads never change empty ranges.
+				ownRange = _packChunkRange(middle + 1, end);
+				chunkOut = middle;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+MKLISP_API InternalExceptionPointer ParallelPool::run(Context *context, const ParallelInputs &inputs, size_t size, size_t chunkSize, ParallelChunkCallback callback, void *userData) {
+	if (!size)
+		return {};
+	size_t nChunks = (size + chunkSize - 1) / chunkSize;
+	assert(("Too many chunks", nChunks <= UINT32_MAX));
+
+	if ((nChunks < 2) || _workers.empty() || _isLoopRunning.exchange(true)) {
+		for (size_t begin = 0; begin < size; begin += chunkSize)
+			MKLISP_RETURN_IF_EXCEPT(callback(userData, context, begin, std::min(begin + chunkSize, size)));
+		return {};
+	}
+
+	ParallelGlobals globals(&_runtime->globalHeapResource);
+	std::pmr::vector<Object *> lentObjects(&_runtime->globalHeapResource);
+	for (size_t i = 0; i < inputs.nValues; ++i)
+		freezeForWorkers(context, inputs.values[i], globals, lentObjects);
+
+	// Lent objects cannot be changed, so holding the values the walks
+	// started from keeps all of them alive, even if the chunks rebind the
+	// globals.
+	HostRefHolder refHolder(&_runtime->globalHeapResource);
+	for (size_t i = 0; i < inputs.nValues; ++i) {
+		if ((inputs.values[i].valueType == ValueType::Object) || (inputs.values[i].valueType == ValueType::QuotedObject))
+			refHolder.addObject(inputs.values[i].exData.asObject);
+	}
+	for (auto &i : globals) {
+		if ((i.second.valueType == ValueType::Object) || (i.second.valueType == ValueType::QuotedObject))
+			refHolder.addObject(i.second.exData.asObject);
+	}
+
+	size_t nThreads = _workers.size() + 1;
+	Loop loop(&_runtime->globalHeapResource, nThreads);
+	loop.callback = callback;
+	loop.userData = userData;
+	loop.size = size;
+	loop.chunkSize = chunkSize;
+	loop.globals = &globals;
+	loop.nUnfinishedChunks = nChunks;
+	for (size_t i = 0; i < nThreads; ++i)
+		loop.chunkRanges[i].packedRange = _packChunkRange(nChunks * i / nThreads, nChunks * (i + 1) / nThreads);
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_loop = &loop;
+		++_nStartedLoops;
+	}
+	_loopStartedCond.notify_all();
+
+	_runChunks(&loop, context, nThreads - 1);
+
+	{
+		// The workers may stop the world meanwhile.
+		BlockingScope blockingScope(_runtime);
+		std::unique_lock<std::mutex> lock(_mutex);
+
+		_loopDoneCond.wait(lock, [&loop]() { return !loop.nUnfinishedChunks; });
+		_loop = nullptr;
+		_loopDoneCond.wait(lock, [&loop]() { return !loop.nJoinedWorkers; });
+	}
+	thawLentObjects(lentObjects);
+	_isLoopRunning = false;
+
+	return std::move(loop.exception);
+}
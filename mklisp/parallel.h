@@ -0,0 +1,132 @@
+#ifndef _MKLISP_PARALLEL_H_
+#define _MKLISP_PARALLEL_H_
+
+#include "runtime.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+namespace mklisp {
+	// Inputs of the parallel builtins shorter than this are processed by the
+	// calling thread alone, and nothing is frozen for them.
+	//
+	// Longer inputs are frozen while the workers share them, see
+	// `ParallelPool::run`, and thawed once the loop has returned, so calls
+	// which change them fail during the loop only.
+	constexpr static size_t PARALLEL_MIN_SIZE = 2048;
+	// Inputs are split into chunks of at least `PARALLEL_MIN_CHUNK_SIZE`
+	// elements and into at most `PARALLEL_MAX_CHUNKS` chunks. The chunks only
+	// depend on the size of the input, not on the number of threads, so the
+	// results do not either.
+	constexpr static size_t PARALLEL_MIN_CHUNK_SIZE = 256;
+	constexpr static size_t PARALLEL_MAX_CHUNKS = 1024;
+
+	// Globals of the calling context bound by the workers while they run the
+	// chunks of a loop, see `freezeForWorkers`.
+	using ParallelGlobals = std::pmr::vector<std::pair<uint32_t, Value>>;
+
+	// Values which the chunks of a loop use.
+	struct ParallelInputs {
+		const Value *values;
+		size_t nValues;
+	};
+
+	// Called for the elements from `begin` to `end` of a loop, on the context
+	// of the thread which has taken the chunk. Callbacks must not throw,
+	// results are passed through `userData`.
+	typedef InternalExceptionPointer (*ParallelChunkCallback)(void *userData, Context *context, size_t begin, size_t end);
+
+	// Freezes the value and the values of the globals of the context which it
+	// refers to, transitively, so that the workers may share them, and adds
+	// the globals to `globalsOut`. Objects which were not frozen yet are
+	// marked as lent and added to `lentObjectsOut`.
+	MKLISP_API void freezeForWorkers(Context *context, const Value &value, ParallelGlobals &globalsOut, std::pmr::vector<Object *> &lentObjectsOut);
+	// Thaws the objects frozen by `freezeForWorkers` and clears the vector.
+	// Objects frozen by `Runtime::freeze` meanwhile stay frozen.
+	MKLISP_API void thawLentObjects(std::pmr::vector<Object *> &lentObjects) noexcept;
+
+	// Returns the size of the chunks the parallel builtins split an input of
+	// `size` elements into, which is `size` for short inputs.
+	MKLISP_FORCEINLINE size_t getParallelChunkSize(size_t size) noexcept {
+		if (size < PARALLEL_MIN_SIZE)
+			return size;
+		return std::max(PARALLEL_MIN_CHUNK_SIZE, (size + PARALLEL_MAX_CHUNKS - 1) / PARALLEL_MAX_CHUNKS);
+	}
+
+	// Runs loops over the chunks of inputs on a pool of threads of a runtime,
+	// each of which evaluates on a context of its own, with the calling thread
+	// taking part. See `Runtime::getParallelPool`.
+	//
+	// Each thread starts with an even share of the chunks and takes them from
+	// the front. Threads which have run out of chunks steal the back half of
+	// the chunks left to another thread, so threads which are slowed down by
+	// costly elements or by collections give their chunks away.
+	//
+	// One loop runs at a time, loops started meanwhile, including loops
+	// started by the chunks of a loop, run on the calling thread alone.
+	class ParallelPool {
+	private:
+		// Chunks left to a thread, packed as `begin | end << 32`.
+		struct alignas(64) ChunkRange {
+			std::atomic_uint64_t packedRange;
+		};
+
+		struct Loop {
+			ParallelChunkCallback callback;
+			void *userData;
+			size_t size;
+			size_t chunkSize;
+			const ParallelGlobals *globals;
+			// One for each worker and the last one for the calling thread.
+			std::pmr::vector<ChunkRange> chunkRanges;
+			std::atomic_size_t nUnfinishedChunks;
+			// Chunks after the first failed one are skipped, the exception
+			// of the first one is kept.
+			std::atomic_size_t firstFailedChunk = SIZE_MAX;
+			std::mutex exceptionMutex;
+			InternalExceptionPointer exception;
+			// Guarded by `ParallelPool::_mutex`.
+			size_t nJoinedWorkers = 0;
+
+			Loop(std::pmr::memory_resource *memoryResource, size_t nThreads);
+		};
+
+		Runtime *_runtime;
+		std::mutex _mutex;
+		std::condition_variable _loopStartedCond;
+		std::condition_variable _loopDoneCond;
+		// Set while a loop runs on the workers.
+		std::atomic_bool _isLoopRunning = false;
+		Loop *_loop = nullptr;
+		size_t _nStartedLoops = 0;
+		bool _isStopping = false;
+		std::pmr::vector<std::thread> _workers;
+
+		void _runWorker(size_t index);
+		void _runChunks(Loop *loop, Context *context, size_t index);
+		bool _takeChunk(Loop *loop, size_t index, size_t &chunkOut);
+
+	public:
+		MKLISP_API ParallelPool(Runtime *runtime, size_t nWorkers);
+		ParallelPool(const ParallelPool &) = delete;
+		MKLISP_API ~ParallelPool();
+
+		MKLISP_FORCEINLINE size_t getWorkerCount() const noexcept {
+			return _workers.size();
+		}
+
+		// Calls the callback for each chunk of `chunkSize` elements of the
+		// input of `size` elements, the calling thread runs them on the
+		// context, the workers bind the globals of the inputs on their own
+		// contexts first. Returns once all chunks have returned, with the
+		// exception of the first chunk which has failed, if any.
+		//
+		// Chunks run on the calling thread alone if there is only one, if
+		// there are no workers or if another loop is running, the inputs are
+		// not frozen then. Otherwise the inputs are frozen for the workers
+		// and thawed before returning.
+		MKLISP_API InternalExceptionPointer run(Context *context, const ParallelInputs &inputs, size_t size, size_t chunkSize, ParallelChunkCallback callback, void *userData);
+	};
+}
+
+#endif
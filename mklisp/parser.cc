@@ -1,5 +1,6 @@
 #include "parser.h"
 #include "runtime.h"
+#include <cstring>
 
 using namespace mklisp;
 
@@ -160,6 +161,7 @@ InternalExceptionPointer Parser::parseExpr(Lexer *lexer, Value &valueOut, HostRe
 }
 
 InternalExceptionPointer Parser::parse(Lexer *lexer, HostObjectRef<ListObject> &listOut, HostRefHolder &hostRefHolder) {
+	MutatorScope mutatorScope(associatedRuntime);
 	Token *beginningToken;
 	Value v;
 
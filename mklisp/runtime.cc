@@ -1,208 +1,823 @@
 #include "runtime.h"
+#include "image.h"
+#include "compiler.h"
+#include "parallel.h"
+#include <exception>
+#include <vector>
+#include <algorithm>
+#include <new>
 
 using namespace mklisp;
 
-MKLISP_API CountablePoolResource::CountablePoolResource(std::pmr::memory_resource *upstream) : upstream(upstream) {}
+MKLISP_API Context::Context(Runtime *runtime)
+	: runtime(runtime),
+	  frameStack(&runtime->globalHeapResource),
+	  globals(&runtime->globalHeapResource),
+	  globalSlots(&runtime->globalHeapResource),
+	  valueStack(&runtime->globalHeapResource),
+	  compiledLists(&runtime->globalHeapResource),
+	  baseBindings(runtime->baseImage ? &runtime->baseImage->bindings : nullptr) {
+	HeapLimitExemptScope exemptScope;
+	// Collections must not see the contexts change.
+	MutatorScope mutatorScope(runtime);
+	auto heapLock = runtime->lockHeap();
+	runtime->contexts.insert(this);
+}
+
+MKLISP_API Context::~Context() {
+	MutatorScope mutatorScope(runtime);
+	compiledLists.clear();
+	auto heapLock = runtime->lockHeap();
+	runtime->contexts.erase(this);
+	runtime->nCallSiteCacheHits += nCallSiteCacheHits;
+	runtime->nCallSiteCacheMisses += nCallSiteCacheMisses;
+}
 
-MKLISP_API void *CountablePoolResource::do_allocate(size_t bytes, size_t alignment) {
-	void *p = upstream->allocate(bytes, alignment);
+MKLISP_API uint32_t Context::resolveGlobal(const std::pmr::string &name) {
+	if (auto it = globalSlots.find(name); it != globalSlots.end())
+		return it->second;
 
-	szAllocated += bytes;
+	uint32_t slot = runtime->resolveGlobalSlot(name);
+	if (slot >= globals.size())
+		syncGlobals();
+	globalSlots.emplace(name, slot);
 
-	return p;
+	return slot;
+}
+
+MKLISP_API void Context::syncGlobals() {
+	std::shared_lock<std::shared_mutex> globalSlotsLock(runtime->globalSlotsMutex);
+	size_t nSlots = runtime->globalSlotNames.size();
+
+	globals.reserve(nSlots);
+	for (size_t i = globals.size(); i < nSlots; ++i) {
+		Value value = runtime->sharedGlobals[i];
+		if ((value.valueType == ValueType::Undefined) && baseBindings) {
+			if (auto it = baseBindings->find(*runtime->globalSlotNames[i]); it != baseBindings->end())
+				value = it->second;
+		}
+		globals.push_back(value);
+	}
 }
 
-MKLISP_API void CountablePoolResource::do_deallocate(void *p, size_t bytes, size_t alignment) {
-	upstream->deallocate(p, bytes, alignment);
+MKLISP_API Value Context::_getUnresolvedBinding(const std::pmr::string &name) const {
+	{
+		std::shared_lock<std::shared_mutex> globalSlotsLock(runtime->globalSlotsMutex);
+		if (auto it = runtime->globalSlots.find(name); it != runtime->globalSlots.end()) {
+			if (it->second < globals.size())
+				return globals[it->second];
+			if (const Value &value = runtime->sharedGlobals[it->second]; value.valueType != ValueType::Undefined)
+				return value;
+		}
+	}
 
-	szAllocated -= bytes;
+	if (baseBindings) {
+		if (auto it = baseBindings->find(name); it != baseBindings->end())
+			return it->second;
+	}
+	return Value();
 }
 
-MKLISP_API bool CountablePoolResource::do_is_equal(const std::pmr::memory_resource &other) const noexcept {
-	return this == &other;
+MKLISP_API void Context::setBinding(const std::pmr::string &name, const Value &value) {
+	storeGlobal(resolveGlobal(name), value);
 }
 
-MKLISP_API EvalStateExData::EvalStateExData() {
+MKLISP_API void Context::removeBinding(const std::pmr::string &name) {
+	uint32_t slot;
+	if (auto it = globalSlots.find(name); it != globalSlots.end())
+		slot = it->second;
+	else {
+		std::shared_lock<std::shared_mutex> globalSlotsLock(runtime->globalSlotsMutex);
+		auto runtimeIt = runtime->globalSlots.find(name);
+		if (runtimeIt == runtime->globalSlots.end())
+			return;
+		slot = runtimeIt->second;
+	}
+
+	if (slot < globals.size())
+		storeGlobal(slot, Value());
 }
 
-MKLISP_API Context::Context(Runtime *runtime) : runtime(runtime), frameList(&runtime->globalHeapResource), bindings(&runtime->globalHeapResource) {
+MKLISP_API const std::pmr::string *Context::getGlobalName(uint32_t slot) const noexcept {
+	std::shared_lock<std::shared_mutex> globalSlotsLock(runtime->globalSlotsMutex);
+
+	if (slot < runtime->globalSlotNames.size())
+		return runtime->globalSlotNames[slot];
+	return nullptr;
 }
 
-MKLISP_API Runtime::Runtime(std::pmr::memory_resource *upstream)
+MKLISP_API Runtime::Runtime(std::pmr::memory_resource *upstream, RuntimeImage *baseImage)
 	: globalHeapResource(upstream),
-	  createdObjects(&globalHeapResource) {
+	  nurseryResource(&globalHeapResource),
+	  createdObjects(&globalHeapResource),
+	  youngObjectsBegin(createdObjects.end()),
+	  rememberedObjects(&globalHeapResource),
+	  contexts(&globalHeapResource),
+	  finalizers(&globalHeapResource),
+	  pendingFinalizers(&globalHeapResource),
+	  baseImage(baseImage),
+	  symbolIds(&globalHeapResource),
+	  globalSlots(&globalHeapResource),
+	  globalSlotNames(&globalHeapResource),
+	  sharedGlobals(&globalHeapResource),
+	  nParallelWorkers(std::max(std::thread::hardware_concurrency(), 1u) - 1),
+	  outOfMemoryError(&globalHeapResource),
+	  _gcPendingObjects(&globalHeapResource) {
+	if (baseImage) {
+		assert(("The base image must be sealed", baseImage->isSealed));
+		++baseImage->nChildRuntimes;
+
+		// Code of the image refers to globals by the slots of the base
+		// runtime, which are kept in the same order.
+		Runtime &baseRuntime = baseImage->baseRuntime;
+		size_t nBaseSlots = baseRuntime.globalSlotNames.size();
+
+		globalSlots.reserve(nBaseSlots);
+		globalSlotNames.reserve(nBaseSlots);
+		sharedGlobals.resize(nBaseSlots);
+		for (auto i : baseRuntime.globalSlotNames) {
+			auto it = globalSlots.emplace(*i, (uint32_t)globalSlotNames.size()).first;
+			globalSlotNames.push_back(&it->first);
+		}
+		nGlobalSlots = nBaseSlots;
+	} else {
+		for (size_t i = 0; i < NUM_SPECIAL_FORMS; ++i)
+			internSymbol(getSpecialFormName((SpecialForm)i));
+	}
 }
 
 MKLISP_API Runtime::~Runtime() {
+	// The workers destroy their contexts.
+	delete _parallelPool;
+
+	_releaseThreadCaches();
+
+	if (baseImage)
+		--baseImage->nChildRuntimes;
+
+	// Host weak references may outlive the runtime.
+	for (WeakReference *i = weakReferences, *next; i; i = next) {
+		next = i->next;
+		i->target = nullptr;
+		i->runtime = nullptr;
+		i->prev = nullptr;
+		i->next = nullptr;
+	}
+	weakReferences = nullptr;
+
+	for (auto i : createdObjects)
+		i->dealloc();
+	createdObjects.clear();
+}
+
+MKLISP_API uint32_t Runtime::internSymbol(const std::pmr::string &name) {
+	// The table of the base image is no longer modified once it is sealed.
+	size_t nBaseSymbols = 0;
+	if (baseImage) {
+		auto &baseSymbolIds = baseImage->baseRuntime.symbolIds;
+		if (auto it = baseSymbolIds.find(name); it != baseSymbolIds.end())
+			return it->second;
+		nBaseSymbols = baseSymbolIds.size();
+	}
+
+	auto heapLock = lockHeap();
+
+	if (auto it = symbolIds.find(name); it != symbolIds.end())
+		return it->second;
+
+	uint32_t id = (uint32_t)(nBaseSymbols + symbolIds.size());
+	symbolIds.emplace(name, id);
+
+	return id;
+}
+
+MKLISP_API uint32_t Runtime::resolveGlobalSlot(const std::pmr::string &name) {
+	{
+		std::shared_lock<std::shared_mutex> globalSlotsLock(globalSlotsMutex);
+		if (auto it = globalSlots.find(name); it != globalSlots.end())
+			return it->second;
+	}
+
+	std::unique_lock<std::shared_mutex> globalSlotsLock(globalSlotsMutex);
+	if (auto it = globalSlots.find(name); it != globalSlots.end())
+		return it->second;
+
+	uint32_t slot = (uint32_t)globalSlotNames.size();
+	globalSlotNames.reserve(slot + 1);
+	sharedGlobals.reserve(slot + 1);
+	auto it = globalSlots.emplace(name, slot).first;
+	globalSlotNames.push_back(&it->first);
+	sharedGlobals.push_back(Value());
+	nGlobalSlots = slot + 1;
+
+	return slot;
+}
+
+MKLISP_API void Runtime::setSharedBinding(const std::pmr::string &name, const Value &value) {
+	switch (value.valueType) {
+		case ValueType::Object:
+		case ValueType::QuotedObject:
+			freeze(value.exData.asObject);
+			break;
+		default:
+			break;
+	}
+
+	uint32_t slot = resolveGlobalSlot(name);
+
+	StopTheWorldScope stopTheWorldScope(this);
+	{
+		std::unique_lock<std::shared_mutex> globalSlotsLock(globalSlotsMutex);
+		sharedGlobals[slot] = value;
+	}
+
+	for (auto i : contexts) {
+		if (slot >= i->globals.size())
+			i->syncGlobals();
+		i->storeGlobal(slot, value);
+	}
+}
+
+MKLISP_API void Runtime::removeSharedBinding(const std::pmr::string &name) {
+	uint32_t slot = resolveGlobalSlot(name);
+
+	StopTheWorldScope stopTheWorldScope(this);
+	{
+		std::unique_lock<std::shared_mutex> globalSlotsLock(globalSlotsMutex);
+		sharedGlobals[slot] = Value();
+	}
+
+	for (auto i : contexts) {
+		if (slot < i->globals.size())
+			i->storeGlobal(slot, Value());
+	}
+}
+
+MKLISP_API ParallelPool *Runtime::getParallelPool() {
+	std::call_once(_parallelPoolOnceFlag, [this]() { _parallelPool = new ParallelPool(this, nParallelWorkers); });
+	return _parallelPool;
 }
 
-MKLISP_API Value Runtime::evalList(Context *context) {
+MKLISP_API void Runtime::freeze(Object *object) {
+	std::pmr::vector<Object *> pendingObjects(&globalHeapResource);
+
+	pendingObjects.push_back(object);
+
+	while (pendingObjects.size()) {
+		Object *curObject = pendingObjects.back();
+		pendingObjects.pop_back();
+
+		if (curObject->objectFlags & OBJECT_FROZEN)
+			continue;
+		curObject->objectFlags |= OBJECT_FROZEN;
+
+		switch (curObject->getObjectType()) {
+			case ObjectType::List:
+				for (auto &i : ((ListObject *)curObject)->elements) {
+					switch (i.valueType) {
+						case ValueType::Object:
+						case ValueType::QuotedObject:
+							pendingObjects.push_back(i.exData.asObject);
+							break;
+						default:
+							break;
+					}
+				}
+				break;
+			case ObjectType::Code:
+				// Cached callees may belong to this runtime only.
+				for (auto &i : ((CodeObject *)curObject)->callSiteCaches)
+					i = CallSiteCache();
+				for (auto &i : ((CodeObject *)curObject)->constants) {
+					switch (i.valueType) {
+						case ValueType::Object:
+						case ValueType::QuotedObject:
+							pendingObjects.push_back(i.exData.asObject);
+							break;
+						default:
+							break;
+					}
+				}
+				break;
+			case ObjectType::Closure: {
+				auto closure = (ClosureObject *)curObject;
+				pendingObjects.push_back(closure->code);
+				for (auto &i : closure->captures) {
+					switch (i.valueType) {
+						case ValueType::Object:
+						case ValueType::QuotedObject:
+							pendingObjects.push_back(i.exData.asObject);
+							break;
+						default:
+							break;
+					}
+				}
+				break;
+			}
+			case ObjectType::Box: {
+				auto &value = ((BoxObject *)curObject)->value;
+				switch (value.valueType) {
+					case ValueType::Object:
+					case ValueType::QuotedObject:
+						pendingObjects.push_back(value.exData.asObject);
+						break;
+					default:
+						break;
+				}
+				break;
+			}
+			default:
+				break;
+		}
+	}
+}
+
+void Runtime::_onHeapSoftLimitCrossed() {
+	_isOverHeapSoftLimit = !_isOverHeapSoftLimit;
+	if (!_isOverHeapSoftLimit)
+		return;
+
+	// Finalizers are run once the world has resumed.
+	if (heapSoftLimitCallback)
+		heapSoftLimitCallback(this, heapSoftLimitCallbackUserData);
+	else
+		collectGarbage();
+}
+
+InternalExceptionPointer Runtime::_pushFrame(Context *context, ListObject *list) {
+	auto &frameStack = context->frameStack;
+
+	if (frameStack.size() >= context->maxFrameDepth)
+		return StackOverflowError::alloc(&globalHeapResource, frameStack.size());
+	frameStack.push_back(Frame(list, context->valueStack.size()));
+
+	return {};
+}
+
+void Runtime::_unwindFrames(Context *context, size_t nFrames) noexcept {
+	auto &frameStack = context->frameStack;
+
+	if (frameStack.size() > nFrames) {
+		context->valueStack.resize(frameStack[nFrames].valueStackBase);
+		frameStack.resize(nFrames, Frame(nullptr, 0));
+	}
+}
+
+MKLISP_API InternalExceptionPointer Runtime::evalList(Context *context, Value &returnValueOut) {
+	size_t nInitialFrames = context->frameStack.size() - 1;
+	MutatorScope mutatorScope(this);
+	NestedEvalScope nestedEvalScope(context);
+	InternalExceptionPointer e;
+
+	try {
+		// Code compiled on other contexts may refer to any slot.
+		if (context->globals.size() < nGlobalSlots)
+			context->syncGlobals();
+		e = _evalList(context, nInitialFrames, returnValueOut);
+	} catch (std::bad_alloc &) {
+		_unwindFrames(context, nInitialFrames);
+		// Reclaim what the evaluation has allocated.
+		collectGarbage();
+		return &outOfMemoryError;
+	}
+
+	if (e)
+		_unwindFrames(context, nInitialFrames);
+	return e;
+}
+
+// Pops the frame which has returned, returns true if it was the initial frame
+// of the evaluation.
+static bool _returnFromFrame(Context *context, size_t nInitialFrames, Value &returnValueOut) {
+	auto &frameStack = context->frameStack;
+
+	Frame &calledFrame = frameStack.back();
+	Value returnValue = calledFrame.returnValue;
+	context->valueStack.resize(calledFrame.valueStackBase);
+	frameStack.pop_back();
+
+	if (frameStack.size() > nInitialFrames) {
+		frameStack.back().returnValue = returnValue;
+		return false;
+	}
+	returnValueOut = returnValue;
+	return true;
+}
+
+static InternalExceptionPointer _lookupVariable(Context *context, SymbolObject *symbol, Value &valueOut) {
+	valueOut = context->getBinding(symbol->name);
+	if (valueOut.valueType == ValueType::Undefined)
+		return UnboundVariableError::alloc(&context->runtime->globalHeapResource, symbol->name);
+	return {};
+}
+
+// Returns the code compiled for the list, which is compiled once until
+// globals are rebound.
+static InternalExceptionPointer _getListCode(Context *context, ListObject *list, CodeObject *&codeOut) {
+	size_t bindingVersion = context->runtime->bindingVersion;
+	auto &compiledLists = context->compiledLists;
+
+	if (auto it = compiledLists.find(list); it != compiledLists.end()) {
+		// Lists which have been collected may have left entries to new ones
+		// at the same address.
+		if ((it->second.list.get() == list) && (it->second.bindingVersion == bindingVersion)) {
+			codeOut = it->second.code.get();
+			return {};
+		}
+		compiledLists.erase(it);
+	}
+
+	HostObjectRef<CodeObject> code;
+	Compiler compiler(context);
+	MKLISP_RETURN_IF_EXCEPT(compiler.compile(Value(list), code));
+
+	if (compiledLists.size() >= context->compiledListsPruneSize) {
+		for (auto it = compiledLists.begin(); it != compiledLists.end();) {
+			if (it->second.list)
+				++it;
+			else
+				it = compiledLists.erase(it);
+		}
+		context->compiledListsPruneSize = std::max(compiledLists.size() * 2, (size_t)64);
+	}
+
+	auto &entry = compiledLists[list];
+	entry.list = list;
+	entry.code = code;
+	entry.bindingVersion = bindingVersion;
+	codeOut = code.get();
+	return {};
+}
+
+// Only calls to globals are evaluated by walking the forms, everything else,
+// including the special forms, is compiled once and executed in place.
+InternalExceptionPointer Runtime::_evalList(Context *context, size_t nInitialFrames, Value &returnValueOut) {
+	auto &frameStack = context->frameStack;
+	auto &valueStack = context->valueStack;
+
 	while (true) {
-		Frame &curFrame = context->frameList.back();
+		checkGarbageCollection();
+		if (consumeFuel(context)) {
+			context->isSuspended = true;
+			return {};
+		}
+
+		Frame &curFrame = frameStack.back();
 		switch (curFrame.evalState) {
 			case EvalState::Initial: {
-				Value callTarget = curFrame.curEvalList->elements[0];
-
-				switch (callTarget.valueType) {
-					case ValueType::Object: {
-						Object *object = callTarget.exData.asObject;
-						switch (object->getObjectType()) {
-							case ObjectType::Symbol: {
-								SymbolObject *symbolObject = (SymbolObject *)object;
-
-								if (symbolObject->name == "if") {
-								} else {
-									// Evaluate all arguments first.
-									curFrame.evalStateExData.asEvalArgs.index = 1;
-									curFrame.evalStateExData.asEvalArgs.callTarget = context->bindings.at(symbolObject->name);
-									curFrame.evalState = EvalState::EvalArgs;
-									continue;
-								}
-								break;
-							}
-							default:
-								terminate();
-						}
-						break;
-					}
-					default:
-						// Target is uncallable.
-						terminate();
+				auto &elements = curFrame.curEvalList->elements;
+				SymbolObject *head = nullptr;
+
+				if (elements.size() &&
+					(elements[0].valueType == ValueType::Object) &&
+					(elements[0].exData.asObject->getObjectType() == ObjectType::Symbol))
+					head = (SymbolObject *)elements[0].exData.asObject;
+
+				if ((!head) || head->isSpecialForm()) {
+					CodeObject *code;
+					MKLISP_RETURN_IF_EXCEPT(_getListCode(context, curFrame.curEvalList, code));
+
+					Value returnValue;
+					MKLISP_RETURN_IF_EXCEPT(_callCode(context, code, nullptr, valueStack.size(), returnValue));
+					// The frame of the code keeps it alive while it runs, even if
+					// it is dropped from the cache meanwhile.
+					if (context->isSuspended)
+						return {};
+
+					frameStack.back().returnValue = returnValue;
+					if (_returnFromFrame(context, nInitialFrames, returnValueOut))
+						return {};
+					continue;
 				}
+
+				Value callTarget;
+				MKLISP_RETURN_IF_EXCEPT(_lookupVariable(context, head, callTarget));
+				if (callTarget.valueType != ValueType::Object)
+					return UncallableTargetError::alloc(&globalHeapResource, callTarget);
+
+				// Evaluate all arguments first.
+				curFrame.callTarget = callTarget.exData.asObject;
+				curFrame.argIndex = 1;
+				curFrame.evalState = EvalState::EvalArgs;
 				break;
 			}
 			case EvalState::EvalArgs: {
-				size_t &curIndex = curFrame.evalStateExData.asEvalArgs.index;
-				if (curIndex < curFrame.curEvalList->elements.size()) {
-					Value &curElement = curFrame.curEvalList->elements[curIndex];
+				if (curFrame.argIndex < curFrame.curEvalList->elements.size()) {
+					const Value &curElement = curFrame.curEvalList->elements[curFrame.argIndex];
 
 					switch (curElement.valueType) {
-						case ValueType::Nil:
-						case ValueType::Int:
-						case ValueType::UInt:
-						case ValueType::Long:
-						case ValueType::ULong:
-						case ValueType::Short:
-						case ValueType::UShort:
-						case ValueType::Byte:
-						case ValueType::UByte:
-						case ValueType::Char:
-							curFrame.curEvalList->elements[curIndex] = curElement;
-							++curIndex;
-							continue;
 						case ValueType::QuotedObject:
-							curElement.valueType = ValueType::Object;
-							curFrame.curEvalList->elements[curIndex] = curElement;
-							++curIndex;
+							valueStack.push_back(Value(curElement.exData.asObject));
+							++curFrame.argIndex;
 							continue;
 						case ValueType::Object: {
 							Object *object = curElement.exData.asObject;
 							switch (object->getObjectType()) {
-								case ObjectType::String:
-									curFrame.curEvalList->elements[curIndex] = curElement;
-									++curIndex;
+								case ObjectType::Symbol: {
+									Value value;
+									MKLISP_RETURN_IF_EXCEPT(_lookupVariable(context, (SymbolObject *)object, value));
+									valueStack.push_back(value);
+									++curFrame.argIndex;
 									continue;
-								case ObjectType::Symbol:
-									curFrame.curEvalList->elements[curIndex] = curElement;
-									++curIndex;
-									continue;
-								case ObjectType::List: {
+								}
+								case ObjectType::List:
 									curFrame.evalState = EvalState::ReceivingEvaluatedArg;
-									Frame newFrame;
-									newFrame.curEvalList = (ListObject *)object;
-									newFrame.evalState = EvalState::Initial;
-									context->frameList.push_back(newFrame);
+									MKLISP_RETURN_IF_EXCEPT(_pushFrame(context, (ListObject *)object));
+									continue;
+								default:
+									valueStack.push_back(curElement);
+									++curFrame.argIndex;
 									continue;
-								}
 							}
 						}
+						default:
+							valueStack.push_back(curElement);
+							++curFrame.argIndex;
+							continue;
 					}
-				} else {
+				} else
 					curFrame.evalState = EvalState::Call;
-					curFrame.evalStateExData.asCall.callTarget = curFrame.evalStateExData.asEvalArgs.callTarget;
-				}
 				break;
 			}
 			case EvalState::ReceivingEvaluatedArg: {
-				size_t &curIndex = curFrame.evalStateExData.asEvalArgs.index;
-
-				ListObject *listObject = (ListObject*)curFrame.curEvalList;
-
-				listObject->elements[curIndex] = curFrame.returnValue;
-
-				++curIndex;
+				valueStack.push_back(curFrame.returnValue);
+				++curFrame.argIndex;
 
 				curFrame.evalState = EvalState::EvalArgs;
 				break;
 			}
 			case EvalState::Call: {
-				Value callTarget = curFrame.evalStateExData.asCall.callTarget;
-				switch (callTarget.valueType) {
-					case ValueType::Object: {
-						Object *object = callTarget.exData.asObject;
-						switch (object->getObjectType()) {
-							case ObjectType::NativeFn: {
-								((NativeFnObject *)object)->callback(context);
-								break;
-							}
-							default:
-								terminate();
+				Object *callTarget = curFrame.callTarget;
+				size_t argBase = curFrame.valueStackBase;
+
+				switch (callTarget->getObjectType()) {
+					case ObjectType::NativeFn: {
+						ValueSpan args(valueStack.data() + argBase, valueStack.size() - argBase);
+						((NativeFnObject *)callTarget)->callback(context, args);
+						if (context->nativeException)
+							return std::move(context->nativeException);
+						// The frame returns once the call has been completed.
+						if (context->callSuspension == CallSuspension::Awaiting) {
+							context->isSuspended = true;
+							return {};
 						}
 						break;
 					}
+					case ObjectType::Code: {
+						Value returnValue;
+						MKLISP_RETURN_IF_EXCEPT(_callCode(context, (CodeObject *)callTarget, nullptr, argBase, returnValue));
+						if (context->isSuspended)
+							return {};
+						frameStack.back().returnValue = returnValue;
+						break;
+					}
+					case ObjectType::Closure: {
+						ClosureObject *closure = (ClosureObject *)callTarget;
+						Value returnValue;
+						MKLISP_RETURN_IF_EXCEPT(_callCode(context, closure->code, closure, argBase, returnValue));
+						if (context->isSuspended)
+							return {};
+						frameStack.back().returnValue = returnValue;
+						break;
+					}
 					default:
-						terminate();
+						return UncallableTargetError::alloc(&globalHeapResource, Value(callTarget));
 				}
 
-				Value returnValue = curFrame.returnValue;
-				context->frameList.pop_back();
-				if (context->frameList.size()) {
-					context->frameList.back().returnValue = returnValue;
-				} else {
-					return returnValue;
-				}
+				// The frame may have been moved by the callback.
+				if (_returnFromFrame(context, nInitialFrames, returnValueOut))
+					return {};
 			}
 		}
 	}
 }
 
-MKLISP_API Value Runtime::eval(Value value, Context *context) {
-	Value returnValue;
+MKLISP_API InternalExceptionPointer Runtime::eval(Value value, Context *context, Value &returnValueOut) {
+	MutatorScope mutatorScope(this);
 
 	switch (value.valueType) {
-		case ValueType::Nil:
-		case ValueType::Int:
-		case ValueType::UInt:
-		case ValueType::Long:
-		case ValueType::ULong:
-		case ValueType::Short:
-		case ValueType::UShort:
-		case ValueType::Byte:
-		case ValueType::UByte:
-		case ValueType::Char:
 		case ValueType::QuotedObject:
-			returnValue = value;
+			returnValueOut = Value(value.exData.asObject);
 			break;
 		case ValueType::Object: {
 			Object *object = value.exData.asObject;
 			switch (object->getObjectType()) {
-				case ObjectType::String:
-					returnValue = value;
-					break;
 				case ObjectType::Symbol:
-					returnValue = value;
-					break;
+					return _lookupVariable(context, (SymbolObject *)object, returnValueOut);
 				case ObjectType::List: {
-					Frame newFrame;
-					newFrame.curEvalList = (ListObject *)object;
-					newFrame.evalState = EvalState::Initial;
-
-					context->frameList.push_back(newFrame);
-					returnValue = evalList(context);
+					try {
+						MKLISP_RETURN_IF_EXCEPT(_pushFrame(context, (ListObject *)object));
+					} catch (std::bad_alloc &) {
+						collectGarbage();
+						return &outOfMemoryError;
+					}
+					return evalList(context, returnValueOut);
 				}
+				default:
+					returnValueOut = value;
+					break;
 			}
+			break;
 		}
+		default:
+			returnValueOut = value;
+			break;
 	}
 
-	return returnValue;
+	return {};
+}
+
+MKLISP_API InternalExceptionPointer Runtime::call(Value fn, const Value *args, size_t nArgs, Context *context, Value &returnValueOut) {
+	auto &valueStack = context->valueStack;
+	size_t nInitialFrames = context->frameStack.size();
+	size_t argBase = valueStack.size();
+	MutatorScope mutatorScope(this);
+	NestedEvalScope nestedEvalScope(context);
+
+	if (fn.valueType != ValueType::Object)
+		return UncallableTargetError::alloc(&globalHeapResource, fn);
+	Object *object = fn.exData.asObject;
+
+	InternalExceptionPointer e;
+	try {
+		if (context->globals.size() < nGlobalSlots)
+			context->syncGlobals();
+
+		switch (object->getObjectType()) {
+			case ObjectType::NativeFn:
+				// Called like the evaluator calls natives, on a frame of its own.
+				if ((e = _pushFrame(context, nullptr)))
+					break;
+				valueStack.insert(valueStack.end(), args, args + nArgs);
+				((NativeFnObject *)object)->callback(context, ValueSpan(valueStack.data() + argBase, nArgs));
+				if (context->nativeException)
+					e = std::move(context->nativeException);
+				else
+					returnValueOut = context->frameStack.back().returnValue;
+				break;
+			case ObjectType::Code:
+				valueStack.insert(valueStack.end(), args, args + nArgs);
+				e = _callCode(context, (CodeObject *)object, nullptr, argBase, returnValueOut);
+				break;
+			case ObjectType::Closure:
+				valueStack.insert(valueStack.end(), args, args + nArgs);
+				e = _callCode(context, ((ClosureObject *)object)->code, (ClosureObject *)object, argBase, returnValueOut);
+				break;
+			default:
+				e = UncallableTargetError::alloc(&globalHeapResource, fn);
+				break;
+		}
+	} catch (std::bad_alloc &) {
+		e = &outOfMemoryError;
+	}
+
+	_unwindFrames(context, nInitialFrames);
+	valueStack.resize(argBase);
+	if (e.get() == &outOfMemoryError)
+		// Reclaim what the call has allocated.
+		collectGarbage();
+	return e;
+}
+
+bool Runtime::_checkSlice(Context *context) {
+	if (!context->isSliceOver) {
+		size_t nSteps = std::min(context->fuel, SLICE_CHECK_INTERVAL);
+		context->fuel -= nSteps;
+		if (nSteps && (std::chrono::steady_clock::now() < context->sliceDeadline)) {
+			context->nStepsToCheck = nSteps;
+			return false;
+		}
+		context->isSliceOver = true;
+	}
+
+	// Checked again at every step until the evaluation yields.
+	context->nStepsToCheck = context->isYieldable ? 1 : SLICE_CHECK_INTERVAL;
+	return context->isYieldable;
+}
+
+// Frames of code on the top of the frame stack have been suspended by the
+// interpreter, they are resumed by a single execution, down to the first one,
+// which has been called by the evaluator or is the initial frame.
+InternalExceptionPointer Runtime::_resumeEval(Context *context, size_t nInitialFrames, Value &returnValueOut) {
+	auto &frameStack = context->frameStack;
+
+	if (frameStack.back().code) {
+		// Code frames take the result of a completed call themselves.
+		size_t entryFrameIndex = frameStack.size() - 1;
+		while ((entryFrameIndex > nInitialFrames) && frameStack[entryFrameIndex - 1].code)
+			--entryFrameIndex;
+
+		Value returnValue;
+		MKLISP_RETURN_IF_EXCEPT(_execute(context, entryFrameIndex, returnValue));
+		if (context->isSuspended)
+			return {};
+
+		if (frameStack.size() == nInitialFrames) {
+			returnValueOut = returnValue;
+			return {};
+		}
+		frameStack.back().returnValue = returnValue;
+		if (_returnFromFrame(context, nInitialFrames, returnValueOut))
+			return {};
+	} else if (context->callSuspension == CallSuspension::Completed) {
+		context->callSuspension = CallSuspension::None;
+		if (_returnFromFrame(context, nInitialFrames, returnValueOut))
+			return {};
+	}
+
+	return _evalList(context, nInitialFrames, returnValueOut);
+}
+
+MKLISP_API InternalExceptionPointer Runtime::startEval(Value value, Context *context, size_t fuel, std::chrono::nanoseconds timeSlice, EvalStatus &statusOut, Value &returnValueOut) {
+	MutatorScope mutatorScope(this);
+	statusOut = EvalStatus::Done;
+
+	if ((value.valueType != ValueType::Object) ||
+		(value.exData.asObject->getObjectType() != ObjectType::List))
+		return eval(value, context, returnValueOut);
+
+	context->resumableFrameBase = context->frameStack.size();
+	try {
+		MKLISP_RETURN_IF_EXCEPT(_pushFrame(context, (ListObject *)value.exData.asObject));
+	} catch (std::bad_alloc &) {
+		collectGarbage();
+		return &outOfMemoryError;
+	}
+
+	return resumeEval(context, fuel, timeSlice, statusOut, returnValueOut);
+}
+
+MKLISP_API InternalExceptionPointer Runtime::resumeEval(Context *context, size_t fuel, std::chrono::nanoseconds timeSlice, EvalStatus &statusOut, Value &returnValueOut) {
+	size_t nInitialFrames = context->resumableFrameBase;
+	assert(("No evaluation to resume", context->frameStack.size() > nInitialFrames));
+	MutatorScope mutatorScope(this);
+
+	if (context->callSuspension == CallSuspension::Awaiting) {
+		statusOut = EvalStatus::Awaiting;
+		return {};
+	}
+
+	context->fuel = fuel;
+	context->sliceDeadline = timeSlice.count()
+								 ? std::chrono::steady_clock::now() + timeSlice
+								 : std::chrono::steady_clock::time_point::max();
+	context->isSliceOver = false;
+	context->isYieldable = true;
+	context->isSuspended = false;
+	context->nStepsToCheck = 1;
+
+	InternalExceptionPointer e;
+	try {
+		if (context->globals.size() < nGlobalSlots)
+			context->syncGlobals();
+		e = _resumeEval(context, nInitialFrames, returnValueOut);
+	} catch (std::bad_alloc &) {
+		e = &outOfMemoryError;
+	}
+
+	if (!context->isSuspended)
+		statusOut = EvalStatus::Done;
+	else if (context->callSuspension == CallSuspension::Awaiting)
+		statusOut = EvalStatus::Awaiting;
+	else
+		statusOut = EvalStatus::Yielded;
+	context->isYieldable = false;
+	context->isSuspended = false;
+	context->nStepsToCheck = SIZE_MAX;
+
+	if (e) {
+		context->callSuspension = CallSuspension::None;
+		_unwindFrames(context, nInitialFrames);
+		if (e.get() == &outOfMemoryError)
+			// Reclaim what the evaluation has allocated.
+			collectGarbage();
+	}
+	return e;
+}
+
+MKLISP_API void Runtime::abortEval(Context *context) noexcept {
+	MutatorScope mutatorScope(this);
+	context->callSuspension = CallSuspension::None;
+	_unwindFrames(context, context->resumableFrameBase);
+}
+
+MKLISP_API bool Runtime::suspendCall(Context *context) noexcept {
+	if (!context->isYieldable)
+		return false;
+
+	context->callSuspension = CallSuspension::Awaiting;
+	return true;
+}
+
+MKLISP_API void Runtime::completeCall(Context *context, const Value &result) noexcept {
+	assert(("No call is awaiting", context->callSuspension == CallSuspension::Awaiting));
+
+	context->frameStack.back().returnValue = result;
+	context->callSuspension = CallSuspension::Completed;
+}
+
+MKLISP_API void Runtime::failCall(Context *context, InternalExceptionPointer &&exception) noexcept {
+	assert(("The call has failed already", !context->nativeException));
+
+	context->nativeException = std::move(exception);
 }
@@ -3,72 +3,658 @@
 
 #include "basedefs.h"
 #include "object.h"
+#include "heap.h"
 #include <memory_resource>
 #include <list>
 #include <unordered_map>
 #include <stack>
+#include <set>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
 
 namespace mklisp {
-	class CountablePoolResource : public std::pmr::memory_resource {
-	public:
-		std::pmr::memory_resource *upstream;
-		size_t szAllocated = 0;
-
-		MKLISP_API CountablePoolResource(std::pmr::memory_resource *upstream);
-		MKLISP_API CountablePoolResource(const CountablePoolResource &) = delete;
-
-		MKLISP_API virtual void *do_allocate(size_t bytes, size_t alignment) override;
-		MKLISP_API virtual void do_deallocate(void *p, size_t bytes, size_t alignment) override;
-		MKLISP_API virtual bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
-	};
-
-	enum class EvalState {
+	enum class EvalState : uint8_t {
 		Initial = 0,
 		EvalArgs,
 		ReceivingEvaluatedArg,
 		Call
 	};
 
-	union EvalStateExData {
-		struct {
-			size_t index;
-			Value callTarget;
-		} asEvalArgs;
-		struct {
-			Value callTarget;
-		} asCall;
-
-		MKLISP_API EvalStateExData();
-	};
-
+	// Frames either evaluate a list with the tree-walking evaluator, or
+	// execute bytecode if `code` is set.
 	struct Frame {
 		ListObject *curEvalList;
-		EvalState evalState;
-		EvalStateExData evalStateExData;
+		// Resolved by the initial state.
+		Object *callTarget = nullptr;
+		CodeObject *code = nullptr;
+		// Closure being called, which holds the captured variables of `code`.
+		ClosureObject *closure = nullptr;
+		// Index of the next element of the list to be evaluated.
+		uint32_t argIndex = 0;
+		// Index of the next instruction to be executed.
+		uint32_t pc = 0;
+		// Evaluated arguments of the frame are pushed onto the value stack of
+		// the context from this index.
+		uint32_t valueStackBase;
+		EvalState evalState = EvalState::Initial;
 		Value returnValue = Value(ValueType::Nil);
+
+		MKLISP_FORCEINLINE Frame(ListObject *curEvalList, size_t valueStackBase)
+			: curEvalList(curEvalList), valueStackBase((uint32_t)valueStackBase) {
+		}
+	};
+
+	constexpr static size_t DEFAULT_MAX_FRAME_DEPTH = 10000;
+	// Steps of a resumable evaluation between checks of its slice.
+	constexpr static size_t SLICE_CHECK_INTERVAL = 1024;
+
+	enum class EvalStatus : uint8_t {
+		Done = 0,
+		// The slice is over, the evaluation is kept in the frames of the context
+		// until it is resumed.
+		Yielded,
+		// A native has suspended its call, see `Runtime::suspendCall`, the
+		// evaluation is resumed once the call has been completed.
+		Awaiting
+	};
+
+	// Called once a resumable evaluation run by a scheduler has returned or
+	// failed. The exception is released afterwards unless the callback has
+	// moved it out.
+	typedef void (*TaskCompletionCallback)(void *userData, Context *context, InternalExceptionPointer &exception, const Value &result);
+
+	enum class CallSuspension : uint8_t {
+		None = 0,
+		Awaiting,
+		// The result is the return value of the top frame until resumed.
+		Completed
 	};
 
 	class Runtime;
+	class RuntimeImage;
+	class ParallelPool;
+
+	using BindingMap = std::pmr::unordered_map<std::pmr::string, Value>;
+	// Maps names of globals to their slots in `Context::globals`.
+	using GlobalSlotMap = std::pmr::unordered_map<std::pmr::string, uint32_t>;
 
 	struct Context {
 		Runtime *runtime;
-		std::pmr::list<Frame> frameList;
-		std::pmr::unordered_map<std::pmr::string, Object *> bindings;
+		std::pmr::vector<Frame> frameStack;
+		// Global bindings, compiled code refers to them by their slots, which
+		// are the same for all contexts of the runtime, see
+		// `Runtime::resolveGlobalSlot`. Slots are never removed, unbound ones
+		// are undefined.
+		std::pmr::vector<Value> globals;
+		// Slots of the globals the context has resolved, which are always
+		// within `globals`.
+		GlobalSlotMap globalSlots;
+		std::pmr::vector<Value> valueStack;
+		// Evaluations which would push more frames fail with a
+		// `StackOverflowError`.
+		size_t maxFrameDepth = DEFAULT_MAX_FRAME_DEPTH;
+
+		// Slice of the resumable evaluation, see `Runtime::startEval`. Steps
+		// are counted down from `nStepsToCheck`, the fuel and the deadline are
+		// only checked once it has reached zero.
+		size_t nStepsToCheck = SIZE_MAX;
+		size_t fuel = 0;
+		std::chrono::steady_clock::time_point sliceDeadline;
+		// Frames from this index belong to the resumable evaluation.
+		size_t resumableFrameBase = 0;
+		bool isSliceOver = false;
+		// Cleared while natives evaluate on the context, the frames of natives
+		// cannot be suspended.
+		bool isYieldable = false;
+		bool isSuspended = false;
+		CallSuspension callSuspension = CallSuspension::None;
+		// Set by natives which fail their call, see `Runtime::failCall`.
+		InternalExceptionPointer nativeException;
+
+		// Code compiled for the lists the evaluator has run on the context,
+		// see `Runtime::_evalList`, which is compiled again once globals have
+		// been rebound. Lists must not be changed once evaluated. Entries of
+		// collected lists are dropped as the cache grows.
+		struct CompiledList {
+			HostWeakRef<ListObject> list;
+			HostObjectRef<CodeObject> code;
+			size_t bindingVersion = 0;
+		};
+		std::pmr::unordered_map<ListObject *, CompiledList> compiledLists;
+		size_t compiledListsPruneSize = 64;
+		// Bindings of the base image of the runtime, shadowed by the globals.
+		const BindingMap *baseBindings;
+
+		// Counted per context so that contexts running on different threads
+		// do not share them, see `collectHeapStats`.
+		size_t nCallSiteCacheHits = 0;
+		size_t nCallSiteCacheMisses = 0;
 
 		MKLISP_API Context(Runtime *runtime);
+		Context(const Context &) = delete;
+		MKLISP_API ~Context();
+
+		// Returns the slot of the global, which is created if it does not
+		// exist yet. New slots are bound to the shared binding of the runtime,
+		// or to the binding of the base image, if any.
+		MKLISP_API uint32_t resolveGlobal(const std::pmr::string &name);
+		// Grows the globals to all slots of the runtime, which code compiled
+		// on other contexts may refer to.
+		MKLISP_API void syncGlobals();
+		// Code which refers to the slot of the global sees the new binding.
+		MKLISP_API void setBinding(const std::pmr::string &name, const Value &value);
+		MKLISP_API void removeBinding(const std::pmr::string &name);
+		// Binds the global in the slot.
+		MKLISP_FORCEINLINE void storeGlobal(uint32_t slot, const Value &value) noexcept;
+		// Returns the name of the global in the slot, only used for reporting
+		// errors.
+		MKLISP_API const std::pmr::string *getGlobalName(uint32_t slot) const noexcept;
+
+		// Returns an undefined value if the name is not bound.
+		MKLISP_FORCEINLINE Value getBinding(const std::pmr::string &name) const {
+			if (auto it = globalSlots.find(name); it != globalSlots.end())
+				return globals[it->second];
+			return _getUnresolvedBinding(name);
+		}
+
+	private:
+		MKLISP_API Value _getUnresolvedBinding(const std::pmr::string &name) const;
+	};
+
+	constexpr static size_t DEFAULT_GC_THRESHOLD = 1 * 1024 * 1024;
+	constexpr static size_t DEFAULT_MINOR_GC_THRESHOLD = 256 * 1024;
+	constexpr static size_t DEFAULT_GC_SLICE_WORK_BUDGET = 4096;
+	constexpr static uint32_t DEFAULT_JIT_THRESHOLD = 1000;
+
+	enum class GCMode : uint8_t {
+		StopTheWorld = 0,
+		Incremental
+	};
+
+	enum class GCPhase : uint8_t {
+		Idle = 0,
+		Marking,
+		Sweeping
+	};
+
+	constexpr static size_t GC_PAUSE_HISTOGRAM_SIZE = 16;
+
+	struct GCPauseStats {
+		size_t nPauses = 0;
+		size_t nMajorCollections = 0;
+		size_t nMinorCollections = 0;
+		std::chrono::nanoseconds totalPauseTime = {};
+		std::chrono::nanoseconds maxPauseTime = {};
+		std::chrono::nanoseconds lastPauseTime = {};
+		// Bucket i counts pauses shorter than 2^i microseconds, the last bucket
+		// counts all longer pauses.
+		size_t pauseHistogram[GC_PAUSE_HISTOGRAM_SIZE] = {};
+	};
+
+	constexpr static size_t RUNTIME_THREAD_CACHE_SIZE = 256;
+
+	// Objects created by a thread, registered in batches.
+	struct RuntimeThreadCache : public ThreadCache {
+		Object *createdObjects[RUNTIME_THREAD_CACHE_SIZE];
+		size_t nCreatedObjects = 0;
+		// Depth of the `MutatorScope`s of the thread.
+		size_t nMutatorScopes = 0;
+
+		MKLISP_API virtual ~RuntimeThreadCache();
+	};
+
+	typedef void (*HeapSoftLimitCallback)(Runtime *runtime, void *userData);
+
+	// Called after the object has been collected, the object must not be
+	// accessed anymore.
+	typedef void (*FinalizerCallback)(Runtime *runtime, void *userData);
+
+	struct Finalizer {
+		Object *object;
+		FinalizerCallback callback;
+		void *userData;
 	};
 
-	class Runtime {
+	// Contexts of a runtime may evaluate on different threads at once, each
+	// context on one thread at a time.
+	//
+	// Memory is allocated by each thread from its own buffers and objects are
+	// registered in batches, the shared state is guarded by `heapMutex`.
+	// Threads using the runtime are its mutators while they are in a
+	// `MutatorScope`, which evaluations enter by themselves. Collections and
+	// other changes which need the runtime to themselves stop the world, see
+	// `stopTheWorld`: they wait until every other mutator has reached a
+	// safepoint, where it is parked until the world resumes. Safepoints are
+	// the calls of `checkGarbageCollection` made by the evaluators, so every
+	// evaluation which does not return reaches them, natives which block must
+	// do so in a `BlockingScope`.
+	//
+	// Objects are not synchronized otherwise, contexts running at once must
+	// not share objects which are not frozen. Values are shared by shared
+	// bindings instead, which are frozen and rebound in all contexts with the
+	// world stopped, see `setSharedBinding`, so reading globals costs the same
+	// as in a single thread.
+	class Runtime : public ThreadCacheOwner {
+	private:
+		MKLISP_FORCEINLINE bool _isCollectionDue() const noexcept {
+			return ((globalHeapResource.szAllocated > heapSoftLimit) != _isOverHeapSoftLimit) ||
+				   (gcPhase != GCPhase::Idle) ||
+				   (globalHeapResource.szAllocated > gcThreshold) ||
+				   (nurseryResource.szYoungAllocated > minorGcThreshold);
+		}
+
+		void _onSafepoint();
+		void _parkMutator(std::unique_lock<std::mutex> &lock);
+		void _waitForParkedMutators(std::unique_lock<std::mutex> &lock, bool isMutator);
+		void _registerCreatedObjects(RuntimeThreadCache *cache);
+		void _markValue(const Value &value);
+		void _markContextRoots();
+		void _markRememberedObjects();
+		size_t _traceObject(Object *object);
+		void _markPendingObjects();
+		void _rememberObject(Object *object);
+		void _shadeObject(Object *object);
+		void _beginMajorCollection();
+		bool _runMajorCollection(size_t workBudget, std::chrono::steady_clock::time_point deadline);
+		void _finishMajorCollection();
+		void _processWeakReferences();
+		void _recordGcPause(std::chrono::steady_clock::time_point beginTime);
+		void _onHeapSoftLimitCrossed();
+		InternalExceptionPointer _pushFrame(Context *context, ListObject *list);
+		InternalExceptionPointer _pushCodeFrame(Context *context, CodeObject *code, ClosureObject *closure, size_t valueStackBase);
+		void _unwindFrames(Context *context, size_t nFrames) noexcept;
+		InternalExceptionPointer _evalList(Context *context, size_t nInitialFrames, Value &returnValueOut);
+		InternalExceptionPointer _callCode(Context *context, CodeObject *code, ClosureObject *closure, size_t argBase, Value &returnValueOut);
+		InternalExceptionPointer _execute(Context *context, size_t entryFrameIndex, Value &returnValueOut);
+		bool _checkSlice(Context *context);
+		InternalExceptionPointer _resumeEval(Context *context, size_t nInitialFrames, Value &returnValueOut);
+
 	public:
 		CountablePoolResource globalHeapResource;
+		NurseryResource nurseryResource;
+		// Guards the object list, the remembered set, the contexts and the
+		// pending objects of incremental marking.
+		std::mutex heapMutex;
+
+		// Objects are appended on creation, so the young objects are always the
+		// tail of the list, starting from `youngObjectsBegin`.
 		std::pmr::list<Object *> createdObjects;
+		std::pmr::list<Object *>::iterator youngObjectsBegin;
+		// Old objects which may refer to young objects.
+		std::pmr::vector<Object *> rememberedObjects;
+
+		std::pmr::set<Context *> contexts;
+
+		// Registered weak references, linked through `WeakReference::next`.
+		WeakReference *weakReferences = nullptr;
+		// Finalizers of objects which have not been collected, and finalizers
+		// which are waiting for `runPendingFinalizers`.
+		std::pmr::vector<Finalizer> finalizers;
+		std::pmr::vector<Finalizer> pendingFinalizers;
+
+		// Image the runtime has been created from, its objects are frozen and
+		// never collected by this runtime.
+		RuntimeImage *const baseImage;
+		// Set once the runtime has been sealed as the base runtime of an
+		// image, its objects are never collected afterwards.
+		bool isImageBase = false;
+		// Interned names of the symbols created by the runtime, see
+		// `internSymbol`.
+		std::pmr::unordered_map<std::pmr::string, uint32_t> symbolIds;
+
+		// Slots of the globals of all contexts, their names and their shared
+		// bindings, which are undefined for names which are not shared.
+		// Guarded by `globalSlotsMutex`, shared bindings are only changed with
+		// the world stopped as well.
+		std::shared_mutex globalSlotsMutex;
+		GlobalSlotMap globalSlots;
+		std::pmr::vector<const std::pmr::string *> globalSlotNames;
+		std::pmr::vector<Value> sharedGlobals;
+		std::atomic_size_t nGlobalSlots = 0;
+
+		// Number of objects registered since the runtime was created.
+		size_t nTotalCreatedObjects = 0;
+
+		// Incremented whenever a global which holds an object is rebound in
+		// any context, which invalidates all call site caches, see
+		// `CallSiteCache`.
+		std::atomic_size_t bindingVersion = 0;
+		// Hits and misses of the contexts which have been destroyed.
+		size_t nCallSiteCacheHits = 0;
+		size_t nCallSiteCacheMisses = 0;
+
+		// Code objects are compiled to native code once frames have been
+		// entered with them `jitThreshold` times, zero disables the JIT. It
+		// has no effect if the JIT is not built, see jit.h.
+		uint32_t jitThreshold = DEFAULT_JIT_THRESHOLD;
 
-		MKLISP_API Runtime(std::pmr::memory_resource *upstream);
-		MKLISP_API ~Runtime();
+		// Threads of the pool which runs the parallel builtins besides the
+		// calling thread, see `getParallelPool`. Changing it has no effect once
+		// the pool has been created.
+		size_t nParallelWorkers;
 
-		MKLISP_API Value evalList(Context *context);
-		MKLISP_API Value eval(Value value, Context *context);
+		// Macro calls expanded by `MacroExpander`, the ones whose expansions
+		// have been found in the cache, and the time spent expanding.
+		// The time is guarded by `heapMutex`.
+		std::atomic_size_t nMacroExpansions = 0;
+		std::atomic_size_t nMacroExpansionCacheHits = 0;
+		std::chrono::nanoseconds macroExpansionTime = {};
+
+		// Allocations over the hard limit, `globalHeapResource.szLimit`, abort
+		// the evaluation with `outOfMemoryError`, objects allocated by the host
+		// outside of evaluations throw `std::bad_alloc` instead.
+		//
+		// Once the heap has grown over `heapSoftLimit`, the callback is called
+		// at the next safepoint, or a full collection is performed if there is
+		// no callback. It is called again only after the heap has dropped
+		// under the soft limit in between.
+		OutOfMemoryError outOfMemoryError;
+		size_t heapSoftLimit = SIZE_MAX;
+		HeapSoftLimitCallback heapSoftLimitCallback = nullptr;
+		void *heapSoftLimitCallbackUserData = nullptr;
+
+		// A major collection is started at the next safepoint once the heap
+		// has grown over `gcThreshold`, the threshold is then reset to twice the
+		// size of the surviving heap, but never less than `minGcThreshold`.
+		// A minor collection is triggered once more than `minorGcThreshold`
+		// bytes have been allocated in the nursery since the last collection.
+		size_t gcThreshold = DEFAULT_GC_THRESHOLD;
+		size_t minGcThreshold = DEFAULT_GC_THRESHOLD;
+		size_t minorGcThreshold = DEFAULT_MINOR_GC_THRESHOLD;
+
+		// In incremental mode, major collections are split into slices which
+		// are performed at safepoints, each slice stops after `gcSliceWorkBudget`
+		// units of work (objects traced or swept) or after `gcSliceTimeBudget`
+		// if it is not zero, whichever comes first.
+		GCMode gcMode = GCMode::StopTheWorld;
+		GCPhase gcPhase = GCPhase::Idle;
+		size_t gcSliceWorkBudget = DEFAULT_GC_SLICE_WORK_BUDGET;
+		std::chrono::nanoseconds gcSliceTimeBudget = {};
+		GCPauseStats gcPauseStats;
+
+	private:
+		bool _isOverHeapSoftLimit = false;
+		bool _isMinorCollection = false;
+		std::pmr::vector<Object *> _gcPendingObjects;
+		// Next object to be checked for host references while marking, or to
+		// be swept while sweeping.
+		std::pmr::list<Object *>::iterator _gcCursor;
+
+		// Guards the counts of mutators and the thread which stops the world,
+		// the request is read without it at safepoints.
+		std::mutex _safepointMutex;
+		std::condition_variable _safepointCond;
+		std::atomic_bool _isWorldStopRequested = false;
+		std::thread::id _worldStoppingThread;
+		size_t _nWorldStops = 0;
+		size_t _nMutators = 0;
+		size_t _nParkedMutators = 0;
+
+		std::once_flag _parallelPoolOnceFlag;
+		ParallelPool *_parallelPool = nullptr;
+
+	public:
+		MKLISP_API Runtime(std::pmr::memory_resource *upstream, RuntimeImage *baseImage = nullptr);
+		MKLISP_API virtual ~Runtime();
+
+		// Locks `heapMutex`. The cache of the thread for the global heap is
+		// created first, caches must not be created with the heap locked.
+		MKLISP_FORCEINLINE std::unique_lock<std::mutex> lockHeap() {
+			globalHeapResource.getThreadCache();
+			return std::unique_lock<std::mutex>(heapMutex);
+		}
+
+		MKLISP_API virtual ThreadCache *newThreadCache() override;
+		MKLISP_API virtual void flushThreadCache(ThreadCache *cache) noexcept override;
+
+		// Returns the id of the symbol name, which is the same for all symbols
+		// with the name. Symbols of the base image keep their ids in child
+		// runtimes.
+		MKLISP_API uint32_t internSymbol(const std::pmr::string &name);
+
+		MKLISP_API void addCreatedObject(Object *object);
+
+		// Flushes the caches of all threads for the runtime and its heaps so
+		// that the object list and the counters are exact, no other thread may
+		// be using the runtime.
+		MKLISP_API void flushAllThreadCaches() noexcept;
+
+		// Makes the thread a mutator of the runtime, see `MutatorScope`.
+		// Waits while the world is stopped by another thread.
+		MKLISP_API void attachMutator();
+		MKLISP_API void detachMutator() noexcept;
+		// Waits until all mutators but the thread are parked at safepoints, and
+		// keeps new ones from running until `resumeTheWorld`. The world may be
+		// stopped again by the same thread meanwhile, if another thread has
+		// stopped it, the thread is parked until then first.
+		MKLISP_API void stopTheWorld();
+		MKLISP_API void resumeTheWorld() noexcept;
+
+		// Returns the slot of the global for all contexts, which is created if
+		// it does not exist yet.
+		MKLISP_API uint32_t resolveGlobalSlot(const std::pmr::string &name);
+		// Freezes the value and binds the name to it in all contexts, contexts
+		// created afterwards are bound to it too unless they bind the name
+		// themselves. Stops the world, see `stopTheWorld`.
+		MKLISP_API void setSharedBinding(const std::pmr::string &name, const Value &value);
+		// Unbinds the shared binding, and the name in all contexts.
+		MKLISP_API void removeSharedBinding(const std::pmr::string &name);
+
+		// Must be called after storing a value into an object, objects must not
+		// be modified in other ways once they may have been promoted or marked.
+		MKLISP_FORCEINLINE void writeBarrier(Object *object, const Value &value) {
+			switch (value.valueType) {
+				case ValueType::Object:
+				case ValueType::QuotedObject:
+					break;
+				default:
+					return;
+			}
+
+			Object *target = value.exData.asObject;
+			switch (gcPhase) {
+				case GCPhase::Idle:
+					if (((object->objectFlags & (OBJECT_OLD | OBJECT_REMEMBERED)) == OBJECT_OLD) &&
+						!(target->objectFlags & OBJECT_OLD))
+						_rememberObject(object);
+					break;
+				case GCPhase::Marking:
+					// Black objects must never refer to white objects.
+					if ((target->associatedRuntime == this) && !(target->objectFlags & OBJECT_MARKED))
+						_shadeObject(target);
+					break;
+				default:
+					break;
+			}
+		}
+
+		// Roots are objects referenced by the host, bindings and live frames of
+		// all contexts. Values returned to the host by `eval` are not roots,
+		// hold them with a `HostObjectRef` if they are used across evaluations.
+		//
+		// Performs a full collection, or finishes the current incremental one.
+		MKLISP_API void collectGarbage();
+		// Collects young objects only, surviving objects are promoted in place.
+		// Does nothing while an incremental collection is in progress.
+		MKLISP_API void collectYoungGarbage();
+		// Performs a bounded slice of an incremental collection, a new one is
+		// started if none is in progress.
+		MKLISP_API void performGcSlice();
+		// Safepoint of the evaluators, parks the thread if another one is
+		// stopping the world.
+		MKLISP_FORCEINLINE void checkGarbageCollection() {
+			if (_isWorldStopRequested.load(std::memory_order_relaxed) || _isCollectionDue())
+				_onSafepoint();
+		}
+
+		// Counts a step of the evaluation on the context at a safepoint,
+		// returns true if it has to yield.
+		MKLISP_FORCEINLINE bool consumeFuel(Context *context) {
+			if (--context->nStepsToCheck)
+				return false;
+			return _checkSlice(context);
+		}
+
+		MKLISP_FORCEINLINE void onHostRefAcquired(Object *object) {
+			if ((gcPhase == GCPhase::Marking) && !(object->objectFlags & OBJECT_MARKED))
+				_shadeObject(object);
+		}
+
+		// Weak references and finalizers must not be registered or
+		// unregistered while a collection is in progress on another thread.
+		MKLISP_API void addWeakReference(WeakReference *weakReference, Object *target);
+		MKLISP_API void removeWeakReference(WeakReference *weakReference) noexcept;
+
+		// The finalizer is queued once the object has been collected, queued
+		// finalizers are run at the next safepoint after the collection, or
+		// by `runPendingFinalizers`. Finalizers of objects of the base image
+		// never run.
+		MKLISP_API void registerFinalizer(Object *object, FinalizerCallback callback, void *userData);
+		MKLISP_API void runPendingFinalizers();
+
+		// Returns the pool of the runtime, which is created on first use with
+		// `nParallelWorkers` threads and stopped with the runtime.
+		MKLISP_API ParallelPool *getParallelPool();
+
+		// Marks the object and everything reachable from it as immutable.
+		// Frozen objects may be read from any thread, and are collected like
+		// other objects once they are no longer referred to.
+		MKLISP_API void freeze(Object *object);
+
+		// Evaluates the list of the last frame of the context, which is popped
+		// on return. The frame and all frames pushed since are popped if an
+		// error occurs.
+		MKLISP_API InternalExceptionPointer evalList(Context *context, Value &returnValueOut);
+		MKLISP_API InternalExceptionPointer eval(Value value, Context *context, Value &returnValueOut);
+		// Calls the function with the arguments, which must not be on the
+		// value stack of the context.
+		MKLISP_API InternalExceptionPointer call(Value fn, const Value *args, size_t nArgs, Context *context, Value &returnValueOut);
+		// Executes code compiled by a `Compiler`.
+		MKLISP_API InternalExceptionPointer execute(CodeObject *code, Context *context, Value &returnValueOut);
+
+		// Evaluates the value in slices of at most `fuel` steps, and at most
+		// `timeSlice` if it is not zero. Steps are iterations of the evaluator
+		// and calls made by the interpreter or loops of native code, so any
+		// evaluation which does not return reaches them.
+		//
+		// Once the slice is over, the evaluation yields at the next step which
+		// is not in an evaluation started by a native function, and the status
+		// is `EvalStatus::Yielded`. The context must not be used for other
+		// evaluations until it has been resumed until done, has failed or has
+		// been aborted.
+		MKLISP_API InternalExceptionPointer startEval(Value value, Context *context, size_t fuel, std::chrono::nanoseconds timeSlice, EvalStatus &statusOut, Value &returnValueOut);
+		MKLISP_API InternalExceptionPointer resumeEval(Context *context, size_t fuel, std::chrono::nanoseconds timeSlice, EvalStatus &statusOut, Value &returnValueOut);
+		// Pops the frames of the yielded evaluation.
+		MKLISP_API void abortEval(Context *context) noexcept;
+
+		// Called by natives marked as async, see `NativeFnObject::isAsync`, to
+		// suspend the resumable evaluation once they have returned, their
+		// return value is ignored. Returns false if the evaluation cannot be
+		// suspended, natives must complete the call themselves then. Whatever
+		// runs the evaluation must complete the call, see `EventLoop`.
+		MKLISP_API bool suspendCall(Context *context) noexcept;
+		// Sets the result of the suspended call, the evaluation continues with
+		// it once resumed.
+		MKLISP_API void completeCall(Context *context, const Value &result) noexcept;
+
+		// Called by natives to fail their call with the exception once they
+		// have returned, their return value is ignored. Evaluations which
+		// called them fail like with errors of their own.
+		MKLISP_API void failCall(Context *context, InternalExceptionPointer &&exception) noexcept;
+	};
+
+	// Threads must be in a scope while they use the objects or the contexts of
+	// a runtime which other threads evaluate on. Scopes may be nested.
+	class MutatorScope {
+	private:
+		Runtime *_runtime;
+
+	public:
+		MKLISP_FORCEINLINE MutatorScope(Runtime *runtime) : _runtime(runtime) {
+			runtime->attachMutator();
+		}
+		MutatorScope(const MutatorScope &) = delete;
+		MKLISP_FORCEINLINE ~MutatorScope() {
+			_runtime->detachMutator();
+		}
+	};
+
+	// Lets collections run while the thread blocks outside of the runtime,
+	// such as natives waiting for I/O. The thread must not use objects of the
+	// runtime in it.
+	class BlockingScope {
+	private:
+		Runtime *_runtime;
+		size_t _nMutatorScopes;
+
+	public:
+		MKLISP_API BlockingScope(Runtime *runtime) noexcept;
+		BlockingScope(const BlockingScope &) = delete;
+		MKLISP_API ~BlockingScope();
 	};
+
+	class StopTheWorldScope {
+	private:
+		Runtime *_runtime;
+
+	public:
+		MKLISP_FORCEINLINE StopTheWorldScope(Runtime *runtime) : _runtime(runtime) {
+			runtime->stopTheWorld();
+		}
+		StopTheWorldScope(const StopTheWorldScope &) = delete;
+		MKLISP_FORCEINLINE ~StopTheWorldScope() {
+			_runtime->resumeTheWorld();
+		}
+	};
+
+	// Evaluations started by natives on a context cannot yield, the outer
+	// evaluation yields once they have returned if its slice is over.
+	class NestedEvalScope {
+	private:
+		Context *_context;
+		bool _wasYieldable;
+
+	public:
+		MKLISP_FORCEINLINE NestedEvalScope(Context *context) noexcept
+			: _context(context), _wasYieldable(context->isYieldable) {
+			context->isYieldable = false;
+		}
+		NestedEvalScope(const NestedEvalScope &) = delete;
+		MKLISP_FORCEINLINE ~NestedEvalScope() {
+			if ((_context->isYieldable = _wasYieldable) && _context->isSliceOver)
+				_context->nStepsToCheck = 1;
+		}
+	};
+
+	MKLISP_FORCEINLINE void Context::storeGlobal(uint32_t slot, const Value &value) noexcept {
+		Value &global = globals[slot];
+
+		switch (global.valueType) {
+			case ValueType::Object:
+			case ValueType::QuotedObject:
+				++runtime->bindingVersion;
+				break;
+			default:
+				break;
+		}
+		global = value;
+	}
+
+	MKLISP_FORCEINLINE void incHostRef(Object *object) noexcept {
+		if (!object->associatedRuntime->isImageBase) {
+			++object->hostRefCount;
+			object->associatedRuntime->onHostRefAcquired(object);
+		}
+	}
+
+	MKLISP_FORCEINLINE void decHostRef(Object *object) noexcept {
+		if (!object->associatedRuntime->isImageBase)
+			--object->hostRefCount;
+	}
 }
 
 #endif
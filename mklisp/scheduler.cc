@@ -0,0 +1,139 @@
+#include "scheduler.h"
+
+using namespace mklisp;
+
+static thread_local Scheduler *_currentScheduler = nullptr;
+
+MKLISP_API Scheduler::Scheduler(std::pmr::memory_resource *memoryResource, size_t nWorkers)
+	: _readyTasks(memoryResource),
+	  _awaitingTasks(memoryResource),
+	  _earlyCallResults(memoryResource),
+	  _workers(memoryResource),
+	  memoryResource(memoryResource) {
+	assert(("The scheduler has no workers", nWorkers));
+
+	for (size_t i = 0; i < nWorkers; ++i)
+		_workers.push_back(std::thread([this]() { _runWorker(); }));
+}
+
+MKLISP_API Scheduler::~Scheduler() {
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_isStopping = true;
+	}
+	_taskReadyCond.notify_all();
+
+	for (auto &i : _workers)
+		i.join();
+
+	for (auto &i : _readyTasks) {
+		if (i.isStarted)
+			i.context->runtime->abortEval(i.context);
+	}
+	for (auto &i : _awaitingTasks)
+		i.first->runtime->abortEval(i.first);
+}
+
+MKLISP_API Scheduler *Scheduler::getCurrent() noexcept {
+	return _currentScheduler;
+}
+
+void Scheduler::_runWorker() {
+	_currentScheduler = this;
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	while (true) {
+		_taskReadyCond.wait(lock, [this]() { return _isStopping || _readyTasks.size(); });
+		if (_isStopping)
+			return;
+
+		Task task = _readyTasks.front();
+		_readyTasks.pop_front();
+		lock.unlock();
+
+		Runtime *runtime = task.context->runtime;
+		if (task.isCallCompleted) {
+			MutatorScope mutatorScope(runtime);
+			runtime->completeCall(task.context, task.callResult);
+			task.isCallCompleted = false;
+			task.callResult = Value();
+		}
+
+		EvalStatus status;
+		Value result;
+		InternalExceptionPointer e = task.isStarted
+										 ? runtime->resumeEval(task.context, fuel, timeSlice, status, result)
+										 : runtime->startEval(task.value, task.context, fuel, timeSlice, status, result);
+		task.isStarted = true;
+
+		bool isDone = e || (status == EvalStatus::Done);
+		if (isDone) {
+			if (task.callback)
+				task.callback(task.userData, task.context, e, result);
+			e.reset();
+		}
+
+		lock.lock();
+		if (isDone) {
+			if (!--_nUnfinishedTasks)
+				_allTasksDoneCond.notify_all();
+		} else if (status == EvalStatus::Awaiting) {
+			// Queued again by `completeCall`, unless the call has been
+			// completed already.
+			if (auto it = _earlyCallResults.find(task.context); it != _earlyCallResults.end()) {
+				task.isCallCompleted = true;
+				task.callResult = it->second;
+				_earlyCallResults.erase(it);
+				_readyTasks.push_back(task);
+				_taskReadyCond.notify_one();
+			} else
+				_awaitingTasks.emplace(task.context, task);
+		} else {
+			_readyTasks.push_back(task);
+			_taskReadyCond.notify_one();
+		}
+	}
+}
+
+MKLISP_API void Scheduler::spawn(Context *context, Value value, TaskCompletionCallback callback, void *userData) {
+	Task task;
+	task.context = context;
+	task.value = value;
+	task.callback = callback;
+	task.userData = userData;
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_readyTasks.push_back(task);
+		++_nUnfinishedTasks;
+	}
+	_taskReadyCond.notify_one();
+}
+
+MKLISP_API void Scheduler::waitAll() {
+	std::unique_lock<std::mutex> lock(_mutex);
+	_allTasksDoneCond.wait(lock, [this]() { return !_nUnfinishedTasks; });
+}
+
+MKLISP_API bool Scheduler::suspendCall(Context *context) noexcept {
+	return context->runtime->suspendCall(context);
+}
+
+MKLISP_API void Scheduler::completeCall(Context *context, const Value &result) {
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	auto it = _awaitingTasks.find(context);
+	if (it == _awaitingTasks.end()) {
+		_earlyCallResults[context] = result;
+		return;
+	}
+
+	Task task = it->second;
+	_awaitingTasks.erase(it);
+	task.isCallCompleted = true;
+	task.callResult = result;
+	_readyTasks.push_back(task);
+	// Notified with the lock held, the scheduler may be destroyed as soon as
+	// the task has completed.
+	_taskReadyCond.notify_one();
+}
@@ -0,0 +1,90 @@
+#ifndef _MKLISP_SCHEDULER_H_
+#define _MKLISP_SCHEDULER_H_
+
+#include "runtime.h"
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <unordered_map>
+
+namespace mklisp {
+	constexpr static size_t DEFAULT_SCHEDULER_FUEL = 100000;
+	constexpr static std::chrono::nanoseconds DEFAULT_SCHEDULER_TIME_SLICE = std::chrono::milliseconds(2);
+
+	// Runs evaluations on many contexts over a pool of threads, in slices of
+	// `fuel` steps and `timeSlice`, see `Runtime::startEval`. Tasks which have
+	// yielded are queued again behind the others, so a task which never
+	// returns only takes its share of the workers. Completion callbacks are
+	// called by the workers.
+	//
+	// Tasks run in the order in which they were queued, contexts of the same
+	// runtime run in parallel as well, see `Runtime`.
+	//
+	// Natives find the scheduler running them with `getCurrent`, and suspend
+	// their calls with `suspendCall`. Tasks awaiting calls take no time of the
+	// workers until the calls are completed with `completeCall`, which any
+	// thread may do.
+	//
+	// The host must keep the values being evaluated alive until the tasks have
+	// completed.
+	class Scheduler {
+	private:
+		struct Task {
+			Context *context;
+			Value value;
+			TaskCompletionCallback callback;
+			void *userData;
+			bool isStarted = false;
+			// Set once the suspended call has been completed, the result is
+			// passed to the runtime before the task is resumed.
+			bool isCallCompleted = false;
+			Value callResult;
+		};
+
+		std::mutex _mutex;
+		std::condition_variable _taskReadyCond;
+		std::condition_variable _allTasksDoneCond;
+		std::pmr::deque<Task> _readyTasks;
+		std::pmr::unordered_map<Context *, Task> _awaitingTasks;
+		// Results of calls completed while the slices which have suspended
+		// them were still running.
+		std::pmr::unordered_map<Context *, Value> _earlyCallResults;
+		std::pmr::vector<std::thread> _workers;
+		size_t _nUnfinishedTasks = 0;
+		bool _isStopping = false;
+
+		void _runWorker();
+
+	public:
+		std::pmr::memory_resource *memoryResource;
+		// Must not be changed while tasks are running.
+		size_t fuel = DEFAULT_SCHEDULER_FUEL;
+		std::chrono::nanoseconds timeSlice = DEFAULT_SCHEDULER_TIME_SLICE;
+
+		MKLISP_API Scheduler(std::pmr::memory_resource *memoryResource, size_t nWorkers);
+		Scheduler(const Scheduler &) = delete;
+		// Waits for the slices being run, evaluations of the tasks which have
+		// not completed are aborted without calling their callbacks.
+		MKLISP_API ~Scheduler();
+
+		// Returns the scheduler whose worker is the thread, if any.
+		MKLISP_API static Scheduler *getCurrent() noexcept;
+
+		// Queues the evaluation of the value on the context, which must not be
+		// used for anything else until the task has completed.
+		MKLISP_API void spawn(Context *context, Value value, TaskCompletionCallback callback, void *userData);
+		// Waits until all tasks have completed.
+		MKLISP_API void waitAll();
+
+		// Suspends the call of the native which calls it, see
+		// `Runtime::suspendCall`, and returns false if it cannot be suspended.
+		MKLISP_API bool suspendCall(Context *context) noexcept;
+		// Completes the suspended call of a task of the scheduler and queues
+		// the task again, may be called by any thread, even before the native
+		// which has suspended the call has returned. The host must keep the
+		// result alive until the task has been resumed.
+		MKLISP_API void completeCall(Context *context, const Value &result);
+	};
+}
+
+#endif
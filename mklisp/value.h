@@ -2,6 +2,7 @@
 #define _MKLISP_VALUE_H_
 
 #include <cstdint>
+#include <cstddef>
 #include "basedefs.h"
 
 namespace mklisp {
@@ -72,6 +73,18 @@ namespace mklisp {
 			exData.asObject = data;
 		}
 	};
+
+	// View of contiguous values.
+	struct ValueSpan {
+		Value *data;
+		size_t size;
+
+		MKLISP_FORCEINLINE ValueSpan(Value *data, size_t size) : data(data), size(size) {}
+
+		MKLISP_FORCEINLINE Value &operator[](size_t index) const { return data[index]; }
+		MKLISP_FORCEINLINE Value *begin() const { return data; }
+		MKLISP_FORCEINLINE Value *end() const { return data + size; }
+	};
 }
 
 #endif
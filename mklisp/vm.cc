@@ -0,0 +1,484 @@
+#include "runtime.h"
+#include "jit.h"
+#include <new>
+#include <algorithm>
+
+using namespace mklisp;
+
+// Instructions jump to the next one through a table of label addresses when
+// labels as values are supported, which is a GNU extension. Define
+// `MKLISP_VM_NO_THREADED_DISPATCH` to dispatch with a switch instead.
+#if defined(__GNUC__) && !defined(MKLISP_VM_NO_THREADED_DISPATCH)
+	#define MKLISP_VM_THREADED_DISPATCH 1
+#else
+	#define MKLISP_VM_THREADED_DISPATCH 0
+#endif
+
+#if MKLISP_VM_THREADED_DISPATCH
+	#define MKLISP_VM_CASE(opcode) opcode_##opcode
+	#define MKLISP_VM_DISPATCH() goto *dispatchTable[(size_t)(curInstruction = *ip++).opcode]
+#else
+	#define MKLISP_VM_CASE(opcode) case Opcode::opcode
+	#define MKLISP_VM_DISPATCH() continue
+#endif
+
+// Loads the state of the frame at `frameIndex` and grows the value stack to
+// hold all values of it.
+#define MKLISP_VM_ENTER_FRAME(spOffset)                                      \
+	{                                                                        \
+		size_t newSpOffset = (spOffset);                                     \
+		Frame &frame = frameStack[frameIndex];                               \
+		code = frame.code;                                                   \
+		instructions = code->instructions.data();                            \
+		constants = code->constants.data();                                  \
+		ip = instructions + frame.pc;                                        \
+		stackBase = frame.valueStackBase;                                    \
+		valueStack.resize(stackBase + code->maxStackSize);                   \
+		locals = valueStack.data() + stackBase;                              \
+		captures = frame.closure ? frame.closure->captures.data() : nullptr; \
+		sp = valueStack.data() + newSpOffset;                                \
+	}
+
+// Saves the state of the frame so that it resumes with the current
+// instruction, the value stack is shrunk to the top of the frame.
+#define MKLISP_VM_SUSPEND()                                             \
+	{                                                                   \
+		frameStack[frameIndex].pc = (uint32_t)(ip - 1 - instructions); \
+		valueStack.resize(sp - valueStack.data());                      \
+		context->isSuspended = true;                                    \
+		return {};                                                      \
+	}
+
+// Suspends the frame after the call of a native which has suspended it, the
+// result is put over the arguments once resumed.
+#define MKLISP_VM_AWAIT()                                           \
+	{                                                               \
+		frameStack[frameIndex].pc = (uint32_t)(ip - instructions); \
+		valueStack.resize(sp - valueStack.data());                  \
+		context->isSuspended = true;                                \
+		return {};                                                  \
+	}
+
+#if MKLISP_JIT
+	// Counts the entry of a frame with the code, which is compiled once it is
+	// hot.
+	#define MKLISP_VM_COUNT_CALL()                                                                      \
+		if ((!code->isFrozen()) && (++code->nCalls == jitThreshold) && jitThreshold && (!code->jitCode)) \
+			code->jitCode = compileJitCode(this, code);
+	// Runs the native code of the frame from the current instruction until it
+	// reaches an instruction which is left to the interpreter, or until a
+	// native has failed its call.
+	#define MKLISP_VM_RUN_JIT()                                                                                                   \
+		if (code->jitCode) {                                                                                                      \
+			uint32_t nextPc = _runJit(this, context, frameIndex, stackBase, locals, captures, sp, (uint32_t)(ip - instructions)); \
+			if (context->nativeException)                                                                                         \
+				return std::move(context->nativeException);                                                                       \
+			ip = instructions + nextPc;                                                                                           \
+			locals = valueStack.data() + stackBase;                                                                               \
+		}
+#else
+	#define MKLISP_VM_COUNT_CALL()
+	#define MKLISP_VM_RUN_JIT()
+#endif
+
+MKLISP_API InternalExceptionPointer Runtime::execute(CodeObject *code, Context *context, Value &returnValueOut) {
+	size_t nInitialFrames = context->frameStack.size();
+	MutatorScope mutatorScope(this);
+	NestedEvalScope nestedEvalScope(context);
+
+	try {
+		// Code compiled on other contexts may refer to any slot.
+		if (context->globals.size() < nGlobalSlots)
+			context->syncGlobals();
+		return _callCode(context, code, nullptr, context->valueStack.size(), returnValueOut);
+	} catch (std::bad_alloc &) {
+		_unwindFrames(context, nInitialFrames);
+		// Reclaim what the execution has allocated.
+		collectGarbage();
+		return &outOfMemoryError;
+	}
+}
+
+InternalExceptionPointer Runtime::_pushCodeFrame(Context *context, CodeObject *code, ClosureObject *closure, size_t valueStackBase) {
+	auto &frameStack = context->frameStack;
+
+	if (frameStack.size() >= context->maxFrameDepth)
+		return StackOverflowError::alloc(&globalHeapResource, frameStack.size());
+	frameStack.push_back(Frame(nullptr, valueStackBase));
+	frameStack.back().code = code;
+	frameStack.back().closure = closure;
+
+	return {};
+}
+
+// The arguments are the values from `argBase` to the top of the value stack.
+InternalExceptionPointer Runtime::_callCode(Context *context, CodeObject *code, ClosureObject *closure, size_t argBase, Value &returnValueOut) {
+	size_t nArgs = context->valueStack.size() - argBase;
+	if (nArgs != code->nParams)
+		return ArityMismatchError::alloc(&globalHeapResource, code->nParams, nArgs);
+
+	size_t nInitialFrames = context->frameStack.size();
+	MKLISP_RETURN_IF_EXCEPT(_pushCodeFrame(context, code, closure, argBase));
+
+	if (InternalExceptionPointer e = _execute(context, nInitialFrames, returnValueOut); e) {
+		_unwindFrames(context, nInitialFrames);
+		return e;
+	}
+
+	return {};
+}
+
+static InternalExceptionPointer _raiseUnboundGlobal(Context *context, uint32_t slot) {
+	const std::pmr::string *name = context->getGlobalName(slot);
+
+	return UnboundVariableError::alloc(
+		&context->runtime->globalHeapResource,
+		name ? std::string_view(*name) : std::string_view());
+}
+
+// Returns false if the value is not callable. Hits of the cache of the call
+// site skip the dispatch on the type of the callee.
+static MKLISP_FORCEINLINE bool _resolveCallTarget(Runtime *runtime, Context *context, CodeObject *code, uint16_t callSiteIndex, const Value &value, CallTarget &targetOut) {
+	if (value.valueType != ValueType::Object)
+		return false;
+	Object *object = value.exData.asObject;
+
+	CallSiteCache *cache = nullptr;
+	if ((callSiteIndex != NO_CALL_SITE_CACHE) && (!code->isFrozen())) {
+		cache = &code->callSiteCaches[callSiteIndex];
+
+		if (cache->bindingVersion == runtime->bindingVersion) {
+			for (uint8_t i = 0; i < cache->nEntries; ++i) {
+				if (cache->entries[i].object == object) {
+					++context->nCallSiteCacheHits;
+					targetOut = cache->entries[i];
+					return true;
+				}
+			}
+		} else {
+			cache->bindingVersion = runtime->bindingVersion;
+			cache->nEntries = 0;
+			cache->nextEntryIndex = 0;
+		}
+		++context->nCallSiteCacheMisses;
+	}
+
+	targetOut.object = object;
+	switch (object->getObjectType()) {
+		case ObjectType::NativeFn:
+			targetOut.callback = ((NativeFnObject *)object)->callback;
+			break;
+		case ObjectType::Code:
+			targetOut.code = (CodeObject *)object;
+			break;
+		case ObjectType::Closure:
+			targetOut.closure = (ClosureObject *)object;
+			targetOut.code = targetOut.closure->code;
+			break;
+		default:
+			return false;
+	}
+
+	if (cache) {
+		uint8_t index;
+		if (cache->nEntries < MAX_CALL_SITE_CACHE_ENTRIES)
+			index = cache->nEntries++;
+		else {
+			index = cache->nextEntryIndex;
+			cache->nextEntryIndex = (uint8_t)((index + 1) % MAX_CALL_SITE_CACHE_ENTRIES);
+		}
+		cache->entries[index] = targetOut;
+		runtime->writeBarrier(code, value);
+	}
+
+	return true;
+}
+
+#if MKLISP_JIT
+static MKLISP_FORCEINLINE uint32_t _runJit(Runtime *runtime, Context *context, size_t frameIndex, size_t stackBase, Value *locals, const Value *&captures, Value *&sp, uint32_t pc) {
+	CodeObject *code = context->frameStack[frameIndex].code;
+
+	JitState state;
+	state.runtime = runtime;
+	state.context = context;
+	state.code = code;
+	state.frameIndex = frameIndex;
+	state.stackBase = stackBase;
+	state.locals = locals;
+	state.captures = captures;
+	state.globals = context->globals.data();
+	state.bindingVersion = &runtime->bindingVersion;
+
+	uint32_t nextPc = runJitCode(code->jitCode, state, sp, pc);
+	sp = state.sp;
+	captures = state.captures;
+	return nextPc;
+}
+#endif
+
+// Runs the frame on the top of the frame stack until the entry frame returns.
+// Calls to code objects are run in the same loop.
+//
+// The value stack is grown by the maximum stack size of the code when a frame
+// is entered and the values are pushed through `sp`. Slots over `sp` may keep
+// values which have been popped alive until they are overwritten or the frame
+// returns.
+//
+// Native functions may evaluate on the same context, which moves the stacks,
+// so frames and values are only referred to by their indices across calls.
+//
+// Once the code of a frame has been compiled, it is run in native code
+// whenever the frame is entered or resumed, see jit.h.
+//
+// Resumable evaluations are suspended at calls, the top of the value stack is
+// where the top frame resumes.
+InternalExceptionPointer Runtime::_execute(Context *context, size_t entryFrameIndex, Value &returnValueOut) {
+	auto &frameStack = context->frameStack;
+	auto &valueStack = context->valueStack;
+	size_t frameIndex = frameStack.size() - 1;
+
+	CodeObject *code;
+	const Instruction *instructions;
+	const Value *constants;
+	const Instruction *ip;
+	size_t stackBase;
+	Value *locals, *sp;
+	const Value *captures;
+	Instruction curInstruction;
+
+	MKLISP_VM_ENTER_FRAME(valueStack.size());
+	if (context->callSuspension == CallSuspension::Completed) {
+		// Resumed after the native called by the last instruction has
+		// completed.
+		context->callSuspension = CallSuspension::None;
+		sp[-1] = frameStack[frameIndex].returnValue;
+		if (ip[-1].opcode == Opcode::TailCall)
+			goto returnTopValue;
+	} else {
+		MKLISP_VM_COUNT_CALL();
+	}
+	MKLISP_VM_RUN_JIT();
+
+#if MKLISP_VM_THREADED_DISPATCH
+	static void *const dispatchTable[NUM_OPCODES] = {
+		&&opcode_PushConst,
+		&&opcode_LoadGlobal,
+		&&opcode_StoreGlobal,
+		&&opcode_LoadLocal,
+		&&opcode_StoreLocal,
+		&&opcode_LoadCapture,
+		&&opcode_BoxLocal,
+		&&opcode_Unbox,
+		&&opcode_StoreBox,
+		&&opcode_Pop,
+		&&opcode_Slide,
+		&&opcode_Jump,
+		&&opcode_JumpIfFalse,
+		&&opcode_JumpIfFalseOrPop,
+		&&opcode_JumpIfTrueOrPop,
+		&&opcode_MakeClosure,
+		&&opcode_Call,
+		&&opcode_TailCall,
+		&&opcode_Return
+	};
+
+	MKLISP_VM_DISPATCH();
+	{
+#else
+	while (true) {
+		switch ((curInstruction = *ip++).opcode) {
+#endif
+	MKLISP_VM_CASE(PushConst) : {
+		*(sp++) = constants[curInstruction.operand];
+		MKLISP_VM_DISPATCH();
+	}
+	MKLISP_VM_CASE(LoadGlobal) : {
+		const Value &value = context->globals[curInstruction.operand];
+		if (value.valueType == ValueType::Undefined)
+			return _raiseUnboundGlobal(context, curInstruction.operand);
+		*(sp++) = value;
+		MKLISP_VM_DISPATCH();
+	}
+	MKLISP_VM_CASE(StoreGlobal) : {
+		context->storeGlobal(curInstruction.operand, sp[-1]);
+		MKLISP_VM_DISPATCH();
+	}
+	MKLISP_VM_CASE(LoadLocal) : {
+		*(sp++) = locals[curInstruction.operand];
+		MKLISP_VM_DISPATCH();
+	}
+	MKLISP_VM_CASE(StoreLocal) : {
+		locals[curInstruction.operand] = sp[-1];
+		MKLISP_VM_DISPATCH();
+	}
+	MKLISP_VM_CASE(LoadCapture) : {
+		*(sp++) = captures[curInstruction.operand];
+		MKLISP_VM_DISPATCH();
+	}
+	MKLISP_VM_CASE(BoxLocal) : {
+		Value &local = locals[curInstruction.operand];
+		local = Value(BoxObject::alloc(this, local).get());
+		MKLISP_VM_DISPATCH();
+	}
+	MKLISP_VM_CASE(Unbox) : {
+		sp[-1] = ((BoxObject *)sp[-1].exData.asObject)->value;
+		MKLISP_VM_DISPATCH();
+	}
+	MKLISP_VM_CASE(StoreBox) : {
+		BoxObject *box = (BoxObject *)(--sp)->exData.asObject;
+		MKLISP_RETURN_IF_EXCEPT(box->set(sp[-1]));
+		MKLISP_VM_DISPATCH();
+	}
+	MKLISP_VM_CASE(Pop) : {
+		--sp;
+		MKLISP_VM_DISPATCH();
+	}
+	MKLISP_VM_CASE(Slide) : {
+		sp[-1 - (ptrdiff_t)curInstruction.operand] = sp[-1];
+		sp -= curInstruction.operand;
+		MKLISP_VM_DISPATCH();
+	}
+	MKLISP_VM_CASE(Jump) : {
+		ip = instructions + curInstruction.operand;
+		MKLISP_VM_DISPATCH();
+	}
+	MKLISP_VM_CASE(JumpIfFalse) : {
+		if ((--sp)->valueType == ValueType::Nil)
+			ip = instructions + curInstruction.operand;
+		MKLISP_VM_DISPATCH();
+	}
+	MKLISP_VM_CASE(JumpIfFalseOrPop) : {
+		if (sp[-1].valueType == ValueType::Nil)
+			ip = instructions + curInstruction.operand;
+		else
+			--sp;
+		MKLISP_VM_DISPATCH();
+	}
+	MKLISP_VM_CASE(JumpIfTrueOrPop) : {
+		if (sp[-1].valueType != ValueType::Nil)
+			ip = instructions + curInstruction.operand;
+		else
+			--sp;
+		MKLISP_VM_DISPATCH();
+	}
+	MKLISP_VM_CASE(MakeClosure) : {
+		uint32_t nCaptures = curInstruction.operand;
+		sp -= nCaptures;
+
+		CodeObject *closureCode = (CodeObject *)sp[-1].exData.asObject;
+		sp[-1] = Value(ClosureObject::alloc(this, closureCode, sp, nCaptures).get());
+		MKLISP_VM_DISPATCH();
+	}
+	MKLISP_VM_CASE(Call) : {
+		checkGarbageCollection();
+		if (consumeFuel(context))
+			MKLISP_VM_SUSPEND();
+
+		uint32_t nArgs = curInstruction.operand;
+		Value *args = sp - nArgs;
+		size_t argBase = args - valueStack.data();
+
+		CallTarget target;
+		if (!_resolveCallTarget(this, context, code, curInstruction.callSiteIndex, args[-1], target))
+			return UncallableTargetError::alloc(&globalHeapResource, args[-1]);
+
+		if (target.callback) {
+			Frame &curFrame = frameStack[frameIndex];
+			curFrame.pc = (uint32_t)(ip - instructions);
+			curFrame.returnValue = Value(ValueType::Nil);
+
+			target.callback(context, ValueSpan(args, nArgs));
+			if (context->nativeException)
+				return std::move(context->nativeException);
+
+			MKLISP_VM_ENTER_FRAME(argBase);
+			if (context->callSuspension == CallSuspension::Awaiting)
+				MKLISP_VM_AWAIT();
+			sp[-1] = frameStack[frameIndex].returnValue;
+			MKLISP_VM_RUN_JIT();
+			MKLISP_VM_DISPATCH();
+		}
+
+		if (nArgs != target.code->nParams)
+			return ArityMismatchError::alloc(&globalHeapResource, target.code->nParams, nArgs);
+
+		frameStack[frameIndex].pc = (uint32_t)(ip - instructions);
+		MKLISP_RETURN_IF_EXCEPT(_pushCodeFrame(context, target.code, target.closure, argBase));
+		++frameIndex;
+
+		MKLISP_VM_ENTER_FRAME(argBase + nArgs);
+		MKLISP_VM_COUNT_CALL();
+		MKLISP_VM_RUN_JIT();
+		MKLISP_VM_DISPATCH();
+	}
+	MKLISP_VM_CASE(TailCall) : {
+		checkGarbageCollection();
+		if (consumeFuel(context))
+			MKLISP_VM_SUSPEND();
+
+		uint32_t nArgs = curInstruction.operand;
+		Value *args = sp - nArgs;
+
+		CallTarget target;
+		if (!_resolveCallTarget(this, context, code, curInstruction.callSiteIndex, args[-1], target))
+			return UncallableTargetError::alloc(&globalHeapResource, args[-1]);
+
+		if (target.callback) {
+			size_t argBase = args - valueStack.data();
+			Frame &curFrame = frameStack[frameIndex];
+			curFrame.pc = (uint32_t)(ip - instructions);
+			curFrame.returnValue = Value(ValueType::Nil);
+
+			target.callback(context, ValueSpan(args, nArgs));
+			if (context->nativeException)
+				return std::move(context->nativeException);
+
+			MKLISP_VM_ENTER_FRAME(argBase);
+			if (context->callSuspension == CallSuspension::Awaiting)
+				MKLISP_VM_AWAIT();
+			sp[-1] = frameStack[frameIndex].returnValue;
+			goto returnTopValue;
+		}
+
+		if (nArgs != target.code->nParams)
+			return ArityMismatchError::alloc(&globalHeapResource, target.code->nParams, nArgs);
+
+		// The arguments replace the local variables and the frame runs the
+		// callee from its beginning.
+		std::copy(args, sp, locals);
+		Frame &curFrame = frameStack[frameIndex];
+		curFrame.code = target.code;
+		curFrame.closure = target.closure;
+		curFrame.pc = 0;
+
+		MKLISP_VM_ENTER_FRAME(stackBase + nArgs);
+		MKLISP_VM_COUNT_CALL();
+		MKLISP_VM_RUN_JIT();
+		MKLISP_VM_DISPATCH();
+	}
+	MKLISP_VM_CASE(Return) : {
+	returnTopValue:
+		Value returnValue = sp[-1];
+
+		if (frameIndex == entryFrameIndex) {
+			returnValueOut = returnValue;
+			valueStack.resize(stackBase);
+			frameStack.pop_back();
+			return {};
+		}
+
+		// The arguments of the returning frame begin right over the callee.
+		size_t argBase = stackBase;
+		frameStack.pop_back();
+		--frameIndex;
+
+		MKLISP_VM_ENTER_FRAME(argBase);
+		sp[-1] = returnValue;
+		MKLISP_VM_RUN_JIT();
+		MKLISP_VM_DISPATCH();
+	}
+#if !MKLISP_VM_THREADED_DISPATCH
+		}
+#endif
+	}
+}
@@ -0,0 +1,59 @@
+#include "test.h"
+#include <mklisp/builtins.h>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+static void _collectGarbageFn(Context *context, ValueSpan) {
+	context->runtime->collectGarbage();
+	context->frameStack.back().returnValue = Value((int32_t)0);
+}
+
+int main() {
+	Runtime runtime(std::pmr::get_default_resource());
+	Context context(&runtime);
+	bindArithmeticBuiltins(&context);
+	context.setBinding("gc", NativeFnObject::alloc(&runtime, _collectGarbageFn).get());
+
+	// Closures capture the variables they use.
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define (make-adder n) (lambda (x) (+ x n))) ((make-adder 5) 10)"), 15));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define (curry3 a) (lambda (b) (lambda (c) (+ a b c)))) (((curry3 1) 20) 300)"), 321));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define (shadow x) ((lambda (x) (+ x 1)) 100)) (shadow 1)"), 101));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define (loop i n f) (if (< i n) (loop (+ i 1) n (lambda () (+ i (f)))) (f))) (loop 0 50 (lambda () 0))"), 1225));
+
+	// Assigned variables are shared by the closures and the frame which
+	// capture them, each call has its own.
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define (make-counter) (let ((n 0)) (lambda () (set! n (+ n 1)) n))) 0"), 0));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define c1 (make-counter)) (define c2 (make-counter)) (c1) (c1) (gc) (c2) (c1)"), 3));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(c2)"), 2));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(let ((x 1)) (let ((f (lambda () x))) (set! x 2) (f)))"), 2));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define (acc n) (lambda (d) (set! n (+ n d)) n)) (define a1 (acc 10)) (a1 5) (a1 7)"), 22));
+
+	// Only assigned captures are boxed, closures hold their captures only.
+	{
+		Value counter = context.getBinding("c1");
+		MKLISP_TEST_CHECK((counter.valueType == ValueType::Object) && (counter.exData.asObject->getObjectType() == ObjectType::Closure));
+		if (counter.valueType == ValueType::Object) {
+			ClosureObject *closure = (ClosureObject *)counter.exData.asObject;
+			MKLISP_TEST_CHECK(closure->captures.size() == 1);
+			MKLISP_TEST_CHECK((closure->captures[0].valueType == ValueType::Object) && (closure->captures[0].exData.asObject->getObjectType() == ObjectType::Box));
+		}
+
+		Value adder = eval(&context, "(make-adder 1)");
+		MKLISP_TEST_CHECK(adder.valueType == ValueType::Object);
+		if (adder.valueType == ValueType::Object) {
+			ClosureObject *closure = (ClosureObject *)adder.exData.asObject;
+			MKLISP_TEST_CHECK((closure->captures.size() == 1) && isInt(closure->captures[0], 1));
+		}
+	}
+
+	// Errors raised in closures unwind their frames, their state is kept.
+	MKLISP_TEST_CHECK(evalFails(&context, "((make-adder 1) 1 2)", RuntimeErrorCode::ArityMismatch));
+	MKLISP_TEST_CHECK(evalFails(&context, "(define (make-failing n) (lambda () (set! n (+ n 1)) (undefined-fn n))) ((make-failing 0))", RuntimeErrorCode::UnboundVariable));
+	MKLISP_TEST_CHECK(evalFails(&context, "(define (apply-to-1 f) (f 1)) (apply-to-1 2)", RuntimeErrorCode::UncallableTarget));
+	MKLISP_TEST_CHECK(context.frameStack.empty());
+	MKLISP_TEST_CHECK(context.valueStack.empty());
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(c1)"), 4));
+
+	return finish();
+}
@@ -0,0 +1,116 @@
+#include "test.h"
+#include <mklisp/builtins.h>
+#include <mklisp/compiler.h>
+#include <string>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+// Compiles the first form of the source and executes the code.
+static InternalExceptionPointer _compileAndExecute(Context *context, const char *src, Value &resultOut) {
+	HostRefHolder refHolder;
+	HostObjectRef<ListObject> forms = parseForms(context->runtime, refHolder, src);
+	MKLISP_TEST_CHECK(forms);
+	if (!forms)
+		return {};
+
+	Compiler compiler(context);
+	HostObjectRef<CodeObject> code;
+	MKLISP_RETURN_IF_EXCEPT(compiler.compile(forms->elements[0], code));
+	MKLISP_TEST_CHECK(code->instructions.size());
+
+	return context->runtime->execute(code.get(), context, resultOut);
+}
+
+// Returns the message of the compilation error, or an empty string if the
+// source compiles.
+static std::string _getCompilationError(Context *context, const char *src) {
+	Value result;
+	InternalExceptionPointer e = _compileAndExecute(context, src, result);
+	if (!e)
+		return {};
+
+	std::string message;
+	if (e->exceptionKind == InternalExceptionKind::CompilationError)
+		message = ((SyntaxError *)e.get())->message;
+	e.reset();
+	return message;
+}
+
+int main() {
+	Runtime runtime(std::pmr::get_default_resource());
+	Context context(&runtime);
+	bindArithmeticBuiltins(&context);
+
+	// Compiled code computes what the interpreter does.
+	{
+		static const char *const sources[] = {
+			"(+ 1 (* 2 3) (- 10 4))",
+			"(if (< 1 2) (+ 40 2) 0)",
+			"(let ((x 3) (y 4)) (+ (* x x) (* y y)))",
+			"((lambda (a b) (- a b)) 10 3)",
+			"(begin 1 2 3)",
+			"(quote 5)"
+		};
+
+		for (auto i : sources) {
+			Value expected = eval(&context, i);
+			MKLISP_TEST_CHECK(expected.valueType == ValueType::Int);
+			if (expected.valueType != ValueType::Int)
+				continue;
+
+			Value result;
+			InternalExceptionPointer e = _compileAndExecute(&context, i, result);
+			MKLISP_TEST_CHECK(!e);
+			e.reset();
+			MKLISP_TEST_CHECK(isInt(result, expected.exData.asInt));
+		}
+	}
+
+	// Code survives collections and may be executed any number of times.
+	{
+		HostRefHolder refHolder;
+		HostObjectRef<ListObject> forms = parseForms(&runtime, refHolder, "(let ((f (lambda (x) (* x 2)))) (+ (f 1) (f 2) (f 3)))");
+		Compiler compiler(&context);
+		HostObjectRef<CodeObject> code;
+		InternalExceptionPointer e = compiler.compile(forms->elements[0], code);
+		MKLISP_TEST_CHECK(!e);
+		e.reset();
+		MKLISP_TEST_CHECK(code->maxStackSize > 0);
+
+		for (int i = 0; i < 100; ++i) {
+			runtime.collectGarbage();
+
+			Value result;
+			e = runtime.execute(code.get(), &context, result);
+			MKLISP_TEST_CHECK(!e);
+			e.reset();
+			MKLISP_TEST_CHECK(isInt(result, 12));
+		}
+		MKLISP_TEST_CHECK(context.valueStack.empty());
+		MKLISP_TEST_CHECK(context.frameStack.empty());
+	}
+
+	// Malformed forms are rejected by the compiler.
+	MKLISP_TEST_CHECK(_getCompilationError(&context, "(undefined-fn 1)") == "Undefined symbol: undefined-fn");
+	MKLISP_TEST_CHECK(_getCompilationError(&context, "(if)") == "Malformed if");
+	MKLISP_TEST_CHECK(_getCompilationError(&context, "(lambda (1) 1)") == "Expecting a parameter name");
+	MKLISP_TEST_CHECK(_getCompilationError(&context, "(let ((x)) x)") == "Malformed let binding");
+
+	// Errors of the code are raised by the VM, which unwinds its frames.
+	{
+		Value result;
+		InternalExceptionPointer e = _compileAndExecute(&context, "((lambda (a) a) 1 2)", result);
+		MKLISP_TEST_CHECK(e && (e->exceptionKind == InternalExceptionKind::RuntimeError) && (((RuntimeError *)e.get())->errorCode == RuntimeErrorCode::ArityMismatch));
+		e.reset();
+
+		e = _compileAndExecute(&context, "(1 2)", result);
+		MKLISP_TEST_CHECK(e && (e->exceptionKind == InternalExceptionKind::RuntimeError) && (((RuntimeError *)e.get())->errorCode == RuntimeErrorCode::UncallableTarget));
+		e.reset();
+
+		MKLISP_TEST_CHECK(context.valueStack.empty());
+		MKLISP_TEST_CHECK(context.frameStack.empty());
+	}
+
+	return finish();
+}
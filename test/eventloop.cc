@@ -0,0 +1,237 @@
+#include "test.h"
+#include <mklisp/builtins.h>
+#include <mklisp/eventloop.h>
+#include <mklisp/scheduler.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#if MKLISP_EVENT_LOOP
+	#include <sys/epoll.h>
+	#include <unistd.h>
+#endif
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+static std::atomic_int32_t nDoneTasks = 0, nFailedTasks = 0, resultSum = 0;
+
+static void _onTaskDone(void *, Context *, InternalExceptionPointer &exception, const Value &result) {
+	if (exception) {
+		++nFailedTasks;
+		return;
+	}
+	++nDoneTasks;
+	if (result.valueType == ValueType::Int)
+		resultSum += result.exData.asInt;
+}
+
+static void _resetTasks() {
+	nDoneTasks = 0;
+	nFailedTasks = 0;
+	resultSum = 0;
+}
+
+static HostObjectRef<NativeFnObject> _allocAsync(Runtime *runtime, NativeFnCallback callback) {
+	HostObjectRef<NativeFnObject> fn = NativeFnObject::alloc(runtime, callback);
+	fn->isAsync = true;
+	return fn;
+}
+
+static std::vector<std::thread> completerThreads;
+
+// Completes the call with 40 from another thread, after the native has
+// returned.
+static void _waitLateFn(Context *context, ValueSpan) {
+	Scheduler *scheduler = Scheduler::getCurrent();
+	if ((!scheduler) || (!scheduler->suspendCall(context))) {
+		context->frameStack.back().returnValue = Value((int32_t)0);
+		return;
+	}
+	completerThreads.push_back(std::thread([scheduler, context] {
+		std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		scheduler->completeCall(context, Value((int32_t)40));
+	}));
+}
+
+// Completes the call with 2 before the native has returned.
+static void _waitEarlyFn(Context *context, ValueSpan) {
+	Scheduler *scheduler = Scheduler::getCurrent();
+	if ((!scheduler) || (!scheduler->suspendCall(context))) {
+		context->frameStack.back().returnValue = Value((int32_t)0);
+		return;
+	}
+	scheduler->completeCall(context, Value((int32_t)2));
+}
+
+static void _waitNeverFn(Context *context, ValueSpan) {
+	if (Scheduler *scheduler = Scheduler::getCurrent(); scheduler)
+		scheduler->suspendCall(context);
+}
+
+static void _testScheduler() {
+	Runtime runtime(std::pmr::get_default_resource());
+	Context c1(&runtime), c2(&runtime);
+	for (Context *i : { &c1, &c2 }) {
+		bindArithmeticBuiltins(i);
+		i->setBinding("wait-late", _allocAsync(&runtime, _waitLateFn).get());
+		i->setBinding("wait-early", _allocAsync(&runtime, _waitEarlyFn).get());
+		i->setBinding("wait-never", _allocAsync(&runtime, _waitNeverFn).get());
+	}
+
+	HostRefHolder refHolder;
+	HostObjectRef<ListObject> forms = parseForms(&runtime, refHolder, "(+ 2 (wait-late)) (+ 1 (wait-early) (wait-early)) (wait-never)");
+
+	// Calls are completed by other threads, or by the natives themselves.
+	_resetTasks();
+	{
+		Scheduler scheduler(std::pmr::get_default_resource(), 2);
+		scheduler.spawn(&c1, forms->elements[0], _onTaskDone, nullptr);
+		scheduler.spawn(&c2, forms->elements[1], _onTaskDone, nullptr);
+		scheduler.waitAll();
+	}
+	for (auto &i : completerThreads)
+		i.join();
+	completerThreads.clear();
+	MKLISP_TEST_CHECK((nDoneTasks == 2) && (nFailedTasks == 0) && (resultSum == 47));
+
+	// Tasks awaiting calls which are never completed are aborted with the
+	// scheduler.
+	{
+		Scheduler scheduler(std::pmr::get_default_resource(), 1);
+		scheduler.spawn(&c1, forms->elements[2], _onTaskDone, nullptr);
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	}
+	MKLISP_TEST_CHECK(nDoneTasks == 2);
+	MKLISP_TEST_CHECK(c1.frameStack.empty());
+	MKLISP_TEST_CHECK(c1.valueStack.empty());
+
+	// Outside of schedulers the natives complete the calls themselves.
+	MKLISP_TEST_CHECK(isInt(eval(&c1, "(+ 2 (wait-late))"), 2));
+}
+
+#if MKLISP_EVENT_LOOP
+static int pipeFds[2];
+static Context *postedContext;
+
+static void _waitReadableFn(Context *context, ValueSpan) {
+	EventLoop *loop = EventLoop::getCurrent();
+	if ((!loop) || (!loop->awaitFd(context, pipeFds[0], EPOLLIN)))
+		context->frameStack.back().returnValue = Value((int32_t)0);
+}
+
+static void _waitPostFn(Context *context, ValueSpan) {
+	EventLoop *loop = EventLoop::getCurrent();
+	if (loop && loop->suspendCall(context))
+		postedContext = context;
+	else
+		context->frameStack.back().returnValue = Value((int32_t)0);
+}
+
+static void _testEventLoop(uint32_t jitThreshold) {
+	Runtime runtime(std::pmr::get_default_resource());
+	runtime.jitThreshold = jitThreshold;
+
+	HostRefHolder refHolder;
+	HostObjectRef<ListObject> forms = parseForms(&runtime, refHolder,
+		"(sleep 50)"
+		"(begin (sleep 20) 3)"
+		"(k 40)"
+		"(h 50)"
+		"(+ 100 (wait-readable))"
+		"(+ 1000 (wait-post))"
+		"(loop 0)"
+		"(+ 1 (k 10) undefined-thing)");
+
+	std::vector<std::unique_ptr<Context>> contexts;
+	for (size_t i = 0; i < 100; ++i) {
+		contexts.push_back(std::make_unique<Context>(&runtime));
+		Context *context = contexts.back().get();
+		bindArithmeticBuiltins(context);
+		bindEventLoopBuiltins(context);
+		context->setBinding("wait-readable", _allocAsync(&runtime, _waitReadableFn).get());
+		context->setBinding("wait-post", _allocAsync(&runtime, _waitPostFn).get());
+		MKLISP_TEST_CHECK(isInt(eval(context,
+									 "(define (k n) (begin (sleep n) (+ n 1)))"
+									 "(define (h n) (if (= n 0) 7 (begin (sleep 0) (h (- n 1)))))"
+									 "(define (loop n) (loop (+ n 1)))"
+									 "0"),
+							  0));
+	}
+
+	{
+		EventLoop loop(std::pmr::get_default_resource());
+
+		// Sleeping tasks wait together.
+		_resetTasks();
+		auto startTime = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < 100; ++i)
+			loop.spawn(contexts[i].get(), forms->elements[i % 4], _onTaskDone, nullptr);
+		loop.run();
+		MKLISP_TEST_CHECK(std::chrono::steady_clock::now() - startTime < std::chrono::seconds(2));
+		MKLISP_TEST_CHECK((nDoneTasks == 100) && (nFailedTasks == 0));
+		MKLISP_TEST_CHECK(resultSum == 25 * (3 + 41 + 7));
+
+		// Calls are completed by descriptors, posted calls, and errors unwind
+		// the suspended calls.
+		_resetTasks();
+		loop.spawn(contexts[0].get(), forms->elements[4], _onTaskDone, nullptr);
+		loop.spawn(contexts[1].get(), forms->elements[5], _onTaskDone, nullptr);
+		loop.spawn(contexts[2].get(), forms->elements[7], _onTaskDone, nullptr);
+		std::thread writer([] {
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+			MKLISP_TEST_CHECK(write(pipeFds[1], "x", 1) == 1);
+		});
+		std::thread poster([&loop] {
+			std::this_thread::sleep_for(std::chrono::milliseconds(40));
+			loop.post([](EventLoop *loop, void *) { loop->completeCall(postedContext, Value((int32_t)42)); }, nullptr);
+		});
+		loop.run();
+		writer.join();
+		poster.join();
+		char buf[1];
+		MKLISP_TEST_CHECK(read(pipeFds[0], buf, 1) == 1);
+		MKLISP_TEST_CHECK((nDoneTasks == 2) && (nFailedTasks == 1));
+		MKLISP_TEST_CHECK(resultSum == 100 + EPOLLIN + 1042);
+
+		// Tasks which never return do not keep the others from completing,
+		// and are aborted once the loop has been stopped.
+		_resetTasks();
+		loop.spawn(contexts[0].get(), forms->elements[6], _onTaskDone, nullptr);
+		for (size_t i = 1; i < 50; ++i)
+			loop.spawn(contexts[i].get(), forms->elements[2], _onTaskDone, nullptr);
+		std::thread stopper([&loop] {
+			std::this_thread::sleep_for(std::chrono::milliseconds(300));
+			loop.stop();
+		});
+		loop.run();
+		stopper.join();
+		MKLISP_TEST_CHECK(nDoneTasks == 49);
+	}
+
+	for (auto &i : contexts) {
+		MKLISP_TEST_CHECK(i->frameStack.empty());
+		MKLISP_TEST_CHECK(i->valueStack.empty());
+	}
+
+	// Outside of loops `sleep` blocks.
+	auto startTime = std::chrono::steady_clock::now();
+	MKLISP_TEST_CHECK(isInt(eval(contexts[0].get(), "(k 40)"), 41));
+	MKLISP_TEST_CHECK(std::chrono::steady_clock::now() - startTime >= std::chrono::milliseconds(40));
+}
+#endif
+
+int main() {
+	_testScheduler();
+
+#if MKLISP_EVENT_LOOP
+	MKLISP_TEST_CHECK(pipe(pipeFds) == 0);
+	_testEventLoop(0);
+	_testEventLoop(1);
+	close(pipeFds[0]);
+	close(pipeFds[1]);
+#endif
+
+	return finish();
+}
@@ -0,0 +1,77 @@
+#include "test.h"
+#include <mklisp/builtins.h>
+#include <string>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+// Returns `(+ 1 (+ 1 ... 0))` nested `depth` times.
+static std::string _makeNestedSource(int depth) {
+	std::string src;
+	for (int i = 0; i < depth; ++i)
+		src += "(+ 1 ";
+	src += "0";
+	for (int i = 0; i < depth; ++i)
+		src += ")";
+	return src;
+}
+
+int main() {
+	Runtime runtime(std::pmr::get_default_resource());
+	Context context(&runtime);
+	bindArithmeticBuiltins(&context);
+
+	HostRefHolder refHolder;
+	std::string src = _makeNestedSource(200);
+	HostObjectRef<ListObject> forms = parseForms(&runtime, refHolder, src.c_str());
+	MKLISP_TEST_CHECK(forms);
+	if (!forms)
+		return finish();
+
+	// Frames are reused by later evaluations.
+	{
+		Value result;
+		InternalExceptionPointer e = runtime.eval(forms->elements[0], &context, result);
+		MKLISP_TEST_CHECK(!e);
+		e.reset();
+		MKLISP_TEST_CHECK(isInt(result, 200));
+
+		size_t frameCapacity = context.frameStack.capacity();
+		for (int i = 0; i < 100; ++i) {
+			e = runtime.eval(forms->elements[0], &context, result);
+			MKLISP_TEST_CHECK(!e);
+			e.reset();
+		}
+		MKLISP_TEST_CHECK(context.frameStack.capacity() == frameCapacity);
+		MKLISP_TEST_CHECK(context.frameStack.empty());
+	}
+
+	// Evaluations deeper than the limit fail and unwind their frames.
+	{
+		context.maxFrameDepth = 50;
+
+		Value result;
+		InternalExceptionPointer e = runtime.eval(forms->elements[0], &context, result);
+		MKLISP_TEST_CHECK(e && (((RuntimeError *)e.get())->errorCode == RuntimeErrorCode::StackOverflow));
+		if (e)
+			MKLISP_TEST_CHECK(((StackOverflowError *)e.get())->depth == 50);
+		e.reset();
+		MKLISP_TEST_CHECK(context.frameStack.empty());
+		MKLISP_TEST_CHECK(context.valueStack.empty());
+
+		// Compiled code is limited as well.
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(define (depth n) (if (= n 0) 0 (+ 1 (depth (- n 1))))) (depth 40)"), 40));
+		MKLISP_TEST_CHECK(evalFails(&context, "(depth 100)", RuntimeErrorCode::StackOverflow));
+		MKLISP_TEST_CHECK(context.frameStack.empty());
+		MKLISP_TEST_CHECK(context.valueStack.empty());
+
+		context.maxFrameDepth = DEFAULT_MAX_FRAME_DEPTH;
+		e = runtime.eval(forms->elements[0], &context, result);
+		MKLISP_TEST_CHECK(!e);
+		e.reset();
+		MKLISP_TEST_CHECK(isInt(result, 200));
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(depth 1000)"), 1000));
+	}
+
+	return finish();
+}
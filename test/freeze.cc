@@ -0,0 +1,93 @@
+#include "test.h"
+#include <mklisp/builtins.h>
+#include <thread>
+#include <vector>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+int main() {
+	Runtime runtime(std::pmr::get_default_resource());
+	Context context(&runtime);
+	bindArithmeticBuiltins(&context);
+
+	HostRefHolder refHolder;
+	HostObjectRef<ListObject> forms = parseForms(&runtime, refHolder, "(+ 1 (* 2 3)) (quote (1 (2 3)))");
+	MKLISP_TEST_CHECK(forms);
+	if (!forms)
+		return finish();
+
+	runtime.freeze(forms.get());
+	MKLISP_TEST_CHECK(forms->isFrozen());
+
+	// Everything reachable is frozen.
+	ListObject *call = (ListObject *)forms->elements[0].exData.asObject;
+	MKLISP_TEST_CHECK(call->isFrozen());
+	MKLISP_TEST_CHECK(call->elements[2].exData.asObject->isFrozen());
+
+	// Frozen forms are evaluated like other forms, any number of times.
+	for (int i = 0; i < 2; ++i) {
+		Value result;
+		InternalExceptionPointer e = runtime.eval(forms->elements[0], &context, result);
+		MKLISP_TEST_CHECK(!e);
+		e.reset();
+		MKLISP_TEST_CHECK(isInt(result, 7));
+	}
+
+	// Mutations are rejected and leave the objects as they are.
+	{
+		InternalExceptionPointer e = call->pushBack(Value((int32_t)1));
+		MKLISP_TEST_CHECK(e && (((RuntimeError *)e.get())->errorCode == RuntimeErrorCode::FrozenObjectMutation));
+		e.reset();
+
+		e = call->setElement(1, Value((int32_t)2));
+		MKLISP_TEST_CHECK(e && (((RuntimeError *)e.get())->errorCode == RuntimeErrorCode::FrozenObjectMutation));
+		e.reset();
+
+		MKLISP_TEST_CHECK((call->elements.size() == 3) && isInt(call->elements[1], 1));
+	}
+
+	// Frozen objects are collected once they are no longer referred to, the
+	// ones which are still referred to survive.
+	{
+		Object *quoted;
+		{
+			HostRefHolder formsRefHolder;
+			HostObjectRef<ListObject> otherForms = parseForms(&runtime, formsRefHolder, "(quote (4 5))");
+			runtime.freeze(otherForms.get());
+			quoted = otherForms.get();
+		}
+		runtime.collectGarbage();
+		runtime.collectYoungGarbage();
+
+		bool isFound = false;
+		for (auto i : runtime.createdObjects)
+			isFound |= i == quoted;
+		MKLISP_TEST_CHECK(!isFound);
+		MKLISP_TEST_CHECK(call->isFrozen() && isInt(call->elements[1], 1));
+	}
+
+	// Frozen objects may be read from any thread, even while they are being
+	// collected.
+	{
+		std::vector<std::thread> threads;
+		std::atomic_size_t nMatches = 0;
+
+		for (int i = 0; i < 4; ++i) {
+			threads.push_back(std::thread([call, &nMatches]() {
+				size_t n = 0;
+				for (int j = 0; j < 1000; ++j)
+					n += call->isFrozen() && isInt(call->elements[1], 1);
+				nMatches += n;
+			}));
+		}
+		for (int i = 0; i < 10; ++i)
+			runtime.collectGarbage();
+		for (auto &i : threads)
+			i.join();
+
+		MKLISP_TEST_CHECK(nMatches == 4000);
+	}
+
+	return finish();
+}
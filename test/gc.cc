@@ -0,0 +1,77 @@
+#include "test.h"
+#include <mklisp/builtins.h>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+static bool _isAlive(Runtime *runtime, Object *object) {
+	for (auto i : runtime->createdObjects) {
+		if (i == object)
+			return true;
+	}
+	return false;
+}
+
+int main() {
+	Runtime runtime(std::pmr::get_default_resource());
+	runtime.gcThreshold = runtime.minGcThreshold = 64 * 1024;
+	Context context(&runtime);
+	bindArithmeticBuiltins(&context);
+
+	// Objects referred to by the host or by bindings survive, cycles which
+	// nothing refers to do not.
+	{
+		HostObjectRef<ListObject> held = ListObject::alloc(&runtime);
+		HostObjectRef<ListObject> bound = ListObject::alloc(&runtime);
+		context.setBinding("bound", bound.get());
+		Object *child, *cycle;
+		{
+			HostObjectRef<StringObject> s = StringObject::alloc(&runtime, std::pmr::string("child"));
+			MKLISP_TEST_CHECK(!held->pushBack(Value(s.get())));
+			child = s.get();
+
+			HostObjectRef<ListObject> l = ListObject::alloc(&runtime);
+			MKLISP_TEST_CHECK(!l->pushBack(Value(l.get())));
+			cycle = l.get();
+		}
+		Object *boundObject = bound.get();
+		bound = {};
+
+		runtime.collectGarbage();
+		MKLISP_TEST_CHECK(_isAlive(&runtime, held.get()));
+		MKLISP_TEST_CHECK(_isAlive(&runtime, child));
+		MKLISP_TEST_CHECK(_isAlive(&runtime, boundObject));
+		MKLISP_TEST_CHECK(!_isAlive(&runtime, cycle));
+
+		context.removeBinding("bound");
+		runtime.collectGarbage();
+		MKLISP_TEST_CHECK(!_isAlive(&runtime, boundObject));
+	}
+
+	// Evaluations which allocate keep the heap bounded.
+	{
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(define (count n acc) (if (= n 0) acc (count (- n 1) (+ acc 1)))) 0"), 0));
+
+		size_t maxObjects = 0;
+		for (int i = 0; i < 2000; ++i) {
+			MKLISP_TEST_CHECK(isInt(eval(&context, "(count 10 0)"), 10));
+			maxObjects = std::max(maxObjects, runtime.createdObjects.size());
+		}
+		MKLISP_TEST_CHECK(maxObjects < 10000);
+	}
+
+	// Failed evaluations leave nothing behind.
+	{
+		MKLISP_TEST_CHECK(evalFails(&context, "(count 10 (undefined-fn))", RuntimeErrorCode::UnboundVariable));
+		MKLISP_TEST_CHECK(context.frameStack.empty());
+		MKLISP_TEST_CHECK(context.valueStack.empty());
+
+		runtime.collectGarbage();
+		size_t nObjects = runtime.createdObjects.size();
+		MKLISP_TEST_CHECK(evalFails(&context, "(count 10 (undefined-fn))", RuntimeErrorCode::UnboundVariable));
+		runtime.collectGarbage();
+		MKLISP_TEST_CHECK(runtime.createdObjects.size() == nObjects);
+	}
+
+	return finish();
+}
@@ -0,0 +1,90 @@
+#include "test.h"
+#include <mklisp/heapstats.h>
+#include <cstdio>
+#include <string>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+static void _append(void *userData, const char *data, size_t size) {
+	((std::string *)userData)->append(data, size);
+}
+
+int main() {
+	Runtime runtime(std::pmr::get_default_resource());
+	Context context(&runtime);
+
+	HostObjectRef<ListObject> big = ListObject::alloc(&runtime);
+	context.setBinding("big\"list", big.get());
+	for (int i = 0; i < 1000; ++i)
+		MKLISP_TEST_CHECK(!big->pushBack(Value(StringObject::alloc(&runtime, std::pmr::string(100, 'x')).get())));
+
+	HostObjectRef<ListObject> small = ListObject::alloc(&runtime);
+	MKLISP_TEST_CHECK(!small->pushBack(Value(StringObject::alloc(&runtime, std::pmr::string("y")).get())));
+
+	// Objects are counted by type, the list referring to the most strings is
+	// their top retainer.
+	HeapStats prevStats, stats;
+	collectHeapStats(&runtime, prevStats);
+	for (int i = 0; i < 10000; ++i)
+		StringObject::alloc(&runtime, std::pmr::string("z"));
+	collectHeapStats(&runtime, stats);
+	{
+		HeapObjectTypeStats &stringStats = stats.typeStats[(size_t)ObjectType::String];
+		MKLISP_TEST_CHECK(stringStats.nObjects >= 1001);
+		MKLISP_TEST_CHECK(stringStats.szObjects >= 1000 * 100);
+		MKLISP_TEST_CHECK(stringStats.nTopRetainers >= 2);
+		MKLISP_TEST_CHECK(stringStats.topRetainers[0].retainer == big.get());
+		MKLISP_TEST_CHECK(stringStats.topRetainers[0].nRetained == 1000);
+		MKLISP_TEST_CHECK(stringStats.topRetainers[0].szRetained >= stringStats.topRetainers[1].szRetained);
+
+		size_t nObjectsInHistogram = 0;
+		for (auto i : stringStats.sizeHistogram)
+			nObjectsInHistogram += i;
+		MKLISP_TEST_CHECK(nObjectsInHistogram == stringStats.nObjects);
+
+		size_t nObjects = 0;
+		for (auto &i : stats.typeStats)
+			nObjects += i.nObjects;
+		MKLISP_TEST_CHECK(nObjects == stats.nObjects);
+		MKLISP_TEST_CHECK(stats.nContexts == 1);
+
+		MKLISP_TEST_CHECK(stats.nTotalCreatedObjects >= prevStats.nTotalCreatedObjects + 10000);
+		MKLISP_TEST_CHECK(getAllocationRate(prevStats, stats) > 0);
+		MKLISP_TEST_CHECK(getAllocationRate(stats, stats) == 0);
+	}
+
+	// Metrics are written in the text exposition format.
+	{
+		std::string metrics;
+		writePrometheusMetrics(stats, _append, &metrics);
+		MKLISP_TEST_CHECK(metrics.find("# TYPE mklisp_heap_objects gauge\n") != std::string::npos);
+		MKLISP_TEST_CHECK(metrics.find("mklisp_heap_objects{type=\"string\"} ") != std::string::npos);
+		MKLISP_TEST_CHECK(metrics.find("mklisp_heap_object_size_bytes_bucket{type=\"string\",le=\"+Inf\"} ") != std::string::npos);
+		MKLISP_TEST_CHECK(metrics.find("mklisp_heap_created_objects_total ") != std::string::npos);
+	}
+
+	// Snapshots hold the objects, their references and the roots, names are
+	// escaped.
+	{
+		std::string snapshot;
+		writeHeapSnapshot(&runtime, _append, &snapshot);
+
+		char bigId[64];
+		snprintf(bigId, sizeof(bigId), "{\"id\":%zu,\"type\":\"list\"", (size_t)(uintptr_t)big.get());
+		MKLISP_TEST_CHECK(snapshot.find(bigId) != std::string::npos);
+		MKLISP_TEST_CHECK(snapshot.find("\"name\":\"big\\\"list\"") != std::string::npos);
+		MKLISP_TEST_CHECK(snapshot.rfind("\n]}\n") == snapshot.size() - 4);
+	}
+
+	// Files which cannot be written are reported.
+	{
+		MKLISP_TEST_CHECK(!writePrometheusMetricsToFile(stats, "/nonexistent/metrics.txt"));
+		MKLISP_TEST_CHECK(!writeHeapSnapshotToFile(&runtime, "/nonexistent/snapshot.json"));
+
+		MKLISP_TEST_CHECK(writeHeapSnapshotToFile(&runtime, "test_heapstats_snapshot.json"));
+		remove("test_heapstats_snapshot.json");
+	}
+
+	return finish();
+}
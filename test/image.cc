@@ -0,0 +1,91 @@
+#include "test.h"
+#include <mklisp/builtins.h>
+#include <mklisp/image.h>
+#include <thread>
+#include <vector>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+int main() {
+	RuntimeImage image(std::pmr::get_default_resource());
+	Object *garbage;
+	{
+		Context context(&image.baseRuntime);
+		bindArithmeticBuiltins(&context);
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(define (square x) (* x x)) (define data (quote (1 2 3))) 0"), 0));
+		garbage = StringObject::alloc(&image.baseRuntime, std::pmr::string("garbage")).get();
+
+		image.seal(&context);
+	}
+	MKLISP_TEST_CHECK(image.isSealed);
+
+	// Objects which are not reachable from the bindings are collected, the
+	// others are frozen.
+	{
+		bool isGarbageFound = false;
+		for (auto i : image.baseRuntime.createdObjects)
+			isGarbageFound |= i == garbage;
+		MKLISP_TEST_CHECK(!isGarbageFound);
+
+		bool isFrozen = true;
+		for (auto i : image.baseRuntime.createdObjects)
+			isFrozen &= i->isFrozen();
+		MKLISP_TEST_CHECK(isFrozen);
+	}
+
+	// Children see the bindings of the image, their own bindings shadow them.
+	{
+		Runtime child(std::pmr::get_default_resource(), &image);
+		Context context(&child);
+		MKLISP_TEST_CHECK(image.nChildRuntimes == 1);
+
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(square 4)"), 16));
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(define (square x) (+ x 1)) (square 4)"), 5));
+
+		Runtime otherChild(std::pmr::get_default_resource(), &image);
+		Context otherContext(&otherChild);
+		MKLISP_TEST_CHECK(isInt(eval(&otherContext, "(square 4)"), 16));
+
+		// Objects of the image cannot be changed by the children.
+		ListObject *data = (ListObject *)context.getBinding("data").exData.asObject;
+		InternalExceptionPointer e = data->pushBack(Value((int32_t)4));
+		MKLISP_TEST_CHECK(e && (((RuntimeError *)e.get())->errorCode == RuntimeErrorCode::FrozenObjectMutation));
+		e.reset();
+		MKLISP_TEST_CHECK(data->elements.size() == 3);
+
+		// Nor collected by them.
+		child.collectGarbage();
+		MKLISP_TEST_CHECK(isInt(eval(&otherContext, "(square 5)"), 25));
+		MKLISP_TEST_CHECK(isInt(data->elements[2], 3));
+	}
+	MKLISP_TEST_CHECK(image.nChildRuntimes == 0);
+
+	// Children run on any thread at once.
+	{
+		std::vector<std::thread> threads;
+		std::atomic_size_t nSucceeded = 0;
+
+		for (int i = 0; i < 4; ++i) {
+			threads.push_back(std::thread([&image, &nSucceeded, i]() {
+				for (int j = 0; j < 50; ++j) {
+					Runtime child(std::pmr::get_default_resource(), &image);
+					Context context(&child);
+					Value result;
+					if (InternalExceptionPointer e = evalSource(&context, "(define (twice x) (+ x x)) (twice (square 3))", result); e) {
+						e.reset();
+						continue;
+					}
+					child.collectGarbage();
+					nSucceeded += isInt(result, 18);
+				}
+			}));
+		}
+		for (auto &i : threads)
+			i.join();
+
+		MKLISP_TEST_CHECK(nSucceeded == 200);
+	}
+
+	return finish();
+}
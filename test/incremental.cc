@@ -0,0 +1,119 @@
+#include "test.h"
+#include <mklisp/builtins.h>
+#include <random>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+// Returns true if all elements of the lists in `root` are strings "x".
+static bool _isIntact(ListObject *root) {
+	for (auto &i : root->elements) {
+		for (auto &j : ((ListObject *)i.exData.asObject)->elements) {
+			if (!isString(j, "x"))
+				return false;
+		}
+	}
+	return true;
+}
+
+int main() {
+	Runtime runtime(std::pmr::get_default_resource());
+	runtime.gcMode = GCMode::Incremental;
+	runtime.gcSliceWorkBudget = 50;
+	runtime.gcThreshold = runtime.minGcThreshold = 64 * 1024;
+	Context context(&runtime);
+	bindArithmeticBuiltins(&context);
+
+	// A collection is split into slices.
+	{
+		HostObjectRef<ListObject> root = ListObject::alloc(&runtime);
+		for (int i = 0; i < 1000; ++i)
+			MKLISP_TEST_CHECK(!root->pushBack(Value(ListObject::alloc(&runtime).get())));
+
+		size_t nPauses = runtime.gcPauseStats.nPauses;
+		size_t nMajorCollections = runtime.gcPauseStats.nMajorCollections;
+		runtime.performGcSlice();
+		MKLISP_TEST_CHECK(runtime.gcPhase != GCPhase::Idle);
+
+		size_t nSlices = 1;
+		while (runtime.gcPhase != GCPhase::Idle) {
+			runtime.performGcSlice();
+			++nSlices;
+		}
+		MKLISP_TEST_CHECK(nSlices > 2);
+		MKLISP_TEST_CHECK(runtime.gcPauseStats.nPauses == nPauses + nSlices);
+		MKLISP_TEST_CHECK(runtime.gcPauseStats.nMajorCollections == nMajorCollections + 1);
+		MKLISP_TEST_CHECK(runtime.gcPauseStats.maxPauseTime >= runtime.gcPauseStats.lastPauseTime);
+
+		size_t nPausesInHistogram = 0;
+		for (auto i : runtime.gcPauseStats.pauseHistogram)
+			nPausesInHistogram += i;
+		MKLISP_TEST_CHECK(nPausesInHistogram == runtime.gcPauseStats.nPauses);
+	}
+
+	// Objects moved around while marking is in progress survive.
+	{
+		std::mt19937 rng(42);
+		HostObjectRef<ListObject> root = ListObject::alloc(&runtime);
+		for (int i = 0; i < 64; ++i)
+			MKLISP_TEST_CHECK(!root->pushBack(Value(ListObject::alloc(&runtime).get())));
+
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(define (make-adder n) (lambda (x) (+ x n))) 0"), 0));
+		HostRefHolder refHolder;
+		HostObjectRef<ListObject> forms = parseForms(&runtime, refHolder, "((make-adder 1) 2)");
+
+		bool isIntact = true;
+		for (int i = 0; i < 50000; ++i) {
+			ListObject *slot = (ListObject *)root->elements[rng() % 64].exData.asObject;
+			switch (rng() % 4) {
+				case 0:
+					MKLISP_TEST_CHECK(!slot->pushBack(Value(StringObject::alloc(&runtime, std::pmr::string("x")).get())));
+					break;
+				case 1:
+					MKLISP_TEST_CHECK(!root->setElement(rng() % 64, Value(ListObject::alloc(&runtime).get())));
+					break;
+				case 2:
+					if (slot->elements.size()) {
+						Value value = slot->elements.back();
+						ListObject *other = (ListObject *)root->elements[rng() % 64].exData.asObject;
+						MKLISP_TEST_CHECK(!slot->popBack());
+						MKLISP_TEST_CHECK(!other->pushBack(value));
+					}
+					break;
+				case 3: {
+					Value result;
+					InternalExceptionPointer e = runtime.eval(forms->elements[0], &context, result);
+					MKLISP_TEST_CHECK(!e);
+					e.reset();
+					MKLISP_TEST_CHECK(isInt(result, 3));
+					break;
+				}
+			}
+			runtime.checkGarbageCollection();
+
+			if (!(i % 5000))
+				isIntact &= _isIntact(root.get());
+		}
+		MKLISP_TEST_CHECK(isIntact);
+		MKLISP_TEST_CHECK(runtime.gcPauseStats.nMajorCollections > 1);
+	}
+
+	// Evaluations failing in the middle of a collection leave it consistent.
+	{
+		HostObjectRef<ListObject> kept = ListObject::alloc(&runtime);
+		MKLISP_TEST_CHECK(!kept->pushBack(Value(StringObject::alloc(&runtime, std::pmr::string("x")).get())));
+
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(define (fail x) (undefined-fn x)) 0"), 0));
+		runtime.performGcSlice();
+		for (int i = 0; i < 100; ++i) {
+			MKLISP_TEST_CHECK(evalFails(&context, "((make-adder 1) (fail 2))", RuntimeErrorCode::UnboundVariable));
+			runtime.checkGarbageCollection();
+		}
+		runtime.collectGarbage();
+		MKLISP_TEST_CHECK(runtime.gcPhase == GCPhase::Idle);
+		MKLISP_TEST_CHECK(isString(kept->elements[0], "x"));
+		MKLISP_TEST_CHECK(isInt(eval(&context, "((make-adder 1) 2)"), 3));
+	}
+
+	return finish();
+}
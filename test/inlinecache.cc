@@ -0,0 +1,86 @@
+#include "test.h"
+#include <mklisp/builtins.h>
+#include <mklisp/heapstats.h>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+static void _addFn(Context *context, ValueSpan args) {
+	context->frameStack.back().returnValue = Value((int32_t)(args[0].exData.asInt + args[1].exData.asInt));
+}
+
+static void _multiplyFn(Context *context, ValueSpan args) {
+	context->frameStack.back().returnValue = Value((int32_t)(args[0].exData.asInt * args[1].exData.asInt));
+}
+
+static size_t _countClosures(Runtime *runtime) {
+	HeapStats stats;
+	collectHeapStats(runtime, stats);
+	return stats.typeStats[(size_t)ObjectType::Closure].nObjects;
+}
+
+int main() {
+	Runtime runtime(std::pmr::get_default_resource());
+	runtime.jitThreshold = 0;
+	Context context(&runtime);
+	bindArithmeticBuiltins(&context);
+	context.setBinding("op", NativeFnObject::alloc(&runtime, _addFn).get());
+
+	// Calls of the same callee hit the cache, rebinding it invalidates them.
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define (loop n acc) (if (= n 0) acc (loop (- n 1) (op acc 2)))) 0"), 0));
+	size_t nHits = context.nCallSiteCacheHits;
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(loop 1000 1)"), 2001));
+	MKLISP_TEST_CHECK(context.nCallSiteCacheHits >= nHits + 2000);
+
+	context.setBinding("op", NativeFnObject::alloc(&runtime, _multiplyFn).get());
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(loop 10 1)"), 1024));
+
+	// Sites calling several callees keep them all.
+	{
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(define (apply2 f a b) (f a b)) (define (sub3 a b) (- a b 3)) 0"), 0));
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(apply2 + 1 2) (apply2 - 10 1) (apply2 sub3 10 1)"), 6));
+
+		nHits = context.nCallSiteCacheHits;
+		size_t nMisses = context.nCallSiteCacheMisses;
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(+ (apply2 + 1 2) (apply2 - 10 1) (apply2 sub3 10 1))"), 18));
+		MKLISP_TEST_CHECK(context.nCallSiteCacheHits >= nHits + 3);
+		MKLISP_TEST_CHECK(context.nCallSiteCacheMisses < nMisses + 3);
+	}
+
+	// Callees which are only cached are released once the entries are stale.
+	{
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(define (make k) (lambda (a b) (+ a b k))) (define (many n) (if (= n 0) 0 (begin (apply2 (make n) 1 1) (many (- n 1))))) (many 200)"), 0));
+		runtime.collectGarbage();
+		size_t nClosures = _countClosures(&runtime);
+
+		context.setBinding("op", NativeFnObject::alloc(&runtime, _addFn).get());
+		runtime.collectGarbage();
+		MKLISP_TEST_CHECK(_countClosures(&runtime) < nClosures);
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(loop 5 0)"), 10));
+	}
+
+	// Assigning integers does not invalidate the caches.
+	{
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(define counter 0) 0"), 0));
+		size_t bindingVersion = runtime.bindingVersion;
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(set! counter 5) (set! counter 6) counter"), 6));
+		MKLISP_TEST_CHECK(runtime.bindingVersion == bindingVersion);
+	}
+
+	// Cached callees which are rebound to values which cannot be called, or
+	// unbound, are not called.
+	{
+		context.setBinding("op", Value((int32_t)1));
+		MKLISP_TEST_CHECK(evalFails(&context, "(loop 5 0)", RuntimeErrorCode::UncallableTarget));
+
+		context.removeBinding("op");
+		MKLISP_TEST_CHECK(evalFails(&context, "(loop 5 0)", RuntimeErrorCode::UnboundVariable));
+		MKLISP_TEST_CHECK(context.frameStack.empty());
+		MKLISP_TEST_CHECK(context.valueStack.empty());
+
+		context.setBinding("op", NativeFnObject::alloc(&runtime, _addFn).get());
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(loop 5 0)"), 10));
+	}
+
+	return finish();
+}
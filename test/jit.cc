@@ -0,0 +1,157 @@
+#include "test.h"
+#include <mklisp/builtins.h>
+#include <mklisp/jit.h>
+#include <string>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+static void _collectGarbageFn(Context *context, ValueSpan) {
+	context->runtime->collectGarbage();
+	context->frameStack.back().returnValue = Value((int32_t)0);
+}
+
+static void _throwFn(Context *, ValueSpan) {
+	throw std::bad_alloc();
+}
+
+static void _identityFn(Context *context, ValueSpan args) {
+	context->frameStack.back().returnValue = args.size ? args[0] : Value(ValueType::Nil);
+}
+
+// Appends the results of the forms of the source to `out`.
+static void _run(Context *context, const char *src, std::string &out) {
+	HostRefHolder refHolder;
+	HostObjectRef<ListObject> forms = parseForms(context->runtime, refHolder, src);
+	MKLISP_TEST_CHECK(forms);
+	if (!forms)
+		return;
+
+	for (auto &i : forms->elements) {
+		Value result;
+		if (InternalExceptionPointer e = context->runtime->eval(i, context, result); e) {
+			out += "error";
+			if (e->exceptionKind == InternalExceptionKind::RuntimeError)
+				out += std::to_string((int)((RuntimeError *)e.get())->errorCode);
+			e.reset();
+		} else {
+			switch (result.valueType) {
+				case ValueType::Int:
+					out += std::to_string(result.exData.asInt);
+					break;
+				case ValueType::Long:
+					out += std::to_string(result.exData.asLong) + "L";
+					break;
+				case ValueType::Nil:
+					out += "nil";
+					break;
+				default:
+					out += "type" + std::to_string((int)result.valueType);
+			}
+		}
+		out += " ";
+	}
+}
+
+static bool _isJitCompiled(Context *context, const char *name) {
+	Value value = context->getBinding(name);
+	if (value.valueType != ValueType::Object)
+		return false;
+
+	switch (value.exData.asObject->getObjectType()) {
+		case ObjectType::Code:
+			return ((CodeObject *)value.exData.asObject)->jitCode;
+		case ObjectType::Closure:
+			return ((ClosureObject *)value.exData.asObject)->code->jitCode;
+		default:
+			return false;
+	}
+}
+
+// Returns the results of a session with the threshold, the interpreter is the
+// reference.
+static std::string _runSession(uint32_t jitThreshold) {
+	Runtime runtime(std::pmr::get_default_resource());
+	runtime.jitThreshold = jitThreshold;
+	Context context(&runtime);
+	bindArithmeticBuiltins(&context);
+	context.setBinding("gc", NativeFnObject::alloc(&runtime, _collectGarbageFn).get());
+	context.setBinding("boom", NativeFnObject::alloc(&runtime, _throwFn).get());
+
+	std::string out;
+	_run(&context, "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))) (fib 20) (fib 1)", out);
+	_run(&context, "(define (sum n acc) (if (= n 0) acc (sum (- n 1) (+ acc n)))) (sum 100000 0)", out);
+
+	// Guards of the integer fast paths fall back to the natives.
+	_run(&context, "(define (add a b) (+ a b)) (define (mul a b) (* a b)) (define (sub a b) (- a b)) (define (lt a b) (< a b)) 0", out);
+	for (int i = 0; i < 5; ++i)
+		_run(&context, "(add 3 4) (add 2147483647 1) (mul 65536 65536) (sub (- 0 2147483647) 2) (lt 1 2) (lt 2 1) (add (quote x) 1)", out);
+
+	// Callees rebound after the code has been compiled are called.
+	_run(&context, "(define (loop n acc) (if (= n 0) acc (loop (- n 1) (+ acc 2)))) (loop 50 0) (loop 50 0)", out);
+	_run(&context, "(define + -) (loop 50 0)", out);
+	bindArithmeticBuiltins(&context);
+	_run(&context, "(loop 50 0)", out);
+
+	// Closures, boxes and globals.
+	_run(&context, "(define total 0) (define (make) (let ((c 0)) (lambda () (set! c (+ c 1)) (set! total (+ total c)) c)))", out);
+	_run(&context, "(define (drive f n) (if (= n 0) (f) (begin (f) (drive f (- n 1))))) (drive (make) 100) total", out);
+
+	// Collections during native calls, exceptions thrown by natives and
+	// unbound globals.
+	_run(&context, "(define (collect n) (if (= n 0) 0 (begin (gc) (+ (fib 5) (collect (- n 1)))))) (collect 30)", out);
+	_run(&context, "(define (bad n) (if (= n 0) (boom) (bad (- n 1)))) (bad 10) (bad 10)", out);
+	_run(&context, "(define (unbound n) (if (= n 0) (undefined-fn) (unbound (- n 1)))) (unbound 10) (unbound 10)", out);
+	_run(&context, "(fib 10)", out);
+
+	MKLISP_TEST_CHECK(context.frameStack.empty());
+	MKLISP_TEST_CHECK(context.valueStack.empty());
+
+	if (MKLISP_JIT && jitThreshold) {
+		MKLISP_TEST_CHECK(_isJitCompiled(&context, "fib"));
+		MKLISP_TEST_CHECK(_isJitCompiled(&context, "sum"));
+	} else
+		MKLISP_TEST_CHECK(!_isJitCompiled(&context, "fib"));
+
+	return out;
+}
+
+int main() {
+	std::string expected = _runSession(0);
+	MKLISP_TEST_CHECK(expected.find(" 6765 1 ") != std::string::npos);
+	MKLISP_TEST_CHECK(expected.find(" 5000050000L ") != std::string::npos);
+	MKLISP_TEST_CHECK(expected.find(" 2147483648L 4294967296L -2147483649L ") != std::string::npos);
+	MKLISP_TEST_CHECK(expected.find("error") != std::string::npos);
+
+	for (uint32_t i : { 1, 2, 10 }) {
+		std::string out = _runSession(i);
+		MKLISP_TEST_CHECK(out == expected);
+		if (out != expected)
+			printf("threshold %u:\n%s\nexpected:\n%s\n", i, out.c_str(), expected.c_str());
+	}
+
+	// Tail calls of other closures of the code loop as well, and the callees
+	// the code has been compiled against are collected once unbound.
+	{
+		Runtime runtime(std::pmr::get_default_resource());
+		runtime.jitThreshold = 2;
+		Context context(&runtime);
+		bindArithmeticBuiltins(&context);
+		context.setBinding("id", NativeFnObject::alloc(&runtime, _identityFn).get());
+
+		std::string out;
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(define (make-step k) (lambda (f n acc) (if (= n 0) acc (f f (- n 1) (id (+ acc k)))))) (define s1 (make-step 1)) (define s2 (make-step 3)) 0"), 0));
+		_run(&context, "(s1 s1 100 0) (s1 s1 100 0) (s2 s2 100 0) (s2 s1 100 0) (s1 s2 100 0)", out);
+		MKLISP_TEST_CHECK(out == "100 100 300 102 298 ");
+		MKLISP_TEST_CHECK((!MKLISP_JIT) || _isJitCompiled(&context, "s1"));
+
+		HostWeakRef<Object> s1 = context.getBinding("s1").exData.asObject, id = context.getBinding("id").exData.asObject;
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(define s1 0) (define id (lambda (x) x)) (s2 s2 100 0)"), 300));
+		runtime.collectGarbage();
+		MKLISP_TEST_CHECK((!s1) && (!id));
+		MKLISP_TEST_CHECK(context.frameStack.empty());
+		MKLISP_TEST_CHECK(context.valueStack.empty());
+	}
+
+	return finish();
+}
@@ -0,0 +1,120 @@
+#include "test.h"
+#include <mklisp/builtins.h>
+#include <mklisp/except.h>
+#include <mklisp/macro.h>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+// Expands the forms and evaluates them in order, the result is the value of
+// the last one.
+static InternalExceptionPointer _expandAndEval(Context *context, MacroExpander *expander, ListObject *forms, Value &resultOut) {
+	MKLISP_RETURN_IF_EXCEPT(expander->expand(forms));
+
+	resultOut = Value(ValueType::Nil);
+	for (auto &i : forms->elements)
+		MKLISP_RETURN_IF_EXCEPT(context->runtime->eval(i, context, resultOut));
+	return {};
+}
+
+// Returns the result, or undefined if the expansion or the evaluation has
+// failed.
+static Value _run(Context *context, MacroExpander *expander, const char *src) {
+	HostRefHolder refHolder;
+	HostObjectRef<ListObject> forms = parseForms(context->runtime, refHolder, src);
+	MKLISP_TEST_CHECK(forms);
+	if (!forms)
+		return Value();
+
+	Value result;
+	if (InternalExceptionPointer e = _expandAndEval(context, expander, forms.get(), result); e) {
+		e.reset();
+		return Value();
+	}
+	return result;
+}
+
+// Returns true if the expansion of the source fails with a syntax error.
+static bool _isRejected(Context *context, MacroExpander *expander, const char *src) {
+	HostRefHolder refHolder;
+	HostObjectRef<ListObject> forms = parseForms(context->runtime, refHolder, src);
+	MKLISP_TEST_CHECK(forms);
+	if (!forms)
+		return false;
+
+	InternalExceptionPointer e = expander->expand(forms.get());
+	bool isRejected = e && (e->exceptionKind == InternalExceptionKind::CompilationError) &&
+					  (((CompilationError *)e.get())->errorCode == CompilationErrorCode::SyntaxError);
+	e.reset();
+	return isRejected;
+}
+
+int main() {
+	Runtime runtime(std::pmr::get_default_resource());
+	Context context(&runtime);
+	bindArithmeticBuiltins(&context);
+	MacroExpander expander(&runtime);
+
+	// Rules are tried in order, variables bound by templates do not capture
+	// the ones of the calls.
+	MKLISP_TEST_CHECK(isInt(_run(&context, &expander, "(define-syntax swap! (syntax-rules () ((_ a b) (let ((tmp a)) (set! a b) (set! b tmp))))) (define tmp 1) (define y 2) (swap! tmp y) (- (* tmp 10) y)"), 19));
+	MKLISP_TEST_CHECK(isInt(_run(&context, &expander, "(define-syntax my-or (syntax-rules () ((_) (< 1 0)) ((_ e) e) ((_ e r ...) (let ((t e)) (if t t (my-or r ...)))))) (define t 5) (my-or (< 1 0) t)"), 5));
+	MKLISP_TEST_CHECK(_run(&context, &expander, "(my-or)").valueType == ValueType::Nil);
+	MKLISP_TEST_CHECK(isInt(_run(&context, &expander, "(define-syntax my-let* (syntax-rules () ((_ () body ...) (let () body ...)) ((_ ((x v) rest ...) body ...) (let ((x v)) (my-let* (rest ...) body ...))))) (my-let* ((a 1) (b (+ a 1)) (c (* b 10))) (+ a b c))"), 23));
+	MKLISP_TEST_CHECK(isInt(_run(&context, &expander, "(define-syntax kw (syntax-rules (=>) ((_ a => b) (+ a b)) ((_ a b) (- a b)))) (+ (* (kw 10 => 3) 100) (kw 10 3))"), 1307));
+	MKLISP_TEST_CHECK(isInt(_run(&context, &expander, "(let ((my-or +)) (my-or 1 2))"), 3));
+
+	// Arguments substituted more than once are expanded once.
+	{
+		size_t nHits = runtime.nMacroExpansionCacheHits;
+		MKLISP_TEST_CHECK(isInt(_run(&context, &expander, "(define-syntax twice (syntax-rules () ((_ e) (+ e e)))) (twice (twice (twice 3)))"), 24));
+		MKLISP_TEST_CHECK(runtime.nMacroExpansionCacheHits > nHits);
+	}
+
+	// Redefining a macro invalidates the cached expansions.
+	{
+		HostRefHolder refHolder;
+		HostObjectRef<ListObject> first = parseForms(&runtime, refHolder, "(define-syntax m (syntax-rules () ((_ x) (+ x 1)))) (m 3)");
+		MKLISP_TEST_CHECK(first);
+		if (first) {
+			HostObjectRef<ListObject> second = ListObject::alloc(&runtime);
+			second->elements.push_back(first->elements[1]);
+
+			Value result;
+			InternalExceptionPointer e = _expandAndEval(&context, &expander, first.get(), result);
+			MKLISP_TEST_CHECK((!e) && isInt(result, 4));
+			e.reset();
+
+			MKLISP_TEST_CHECK(_run(&context, &expander, "(define-syntax m (syntax-rules () ((_ x) (* x 10))))").valueType == ValueType::Nil);
+			e = _expandAndEval(&context, &expander, second.get(), result);
+			MKLISP_TEST_CHECK((!e) && isInt(result, 30));
+			e.reset();
+		}
+	}
+
+	// Cached expansions do not keep the calls alive.
+	{
+		size_t nObjects = 0;
+		for (int i = 0; i < 1100; ++i) {
+			MKLISP_TEST_CHECK(isInt(_run(&context, &expander, "(twice (twice 4))"), 16));
+			if (!(i % 100)) {
+				runtime.collectGarbage();
+				if (i == 100)
+					nObjects = runtime.createdObjects.size();
+			}
+		}
+		runtime.collectGarbage();
+		MKLISP_TEST_CHECK(runtime.createdObjects.size() < nObjects + 500);
+	}
+
+	// Malformed macros and calls which no rule matches are rejected.
+	MKLISP_TEST_CHECK(_isRejected(&context, &expander, "(define-syntax one (syntax-rules () ((_ x) x))) (one)"));
+	MKLISP_TEST_CHECK(_isRejected(&context, &expander, "(define-syntax loop (syntax-rules () ((_ x) (loop x)))) (loop 1)"));
+	MKLISP_TEST_CHECK(_isRejected(&context, &expander, "(define-syntax bad (syntax-rules () ((_ x ...) x))) (bad 1 2)"));
+	MKLISP_TEST_CHECK(_isRejected(&context, &expander, "(define-syntax if (syntax-rules () ((_) 1)))"));
+	MKLISP_TEST_CHECK(isInt(_run(&context, &expander, "(twice 4)"), 8));
+	MKLISP_TEST_CHECK(context.frameStack.empty());
+	MKLISP_TEST_CHECK(context.valueStack.empty());
+
+	return finish();
+}
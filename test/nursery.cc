@@ -0,0 +1,124 @@
+#include "test.h"
+#include <mklisp/heapstats.h>
+#include <algorithm>
+#include <vector>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+// Fails every allocation once `isFailing` is set.
+class FailingResource : public std::pmr::memory_resource {
+public:
+	bool isFailing = false;
+
+	virtual void *do_allocate(size_t bytes, size_t alignment) override {
+		if (isFailing)
+			throw std::bad_alloc();
+		return std::pmr::get_default_resource()->allocate(bytes, alignment);
+	}
+
+	virtual void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+		std::pmr::get_default_resource()->deallocate(p, bytes, alignment);
+	}
+
+	virtual bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+		return this == &other;
+	}
+};
+
+int main() {
+	// Blocks are released once their allocations are, and reused.
+	{
+		FailingResource upstream;
+		NurseryResource nursery(&upstream, 4096);
+		NurseryBlockStats stats;
+
+		std::vector<void *> ptrs;
+		for (int i = 0; i < 64; ++i)
+			ptrs.push_back(nursery.allocate(256, 16));
+		void *large = nursery.allocate(2048, 16);
+		MKLISP_TEST_CHECK(nursery.getBlockOf(ptrs[0]) != nursery.getBlockOf(ptrs[63]));
+
+		nursery.getBlockStats(stats);
+		MKLISP_TEST_CHECK(stats.nBlocks > 1);
+		MKLISP_TEST_CHECK(stats.szLiveAllocations == 64 * 256);
+
+		// A block holding a single live allocation is pinned and sparse.
+		for (size_t i = 1; i < ptrs.size(); ++i)
+			nursery.deallocate(ptrs[i], 256, 16);
+		nursery.deallocate(large, 2048, 16);
+		nursery.flushThreadCache(nursery.getThreadCache());
+		nursery.getBlockStats(stats);
+		MKLISP_TEST_CHECK(stats.nBlocks == 1);
+		MKLISP_TEST_CHECK(stats.szLiveAllocations == 256);
+		MKLISP_TEST_CHECK(stats.nSparseBlocks == 1);
+
+		nursery.deallocate(ptrs[0], 256, 16);
+		nursery.getBlockStats(stats);
+		MKLISP_TEST_CHECK(stats.nBlocks == 0);
+		MKLISP_TEST_CHECK(nursery.nFreeBlocks > 0);
+
+		// Free blocks are used before the upstream resource.
+		upstream.isFailing = true;
+		void *p = nursery.allocate(256, 16);
+		nursery.deallocate(p, 256, 16);
+
+		// Failures of the upstream resource are passed on.
+		bool isThrown = false;
+		try {
+			(void)nursery.allocate(2048, 16);
+		} catch (std::bad_alloc &) {
+			isThrown = true;
+		}
+		MKLISP_TEST_CHECK(isThrown);
+		upstream.isFailing = false;
+	}
+
+	// Survivors of minor collections are promoted, young objects referred to
+	// by old ones survive.
+	{
+		Runtime runtime(std::pmr::get_default_resource());
+
+		HostObjectRef<ListObject> old = ListObject::alloc(&runtime);
+		runtime.collectYoungGarbage();
+		MKLISP_TEST_CHECK(old->objectFlags & OBJECT_OLD);
+
+		{
+			HostObjectRef<StringObject> s = StringObject::alloc(&runtime, std::pmr::string("young"));
+			MKLISP_TEST_CHECK(!(s->objectFlags & OBJECT_OLD));
+			MKLISP_TEST_CHECK(!old->pushBack(Value(s.get())));
+		}
+		Object *garbage = StringObject::alloc(&runtime, std::pmr::string("garbage")).get();
+
+		runtime.collectYoungGarbage();
+		MKLISP_TEST_CHECK(std::find(runtime.createdObjects.begin(), runtime.createdObjects.end(), garbage) == runtime.createdObjects.end());
+		MKLISP_TEST_CHECK(isString(old->elements[0], "young"));
+		MKLISP_TEST_CHECK(old->elements[0].exData.asObject->objectFlags & OBJECT_OLD);
+	}
+
+	// Blocks pinned by a few survivors are reported.
+	{
+		Runtime runtime(std::pmr::get_default_resource());
+		HeapStats stats;
+
+		std::vector<HostObjectRef<ListObject>> kept;
+		{
+			std::vector<HostObjectRef<ListObject>> lists;
+			for (int i = 0; i < 20000; ++i)
+				lists.push_back(ListObject::alloc(&runtime));
+			for (size_t i = 0; i < lists.size(); i += 500)
+				kept.push_back(lists[i]);
+		}
+		runtime.collectYoungGarbage();
+		collectHeapStats(&runtime, stats);
+		MKLISP_TEST_CHECK(stats.nurseryBlockStats.nBlocks > 0);
+		MKLISP_TEST_CHECK(stats.nurseryBlockStats.nSparseBlocks == stats.nurseryBlockStats.nBlocks);
+
+		kept.clear();
+		runtime.collectGarbage();
+		collectHeapStats(&runtime, stats);
+		MKLISP_TEST_CHECK(stats.nurseryBlockStats.szLiveAllocations < 20000 / 500 * sizeof(ListObject));
+	}
+
+	return finish();
+}
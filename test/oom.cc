@@ -0,0 +1,55 @@
+#include "test.h"
+#include <mklisp/builtins.h>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+int main() {
+	Runtime runtime(std::pmr::get_default_resource());
+	runtime.globalHeapResource.szLimit = runtime.globalHeapResource.szAllocated + 4 * 1024 * 1024;
+	runtime.heapSoftLimit = runtime.globalHeapResource.szAllocated + 2 * 1024 * 1024;
+
+	size_t nSoftLimitCrossings = 0;
+	runtime.heapSoftLimitCallback = [](Runtime *, void *userData) {
+		++*(size_t *)userData;
+	};
+	runtime.heapSoftLimitCallbackUserData = &nSoftLimitCrossings;
+
+	Context context(&runtime);
+	bindArithmeticBuiltins(&context);
+
+	// Garbage is collected before the limit is reached.
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define (churn n) (if (= n 0) 0 (begin (lambda () n) (churn (- n 1))))) 0"), 0));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(churn 200000)"), 0));
+
+	// Evaluations growing the heap over the limit fail, the runtime remains
+	// usable.
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define (grow acc) (grow (lambda () acc))) 0"), 0));
+	for (int i = 0; i < 3; ++i) {
+		MKLISP_TEST_CHECK(evalFails(&context, "(grow 0)", RuntimeErrorCode::OutOfMemory));
+		MKLISP_TEST_CHECK(context.frameStack.empty());
+		MKLISP_TEST_CHECK(context.valueStack.empty());
+
+		runtime.collectGarbage();
+		MKLISP_TEST_CHECK(runtime.globalHeapResource.szAllocated < runtime.heapSoftLimit);
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(+ 1 2)"), 3));
+	}
+	MKLISP_TEST_CHECK(nSoftLimitCrossings >= 3);
+
+	// Allocations of the host throw once the limit is reached.
+	{
+		HostRefHolder refHolder;
+		bool isThrown = false;
+		try {
+			for (int i = 0; i < 100000; ++i)
+				refHolder.addObject(StringObject::alloc(&runtime, std::pmr::string(1000, 'x')).get());
+		} catch (std::bad_alloc &) {
+			isThrown = true;
+		}
+		MKLISP_TEST_CHECK(isThrown);
+	}
+	runtime.collectGarbage();
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(+ 1 2)"), 3));
+
+	return finish();
+}
@@ -0,0 +1,163 @@
+#include "test.h"
+#include <mklisp/builtins.h>
+#include <mklisp/optimizer.h>
+#include <new>
+#include <vector>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+static int32_t nSideEffects = 0;
+
+static void _sideFn(Context *context, ValueSpan) {
+	context->frameStack.back().returnValue = Value(++nSideEffects);
+}
+
+static void _throwFn(Context *, ValueSpan) {
+	throw std::bad_alloc();
+}
+
+// Leaves the result undefined.
+static void _declineFn(Context *, ValueSpan) {
+}
+
+static HostObjectRef<NativeFnObject> _allocPure(Runtime *runtime, NativeFnCallback callback) {
+	HostObjectRef<NativeFnObject> fn = NativeFnObject::alloc(runtime, callback);
+	fn->isPure = true;
+	return fn;
+}
+
+// Returns the results of the forms of the source, optimized or not.
+static std::vector<Value> _evalForms(Context *context, HostRefHolder &refHolder, const char *src, bool isOptimized, Optimizer *optimizer = nullptr) {
+	std::vector<Value> results;
+	HostObjectRef<ListObject> forms = parseForms(context->runtime, refHolder, src);
+	MKLISP_TEST_CHECK(forms);
+	if (!forms)
+		return results;
+
+	if (isOptimized) {
+		Optimizer localOptimizer(context);
+		if (!optimizer)
+			optimizer = &localOptimizer;
+		InternalExceptionPointer e = optimizer->optimize(forms.get());
+		MKLISP_TEST_CHECK(!e);
+		e.reset();
+	}
+
+	for (auto &i : forms->elements) {
+		Value result;
+		if (InternalExceptionPointer e = context->runtime->eval(i, context, result); e) {
+			e.reset();
+			result = Value();
+		}
+		results.push_back(result);
+	}
+	return results;
+}
+
+static bool _isSameResult(const Value &lhs, const Value &rhs) {
+	if (lhs.valueType != rhs.valueType)
+		return false;
+	switch (lhs.valueType) {
+		case ValueType::Int:
+			return lhs.exData.asInt == rhs.exData.asInt;
+		case ValueType::Object:
+			if (lhs.exData.asObject->getObjectType() != rhs.exData.asObject->getObjectType())
+				return false;
+			if (lhs.exData.asObject->getObjectType() == ObjectType::String)
+				return ((StringObject *)lhs.exData.asObject)->data == ((StringObject *)rhs.exData.asObject)->data;
+			return true;
+		default:
+			return true;
+	}
+}
+
+int main() {
+	Runtime runtime(std::pmr::get_default_resource());
+	Context context(&runtime);
+	bindArithmeticBuiltins(&context);
+	context.setBinding("side", NativeFnObject::alloc(&runtime, _sideFn).get());
+	context.setBinding("decline", _allocPure(&runtime, _declineFn).get());
+
+	// Optimized forms give the results of the original ones.
+	const char *src =
+		"(+ 1 (* 2 3) (- 10 4))"
+		"(if (< 1 2) 5 (side))"
+		"(if (> 1 2) (side))"
+		"(if (side) 1 2)"
+		"(+ (side) 1)"
+		"(let ((+ -)) (+ 5 3))"
+		"((lambda (* x) (* x 2)) + 4)"
+		"(define (f x) (+ x (* 2 2)))"
+		"(f 1)"
+		"(quote (+ 1 2))"
+		"(cond ((= 1 1) (+ 2 2)) (1 0))"
+		"(define (g) (min 1 2)) (define min +)"
+		"(g)"
+		"(decline 1)";
+	{
+		HostRefHolder refHolder;
+		nSideEffects = 0;
+		std::vector<Value> expected = _evalForms(&context, refHolder, src, false);
+		int32_t nExpectedSideEffects = nSideEffects;
+
+		Optimizer optimizer(&context);
+		nSideEffects = 0;
+		std::vector<Value> results = _evalForms(&context, refHolder, src, true, &optimizer);
+		MKLISP_TEST_CHECK(nSideEffects == nExpectedSideEffects);
+		MKLISP_TEST_CHECK(optimizer.nFoldedCalls >= 3);
+		MKLISP_TEST_CHECK(optimizer.nEliminatedBranches == 2);
+
+		MKLISP_TEST_CHECK(results.size() == expected.size());
+		for (size_t i = 0; i < std::min(results.size(), expected.size()); ++i)
+			MKLISP_TEST_CHECK(_isSameResult(results[i], expected[i]));
+		MKLISP_TEST_CHECK(isInt(results[0], 13));
+		MKLISP_TEST_CHECK(isInt(results[5], 2));
+		MKLISP_TEST_CHECK(isInt(results[13], 3));
+	}
+
+	// Frozen forms are left as they are.
+	{
+		HostRefHolder refHolder;
+		HostObjectRef<ListObject> forms = parseForms(&runtime, refHolder, "(+ 1 2)");
+		MKLISP_TEST_CHECK(forms);
+		if (forms) {
+			runtime.freeze(forms.get());
+
+			Optimizer optimizer(&context);
+			InternalExceptionPointer e = optimizer.optimize(forms.get());
+			MKLISP_TEST_CHECK(!e);
+			e.reset();
+			MKLISP_TEST_CHECK(optimizer.nFoldedCalls == 0);
+			MKLISP_TEST_CHECK(forms->elements[0].valueType == ValueType::Object);
+		}
+	}
+
+	// Exceptions thrown by pure natives leave the stacks and the forms which
+	// have not been folded as they were.
+	{
+		context.setBinding("boom", _allocPure(&runtime, _throwFn).get());
+
+		HostRefHolder refHolder;
+		HostObjectRef<ListObject> forms = parseForms(&runtime, refHolder, "(+ 1 2) (boom 1) (+ 3 4)");
+		MKLISP_TEST_CHECK(forms);
+		if (forms) {
+			Optimizer optimizer(&context);
+			bool isThrown = false;
+			try {
+				InternalExceptionPointer e = optimizer.optimize(forms.get());
+				e.reset();
+			} catch (std::bad_alloc &) {
+				isThrown = true;
+			}
+			MKLISP_TEST_CHECK(isThrown);
+			MKLISP_TEST_CHECK(optimizer.nFoldedCalls == 1);
+			MKLISP_TEST_CHECK(isInt(forms->elements[0], 3));
+			MKLISP_TEST_CHECK(forms->elements[2].valueType == ValueType::Object);
+		}
+		MKLISP_TEST_CHECK(context.frameStack.empty());
+		MKLISP_TEST_CHECK(context.valueStack.empty());
+	}
+
+	return finish();
+}
@@ -0,0 +1,163 @@
+#include "test.h"
+#include <mklisp/builtins.h>
+#include <mklisp/parallel.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+static int64_t _getNumber(const Value &value) {
+	switch (value.valueType) {
+		case ValueType::Int:
+			return value.exData.asInt;
+		case ValueType::Long:
+			return value.exData.asLong;
+		default:
+			return INT64_MIN;
+	}
+}
+
+static ListObject *_getList(const Value &value) {
+	if ((value.valueType != ValueType::Object) || (value.exData.asObject->getObjectType() != ObjectType::List))
+		return nullptr;
+	return (ListObject *)value.exData.asObject;
+}
+
+// Binds the name to a list of the integers below `n`, shuffled if `seed` is
+// not zero.
+static void _bindRange(Context *context, const char *name, size_t n, unsigned seed) {
+	std::vector<int32_t> numbers(n);
+	for (size_t i = 0; i < n; ++i)
+		numbers[i] = (int32_t)i;
+	if (seed)
+		std::shuffle(numbers.begin(), numbers.end(), std::mt19937(seed));
+
+	MutatorScope mutatorScope(context->runtime);
+	HostObjectRef<ListObject> list = ListObject::alloc(context->runtime);
+	for (auto i : numbers)
+		MKLISP_TEST_CHECK(!list->pushBack(Value(i)));
+	context->setBinding(name, list.get());
+}
+
+static void _testParallel(GCMode gcMode, size_t nWorkers, size_t n) {
+	Runtime runtime(std::pmr::get_default_resource());
+	runtime.nParallelWorkers = nWorkers;
+	runtime.gcMode = gcMode;
+	runtime.gcThreshold = runtime.minGcThreshold = 512 * 1024;
+	runtime.minorGcThreshold = 64 * 1024;
+	runtime.jitThreshold = 50;
+	Context context(&runtime);
+	bindArithmeticBuiltins(&context);
+	bindParallelBuiltins(&context);
+	_bindRange(&context, "xs", n, 0);
+	_bindRange(&context, "ys", n, 42);
+
+	int64_t sum = (int64_t)n * (n - 1) / 2;
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define (helper x) (* x 3)) (define (score x) (+ (helper x) 1)) (define (make-adder n) (lambda (x) (+ x n))) 0"), 0));
+
+	// Results are in the order of the lists.
+	if (ListObject *list = _getList(eval(&context, "(pmap score xs)")); list) {
+		MKLISP_TEST_CHECK(list->elements.size() == n);
+		for (size_t i = 0; i < std::min(list->elements.size(), n); ++i)
+			MKLISP_TEST_CHECK(isInt(list->elements[i], (int32_t)(3 * i + 1)));
+	} else
+		MKLISP_TEST_CHECK(false);
+	MKLISP_TEST_CHECK(_getNumber(eval(&context, "(preduce + 0 xs)")) == sum);
+	MKLISP_TEST_CHECK(_getNumber(eval(&context, "(preduce + 7 (pfilter (lambda (x) (< x 50)) ys))")) == 7 + 49 * 50 / 2);
+
+	for (auto src : { "(psort < ys)", "(psort (lambda (a b) (> a b)) ys)" }) {
+		bool isAscending = src[7] == '<';
+		if (ListObject *list = _getList(eval(&context, src)); list) {
+			MKLISP_TEST_CHECK(list->elements.size() == n);
+			for (size_t i = 0; i < std::min(list->elements.size(), n); ++i)
+				MKLISP_TEST_CHECK(isInt(list->elements[i], (int32_t)(isAscending ? i : n - 1 - i)));
+		} else
+			MKLISP_TEST_CHECK(false);
+	}
+
+	// Sorting is stable, ints and longs of the same number are equal.
+	{
+		std::mt19937 generator(7);
+		std::vector<std::pair<int32_t, size_t>> expected;
+		{
+			MutatorScope mutatorScope(&runtime);
+			HostObjectRef<ListObject> list = ListObject::alloc(&runtime);
+			for (size_t i = 0; i < n; ++i) {
+				int32_t k = generator() % 100;
+				MKLISP_TEST_CHECK(!list->pushBack((i & 1) ? Value((int64_t)k) : Value(k)));
+				expected.push_back({ k, i });
+			}
+			context.setBinding("zs", list.get());
+		}
+		std::stable_sort(expected.begin(), expected.end(), [](auto &lhs, auto &rhs) { return lhs.first < rhs.first; });
+
+		if (ListObject *list = _getList(eval(&context, "(psort < zs)")); list) {
+			MKLISP_TEST_CHECK(list->elements.size() == n);
+			for (size_t i = 0; i < std::min(list->elements.size(), n); ++i) {
+				bool isLong = expected[i].second & 1;
+				MKLISP_TEST_CHECK(list->elements[i].valueType == (isLong ? ValueType::Long : ValueType::Int));
+				MKLISP_TEST_CHECK(_getNumber(list->elements[i]) == expected[i].first);
+			}
+		} else
+			MKLISP_TEST_CHECK(false);
+	}
+
+	// Closures allocated by the workers survive collections, nested loops
+	// run on the calling thread.
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define adders (pmap make-adder xs)) 0"), 0));
+	runtime.collectGarbage();
+	MKLISP_TEST_CHECK(_getNumber(eval(&context, "(preduce + 0 (pmap (lambda (f) (f 1)) adders))")) == sum + (int64_t)n);
+	MKLISP_TEST_CHECK(_getNumber(eval(&context, "(preduce + 0 (pmap (lambda (x) (preduce + 0 (pmap score (quote (1 2 3))))) xs))")) == (int64_t)n * 21);
+
+	// Failed calls and bad arguments fail the builtins, also when they are
+	// called by compiled code.
+	MKLISP_TEST_CHECK(evalFails(&context, "(pmap (lambda (x) (+ x undefined-y)) xs)", RuntimeErrorCode::UnboundVariable));
+	MKLISP_TEST_CHECK(evalFails(&context, "(psort (lambda (a) a) ys)", RuntimeErrorCode::ArityMismatch));
+	MKLISP_TEST_CHECK(evalFails(&context, "(preduce + xs)", RuntimeErrorCode::ArityMismatch));
+	MKLISP_TEST_CHECK(evalFails(&context, "(pmap 1 xs)", RuntimeErrorCode::InvalidArgument));
+	MKLISP_TEST_CHECK(evalFails(&context, "(pfilter score 1)", RuntimeErrorCode::InvalidArgument));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define (bad-map l) (+ 1 (pmap 1 l))) 0"), 0));
+	for (size_t i = 0; i < 60; ++i)
+		MKLISP_TEST_CHECK(evalFails(&context, "(bad-map xs)", RuntimeErrorCode::InvalidArgument));
+	MKLISP_TEST_CHECK(context.frameStack.empty());
+	MKLISP_TEST_CHECK(context.valueStack.empty());
+	if (ListObject *list = _getList(eval(&context, "(pmap score (quote ()))")); list)
+		MKLISP_TEST_CHECK(list->elements.empty());
+	else
+		MKLISP_TEST_CHECK(false);
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(preduce + 5 (quote ()))"), 5));
+
+	// Nothing stays frozen once the loops have returned, changes fail while
+	// the workers share the values only.
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define c1 (let ((n 0)) (lambda () (begin (set! n (+ n 1)) n)))) (c1) (pmap (lambda (x) x) (quote (1 2 3))) (c1)"), 2));
+	_bindRange(&context, "ws", n, 0);
+	MKLISP_TEST_CHECK(evalFails(&context, "(pmap (lambda (x y) (c1)) ws)", RuntimeErrorCode::ArityMismatch));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(c1)"), 3));
+	if ((n >= PARALLEL_MIN_SIZE) && nWorkers) {
+		MKLISP_TEST_CHECK(evalFails(&context, "(pmap (lambda (x) (c1)) ws)", RuntimeErrorCode::FrozenObjectMutation));
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(c1)"), 4));
+	} else
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(pmap (lambda (x) (c1)) ws) (c1)"), 4 + (int32_t)n));
+	for (auto name : { "ws", "xs", "score", "helper", "c1" }) {
+		Value value = context.getBinding(name);
+		MKLISP_TEST_CHECK((value.valueType == ValueType::Object) && !value.exData.asObject->isFrozen());
+	}
+
+	// Redefined helpers are seen by the workers.
+	MKLISP_TEST_CHECK(_getNumber(eval(&context, "(define (helper x) (* x 5)) (preduce + 0 (pmap score xs))")) == 5 * sum + (int64_t)n);
+	MKLISP_TEST_CHECK(context.frameStack.empty());
+	MKLISP_TEST_CHECK(context.valueStack.empty());
+}
+
+int main() {
+	for (size_t n : { 100, 5000 }) {
+		for (size_t nWorkers : { 0, 3 }) {
+			_testParallel(GCMode::StopTheWorld, nWorkers, n);
+			_testParallel(GCMode::Incremental, nWorkers, n);
+		}
+	}
+
+	return finish();
+}
@@ -0,0 +1,148 @@
+#include "test.h"
+#include <cstring>
+#include <thread>
+#include <vector>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+struct Allocation {
+	unsigned char *p;
+	size_t size;
+	unsigned char pattern;
+};
+
+// Fills the allocation with its pattern, so overlapping allocations are
+// detected by `_isIntact`.
+static Allocation _allocate(CountablePoolResource &pool, size_t size, unsigned char pattern) {
+	Allocation allocation = { (unsigned char *)pool.allocate(size, 8), size, pattern };
+	memset(allocation.p, pattern, size);
+	return allocation;
+}
+
+static bool _isIntact(const Allocation &allocation) {
+	for (size_t i = 0; i < allocation.size; ++i) {
+		if (allocation.p[i] != allocation.pattern)
+			return false;
+	}
+	return true;
+}
+
+static size_t _countSlabs(CountablePoolResource &pool) {
+	size_t nSlabs = 0;
+	for (auto &i : pool.sizeClasses)
+		nSlabs += i.stats.nSlabs;
+	return nSlabs;
+}
+
+int main() {
+	// Small allocations come from the slabs, large ones from the upstream
+	// resource, empty slabs are returned.
+	{
+		CountablePoolResource pool(std::pmr::new_delete_resource());
+
+		std::vector<Allocation> allocations;
+		for (size_t i = 0; i < 20000; ++i)
+			allocations.push_back(_allocate(pool, (i * 37) % 700, (unsigned char)i));
+
+		bool isIntact = true;
+		for (auto &i : allocations)
+			isIntact &= _isIntact(i);
+		MKLISP_TEST_CHECK(isIntact);
+
+		pool.flushThreadCache(pool.getThreadCache());
+		size_t szLive = 0;
+		for (auto &i : allocations)
+			szLive += i.size;
+		MKLISP_TEST_CHECK(pool.szAllocated == szLive);
+		MKLISP_TEST_CHECK(pool.largeAllocationStats.nLiveAllocations > 0);
+		MKLISP_TEST_CHECK(pool.sizeClasses[CountablePoolResource::getSizeClassIndex(24)].stats.nLiveAllocations > 0);
+
+		// Slots freed in a slab are reused before new slabs are allocated.
+		for (size_t i = 0; i < allocations.size(); i += 2)
+			pool.deallocate(allocations[i].p, allocations[i].size, 8);
+		size_t nSlabs = _countSlabs(pool);
+		for (size_t i = 0; i < allocations.size(); i += 2)
+			allocations[i] = _allocate(pool, allocations[i].size, (unsigned char)~i);
+		MKLISP_TEST_CHECK(_countSlabs(pool) == nSlabs);
+
+		isIntact = true;
+		for (auto &i : allocations)
+			isIntact &= _isIntact(i);
+		MKLISP_TEST_CHECK(isIntact);
+
+		for (auto &i : allocations)
+			pool.deallocate(i.p, i.size, 8);
+		pool.flushThreadCache(pool.getThreadCache());
+
+		MKLISP_TEST_CHECK(pool.szAllocated == 0);
+		MKLISP_TEST_CHECK(pool.largeAllocationStats.nLiveAllocations == 0);
+		bool isEmpty = true;
+		for (auto &i : pool.sizeClasses)
+			isEmpty &= (i.stats.nLiveAllocations == 0) && (i.stats.nSlabs <= 1);
+		MKLISP_TEST_CHECK(isEmpty);
+		MKLISP_TEST_CHECK(pool.szReserved == _countSlabs(pool) * pool.slabSize);
+	}
+
+	// Threads allocate and free at once.
+	{
+		CountablePoolResource pool(std::pmr::new_delete_resource());
+		std::vector<std::thread> threads;
+		std::atomic_size_t nCorrupted = 0;
+
+		for (int i = 0; i < 4; ++i) {
+			threads.push_back(std::thread([&pool, &nCorrupted, i]() {
+				std::vector<Allocation> allocations;
+				for (size_t j = 0; j < 10000; ++j) {
+					allocations.push_back(_allocate(pool, 16 + j % 100, (unsigned char)(i * 16 + j)));
+					if (j % 3 == 0) {
+						if (!_isIntact(allocations.front()))
+							++nCorrupted;
+						pool.deallocate(allocations.front().p, allocations.front().size, 8);
+						allocations.erase(allocations.begin());
+					}
+				}
+				for (auto &k : allocations) {
+					if (!_isIntact(k))
+						++nCorrupted;
+					pool.deallocate(k.p, k.size, 8);
+				}
+				pool.flushThreadCache(pool.getThreadCache());
+			}));
+		}
+		for (auto &i : threads)
+			i.join();
+
+		MKLISP_TEST_CHECK(nCorrupted == 0);
+		MKLISP_TEST_CHECK(pool.szAllocated == 0);
+	}
+
+	// Failures of the upstream resource are passed on and leave the pool
+	// usable.
+	{
+		CountablePoolResource pool(std::pmr::null_memory_resource());
+
+		bool isThrown = false;
+		try {
+			(void)pool.allocate(16, 8);
+		} catch (std::bad_alloc &) {
+			isThrown = true;
+		}
+		MKLISP_TEST_CHECK(isThrown);
+
+		isThrown = false;
+		try {
+			(void)pool.allocate(4096, 8);
+		} catch (std::bad_alloc &) {
+			isThrown = true;
+		}
+		MKLISP_TEST_CHECK(isThrown);
+
+		pool.flushThreadCache(pool.getThreadCache());
+		MKLISP_TEST_CHECK(pool.szAllocated == 0);
+		MKLISP_TEST_CHECK(pool.szReserved == 0);
+		MKLISP_TEST_CHECK(pool.largeAllocationStats.nLiveAllocations == 0);
+	}
+
+	return finish();
+}
@@ -0,0 +1,148 @@
+#include "test.h"
+#include <mklisp/builtins.h>
+#include <mklisp/scheduler.h>
+#include <atomic>
+#include <memory>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+// Evaluates its argument, which cannot yield.
+static void _evalFn(Context *context, ValueSpan args) {
+	Value result;
+	if (InternalExceptionPointer e = context->runtime->eval(args[0], context, result); e) {
+		e.reset();
+		result = Value(ValueType::Nil);
+	}
+	context->frameStack.back().returnValue = result;
+}
+
+static std::atomic_size_t nDoneTasks = 0, nFailedTasks = 0;
+static std::atomic_int32_t resultSum = 0;
+
+static void _onTaskDone(void *, Context *, InternalExceptionPointer &exception, const Value &result) {
+	if (exception) {
+		if ((exception->exceptionKind == InternalExceptionKind::RuntimeError) &&
+			(((RuntimeError *)exception.get())->errorCode == RuntimeErrorCode::UnboundVariable))
+			++nFailedTasks;
+		return;
+	}
+	++nDoneTasks;
+	if (result.valueType == ValueType::Int)
+		resultSum += result.exData.asInt;
+}
+
+// Runs the evaluation of the form in slices with collections between them,
+// until it is done or `maxSlices` have run.
+static InternalExceptionPointer _runSliced(Context *context, const char *src, size_t maxSlices, EvalStatus &statusOut, Value &resultOut, size_t &nSlicesOut) {
+	HostRefHolder refHolder;
+	HostObjectRef<ListObject> forms = parseForms(context->runtime, refHolder, src);
+	MKLISP_TEST_CHECK(forms && (forms->elements.size() == 1));
+	if (!forms)
+		return {};
+
+	nSlicesOut = 1;
+	MKLISP_RETURN_IF_EXCEPT(context->runtime->startEval(forms->elements[0], context, 1000, {}, statusOut, resultOut));
+	while ((statusOut == EvalStatus::Yielded) && (nSlicesOut < maxSlices)) {
+		context->runtime->collectGarbage();
+		MKLISP_RETURN_IF_EXCEPT(context->runtime->resumeEval(context, 1000, {}, statusOut, resultOut));
+		++nSlicesOut;
+	}
+	return {};
+}
+
+static void _testSlices(uint32_t jitThreshold) {
+	Runtime runtime(std::pmr::get_default_resource());
+	runtime.jitThreshold = jitThreshold;
+	Context context(&runtime);
+	bindArithmeticBuiltins(&context);
+	context.setBinding("ev", NativeFnObject::alloc(&runtime, _evalFn).get());
+	MKLISP_TEST_CHECK(isInt(eval(&context,
+								 "(define (loop n) (loop (+ n 1)))"
+								 "(define (count n acc) (if (= n 0) acc (count (- n 1) (+ acc 1))))"
+								 "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+								 "(define (fail) (+ 1 (fib 10) undefined-x))"
+								 "0"),
+						  0));
+
+	EvalStatus status;
+	Value result;
+	size_t nSlices;
+
+	// Evaluations yield and are resumed where they were, evaluations started
+	// by natives run to completion.
+	InternalExceptionPointer e = _runSliced(&context, "(count 100000 0)", 1000, status, result, nSlices);
+	MKLISP_TEST_CHECK((!e) && (status == EvalStatus::Done) && isInt(result, 100000) && (nSlices > 1));
+	e = _runSliced(&context, "(fib 20)", 1000, status, result, nSlices);
+	MKLISP_TEST_CHECK((!e) && (status == EvalStatus::Done) && isInt(result, 6765) && (nSlices > 1));
+	e = _runSliced(&context, "(+ 1 (ev (quote (fib 15))) (fib 10))", 1000, status, result, nSlices);
+	MKLISP_TEST_CHECK((!e) && (status == EvalStatus::Done) && isInt(result, 666));
+	MKLISP_TEST_CHECK(context.frameStack.empty());
+	MKLISP_TEST_CHECK(context.valueStack.empty());
+
+	// Evaluations which never return are aborted.
+	e = _runSliced(&context, "(let ((f (lambda (x) (loop x)))) (f 1))", 50, status, result, nSlices);
+	MKLISP_TEST_CHECK((!e) && (status == EvalStatus::Yielded));
+	runtime.abortEval(&context);
+	MKLISP_TEST_CHECK(context.frameStack.empty());
+	MKLISP_TEST_CHECK(context.valueStack.empty());
+
+	// Errors unwind the frames of the evaluation.
+	e = _runSliced(&context, "(fail)", 1000, status, result, nSlices);
+	MKLISP_TEST_CHECK(e && (e->exceptionKind == InternalExceptionKind::RuntimeError) &&
+					  (((RuntimeError *)e.get())->errorCode == RuntimeErrorCode::UnboundVariable));
+	e.reset();
+	MKLISP_TEST_CHECK(context.frameStack.empty());
+	MKLISP_TEST_CHECK(context.valueStack.empty());
+
+	// Slices are bounded by time as well.
+	{
+		HostRefHolder refHolder;
+		HostObjectRef<ListObject> forms = parseForms(&runtime, refHolder, "(loop 0)");
+		e = runtime.startEval(forms->elements[0], &context, SIZE_MAX, std::chrono::milliseconds(20), status, result);
+		MKLISP_TEST_CHECK((!e) && (status == EvalStatus::Yielded));
+		e.reset();
+		runtime.abortEval(&context);
+	}
+
+	// Evaluations which are not resumable are not affected.
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(fib 15)"), 610));
+}
+
+int main() {
+	_testSlices(0);
+	_testSlices(1);
+
+	// Tasks which never return do not keep the others from completing.
+	{
+		Runtime runtime(std::pmr::get_default_resource());
+		std::vector<std::unique_ptr<Context>> contexts;
+		HostRefHolder refHolder;
+		HostObjectRef<ListObject> forms = parseForms(&runtime, refHolder, "(fib 15) (loop 0) (fail)");
+
+		Scheduler scheduler(std::pmr::get_default_resource(), 4);
+		scheduler.fuel = 2000;
+		for (size_t i = 0; i < 200; ++i) {
+			contexts.push_back(std::make_unique<Context>(&runtime));
+			Context *context = contexts.back().get();
+			bindArithmeticBuiltins(context);
+			MKLISP_TEST_CHECK(isInt(eval(context,
+										 "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+										 "(define (loop n) (loop (+ n 1)))"
+										 "(define (fail) (+ 1 undefined-x))"
+										 "0"),
+								  0));
+		}
+		for (size_t i = 0; i < 200; ++i)
+			scheduler.spawn(contexts[i].get(), forms->elements[i % 20 == 0 ? 1 : (i % 20 == 1 ? 2 : 0)], _onTaskDone, nullptr);
+
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+		while (((nDoneTasks + nFailedTasks) < 190) && (std::chrono::steady_clock::now() < deadline))
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		MKLISP_TEST_CHECK(nDoneTasks == 180);
+		MKLISP_TEST_CHECK(nFailedTasks == 10);
+		MKLISP_TEST_CHECK(resultSum == 180 * 610);
+	}
+
+	return finish();
+}
@@ -0,0 +1,75 @@
+#include "test.h"
+#include <mklisp/builtins.h>
+#include <mklisp/compiler.h>
+#include <mklisp/image.h>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+int main() {
+	Runtime runtime(std::pmr::get_default_resource());
+	Context context(&runtime);
+	bindArithmeticBuiltins(&context);
+
+	// Compiled code sees redefinitions of the globals it refers to, lambdas
+	// may refer to globals defined later.
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define (f) (g)) (define (g) 1) (f)"), 1));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define (g) 2) (f)"), 2));
+	context.setBinding("g", Value((int32_t)3));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define (f) g) (f)"), 3));
+
+	// Locals do not shadow globals outside of their scope.
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(let ((g 10)) (+ g (f)))"), 13));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "g"), 3));
+
+	// Slots are the same in all contexts of the runtime, each context has its
+	// own bindings.
+	{
+		Context otherContext(&runtime);
+		bindArithmeticBuiltins(&otherContext);
+		MKLISP_TEST_CHECK(otherContext.resolveGlobal("g") == context.resolveGlobal("g"));
+		MKLISP_TEST_CHECK(otherContext.getBinding("g").valueType == ValueType::Undefined);
+		MKLISP_TEST_CHECK(isInt(eval(&otherContext, "(define g 4) g"), 4));
+		MKLISP_TEST_CHECK(isInt(eval(&context, "g"), 3));
+	}
+
+	// Undefined globals are reported by the compiler, globals removed after
+	// the code has been compiled when it runs.
+	{
+		HostRefHolder refHolder;
+		HostObjectRef<ListObject> forms = parseForms(&runtime, refHolder, "(undefined-fn)");
+		Compiler compiler(&context);
+		HostObjectRef<CodeObject> code;
+		InternalExceptionPointer e = compiler.compile(forms->elements[0], code);
+		MKLISP_TEST_CHECK(e && (e->exceptionKind == InternalExceptionKind::CompilationError));
+		e.reset();
+
+		context.removeBinding("g");
+		MKLISP_TEST_CHECK(evalFails(&context, "(f)", RuntimeErrorCode::UnboundVariable));
+		MKLISP_TEST_CHECK(context.frameStack.empty());
+		MKLISP_TEST_CHECK(context.valueStack.empty());
+
+		context.setBinding("g", Value((int32_t)5));
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(f)"), 5));
+	}
+
+	// Code of a base image refers to the slots of the base runtime, which its
+	// children keep.
+	{
+		RuntimeImage image(std::pmr::get_default_resource());
+		{
+			Context baseContext(&image.baseRuntime);
+			bindArithmeticBuiltins(&baseContext);
+			MKLISP_TEST_CHECK(isInt(eval(&baseContext, "(define base 7) (define (get-base) (+ base 0)) 0"), 0));
+			image.seal(&baseContext);
+		}
+
+		Runtime child(std::pmr::get_default_resource(), &image);
+		Context childContext(&child);
+		MKLISP_TEST_CHECK(isInt(eval(&childContext, "(define other 1) (get-base)"), 7));
+		MKLISP_TEST_CHECK(isInt(eval(&childContext, "(define base 8) (get-base)"), 8));
+		MKLISP_TEST_CHECK(isInt(eval(&childContext, "other"), 1));
+	}
+
+	return finish();
+}
@@ -0,0 +1,67 @@
+#include "test.h"
+#include <mklisp/builtins.h>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+static int32_t nCalls = 0;
+
+// Returns the number of calls so far.
+static void _countFn(Context *context, ValueSpan) {
+	context->frameStack.back().returnValue = Value(++nCalls);
+}
+
+// Returns true if the evaluation fails with a compilation error.
+static bool _isMalformed(Context *context, const char *src) {
+	Value result;
+	InternalExceptionPointer e = evalSource(context, src, result);
+	bool isMalformed = e && (e->exceptionKind == InternalExceptionKind::CompilationError);
+	e.reset();
+	return isMalformed;
+}
+
+int main() {
+	Runtime runtime(std::pmr::get_default_resource());
+	Context context(&runtime);
+	bindArithmeticBuiltins(&context);
+	context.setBinding("count", NativeFnObject::alloc(&runtime, _countFn).get());
+
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define (fact n) (if (< n 2) 1 (* n (fact (- n 1))))) (fact 10)"), 3628800));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(let ((a 3) (b 4)) (* a b))"), 12));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "((lambda (x y) (- x y)) 10 3)"), 7));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(cond ((< 5 3) 1) ((< 3 5) 2) (else 3))"), 2));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(cond ((= 1 2) 1) (else 3))"), 3));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(begin (define x 1) (set! x (- x 5)) (+ x 10))"), 6));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(let ((a 1)) (set! a 9) a)"), 9));
+	MKLISP_TEST_CHECK(isString(eval(&context, "(quote \"q\")"), "q"));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(and 1 2 3)"), 3));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(or (= 1 2) 7)"), 7));
+
+	// Untaken branches and operands after a short-circuit are not evaluated.
+	nCalls = 0;
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(if (< 1 2) 5 (count))"), 5));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(if (= 1 2) (count) 6)"), 6));
+	MKLISP_TEST_CHECK(eval(&context, "(and 1 (= 1 2) (count))").valueType == ValueType::Nil);
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(or (= 1 2) 8 (count))"), 8));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(cond ((< 1 2) 9) ((count) 10))"), 9));
+	MKLISP_TEST_CHECK(nCalls == 0);
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(or (= 1 2) (count))"), 1));
+
+	// Malformed forms are rejected, errors of the operands are raised.
+	MKLISP_TEST_CHECK(_isMalformed(&context, "(if 1)"));
+	MKLISP_TEST_CHECK(_isMalformed(&context, "(let (a) a)"));
+	MKLISP_TEST_CHECK(_isMalformed(&context, "(define)"));
+	MKLISP_TEST_CHECK(_isMalformed(&context, "(lambda x)"));
+	MKLISP_TEST_CHECK(_isMalformed(&context, "(set! 1 2)"));
+	MKLISP_TEST_CHECK(_isMalformed(&context, "(cond (else 1) ((< 1 2) 2))"));
+	MKLISP_TEST_CHECK(_isMalformed(&context, "(define if 1)"));
+	MKLISP_TEST_CHECK(_isMalformed(&context, "(lambda (x x) x)"));
+	MKLISP_TEST_CHECK(_isMalformed(&context, "(define (dup a b a) b)"));
+	MKLISP_TEST_CHECK(_isMalformed(&context, "(let ((a 1) (a 2)) a)"));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(let ((a 1)) (let ((a 2)) a))"), 2));
+	MKLISP_TEST_CHECK(evalFails(&context, "(fact 1 2)", RuntimeErrorCode::ArityMismatch));
+	MKLISP_TEST_CHECK(context.frameStack.empty());
+	MKLISP_TEST_CHECK(context.valueStack.empty());
+
+	return finish();
+}
@@ -0,0 +1,45 @@
+#include "test.h"
+#include <mklisp/builtins.h>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+static size_t maxFrameDepth = 0;
+
+// Records the depth of the frames, returns 0.
+static void _probeFn(Context *context, ValueSpan) {
+	maxFrameDepth = std::max(maxFrameDepth, context->frameStack.size());
+	context->frameStack.back().returnValue = Value((int32_t)0);
+}
+
+int main() {
+	Runtime runtime(std::pmr::get_default_resource());
+	Context context(&runtime);
+	bindArithmeticBuiltins(&context);
+	context.setBinding("probe", NativeFnObject::alloc(&runtime, _probeFn).get());
+	context.setBinding("nil", Value(ValueType::Nil));
+	context.maxFrameDepth = 100;
+
+	// Calls in tail position through the special forms reuse the frame.
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define (count n acc) (if (= n 0) (+ acc (probe)) (count (- n 1) (+ acc 1)))) (count 1000000 0)"), 1000000));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define (loop n) (let ((m (- n 1))) (if (= m 0) 42 (begin (probe) (loop m))))) (loop 500000)"), 42));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define (short n) (and 1 (or nil (if (= n 0) 7 (short (- n 1)))))) (short 200000)"), 7));
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define (pick n) (cond ((= n 0) 8) (else (pick (- n 1))))) (pick 200000)"), 8));
+
+	// Mutual recursion and closures calling themselves.
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define (is-even n) (if (= n 0) 1 (is-odd (- n 1)))) (define (is-odd n) (if (= n 0) nil (is-even (- n 1)))) (is-even 1000000)"), 1));
+	MKLISP_TEST_CHECK(eval(&context, "(is-even 1000001)").valueType == ValueType::Nil);
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define (make) (let ((k 0)) (lambda (n) (set! k (+ k 1)) (if (= n 0) k (self (- n 1)))))) (define self (make)) (self 300000)"), 300001));
+
+	MKLISP_TEST_CHECK(maxFrameDepth > 0);
+	MKLISP_TEST_CHECK(maxFrameDepth < 10);
+
+	// Calls which are not in tail position still use a frame each.
+	MKLISP_TEST_CHECK(isInt(eval(&context, "(define (depth n) (if (= n 0) 0 (+ 1 (depth (- n 1))))) (depth 50)"), 50));
+	MKLISP_TEST_CHECK(evalFails(&context, "(depth 100000)", RuntimeErrorCode::StackOverflow));
+	MKLISP_TEST_CHECK(evalFails(&context, "(define (fail n) (if (= n 0) (undefined-fn) (fail (- n 1)))) (fail 100000)", RuntimeErrorCode::UnboundVariable));
+	MKLISP_TEST_CHECK(context.frameStack.empty());
+	MKLISP_TEST_CHECK(context.valueStack.empty());
+
+	return finish();
+}
@@ -0,0 +1,98 @@
+#ifndef _MKLISP_TEST_TEST_H_
+#define _MKLISP_TEST_TEST_H_
+
+#include <mklisp/runtime.h>
+#include <mklisp/parser.h>
+#include <cstdio>
+
+// Reports the check if it fails, the test goes on and fails at the end.
+#define MKLISP_TEST_CHECK(cond)                                                \
+	do {                                                                       \
+		if (!(cond)) {                                                         \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			++mklisp::test::nFailedChecks;                                     \
+		}                                                                      \
+	} while (0)
+
+namespace mklisp {
+	namespace test {
+		inline size_t nFailedChecks = 0;
+
+		// Returns the parsed forms, or null if the source is invalid.
+		inline HostObjectRef<ListObject> parseForms(Runtime *runtime, HostRefHolder &refHolder, const char *src) {
+			Lexer lexer;
+			if (InternalExceptionPointer e = lexer.lex(&runtime->globalHeapResource, src); e) {
+				e.reset();
+				return {};
+			}
+
+			Parser parser(runtime);
+			HostObjectRef<ListObject> forms;
+			if (InternalExceptionPointer e = parser.parse(&lexer, forms, refHolder); e) {
+				e.reset();
+				return {};
+			}
+			return forms;
+		}
+
+		// Evaluates the forms of the source in order, the result is the value
+		// of the last one.
+		inline InternalExceptionPointer evalSource(Context *context, const char *src, Value &resultOut) {
+			HostRefHolder refHolder;
+			HostObjectRef<ListObject> forms = parseForms(context->runtime, refHolder, src);
+			MKLISP_TEST_CHECK(forms);
+			if (!forms)
+				return {};
+
+			resultOut = Value(ValueType::Nil);
+			for (auto &i : forms->elements)
+				MKLISP_RETURN_IF_EXCEPT(context->runtime->eval(i, context, resultOut));
+			return {};
+		}
+
+		// Returns the result, or undefined if the evaluation has failed.
+		inline Value eval(Context *context, const char *src) {
+			Value result;
+			if (InternalExceptionPointer e = evalSource(context, src, result); e) {
+				e.reset();
+				return Value();
+			}
+			return result;
+		}
+
+		// Returns true if the evaluation fails with the error, which is
+		// released.
+		inline bool evalFails(Context *context, const char *src, RuntimeErrorCode errorCode) {
+			Value result;
+			InternalExceptionPointer e = evalSource(context, src, result);
+			if (!e)
+				return false;
+
+			bool isExpected = (e->exceptionKind == InternalExceptionKind::RuntimeError) &&
+							  (((RuntimeError *)e.get())->errorCode == errorCode);
+			e.reset();
+			return isExpected;
+		}
+
+		inline bool isInt(const Value &value, int32_t n) {
+			return (value.valueType == ValueType::Int) && (value.exData.asInt == n);
+		}
+
+		inline bool isString(const Value &value, const char *s) {
+			return (value.valueType == ValueType::Object) &&
+				   (value.exData.asObject->getObjectType() == ObjectType::String) &&
+				   (((StringObject *)value.exData.asObject)->data == s);
+		}
+
+		// Returns the exit status of the test.
+		inline int finish() {
+			if (nFailedChecks) {
+				printf("%zu checks failed\n", nFailedChecks);
+				return 1;
+			}
+			return 0;
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,97 @@
+#include "test.h"
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+int main() {
+	// Objects allocated by threads are registered and accounted, even after
+	// the threads have exited.
+	{
+		Runtime runtime(std::pmr::get_default_resource());
+		size_t szBaseAllocated = runtime.globalHeapResource.szAllocated;
+
+		std::vector<ListObject *> roots(8);
+		{
+			std::vector<std::thread> threads;
+			for (size_t i = 0; i < roots.size(); ++i) {
+				threads.push_back(std::thread([&runtime, &roots, i]() {
+					MutatorScope mutatorScope(&runtime);
+
+					HostObjectRef<ListObject> root = ListObject::alloc(&runtime);
+					for (int j = 0; j < 20000; ++j) {
+						HostObjectRef<StringObject> s = StringObject::alloc(&runtime, std::pmr::string("x"));
+						if (!(j % 10))
+							MKLISP_TEST_CHECK(!root->pushBack(Value(s.get())));
+					}
+					incHostRef(root.get());
+					roots[i] = root.get();
+				}));
+			}
+			for (auto &i : threads)
+				i.join();
+		}
+
+		runtime.collectGarbage();
+		bool isIntact = true;
+		for (auto i : roots) {
+			isIntact &= i->elements.size() == 2000;
+			for (auto &j : i->elements)
+				isIntact &= isString(j, "x");
+		}
+		MKLISP_TEST_CHECK(isIntact);
+		MKLISP_TEST_CHECK(runtime.createdObjects.size() >= roots.size() * 2001);
+		MKLISP_TEST_CHECK(runtime.globalHeapResource.szAllocated > szBaseAllocated);
+
+		for (auto i : roots)
+			decHostRef(i);
+		runtime.collectGarbage();
+		MKLISP_TEST_CHECK(runtime.createdObjects.size() < roots.size() * 2001);
+	}
+
+	// Runtimes may be destroyed while threads which have allocated from them
+	// are alive, and threads may outlive them.
+	{
+		auto runtime = std::make_unique<Runtime>(std::pmr::get_default_resource());
+		std::thread thread([&runtime]() {
+			MutatorScope mutatorScope(runtime.get());
+			for (int i = 0; i < 1000; ++i)
+				StringObject::alloc(runtime.get(), std::pmr::string("y"));
+		});
+		thread.join();
+		runtime.reset();
+
+		Runtime otherRuntime(std::pmr::get_default_resource());
+		for (int i = 0; i < 1000; ++i)
+			StringObject::alloc(&otherRuntime, std::pmr::string("z"));
+		otherRuntime.collectGarbage();
+	}
+
+	// Allocations over the limit fail on the thread which makes them only.
+	{
+		Runtime runtime(std::pmr::get_default_resource());
+		runtime.globalHeapResource.szLimit = runtime.globalHeapResource.szAllocated + 1024 * 1024;
+
+		std::atomic_size_t nFailures = 0;
+		std::thread thread([&runtime, &nFailures]() {
+			MutatorScope mutatorScope(&runtime);
+			try {
+				std::vector<HostObjectRef<StringObject>> strings;
+				for (int i = 0; i < 100000; ++i)
+					strings.push_back(StringObject::alloc(&runtime, std::pmr::string(256, 'x')));
+			} catch (std::bad_alloc &) {
+				++nFailures;
+			}
+		});
+		thread.join();
+		MKLISP_TEST_CHECK(nFailures == 1);
+
+		runtime.collectGarbage();
+		HostObjectRef<StringObject> s = StringObject::alloc(&runtime, std::pmr::string("ok"));
+		MKLISP_TEST_CHECK(s->data == "ok");
+	}
+
+	return finish();
+}
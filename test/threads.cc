@@ -0,0 +1,136 @@
+#include "test.h"
+#include <mklisp/builtins.h>
+#include <mklisp/heapstats.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+static std::atomic_size_t nWorkerErrors = 0;
+
+// Evaluates in a mutator scope, the references to the forms are released
+// while other threads may be collecting.
+static Value _evalShared(Context *context, const char *src) {
+	MutatorScope mutatorScope(context->runtime);
+	return eval(context, src);
+}
+
+static void _runWorker(Runtime *runtime, size_t nIterations) {
+	Context context(runtime);
+	if (!isInt(_evalShared(&context,
+						   "(define (make-adder n) (lambda (x) (+ x n)))"
+						   "(define (churn n acc) (if (= n 0) acc (churn (- n 1) (+ acc ((make-adder n) 1) (square 2)))))"
+						   "0"),
+			   0)) {
+		++nWorkerErrors;
+		return;
+	}
+
+	// Sum of n + 1 + 4 for n from 1 to 200.
+	constexpr int32_t expectedChurn = 200 * 201 / 2 + 5 * 200;
+	int32_t lastGeneration = 0;
+
+	for (size_t i = 0; i < nIterations; ++i) {
+		if (!isInt(_evalShared(&context, "(churn 200 0)"), expectedChurn)) {
+			++nWorkerErrors;
+			return;
+		}
+
+		// Redefinitions of the shared binding are seen in order.
+		Value generation = _evalShared(&context, "(+ generation 0)");
+		if ((generation.valueType != ValueType::Int) || (generation.exData.asInt < lastGeneration)) {
+			++nWorkerErrors;
+			return;
+		}
+		lastGeneration = generation.exData.asInt;
+
+		// Contexts created and destroyed while the others run.
+		if (!(i % 16)) {
+			Context tempContext(runtime);
+			if (!isInt(_evalShared(&tempContext, "((lambda (x) (square x)) 7)"), 49)) {
+				++nWorkerErrors;
+				return;
+			}
+		}
+	}
+}
+
+static void _testThreads(GCMode gcMode) {
+	Runtime runtime(std::pmr::get_default_resource());
+	runtime.gcMode = gcMode;
+	runtime.gcThreshold = runtime.minGcThreshold = 256 * 1024;
+	runtime.minorGcThreshold = 64 * 1024;
+
+	{
+		Context context(&runtime);
+		bindArithmeticBuiltins(&context);
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(define (square x) (* x x)) 0"), 0));
+		for (auto i : { "+", "-", "*", "=", "<", "square" })
+			runtime.setSharedBinding(i, context.getBinding(i));
+		runtime.setSharedBinding("generation", Value((int32_t)0));
+	}
+
+	nWorkerErrors = 0;
+	std::atomic_bool isDone = false;
+	std::thread redefiner([&runtime, &isDone]() {
+		for (int32_t i = 1; !isDone; ++i) {
+			runtime.setSharedBinding("generation", Value(i));
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+		}
+	});
+
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < 4; ++i)
+		workers.push_back(std::thread(_runWorker, &runtime, 50));
+
+	// Stops the world from a thread which is not a mutator.
+	HeapStats stats;
+	for (size_t i = 0; i < 4; ++i) {
+		collectHeapStats(&runtime, stats);
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	}
+
+	for (auto &i : workers)
+		i.join();
+	isDone = true;
+	redefiner.join();
+
+	MKLISP_TEST_CHECK(nWorkerErrors == 0);
+	collectHeapStats(&runtime, stats);
+	MKLISP_TEST_CHECK(stats.gcPauseStats.nMajorCollections + stats.gcPauseStats.nMinorCollections > 0);
+}
+
+int main() {
+	_testThreads(GCMode::StopTheWorld);
+	_testThreads(GCMode::Incremental);
+
+	// Shared values are frozen, contexts may bind the names themselves, and
+	// removed bindings are unbound in all contexts.
+	{
+		Runtime runtime(std::pmr::get_default_resource());
+		Context context(&runtime);
+		bindArithmeticBuiltins(&context);
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(define (make-counter) (let ((n 0)) (lambda () (set! n (+ n 1)) n))) (define counter (make-counter)) (counter)"), 1));
+		runtime.setSharedBinding("counter", context.getBinding("counter"));
+		runtime.setSharedBinding("limit", Value((int32_t)10));
+
+		Context other(&runtime);
+		bindArithmeticBuiltins(&other);
+		MKLISP_TEST_CHECK(isInt(eval(&other, "limit"), 10));
+		MKLISP_TEST_CHECK(evalFails(&other, "(counter)", RuntimeErrorCode::FrozenObjectMutation));
+		MKLISP_TEST_CHECK(evalFails(&context, "(counter)", RuntimeErrorCode::FrozenObjectMutation));
+
+		MKLISP_TEST_CHECK(isInt(eval(&other, "(define limit 20) limit"), 20));
+		MKLISP_TEST_CHECK(isInt(eval(&context, "limit"), 10));
+
+		runtime.removeSharedBinding("limit");
+		MKLISP_TEST_CHECK(evalFails(&context, "limit", RuntimeErrorCode::UnboundVariable));
+		MKLISP_TEST_CHECK(evalFails(&other, "limit", RuntimeErrorCode::UnboundVariable));
+		MKLISP_TEST_CHECK(context.frameStack.empty());
+		MKLISP_TEST_CHECK(other.frameStack.empty());
+	}
+
+	return finish();
+}
@@ -0,0 +1,136 @@
+#include "test.h"
+#include <mklisp/builtins.h>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+// Returns a list of the arguments.
+static void _collectFn(Context *context, ValueSpan args) {
+	HostObjectRef<ListObject> list = ListObject::alloc(context->runtime);
+	for (auto &i : args) {
+		if (InternalExceptionPointer e = list->pushBack(i); e)
+			e.reset();
+	}
+	context->frameStack.back().returnValue = Value(list.get());
+}
+
+static bool _isIntList(const Value &value, std::initializer_list<int32_t> elements) {
+	if ((value.valueType != ValueType::Object) || (value.exData.asObject->getObjectType() != ObjectType::List))
+		return false;
+
+	ListObject *list = (ListObject *)value.exData.asObject;
+	if (list->elements.size() != elements.size())
+		return false;
+
+	size_t index = 0;
+	for (auto i : elements) {
+		if (!isInt(list->elements[index++], i))
+			return false;
+	}
+	return true;
+}
+
+int main() {
+	Runtime runtime(std::pmr::get_default_resource());
+	Context context(&runtime);
+	bindArithmeticBuiltins(&context);
+	context.setBinding("collect", NativeFnObject::alloc(&runtime, _collectFn).get());
+
+	HostRefHolder refHolder;
+	HostObjectRef<ListObject> forms = parseForms(&runtime, refHolder, "(collect 1 (+ 1 1) (collect) (quote (3 4)) (collect 5 6))");
+	MKLISP_TEST_CHECK(forms);
+	if (!forms)
+		return finish();
+	ListObject *form = (ListObject *)forms->elements[0].exData.asObject;
+
+	// Forms are left as they have been parsed, so they can be evaluated
+	// again, natives see their own arguments only.
+	for (int i = 0; i < 1000; ++i) {
+		Value result;
+		InternalExceptionPointer e = runtime.eval(forms->elements[0], &context, result);
+		MKLISP_TEST_CHECK(!e);
+		e.reset();
+
+		MKLISP_TEST_CHECK(result.valueType == ValueType::Object);
+		if (result.valueType != ValueType::Object)
+			break;
+		ListObject *list = (ListObject *)result.exData.asObject;
+		MKLISP_TEST_CHECK(list->elements.size() == 5);
+		MKLISP_TEST_CHECK(isInt(list->elements[0], 1));
+		MKLISP_TEST_CHECK(isInt(list->elements[1], 2));
+		MKLISP_TEST_CHECK(_isIntList(list->elements[2], {}));
+		MKLISP_TEST_CHECK(_isIntList(list->elements[4], { 5, 6 }));
+
+		MKLISP_TEST_CHECK(context.valueStack.empty());
+	}
+	MKLISP_TEST_CHECK(form->elements.size() == 6);
+	MKLISP_TEST_CHECK(form->elements[2].valueType == ValueType::Object);
+	MKLISP_TEST_CHECK(isInt(form->elements[1], 1));
+
+	// Evaluations failing halfway through the arguments leave the forms and
+	// the stack as they were.
+	{
+		HostObjectRef<ListObject> failingForms = parseForms(&runtime, refHolder, "(define (fail) (undefined-fn)) (collect 1 2 (fail) 3)");
+		MKLISP_TEST_CHECK(failingForms);
+		if (!failingForms)
+			return finish();
+
+		Value result;
+		InternalExceptionPointer e = runtime.eval(failingForms->elements[0], &context, result);
+		MKLISP_TEST_CHECK(!e);
+		e.reset();
+
+		for (int i = 0; i < 2; ++i) {
+			e = runtime.eval(failingForms->elements[1], &context, result);
+			MKLISP_TEST_CHECK(e && (((RuntimeError *)e.get())->errorCode == RuntimeErrorCode::UnboundVariable));
+			e.reset();
+
+			MKLISP_TEST_CHECK(context.valueStack.empty());
+			MKLISP_TEST_CHECK(context.frameStack.empty());
+			MKLISP_TEST_CHECK(((ListObject *)failingForms->elements[1].exData.asObject)->elements.size() == 5);
+		}
+
+		MKLISP_TEST_CHECK(isInt(eval(&context, "(define (fail) 0) 0"), 0));
+		e = runtime.eval(failingForms->elements[1], &context, result);
+		MKLISP_TEST_CHECK(!e);
+		e.reset();
+		MKLISP_TEST_CHECK(_isIntList(result, { 1, 2, 0, 3 }));
+	}
+
+	// Special forms are compiled once, and again once globals have been
+	// rebound. The code of collected lists is dropped.
+	{
+		HostObjectRef<ListObject> letForms = parseForms(&runtime, refHolder, "(let ((x 2)) (* x 21))");
+		MKLISP_TEST_CHECK(letForms);
+		if (!letForms)
+			return finish();
+		ListObject *letForm = (ListObject *)letForms->elements[0].exData.asObject;
+
+		CodeObject *codes[3] = {};
+		for (int i = 0; i < 3; ++i) {
+			if (i == 2)
+				MKLISP_TEST_CHECK(isInt(eval(&context, "(define (g) 1) (define (g) 2) 0"), 0));
+
+			Value result;
+			InternalExceptionPointer e = runtime.eval(Value(letForm), &context, result);
+			MKLISP_TEST_CHECK((!e) && isInt(result, 42));
+			e.reset();
+
+			auto it = context.compiledLists.find(letForm);
+			MKLISP_TEST_CHECK(it != context.compiledLists.end());
+			if (it != context.compiledLists.end())
+				codes[i] = it->second.code.get();
+		}
+		MKLISP_TEST_CHECK(codes[0] && (codes[0] == codes[1]) && (codes[1] != codes[2]));
+
+		for (int i = 0; i < 1000; ++i) {
+			MKLISP_TEST_CHECK(isInt(eval(&context, "(let ((y 1)) y)"), 1));
+			if (!(i % 100))
+				runtime.collectGarbage();
+		}
+		MKLISP_TEST_CHECK(context.compiledLists.size() < 500);
+		MKLISP_TEST_CHECK(context.compiledLists.count(letForm));
+	}
+
+	return finish();
+}
@@ -0,0 +1,89 @@
+#include "test.h"
+#include <memory>
+
+using namespace mklisp;
+using namespace mklisp::test;
+
+static void _countFinalization(Runtime *, void *userData) {
+	++*(size_t *)userData;
+}
+
+int main() {
+	auto runtime = std::make_unique<Runtime>(std::pmr::get_default_resource());
+	HostWeakRef<StringObject> outliving;
+
+	{
+		size_t nFinalized = 0;
+		HostObjectRef<StringObject> strong = StringObject::alloc(runtime.get(), std::pmr::string("kept"));
+
+		// Weak references are cleared by minor collections.
+		HostWeakRef<StringObject> weakToDead = StringObject::alloc(runtime.get(), std::pmr::string("dead")).get();
+		HostWeakRef<StringObject> weakToKept = strong.get();
+		HostObjectRef<WeakRefObject> weakObjectToDead = WeakRefObject::alloc(runtime.get(), StringObject::alloc(runtime.get(), std::pmr::string("dead")).get());
+		HostObjectRef<WeakRefObject> weakObjectToKept = WeakRefObject::alloc(runtime.get(), strong.get());
+
+		runtime->registerFinalizer(StringObject::alloc(runtime.get(), std::pmr::string("finalized")).get(), _countFinalization, &nFinalized);
+
+		runtime->collectYoungGarbage();
+		MKLISP_TEST_CHECK(!weakToDead);
+		MKLISP_TEST_CHECK(weakToKept.get() == strong.get());
+		MKLISP_TEST_CHECK(!weakObjectToDead->getTarget());
+		MKLISP_TEST_CHECK(weakObjectToKept->getTarget() == strong.get());
+
+		// Finalizers run after the collection, not during it.
+		MKLISP_TEST_CHECK(nFinalized == 0);
+		MKLISP_TEST_CHECK(runtime->pendingFinalizers.size() == 1);
+		runtime->runPendingFinalizers();
+		MKLISP_TEST_CHECK(nFinalized == 1);
+		MKLISP_TEST_CHECK(runtime->pendingFinalizers.empty());
+
+		// Weak references copied while an incremental collection is marking
+		// are cleared as well.
+		runtime->gcMode = GCMode::Incremental;
+		runtime->gcSliceWorkBudget = 2;
+		{
+			HostObjectRef<StringObject> old = StringObject::alloc(runtime.get(), std::pmr::string("old"));
+			runtime->collectYoungGarbage();
+			runtime->registerFinalizer(old.get(), _countFinalization, &nFinalized);
+
+			HostWeakRef<StringObject> weakToOld = old.get();
+			runtime->performGcSlice();
+			old = {};
+			HostWeakRef<StringObject> copiedWeakToOld = weakToOld;
+			while (runtime->gcPhase != GCPhase::Idle)
+				runtime->performGcSlice();
+			runtime->collectGarbage();
+
+			MKLISP_TEST_CHECK(!weakToOld);
+			MKLISP_TEST_CHECK(!copiedWeakToOld);
+			MKLISP_TEST_CHECK(!copiedWeakToOld.lock());
+			runtime->runPendingFinalizers();
+			MKLISP_TEST_CHECK(nFinalized == 2);
+		}
+		MKLISP_TEST_CHECK(weakToKept.lock()->data == "kept");
+
+		// Frozen objects are finalized and their weak references cleared like
+		// the ones of other objects.
+		{
+			HostWeakRef<StringObject> weakToFrozen;
+			{
+				HostObjectRef<StringObject> frozen = StringObject::alloc(runtime.get(), std::pmr::string("frozen"));
+				runtime->freeze(frozen.get());
+				runtime->registerFinalizer(frozen.get(), _countFinalization, &nFinalized);
+				weakToFrozen = frozen.get();
+			}
+			runtime->collectGarbage();
+			runtime->runPendingFinalizers();
+			MKLISP_TEST_CHECK(nFinalized == 3);
+			MKLISP_TEST_CHECK(!weakToFrozen);
+		}
+
+		outliving = strong.get();
+	}
+
+	// Weak references may outlive the runtime.
+	runtime.reset();
+	MKLISP_TEST_CHECK(!outliving);
+
+	return finish();
+}